@@ -0,0 +1,431 @@
+#!/usr/bin/env python3
+"""
+Throughput benchmark: starts the mock mongod and an nginx built with
+nginx-gridfs, drives it with a mix of requests and reports requests/s, MB/s,
+latency percentiles and the memory of the nginx workers.
+
+    $ python3 bench.py --nginx /usr/local/nginx/sbin/nginx --size 256k \\
+          --mix full=70,range=10,head=10,conditional=10 --json run.json
+    $ python3 bench.py --nginx ... --compare run.json
+
+Everything runs on the loopback interface from a temporary prefix; pass
+--keep to look at the generated nginx.conf and logs afterwards.
+"""
+
+import argparse
+import asyncio
+import json
+import os
+import random
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+
+import mockmongo  # noqa: E402
+
+NGINX_CONF = """\
+worker_processes  {workers};
+daemon            off;
+error_log         {prefix}/error.log {log_level};
+pid               {prefix}/nginx.pid;
+
+events {{
+    worker_connections  4096;
+}}
+
+http {{
+    access_log  off;
+    default_type  application/octet-stream;
+    keepalive_requests  100000;
+
+    server {{
+        listen  127.0.0.1:{port};
+
+        location /gridfs/ {{
+            gridfs {db} root_collection={root} field=filename type=string;
+            mongo 127.0.0.1:{mongo_port}{mongo_params};
+{extra}        }}
+
+        location = /gridfs_status {{
+            gridfs_status;
+        }}
+    }}
+}}
+"""
+
+MIXES = ("full", "range", "head", "conditional")
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(("127.0.0.1", 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def wait_port(port, timeout=10.0):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        try:
+            socket.create_connection(("127.0.0.1", port), 0.2).close()
+            return True
+        except OSError:
+            time.sleep(0.05)
+    return False
+
+
+def parse_mix(s):
+    mix = {}
+    for part in s.split(","):
+        name, _, weight = part.partition("=")
+        if name not in MIXES:
+            raise argparse.ArgumentTypeError("unknown request type \"%s\"" % name)
+        mix[name] = float(weight or 1)
+    return mix
+
+
+# ---------- nginx ---------- #
+
+
+class Nginx(object):
+
+    def __init__(self, binary, prefix, **conf):
+        self.binary = binary
+        self.prefix = prefix
+        self.conf = os.path.join(prefix, "nginx.conf")
+        with open(self.conf, "w") as f:
+            f.write(NGINX_CONF.format(prefix=prefix, **conf))
+        self.port = conf["port"]
+        self.proc = None
+
+    def start(self):
+        os.makedirs(os.path.join(self.prefix, "logs"), exist_ok=True)
+        self.proc = subprocess.Popen([self.binary, "-p", self.prefix, "-c", self.conf])
+        if not wait_port(self.port):
+            self.stop()
+            raise RuntimeError("nginx did not start, see %s/error.log" % self.prefix)
+
+    def workers(self):
+        pids = []
+        for pid in os.listdir("/proc"):
+            if not pid.isdigit():
+                continue
+            try:
+                with open("/proc/%s/stat" % pid) as f:
+                    stat = f.read()
+            except OSError:
+                continue
+            ppid = int(stat[stat.rindex(")") + 2:].split()[1])
+            if ppid == self.proc.pid:
+                pids.append(int(pid))
+        return pids
+
+    def rss(self):
+        """Resident set size of each worker, in kB."""
+        out = []
+        for pid in self.workers():
+            try:
+                with open("/proc/%d/status" % pid) as f:
+                    for line in f:
+                        if line.startswith("VmRSS:"):
+                            out.append(int(line.split()[1]))
+            except OSError:
+                pass
+        return out
+
+    def stop(self):
+        if self.proc and self.proc.poll() is None:
+            self.proc.send_signal(signal.SIGQUIT)
+            try:
+                self.proc.wait(10)
+            except subprocess.TimeoutExpired:
+                self.proc.kill()
+                self.proc.wait()
+
+
+# ---------- Load generator ---------- #
+
+
+class Client(object):
+    """One keep-alive HTTP/1.1 connection."""
+
+    def __init__(self, port):
+        self.port = port
+        self.reader = self.writer = None
+
+    async def connect(self):
+        self.reader, self.writer = await asyncio.open_connection("127.0.0.1", self.port)
+
+    def close(self):
+        if self.writer:
+            self.writer.close()
+            self.reader = self.writer = None
+
+    async def request(self, method, path, headers):
+        if self.writer is None:
+            await self.connect()
+        lines = ["%s %s HTTP/1.1" % (method, path), "Host: bench"]
+        lines += ["%s: %s" % h for h in headers]
+        self.writer.write(("\r\n".join(lines) + "\r\n\r\n").encode())
+
+        head = await self.reader.readuntil(b"\r\n\r\n")
+        status = int(head[9:12])
+        length, chunked, close = None, False, False
+        for line in head.split(b"\r\n")[1:]:
+            name, _, value = line.partition(b":")
+            name = name.strip().lower()
+            value = value.strip().lower()
+            if name == b"content-length":
+                length = int(value)
+            elif name == b"transfer-encoding" and value == b"chunked":
+                chunked = True
+            elif name == b"connection" and value == b"close":
+                close = True
+
+        body = 0
+        if method != "HEAD" and status not in (204, 304):
+            if chunked:
+                while True:
+                    size = int((await self.reader.readuntil(b"\r\n")).split(b";")[0], 16)
+                    await self.reader.readexactly(size + 2)
+                    body += size
+                    if size == 0:
+                        break
+            elif length is not None:
+                left = length
+                while left:
+                    data = await self.reader.read(min(left, 1 << 20))
+                    if not data:
+                        raise ConnectionError("short body")
+                    left -= len(data)
+                body = length
+            else:
+                while True:
+                    data = await self.reader.read(1 << 20)
+                    if not data:
+                        break
+                    body += len(data)
+                close = True
+        if close:
+            self.close()
+        return status, len(head) + body
+
+
+class Load(object):
+
+    def __init__(self, port, catalog, mix, seed=0):
+        self.port = port
+        self.catalog = catalog
+        self.names = list(mix)
+        self.weights = [mix[n] for n in self.names]
+        self.random = random.Random(seed)
+        self.latencies = []
+        self.statuses = {}
+        self.by_type = dict((n, 0) for n in self.names)
+        self.bytes = 0
+        self.errors = 0
+
+    def pick(self):
+        kind = self.random.choices(self.names, self.weights)[0]
+        i = self.random.randrange(self.catalog.count)
+        path = "/gridfs/" + self.catalog.name(i)
+        headers = []
+        method = "GET"
+        if kind == "head":
+            method = "HEAD"
+        elif kind == "range":
+            length = self.catalog.length(i)
+            size = min(length, 64 * 1024)
+            start = self.random.randrange(length - size + 1)
+            headers.append(("Range", "bytes=%d-%d" % (start, start + size - 1)))
+        elif kind == "conditional":
+            headers.append(("If-None-Match", "\"%s\"" % self.catalog.md5(i)))
+        return kind, method, path, headers
+
+    async def worker(self, deadline, requests):
+        client = Client(self.port)
+        while time.monotonic() < deadline and (requests is None or requests[0] > 0):
+            if requests is not None:
+                requests[0] -= 1
+            kind, method, path, headers = self.pick()
+            start = time.monotonic()
+            try:
+                status, size = await client.request(method, path, headers)
+            except (OSError, asyncio.IncompleteReadError, asyncio.LimitOverrunError,
+                    ValueError):
+                self.errors += 1
+                client.close()
+                continue
+            self.latencies.append(time.monotonic() - start)
+            self.statuses[status] = self.statuses.get(status, 0) + 1
+            self.by_type[kind] += 1
+            self.bytes += size
+        client.close()
+
+    async def run(self, connections, duration, requests=None):
+        deadline = time.monotonic() + duration
+        left = [requests] if requests else None
+        start = time.monotonic()
+        await asyncio.gather(*[self.worker(deadline, left) for _ in range(connections)])
+        return time.monotonic() - start
+
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100.0))]
+
+
+def warm_md5(catalog):
+    for i in range(catalog.count):
+        catalog.md5(i)
+
+
+# ---------- Report ---------- #
+
+METRICS = (
+    ("requests_per_sec", "requests/s", "%.1f", 1),
+    ("mb_per_sec", "MB/s", "%.2f", 1),
+    ("p50_ms", "p50 ms", "%.3f", -1),
+    ("p99_ms", "p99 ms", "%.3f", -1),
+    ("worker_rss_kb", "worker RSS kB", "%d", -1),
+)
+
+
+def report(result, baseline=None):
+    print("requests   %d in %.2fs, %d errors" % (result["requests"], result["elapsed"],
+                                                  result["errors"]))
+    print("types      %s" % " ".join("%s=%d" % kv for kv in sorted(result["types"].items())))
+    print("statuses   %s" % " ".join("%s=%d" % kv for kv in sorted(result["statuses"].items())))
+    for key, label, fmt, better in METRICS:
+        line = "%-14s %12s" % (label, fmt % result[key])
+        if baseline and baseline.get(key):
+            delta = (result[key] - baseline[key]) * 100.0 / baseline[key]
+            mark = ""
+            if abs(delta) >= 5:
+                mark = "  better" if delta * better > 0 else "  worse"
+            line += "   (%+.1f%% vs %s%s)" % (delta, fmt % baseline[key], mark)
+        print(line)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--nginx", required=True, help="nginx binary built with the module")
+    parser.add_argument("--workers", type=int, default=1, help="worker_processes")
+    parser.add_argument("--connections", type=int, default=32,
+                        help="concurrent keep-alive connections")
+    parser.add_argument("--duration", type=float, default=10.0, help="seconds to run")
+    parser.add_argument("--requests", type=int, help="stop after this many requests")
+    parser.add_argument("--warmup", type=float, default=1.0, help="seconds run before measuring")
+    parser.add_argument("--mix", type=parse_mix, default=parse_mix("full"),
+                        help="weighted request types, e.g. full=70,range=10,head=10,conditional=10")
+    parser.add_argument("--location", default="",
+                        help="extra directives for the gridfs location, e.g. \"gridfs_gunzip on;\"")
+    parser.add_argument("--mongo", help="use a mock mongod already listening at this port")
+    parser.add_argument("--mongo-params", default="",
+                        help="parameters of the mongo directive, e.g. \"protocol=op_msg\"")
+    parser.add_argument("--tls", action="store_true",
+                        help="TLS between nginx and the mock, with a self-signed certificate")
+    parser.add_argument("--seed", type=int, default=0)
+    parser.add_argument("--json", help="write the results to this file")
+    parser.add_argument("--compare", help="compare against the results in this file")
+    parser.add_argument("--keep", action="store_true", help="keep the temporary prefix")
+    mockmongo.add_arguments(parser)
+    args = parser.parse_args()
+
+    catalog = mockmongo.Catalog(args.files,
+                                [mockmongo.parse_size(s) for s in args.size.split(",")],
+                                mockmongo.parse_size(args.chunk_size))
+    if "conditional" in args.mix:
+        warm_md5(catalog)
+
+    prefix = tempfile.mkdtemp(prefix="gridfs-bench-")
+    mongo_params = args.mongo_params
+    mock = None
+    if args.mongo:
+        mongo_port = int(args.mongo)
+        if args.tls:
+            mongo_params += " tls"
+    else:
+        mongo_port = free_port()
+        cmd = [sys.executable, mockmongo.__file__, "--port", str(mongo_port),
+               "--files", str(args.files), "--size", args.size,
+               "--chunk-size", args.chunk_size, "--db", args.db,
+               "--root", args.root, "--latency", str(args.latency),
+               "--jitter", str(args.jitter)]
+        if args.tls:
+            cert, key = mockmongo.make_cert(prefix)
+            cmd += ["--tls-cert", cert, "--tls-key", key]
+            mongo_params += " tls_ca=" + cert
+        mock = subprocess.Popen(cmd)
+        if not wait_port(mongo_port):
+            mock.kill()
+            sys.exit("mock mongod did not start")
+
+    extra = "".join("            %s;\n" % d.strip() for d in args.location.split(";")
+                    if d.strip())
+    nginx = Nginx(os.path.abspath(args.nginx), prefix, workers=args.workers,
+                  port=free_port(), db=args.db, root=args.root, mongo_port=mongo_port,
+                  mongo_params=" " + mongo_params.strip() if mongo_params.strip() else "",
+                  extra=extra, log_level="warn")
+    try:
+        nginx.start()
+        if args.warmup > 0:
+            asyncio.run(Load(nginx.port, catalog, args.mix, args.seed + 1)
+                        .run(args.connections, args.warmup))
+        rss_before = nginx.rss()
+        load = Load(nginx.port, catalog, args.mix, args.seed)
+        elapsed = asyncio.run(load.run(args.connections, args.duration, args.requests))
+        rss = nginx.rss()
+    finally:
+        nginx.stop()
+        if mock:
+            mock.terminate()
+            mock.wait()
+        if not args.keep:
+            shutil.rmtree(prefix, ignore_errors=True)
+        else:
+            print("prefix     %s" % prefix)
+
+    n = len(load.latencies)
+    result = {
+        "config": {"files": args.files, "size": args.size, "chunk_size": args.chunk_size,
+                   "latency_ms": args.latency, "workers": args.workers,
+                   "connections": args.connections, "mix": args.mix,
+                   "location": args.location, "tls": args.tls},
+        "requests": n,
+        "errors": load.errors,
+        "elapsed": elapsed,
+        "types": load.by_type,
+        "statuses": dict((str(k), v) for k, v in load.statuses.items()),
+        "requests_per_sec": n / elapsed if elapsed else 0.0,
+        "mb_per_sec": load.bytes / elapsed / 1e6 if elapsed else 0.0,
+        "p50_ms": percentile(load.latencies, 50) * 1000,
+        "p99_ms": percentile(load.latencies, 99) * 1000,
+        "worker_rss_kb": max(rss or [0]),
+        "worker_rss_before_kb": max(rss_before or [0]),
+    }
+
+    baseline = None
+    if args.compare:
+        with open(args.compare) as f:
+            baseline = json.load(f)
+        if baseline.get("config") != result["config"]:
+            print("warning: %s was run with a different configuration" % args.compare)
+    report(result, baseline)
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(result, f, indent=2, sort_keys=True)
+    sys.exit(1 if load.errors else 0)
+
+
+if __name__ == "__main__":
+    main()
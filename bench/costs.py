@@ -0,0 +1,322 @@
+#!/usr/bin/env python3
+"""
+Per-request cost accounting: runs each scripted request type against nginx
+and the mock mongod and counts what one request costs: round trips to
+mongod, queries, commands, cursors, allocations and syscalls. The counts are
+compared with bench/costs.json and the run fails if any of them went up.
+
+    $ python3 costs.py --nginx /usr/local/nginx/sbin/nginx
+    $ python3 costs.py --nginx /usr/local/nginx/sbin/nginx --update
+
+nginx runs as a single process (master_process off) so that every count
+belongs to the requests sent. Allocations are counted by preloading
+malloc_count.c, built with cc on the fly; syscalls by attaching strace. Both
+are skipped, with a note, when cc or strace is missing.
+"""
+
+import argparse
+import json
+import os
+import shutil
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+
+import bench  # noqa: E402
+import mockmongo  # noqa: E402
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+BASELINE = os.path.join(HERE, "costs.json")
+
+NGINX_CONF = """\
+master_process  off;
+daemon          off;
+error_log       {prefix}/error.log warn;
+pid             {prefix}/nginx.pid;
+
+events {{
+    worker_connections  64;
+}}
+
+http {{
+    access_log  off;
+    default_type  application/octet-stream;
+
+    server {{
+        listen  127.0.0.1:{port};
+
+        location /gridfs/ {{
+            gridfs {db} field=filename type=string;
+            mongo 127.0.0.1:{mongo_port}{mongo_params};
+{extra}        }}
+    }}
+}}
+"""
+
+# file0 fits in one chunk, file1 spans five
+SIZES = (1000, 1200 * 1024)
+CHUNK_SIZE = 255 * 1024
+
+SCENARIOS = (
+    ("small_full", "GET", "/gridfs/file0", []),
+    ("large_full", "GET", "/gridfs/file1", []),
+    ("range", "GET", "/gridfs/file1", [("Range", "bytes=600000-665535")]),
+    ("head", "HEAD", "/gridfs/file1", []),
+    ("conditional", "GET", "/gridfs/file1", [("If-None-Match", None)]),
+    ("not_found", "GET", "/gridfs/missing", []),
+)
+
+MONGO_COUNTS = ("round_trips", "queries", "commands", "get_mores", "cursors_opened",
+                "kill_cursors", "inserts")
+MALLOC_COUNTS = ("malloc", "calloc", "realloc", "memalign", "free")
+
+
+def request(port, method, path, headers):
+    """One request on a fresh connection; returns the status."""
+    s = socket.create_connection(("127.0.0.1", port))
+    lines = ["%s %s HTTP/1.1" % (method, path), "Host: bench", "Connection: close"]
+    lines += ["%s: %s" % h for h in headers]
+    s.sendall(("\r\n".join(lines) + "\r\n\r\n").encode())
+    data = b""
+    while True:
+        chunk = s.recv(1 << 20)
+        if not chunk:
+            break
+        data += chunk
+    s.close()
+    return int(data[9:12]) if len(data) >= 12 else 0
+
+
+def build_shim(prefix):
+    cc = shutil.which("cc") or shutil.which("gcc")
+    if cc is None:
+        return None
+    out = os.path.join(prefix, "malloc_count.so")
+    try:
+        subprocess.check_call([cc, "-shared", "-fPIC", "-O2", "-o", out,
+                               os.path.join(HERE, "malloc_count.c"), "-ldl"])
+    except (OSError, subprocess.CalledProcessError):
+        return None
+    return out
+
+
+class Strace(object):
+    """Counts the syscalls of a process while attached."""
+
+    def __init__(self, pid, out):
+        self.out = out
+        self.proc = subprocess.Popen(["strace", "-o", out, "-p", str(pid)],
+                                     stderr=subprocess.PIPE, universal_newlines=True)
+        # "strace: Process N attached"
+        self.proc.stderr.readline()
+
+    def stop(self):
+        self.proc.send_signal(signal.SIGINT)
+        self.proc.wait()
+        counts = {}
+        with open(self.out) as f:
+            for line in f:
+                if line.startswith(("+++", "---")) or "resumed>" in line:
+                    continue
+                name = line.split("(", 1)[0].strip()
+                counts[name] = counts.get(name, 0) + 1
+        return counts
+
+
+class Harness(object):
+
+    def __init__(self, args, prefix):
+        self.args = args
+        self.prefix = prefix
+        mongo_params = args.mongo_params
+        tls = None
+        if args.tls:
+            cert, key = mockmongo.make_cert(prefix)
+            tls = mockmongo.tls_context(cert, key)
+            mongo_params += " tls_ca=" + cert
+        self.mock = mockmongo.MockMongo(
+            port=0, catalog=mockmongo.Catalog(len(SIZES), SIZES, CHUNK_SIZE),
+            db=args.db, tls=tls).start()
+        self.md5 = self.mock.catalog.md5(1)
+        self.counters = os.path.join(prefix, "counters")
+        self.shim = build_shim(prefix)
+        self.strace = shutil.which("strace") is not None and not args.no_strace
+        self.port = bench.free_port()
+
+        extra = "".join("            %s;\n" % d.strip() for d in args.location.split(";")
+                        if d.strip())
+        conf = os.path.join(prefix, "nginx.conf")
+        with open(conf, "w") as f:
+            f.write(NGINX_CONF.format(prefix=prefix, port=self.port, db=args.db,
+                                      mongo_port=self.mock.port, extra=extra,
+                                      mongo_params=" " + mongo_params.strip()
+                                      if mongo_params.strip() else ""))
+        os.makedirs(os.path.join(prefix, "logs"), exist_ok=True)
+        env = dict(os.environ)
+        if self.shim:
+            env["LD_PRELOAD"] = self.shim
+            env["GRIDFS_BENCH_COUNTERS"] = self.counters
+        self.nginx = subprocess.Popen([os.path.abspath(args.nginx), "-p", prefix, "-c", conf],
+                                      env=env)
+        if not bench.wait_port(self.port):
+            self.stop()
+            raise RuntimeError("nginx did not start, see %s/error.log" % prefix)
+
+    def mallocs(self):
+        if not self.shim:
+            return {}
+        with open(self.counters, "rb") as f:
+            return dict(zip(MALLOC_COUNTS, struct.unpack("<5Q", f.read(40))))
+
+    def mongo(self):
+        s = self.mock.stats.snapshot()
+        s["round_trips"] = s["queries"] + s["commands"] + s["get_mores"]
+        return dict((k, s[k]) for k in MONGO_COUNTS)
+
+    def measure(self, method, path, headers, repeat, idle=0):
+        """Counts per request, averaged over repeat requests; idle is the
+        number of syscalls strace sees with no request at all."""
+        trace = None
+        if self.strace:
+            trace = Strace(self.nginx.pid, os.path.join(self.prefix, "strace.out"))
+        mongo, mallocs = self.mongo(), self.mallocs()
+        statuses = set()
+        for _ in range(repeat):
+            statuses.add(request(self.port, method, path, headers))
+        time.sleep(self.args.settle)
+        mongo_after, mallocs_after = self.mongo(), self.mallocs()
+        syscalls = trace.stop() if trace else {}
+
+        counts = {}
+        for k in MONGO_COUNTS:
+            counts[k] = (mongo_after[k] - mongo[k]) / float(repeat)
+        for k in mallocs_after:
+            counts[k] = (mallocs_after[k] - mallocs[k]) / float(repeat)
+        if trace:
+            counts["syscalls"] = max(0.0, (sum(syscalls.values()) - idle) / float(repeat))
+        return counts, statuses, syscalls
+
+    def run(self):
+        # wait for the worker's connections, set up in the background
+        deadline = time.time() + 10
+        while request(self.port, "GET", "/gridfs/file0", []) == 503:
+            if time.time() > deadline:
+                raise RuntimeError("nginx could not connect to the mock mongod")
+            time.sleep(0.05)
+        idle = self._idle_syscalls() if self.strace else 0
+
+        results = {}
+        for name, method, path, headers in SCENARIOS:
+            headers = [(h, v if v is not None else "\"%s\"" % self.md5) for h, v in headers]
+            counts, statuses, syscalls = self.measure(method, path, headers,
+                                                      self.args.repeat, idle)
+            counts = dict((k, round(v, 1)) for k, v in counts.items())
+            results[name] = counts
+            line = "%-12s %s  %s" % (name, "/".join(str(s) for s in sorted(statuses)),
+                                     " ".join("%s=%g" % (k, counts[k]) for k in
+                                              sorted(counts, key=order)))
+            print(line)
+            if self.args.verbose and syscalls:
+                print("             " + " ".join("%s=%d" % kv for kv in sorted(syscalls.items())))
+        if self.args.tls:
+            s = self.mock.stats.snapshot()
+            print("%-12s handshakes=%d resumed=%d" % ("tls", s["tls_handshakes"],
+                                                     s["tls_resumed"]))
+        return results
+
+    def _idle_syscalls(self):
+        trace = Strace(self.nginx.pid, os.path.join(self.prefix, "strace.out"))
+        time.sleep(self.args.settle)
+        return sum(trace.stop().values())
+
+    def stop(self):
+        if self.nginx.poll() is None:
+            self.nginx.send_signal(signal.SIGQUIT)
+            try:
+                self.nginx.wait(10)
+            except subprocess.TimeoutExpired:
+                self.nginx.kill()
+                self.nginx.wait()
+        self.mock.stop()
+
+
+def order(key):
+    keys = MONGO_COUNTS + MALLOC_COUNTS + ("syscalls",)
+    return keys.index(key) if key in keys else len(keys)
+
+
+def compare(results, baseline):
+    """Counts that went up or that the baseline lacks, as lines to print."""
+    worse = []
+    for name, counts in sorted(results.items()):
+        base = baseline.get(name, {})
+        for k in sorted(counts, key=order):
+            if k not in base:
+                worse.append("%s: %s %g, not in the baseline" % (name, k, counts[k]))
+            elif counts[k] > base[k]:
+                worse.append("%s: %s %g -> %g" % (name, k, base[k], counts[k]))
+    return worse
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--nginx", required=True, help="nginx binary built with the module")
+    parser.add_argument("--db", default="bench")
+    parser.add_argument("--location", default="",
+                        help="extra directives for the gridfs location")
+    parser.add_argument("--mongo-params", default="",
+                        help="parameters of the mongo directive, e.g. \"protocol=op_msg\"")
+    parser.add_argument("--tls", action="store_true",
+                        help="TLS between nginx and the mock, with a self-signed certificate")
+    parser.add_argument("--repeat", type=int, default=10,
+                        help="requests per scenario, counts are averaged")
+    parser.add_argument("--settle", type=float, default=0.2,
+                        help="seconds to wait for nginx to go idle after the requests")
+    parser.add_argument("--baseline", default=BASELINE, help="counts to compare with")
+    parser.add_argument("--update", action="store_true",
+                        help="write the counts to the baseline instead of comparing")
+    parser.add_argument("--no-strace", action="store_true", help="don't count syscalls")
+    parser.add_argument("--verbose", action="store_true", help="list syscalls by name")
+    args = parser.parse_args()
+
+    prefix = tempfile.mkdtemp(prefix="gridfs-costs-")
+    harness = Harness(args, prefix)
+    try:
+        if not harness.shim:
+            print("note: no C compiler, allocations not counted")
+        if not harness.strace:
+            print("note: strace not used, syscalls not counted")
+        results = harness.run()
+    finally:
+        harness.stop()
+        shutil.rmtree(prefix, ignore_errors=True)
+
+    if args.update:
+        with open(args.baseline, "w") as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+            f.write("\n")
+        print("wrote %s" % args.baseline)
+        return
+
+    if not os.path.exists(args.baseline):
+        print("no baseline at %s, run with --update to write one" % args.baseline)
+        sys.exit(1)
+
+    with open(args.baseline) as f:
+        worse = compare(results, json.load(f))
+    if worse:
+        print("counts went up or have no baseline:")
+        for line in worse:
+            print("  " + line)
+        sys.exit(1)
+    print("no count went up")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,172 @@
+/*
+ * Allocation counter for bench/costs.py.
+ *
+ * Preload it into nginx and point GRIDFS_BENCH_COUNTERS at a file; the
+ * counters are kept in that file, mapped shared, so the harness can read
+ * them between requests without touching the process:
+ *
+ *   $ cc -shared -fPIC -O2 -o malloc_count.so malloc_count.c -ldl
+ *   $ GRIDFS_BENCH_COUNTERS=/tmp/counters LD_PRELOAD=./malloc_count.so nginx ...
+ *
+ * The file holds five little endian uint64: malloc, calloc, realloc,
+ * memalign (posix_memalign, memalign, aligned_alloc) and free calls.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+typedef struct {
+    uint64_t malloc;
+    uint64_t calloc;
+    uint64_t realloc;
+    uint64_t memalign;
+    uint64_t free;
+} counters_t;
+
+static counters_t local_counters;
+static counters_t *counters = &local_counters;
+
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+static void *(*real_memalign)(size_t, size_t);
+static void *(*real_aligned_alloc)(size_t, size_t);
+static void (*real_free)(void *);
+
+/* dlsym() may allocate before the real functions are known */
+static char bootstrap[8192];
+static size_t bootstrap_used;
+static int resolving;
+
+#define COUNT(field) __atomic_fetch_add(&counters->field, 1, __ATOMIC_RELAXED)
+
+static void *bootstrap_alloc(size_t size) {
+    void *p;
+
+    size = (size + 15) & ~(size_t) 15;
+    if (bootstrap_used + size > sizeof(bootstrap)) {
+        return NULL;
+    }
+    p = bootstrap + bootstrap_used;
+    bootstrap_used += size;
+    return p;
+}
+
+static int from_bootstrap(void *p) {
+    return (char *) p >= bootstrap && (char *) p < bootstrap + sizeof(bootstrap);
+}
+
+static void resolve(void) {
+    if (real_malloc || resolving) {
+        return;
+    }
+    resolving = 1;
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+    real_memalign = dlsym(RTLD_NEXT, "memalign");
+    real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+    real_free = dlsym(RTLD_NEXT, "free");
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    resolving = 0;
+}
+
+__attribute__((constructor))
+static void init(void) {
+    const char *path;
+    void *map;
+    int fd;
+
+    resolve();
+
+    path = getenv("GRIDFS_BENCH_COUNTERS");
+    if (path == NULL) {
+        return;
+    }
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        return;
+    }
+    if (ftruncate(fd, sizeof(counters_t)) == 0) {
+        map = mmap(NULL, sizeof(counters_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+            memcpy(map, &local_counters, sizeof(counters_t));
+            counters = map;
+        }
+    }
+    close(fd);
+}
+
+void *malloc(size_t size) {
+    resolve();
+    if (real_malloc == NULL) {
+        return bootstrap_alloc(size);
+    }
+    COUNT(malloc);
+    return real_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    void *p;
+
+    resolve();
+    if (real_calloc == NULL || resolving) {
+        p = bootstrap_alloc(n * size);
+        if (p) {
+            memset(p, 0, n * size);
+        }
+        return p;
+    }
+    COUNT(calloc);
+    return real_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    void *p;
+
+    resolve();
+    if (from_bootstrap(ptr) || real_realloc == NULL) {
+        p = malloc(size);
+        if (p && ptr) {
+            size_t left = bootstrap + sizeof(bootstrap) - (char *) ptr;
+            memcpy(p, ptr, size < left ? size : left);
+        }
+        return p;
+    }
+    COUNT(realloc);
+    return real_realloc(ptr, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    resolve();
+    COUNT(memalign);
+    return real_posix_memalign(memptr, alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    resolve();
+    COUNT(memalign);
+    return real_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    resolve();
+    COUNT(memalign);
+    return real_aligned_alloc(alignment, size);
+}
+
+void free(void *ptr) {
+    if (ptr == NULL || from_bootstrap(ptr)) {
+        return;
+    }
+    resolve();
+    COUNT(free);
+    real_free(ptr);
+}
@@ -0,0 +1,911 @@
+#!/usr/bin/env python3
+"""
+A stand-in for mongod speaking enough of the wire protocol for
+nginx-gridfs: OP_QUERY, OP_GET_MORE, OP_INSERT, OP_DELETE and
+OP_KILL_CURSORS, the commands the C driver sends, OP_MSG with find, getMore
+(exhaust included), killCursors, insert and delete, OP_COMPRESSED with zlib
+(and snappy or zstd when their Python packages are installed), and a small
+query engine over synthetic GridFS files. With --tls-cert it listens with
+TLS only and counts the handshakes clients resumed.
+
+Files are generated, not stored: file i is named "file<i>" and every chunk
+of it repeats the same pattern, so large files cost no memory. Documents
+inserted by clients (e.g. uploads) are kept in memory and queried as well.
+
+Run on its own:
+
+    $ python3 mockmongo.py --port 27017 --files 100 --size 256k --chunk-size 255k
+
+or import it: MockMongo(...).start() serves from a background thread.
+"""
+
+import argparse
+import asyncio
+import datetime
+import hashlib
+import os
+import random
+import re
+import ssl
+import struct
+import subprocess
+import threading
+import zlib
+
+try:
+    import snappy
+except ImportError:
+    snappy = None
+
+try:
+    import zstandard
+except ImportError:
+    zstandard = None
+
+# ---------- BSON ---------- #
+
+
+class ObjectId(object):
+    __slots__ = ("binary",)
+
+    def __init__(self, binary):
+        assert len(binary) == 12
+        self.binary = bytes(binary)
+
+    def __eq__(self, other):
+        return isinstance(other, ObjectId) and other.binary == self.binary
+
+    def __lt__(self, other):
+        return self.binary < other.binary
+
+    def __hash__(self):
+        return hash(self.binary)
+
+    def __repr__(self):
+        return "ObjectId(%s)" % self.binary.hex()
+
+    def __str__(self):
+        return self.binary.hex()
+
+
+def _cstring(s):
+    b = s.encode("utf-8")
+    if b"\0" in b:
+        raise ValueError("NUL in key")
+    return b + b"\0"
+
+
+class RawDocs(list):
+    """An array of documents already encoded."""
+
+
+def _element(key, value):
+    k = _cstring(key)
+    if isinstance(value, RawDocs):
+        body = b"".join(b"\x03" + _cstring(str(i)) + d for i, d in enumerate(value))
+        return b"\x04" + k + struct.pack("<i", len(body) + 5) + body + b"\0"
+    if isinstance(value, bool):
+        return b"\x08" + k + (b"\x01" if value else b"\x00")
+    if isinstance(value, int):
+        if -2 ** 31 <= value < 2 ** 31:
+            return b"\x10" + k + struct.pack("<i", value)
+        return b"\x12" + k + struct.pack("<q", value)
+    if isinstance(value, float):
+        return b"\x01" + k + struct.pack("<d", value)
+    if isinstance(value, str):
+        b = value.encode("utf-8")
+        return b"\x02" + k + struct.pack("<i", len(b) + 1) + b + b"\0"
+    if isinstance(value, dict):
+        return b"\x03" + k + encode(value)
+    if isinstance(value, (list, tuple)):
+        return b"\x04" + k + encode(dict((str(i), v) for i, v in enumerate(value)))
+    if isinstance(value, (bytes, bytearray, memoryview)):
+        return b"\x05" + k + struct.pack("<i", len(value)) + b"\x00" + bytes(value)
+    if isinstance(value, ObjectId):
+        return b"\x07" + k + value.binary
+    if isinstance(value, datetime.datetime):
+        epoch = datetime.datetime(1970, 1, 1, tzinfo=datetime.timezone.utc)
+        if value.tzinfo is None:
+            value = value.replace(tzinfo=datetime.timezone.utc)
+        ms = int((value - epoch).total_seconds() * 1000)
+        return b"\x09" + k + struct.pack("<q", ms)
+    if value is None:
+        return b"\x0a" + k
+    raise TypeError("cannot encode %r" % (value,))
+
+
+def encode(doc):
+    body = b"".join(_element(k, v) for k, v in doc.items())
+    return struct.pack("<i", len(body) + 5) + body + b"\0"
+
+
+def _read_cstring(data, pos):
+    end = data.index(b"\0", pos)
+    return data[pos:end].decode("utf-8", "replace"), end + 1
+
+
+def decode(data, pos=0):
+    """Decode the document at pos, return (doc, position after it)."""
+    size = struct.unpack_from("<i", data, pos)[0]
+    end = pos + size - 1
+    pos += 4
+    doc = {}
+    while pos < end:
+        t = data[pos]
+        pos += 1
+        key, pos = _read_cstring(data, pos)
+        if t == 0x01:
+            doc[key] = struct.unpack_from("<d", data, pos)[0]
+            pos += 8
+        elif t in (0x02, 0x0D, 0x0E):
+            n = struct.unpack_from("<i", data, pos)[0]
+            doc[key] = data[pos + 4:pos + 3 + n].decode("utf-8", "replace")
+            pos += 4 + n
+        elif t in (0x03, 0x04):
+            sub, pos = decode(data, pos)
+            doc[key] = list(sub.values()) if t == 0x04 else sub
+        elif t == 0x05:
+            n = struct.unpack_from("<i", data, pos)[0]
+            doc[key] = bytes(data[pos + 5:pos + 5 + n])
+            pos += 5 + n
+        elif t == 0x07:
+            doc[key] = ObjectId(data[pos:pos + 12])
+            pos += 12
+        elif t == 0x08:
+            doc[key] = data[pos] != 0
+            pos += 1
+        elif t == 0x09:
+            ms = struct.unpack_from("<q", data, pos)[0]
+            doc[key] = datetime.datetime(1970, 1, 1, tzinfo=datetime.timezone.utc) \
+                + datetime.timedelta(milliseconds=ms)
+            pos += 8
+        elif t in (0x0A, 0x06, 0x7F, 0xFF):
+            doc[key] = None
+        elif t == 0x0B:
+            pattern, pos = _read_cstring(data, pos)
+            _, pos = _read_cstring(data, pos)
+            doc[key] = re.compile(pattern)
+        elif t == 0x10:
+            doc[key] = struct.unpack_from("<i", data, pos)[0]
+            pos += 4
+        elif t in (0x11, 0x12):
+            doc[key] = struct.unpack_from("<q", data, pos)[0]
+            pos += 8
+        else:
+            raise ValueError("unsupported BSON type 0x%02x" % t)
+    return doc, end + 1
+
+
+# ---------- Synthetic files ---------- #
+
+
+def parse_size(s):
+    s = str(s).strip().lower()
+    mult = {"k": 1024, "m": 1024 ** 2, "g": 1024 ** 3}.get(s[-1:], 1)
+    return int(float(s.rstrip("kmg")) * mult)
+
+
+class Catalog(object):
+    """The synthetic files: sizes cycle through the given list."""
+
+    EPOCH = datetime.datetime(2020, 1, 1, tzinfo=datetime.timezone.utc)
+
+    def __init__(self, count=100, sizes=(256 * 1024,), chunk_size=255 * 1024,
+                 content_type="application/octet-stream"):
+        self.count = count
+        self.sizes = list(sizes)
+        self.chunk_size = chunk_size
+        self.content_type = content_type
+        self._md5 = {}
+
+    @staticmethod
+    def oid(i):
+        return ObjectId(b"gfsb" + struct.pack(">Q", i))
+
+    @staticmethod
+    def name(i):
+        return "file%d" % i
+
+    def index_of(self, value):
+        """File index for an _id or filename, or None."""
+        if isinstance(value, ObjectId):
+            if value.binary[:4] != b"gfsb":
+                return None
+            i = struct.unpack(">Q", value.binary[4:])[0]
+        elif isinstance(value, str) and value.startswith("file") and value[4:].isdigit():
+            i = int(value[4:])
+        else:
+            return None
+        return i if 0 <= i < self.count else None
+
+    def length(self, i):
+        return self.sizes[i % len(self.sizes)]
+
+    def numchunks(self, i):
+        return (self.length(i) + self.chunk_size - 1) // self.chunk_size
+
+    def pattern(self, i):
+        return bytes((i * 7 + k) & 0xFF for k in range(251)) * (self.chunk_size // 251 + 1)
+
+    def chunk_data(self, i, n, pattern=None):
+        pattern = pattern or self.pattern(i)
+        start = n * self.chunk_size
+        return pattern[:min(self.chunk_size, self.length(i) - start)]
+
+    def md5(self, i):
+        if i not in self._md5:
+            h = hashlib.md5()
+            pattern = self.pattern(i)
+            for n in range(self.numchunks(i)):
+                h.update(self.chunk_data(i, n, pattern))
+            self._md5[i] = h.hexdigest()
+        return self._md5[i]
+
+    def file_doc(self, i):
+        return {
+            "_id": self.oid(i),
+            "filename": self.name(i),
+            "length": self.length(i),
+            "chunkSize": self.chunk_size,
+            "uploadDate": self.EPOCH + datetime.timedelta(seconds=i),
+            "md5": self.md5(i),
+            "contentType": self.content_type,
+        }
+
+    def chunk_doc(self, i, n, pattern=None):
+        return {
+            "_id": ObjectId(b"gfsc" + struct.pack(">IL", i, n)),
+            "files_id": self.oid(i),
+            "n": n,
+            "data": self.chunk_data(i, n, pattern),
+        }
+
+
+# ---------- Query engine ---------- #
+
+
+def _compare_key(v):
+    order = {type(None): 0, int: 1, float: 1, str: 2, dict: 3, list: 4,
+             bytes: 5, ObjectId: 6, bool: 7, datetime.datetime: 8}
+    return (order.get(type(v), 9), v)
+
+
+def _matches_value(value, cond):
+    if isinstance(cond, dict) and cond and all(k.startswith("$") for k in cond):
+        for op, arg in cond.items():
+            try:
+                if op == "$in":
+                    if value not in arg:
+                        return False
+                elif op == "$nin":
+                    if value in arg:
+                        return False
+                elif op == "$ne":
+                    if value == arg:
+                        return False
+                elif op == "$gt":
+                    if value is None or not value > arg:
+                        return False
+                elif op == "$gte":
+                    if value is None or not value >= arg:
+                        return False
+                elif op == "$lt":
+                    if value is None or not value < arg:
+                        return False
+                elif op == "$lte":
+                    if value is None or not value <= arg:
+                        return False
+                elif op == "$exists":
+                    if (value is not None) != bool(arg):
+                        return False
+                else:
+                    return False
+            except TypeError:
+                return False
+        return True
+    if hasattr(cond, "search"):
+        return isinstance(value, str) and cond.search(value) is not None
+    return value == cond
+
+
+def matches(doc, query):
+    for key, cond in query.items():
+        if key == "$or":
+            if not any(matches(doc, q) for q in cond):
+                return False
+            continue
+        if key == "$and":
+            if not all(matches(doc, q) for q in cond):
+                return False
+            continue
+        if not _matches_value(doc.get(key), cond):
+            return False
+    return True
+
+
+def _equality_values(query, key):
+    """Values key is restricted to by query, or None if unrestricted."""
+    cond = query.get(key)
+    if cond is None:
+        return None
+    if isinstance(cond, dict) and "$in" in cond:
+        return list(cond["$in"])
+    if isinstance(cond, dict) and any(k.startswith("$") for k in cond):
+        return None
+    return [cond]
+
+
+def _int_range(query, key):
+    """[lo, hi) key is restricted to by $gt/$gte/$lt/$lte, unbounded sides
+    as +-inf."""
+    lo, hi = float("-inf"), float("inf")
+    cond = query.get(key)
+    if isinstance(cond, dict):
+        for op, v in cond.items():
+            if not isinstance(v, int) or isinstance(v, bool):
+                continue
+            if op == "$gte":
+                lo = max(lo, v)
+            elif op == "$gt":
+                lo = max(lo, v + 1)
+            elif op == "$lt":
+                hi = min(hi, v)
+            elif op == "$lte":
+                hi = min(hi, v + 1)
+    return lo, hi
+
+
+def project(doc, fields):
+    if not fields:
+        return doc
+    include = [k for k, v in fields.items() if v]
+    if include:
+        out = {}
+        if fields.get("_id", 1) and "_id" in doc:
+            out["_id"] = doc["_id"]
+        for k in include:
+            if k in doc:
+                out[k] = doc[k]
+        return out
+    return dict((k, v) for k, v in doc.items() if k not in fields)
+
+
+# ---------- Server ---------- #
+
+OP_REPLY = 1
+OP_UPDATE = 2001
+OP_INSERT = 2002
+OP_QUERY = 2004
+OP_GET_MORE = 2005
+OP_DELETE = 2006
+OP_KILL_CURSORS = 2007
+OP_COMPRESSED = 2012
+OP_MSG = 2013
+
+MSG_CHECKSUM_PRESENT = 1 << 0
+MSG_MORE_TO_COME = 1 << 1
+MSG_EXHAUST_ALLOWED = 1 << 16
+
+# id -> (name, compress, decompress)
+COMPRESSORS = {2: ("zlib", zlib.compress, zlib.decompress)}
+if snappy is not None:
+    COMPRESSORS[1] = ("snappy", snappy.compress, snappy.uncompress)
+if zstandard is not None:
+    COMPRESSORS[3] = ("zstd", zstandard.ZstdCompressor().compress,
+                      zstandard.ZstdDecompressor().decompress)
+
+FIRST_BATCH_DOCS = 101
+MAX_BATCH_BYTES = 4 * 1024 * 1024
+
+
+class Stats(object):
+    """What clients asked for, for the cost accounting harness."""
+
+    FIELDS = ("connections", "messages", "queries", "commands", "get_mores",
+              "inserts", "deletes", "kill_cursors", "cursors_opened",
+              "docs_returned", "pushed_batches", "compressed", "bytes_in", "bytes_out",
+              "tls_handshakes", "tls_resumed")
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.reset()
+
+    def reset(self):
+        with self.lock:
+            for f in self.FIELDS:
+                setattr(self, f, 0)
+            self.by_command = {}
+            self.by_ns = {}
+
+    def add(self, field, n=1):
+        with self.lock:
+            setattr(self, field, getattr(self, field) + n)
+
+    def command(self, name):
+        with self.lock:
+            self.by_command[name] = self.by_command.get(name, 0) + 1
+
+    def ns(self, ns):
+        with self.lock:
+            self.by_ns[ns] = self.by_ns.get(ns, 0) + 1
+
+    def snapshot(self):
+        with self.lock:
+            snap = dict((f, getattr(self, f)) for f in self.FIELDS)
+            snap["by_command"] = dict(self.by_command)
+            snap["by_ns"] = dict(self.by_ns)
+            return snap
+
+
+class MockMongo(object):
+
+    def __init__(self, host="127.0.0.1", port=27017, catalog=None, db="bench",
+                 root="fs", latency=0.0, jitter=0.0, seed=0, tls=None):
+        self.host = host
+        self.port = port
+        self.catalog = catalog or Catalog()
+        self.db = db
+        self.root = root
+        self.latency = latency
+        self.jitter = jitter
+        self.random = random.Random(seed)
+        self.tls = tls
+        self.stats = Stats()
+        self.collections = {}  # ns -> list of inserted documents
+        self.cursors = {}  # id -> (iterator of docs, limit left)
+        self.next_cursor = 1
+        self.next_request = 1
+        self.loop = None
+        self.server = None
+
+    # ----- documents
+
+    def _synthetic(self, ns, query):
+        """Generated documents of ns that may match query."""
+        if ns == "%s.%s.files" % (self.db, self.root):
+            ids = _equality_values(query, "_id")
+            names = _equality_values(query, "filename")
+            wanted = ids if ids is not None else names
+            if wanted is not None:
+                indexes = [self.catalog.index_of(v) for v in wanted]
+            else:
+                indexes = range(self.catalog.count)
+            for i in sorted(set(i for i in indexes if i is not None)):
+                yield self.catalog.file_doc(i)
+        elif ns == "%s.%s.chunks" % (self.db, self.root):
+            ids = _equality_values(query, "files_id")
+            if ids is not None:
+                indexes = [self.catalog.index_of(v) for v in ids]
+            else:
+                indexes = range(self.catalog.count)
+            ns_cond = _equality_values(query, "n")
+            lo, hi = _int_range(query, "n")
+            for i in sorted(set(i for i in indexes if i is not None)):
+                pattern = self.catalog.pattern(i)
+                if ns_cond is not None:
+                    chunks = [n for n in ns_cond
+                              if isinstance(n, int) and 0 <= n < self.catalog.numchunks(i)]
+                else:
+                    chunks = range(max(lo, 0), min(hi, self.catalog.numchunks(i)))
+                for n in chunks:
+                    yield self.catalog.chunk_doc(i, n, pattern)
+
+    def find(self, ns, query, fields=None, orderby=None):
+        docs = [d for d in self._synthetic(ns, query) if matches(d, query)]
+        docs += [d for d in self.collections.get(ns, []) if matches(d, query)]
+        if orderby:
+            for key, direction in reversed(list(orderby.items())):
+                docs.sort(key=lambda d: _compare_key(d.get(key)), reverse=direction < 0)
+        return [project(d, fields) for d in docs]
+
+    # ----- commands
+
+    def command(self, db, cmd):
+        name = next(iter(cmd), "")
+        lname = name.lower()
+        self.stats.command(lname)
+        if lname in ("ismaster", "hello"):
+            reply = {"ismaster": True, "maxBsonObjectSize": 16 * 1024 * 1024,
+                     "maxMessageSizeBytes": 48 * 1024 * 1024, "maxWireVersion": 6,
+                     "minWireVersion": 0, "ok": 1.0}
+            if "compression" in cmd:
+                names = [c[0] for c in COMPRESSORS.values()]
+                reply["compression"] = [c for c in cmd["compression"] if c in names]
+            return reply
+        if lname == "getlasterror":
+            return {"err": None, "n": 0, "ok": 1.0}
+        if lname == "getnonce":
+            return {"nonce": "%016x" % self.random.getrandbits(64), "ok": 1.0}
+        if lname in ("authenticate", "ping", "buildinfo", "logout"):
+            return {"ok": 1.0, "version": "2.4.0"}
+        if lname == "count":
+            return {"n": len(self.find("%s.%s" % (db, cmd[name]), cmd.get("query") or {})),
+                    "ok": 1.0}
+        if lname == "filemd5":
+            root = cmd.get("root", "fs")
+            chunks = self.find("%s.%s.chunks" % (db, root), {"files_id": cmd[name]},
+                               orderby={"n": 1})
+            h = hashlib.md5()
+            for c in chunks:
+                h.update(c.get("data", b""))
+            return {"md5": h.hexdigest(), "numChunks": len(chunks), "ok": 1.0}
+        if lname == "insert":
+            self.stats.add("inserts")
+            ns = "%s.%s" % (db, cmd[name])
+            self.stats.ns(ns)
+            self.collections.setdefault(ns, []).extend(cmd.get("documents", []))
+            return {"n": len(cmd.get("documents", [])), "ok": 1.0}
+        if lname == "delete":
+            self.stats.add("deletes")
+            ns = "%s.%s" % (db, cmd[name])
+            n = len(self.collections.get(ns, []))
+            for d in cmd.get("deletes", []):
+                self.collections[ns] = [doc for doc in self.collections.get(ns, [])
+                                        if not matches(doc, d.get("q", {}))]
+            return {"n": n - len(self.collections.get(ns, [])), "ok": 1.0}
+        if lname == "benchstats":
+            return {"stats": self.stats.snapshot(), "ok": 1.0}
+        if lname == "benchreset":
+            self.stats.reset()
+            return {"ok": 1.0}
+        return {"ok": 1.0}
+
+    # ----- wire protocol
+
+    def _reply(self, request_id, docs, cursor_id=0, flags=0, starting_from=0):
+        """Reply with docs, given as dicts or already encoded."""
+        body = b"".join(d if isinstance(d, bytes) else encode(d) for d in docs)
+        header = struct.pack("<iiiiiqii", 36 + len(body), 0, request_id, OP_REPLY,
+                             flags, cursor_id, starting_from, len(docs))
+        self.stats.add("docs_returned", len(docs))
+        self.stats.add("bytes_out", 36 + len(body))
+        return header + body
+
+    def _batch(self, docs, limit, first):
+        """Encode the next batch: at most limit docs and MAX_BATCH_BYTES."""
+        out, size = [], 0
+        cap = limit if limit > 0 else (FIRST_BATCH_DOCS if first else 0)
+        for d in docs:
+            out.append(encode(d))
+            size += len(out[-1])
+            if (cap and len(out) >= cap) or size >= MAX_BATCH_BYTES:
+                break
+        return out
+
+    def _open_cursor(self, docs, limit):
+        cursor_id = self.next_cursor
+        self.next_cursor += 1
+        self.cursors[cursor_id] = (docs, limit)
+        self.stats.add("cursors_opened")
+        return cursor_id
+
+    def _query(self, request_id, data):
+        flags, = struct.unpack_from("<i", data, 16)
+        ns, pos = _read_cstring(data, 20)
+        skip, to_return = struct.unpack_from("<ii", data, pos)
+        query, pos = decode(data, pos + 8)
+        fields = decode(data, pos)[0] if pos < len(data) else None
+
+        db, _, coll = ns.partition(".")
+        if coll == "$cmd":
+            self.stats.add("commands")
+            return self._reply(request_id, [self.command(db, query)])
+
+        self.stats.add("queries")
+        self.stats.ns(ns)
+
+        orderby = None
+        for wrapper in ("$query", "query"):
+            if wrapper in query and isinstance(query[wrapper], dict):
+                orderby = query.get("$orderby", query.get("orderby"))
+                query = query[wrapper]
+                break
+
+        docs = self.find(ns, query, fields, orderby)[skip:]
+        single = to_return < 0 or to_return == 1
+        limit = abs(to_return)
+        batch = self._batch(docs, limit, True)
+        rest = docs[len(batch):]
+        if limit:
+            rest = rest[:max(0, limit - len(batch))]
+        cursor_id = 0
+        if rest and not single:
+            cursor_id = self._open_cursor(rest, limit - len(batch) if limit else 0)
+        return self._reply(request_id, batch, cursor_id)
+
+    def _get_more(self, request_id, data):
+        self.stats.add("get_mores")
+        ns, pos = _read_cstring(data, 20)
+        to_return, cursor_id = struct.unpack_from("<iq", data, pos)
+        if cursor_id not in self.cursors:
+            return self._reply(request_id, [], 0, flags=1)
+        docs, limit = self.cursors.pop(cursor_id)
+        n = to_return if to_return > 0 else limit
+        batch = self._batch(docs, n, False)
+        rest = docs[len(batch):]
+        left = limit - len(batch) if limit else 0
+        if limit and left <= 0:
+            rest = []
+        if rest:
+            self.cursors[cursor_id] = (rest, left)
+            return self._reply(request_id, batch, cursor_id)
+        return self._reply(request_id, batch, 0)
+
+    def _msg_reply(self, request_id, doc, flags=0):
+        """An OP_MSG answering request_id, under a requestID of its own."""
+        body = encode(doc)
+        self.next_request += 1
+        header = struct.pack("<iiiiib", 21 + len(body), self.next_request, request_id, OP_MSG,
+                             flags, 0)
+        self.stats.add("bytes_out", 21 + len(body))
+        return header + body
+
+    def _compressed(self, request_id, data):
+        """Unwrap an OP_COMPRESSED, handle the message inside and compress
+        the replies the same way."""
+        opcode, _size, compressor = struct.unpack_from("<iiB", data, 16)
+        _, compress, decompress = COMPRESSORS[compressor]
+        body = decompress(bytes(data[25:]))
+        inner = struct.pack("<iiii", 16 + len(body), request_id, 0, opcode) + body
+        self.stats.add("compressed")
+        self.stats.add("messages", -1)
+        self.stats.add("bytes_in", -len(inner))
+        replies = self.handle(inner)
+        if replies is None:
+            return None
+        out, pos = [], 0
+        while pos < len(replies):
+            length, = struct.unpack_from("<i", replies, pos)
+            reply = replies[pos:pos + length]
+            packed = compress(reply[16:])
+            ids = struct.unpack_from("<ii", reply, 4)
+            out.append(struct.pack("<iiiiiiB", 25 + len(packed), ids[0], ids[1], OP_COMPRESSED,
+                                   struct.unpack_from("<i", reply, 12)[0], length - 16,
+                                   compressor) + packed)
+            self.stats.add("bytes_out", len(out[-1]) - length)
+            pos += length
+        return b"".join(out)
+
+    def _cursor_reply(self, request_id, ns, batch, cursor_id, key, flags=0):
+        self.stats.add("docs_returned", len(batch))
+        return self._msg_reply(request_id, {
+            "cursor": {key: RawDocs(batch), "id": cursor_id, "ns": ns}, "ok": 1.0}, flags)
+
+    def _msg(self, request_id, data):
+        flags, = struct.unpack_from("<I", data, 16)
+        end = len(data) - (4 if flags & MSG_CHECKSUM_PRESENT else 0)
+        body, pos = {}, 20
+        while pos < end:
+            kind = data[pos]
+            pos += 1
+            if kind == 0:
+                body, pos = decode(data, pos)
+            else:
+                size, = struct.unpack_from("<i", data, pos)
+                ident, docpos = _read_cstring(data, pos + 4)
+                docs = body.setdefault(ident, [])
+                while docpos < pos + size:
+                    doc, docpos = decode(data, docpos)
+                    docs.append(doc)
+                pos += size
+
+        name = next(iter(body), "")
+        db = body.get("$db", "admin")
+        if name == "find":
+            return self._msg_find(request_id, db, body)
+        if name == "getMore":
+            return self._msg_get_more(request_id, db, body, flags & MSG_EXHAUST_ALLOWED)
+        if name == "killCursors":
+            self.stats.add("kill_cursors")
+            for cursor_id in body.get("cursors", []):
+                self.cursors.pop(cursor_id, None)
+            return self._msg_reply(request_id, {"ok": 1.0})
+        if name in ("insert", "delete"):
+            return self._msg_reply(request_id, self.command(db, body))
+        self.stats.add("commands")
+        return self._msg_reply(request_id, self.command(db, body))
+
+    def _msg_find(self, request_id, db, cmd):
+        ns = "%s.%s" % (db, cmd["find"])
+        self.stats.add("queries")
+        self.stats.ns(ns)
+        docs = self.find(ns, cmd.get("filter") or {}, cmd.get("projection"),
+                         cmd.get("sort"))[cmd.get("skip", 0):]
+        limit = abs(cmd.get("limit", 0))
+        if limit:
+            docs = docs[:limit]
+        batch_size = cmd.get("batchSize", 0)
+        batch = self._batch(docs, batch_size, True)
+        rest = docs[len(batch):]
+        cursor_id = 0
+        if rest and not cmd.get("singleBatch"):
+            cursor_id = self._open_cursor(rest, 0)
+        return self._cursor_reply(request_id, ns, batch, cursor_id, "firstBatch")
+
+    def _msg_get_more(self, request_id, db, cmd, exhaust):
+        """Reply with the next batch; with exhaust, push every batch left,
+        each flagged moreToCome but the last and answering the one before."""
+        self.stats.add("get_mores")
+        ns = "%s.%s" % (db, cmd.get("collection", ""))
+        cursor_id = cmd["getMore"]
+        if cursor_id not in self.cursors:
+            return self._msg_reply(request_id, {"ok": 0.0, "code": 43,
+                                                "errmsg": "cursor id %d not found" % cursor_id})
+        docs, _ = self.cursors.pop(cursor_id)
+        replies = []
+        while True:
+            batch = self._batch(docs, cmd.get("batchSize", 0), False)
+            docs = docs[len(batch):]
+            more = exhaust and bool(docs)
+            replies.append(self._cursor_reply(request_id, ns, batch, cursor_id if docs else 0,
+                                              "nextBatch", MSG_MORE_TO_COME if more else 0))
+            request_id = self.next_request
+            if not more:
+                break
+            self.stats.add("pushed_batches")
+        if docs:
+            self.cursors[cursor_id] = (docs, 0)
+        return b"".join(replies)
+
+    def _insert(self, data):
+        self.stats.add("inserts")
+        ns, pos = _read_cstring(data, 20)
+        self.stats.ns(ns)
+        docs = self.collections.setdefault(ns, [])
+        while pos < len(data):
+            doc, pos = decode(data, pos)
+            docs.append(doc)
+
+    def _delete(self, data):
+        self.stats.add("deletes")
+        ns, pos = _read_cstring(data, 20)
+        _flags, = struct.unpack_from("<i", data, pos)
+        query, _ = decode(data, pos + 4)
+        self.collections[ns] = [d for d in self.collections.get(ns, [])
+                                if not matches(d, query)]
+
+    def _kill_cursors(self, data):
+        self.stats.add("kill_cursors")
+        n, = struct.unpack_from("<i", data, 20)
+        for k in range(n):
+            self.cursors.pop(struct.unpack_from("<q", data, 24 + 8 * k)[0], None)
+
+    def handle(self, data):
+        """Handle one message, return the reply bytes or None."""
+        request_id, _, opcode = struct.unpack_from("<iii", data, 4)
+        self.stats.add("messages")
+        self.stats.add("bytes_in", len(data))
+        if opcode == OP_QUERY:
+            return self._query(request_id, data)
+        if opcode == OP_GET_MORE:
+            return self._get_more(request_id, data)
+        if opcode == OP_MSG:
+            return self._msg(request_id, data)
+        if opcode == OP_COMPRESSED:
+            return self._compressed(request_id, data)
+        if opcode == OP_INSERT:
+            self._insert(data)
+        elif opcode == OP_DELETE:
+            self._delete(data)
+        elif opcode == OP_KILL_CURSORS:
+            self._kill_cursors(data)
+        return None
+
+    async def _delay(self):
+        if self.latency or self.jitter:
+            await asyncio.sleep(max(0.0, self.latency + self.random.uniform(-self.jitter,
+                                                                             self.jitter)))
+
+    async def _serve(self, reader, writer):
+        self.stats.add("connections")
+        ssl_object = writer.get_extra_info("ssl_object")
+        if ssl_object is not None:
+            self.stats.add("tls_handshakes")
+            if ssl_object.session_reused:
+                self.stats.add("tls_resumed")
+        try:
+            while True:
+                head = await reader.readexactly(4)
+                length, = struct.unpack("<i", head)
+                data = head + await reader.readexactly(length - 4)
+                reply = self.handle(data)
+                if reply is not None:
+                    await self._delay()
+                    writer.write(reply)
+                    await writer.drain()
+        except (asyncio.IncompleteReadError, ConnectionError, ssl.SSLError):
+            pass
+        finally:
+            writer.close()
+
+    async def serve(self, ready=None):
+        self.loop = asyncio.get_event_loop()
+        self.server = await asyncio.start_server(self._serve, self.host, self.port,
+                                                 ssl=self.tls)
+        if self.port == 0:
+            self.port = self.server.sockets[0].getsockname()[1]
+        if ready is not None:
+            ready.set()
+        async with self.server:
+            await self.server.serve_forever()
+
+    def start(self):
+        """Serve from a daemon thread; returns once listening."""
+        ready = threading.Event()
+
+        def run():
+            try:
+                asyncio.run(self.serve(ready))
+            except asyncio.CancelledError:
+                pass
+
+        thread = threading.Thread(target=run, daemon=True)
+        thread.start()
+        ready.wait()
+        return self
+
+    def stop(self):
+        if self.loop and self.server:
+            self.loop.call_soon_threadsafe(self.server.close)
+
+
+def tls_context(cert, key=None):
+    """Server side TLS; OpenSSL's defaults let clients resume sessions, by
+    ticket or, before TLS 1.3, by id."""
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    context.load_cert_chain(cert, key)
+    return context
+
+
+def make_cert(directory):
+    """A self-signed certificate for 127.0.0.1, made with the openssl
+    command; returns the certificate and key paths."""
+    cert = os.path.join(directory, "mongod.crt")
+    key = os.path.join(directory, "mongod.key")
+    subprocess.check_call(["openssl", "req", "-x509", "-newkey", "rsa:2048", "-nodes",
+                           "-keyout", key, "-out", cert, "-days", "2",
+                           "-subj", "/CN=localhost",
+                           "-addext", "subjectAltName=IP:127.0.0.1,DNS:localhost"],
+                          stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    return cert, key
+
+
+def add_arguments(parser):
+    parser.add_argument("--files", type=int, default=100, help="number of files")
+    parser.add_argument("--size", default="256k",
+                        help="file size, or comma separated sizes to cycle through")
+    parser.add_argument("--chunk-size", default="255k", help="GridFS chunkSize")
+    parser.add_argument("--db", default="bench")
+    parser.add_argument("--root", default="fs", help="GridFS root collection")
+    parser.add_argument("--latency", type=float, default=0.0,
+                        help="milliseconds added to every reply")
+    parser.add_argument("--jitter", type=float, default=0.0,
+                        help="random +/- milliseconds added to the latency")
+
+
+def from_arguments(args, port, host="127.0.0.1"):
+    catalog = Catalog(args.files, [parse_size(s) for s in args.size.split(",")],
+                      parse_size(args.chunk_size))
+    return MockMongo(host, port, catalog, args.db, args.root,
+                     args.latency / 1000.0, args.jitter / 1000.0)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=27017)
+    parser.add_argument("--tls-cert", help="listen with TLS, with this PEM certificate")
+    parser.add_argument("--tls-key", help="its key, if not in the certificate file")
+    add_arguments(parser)
+    args = parser.parse_args()
+    mock = from_arguments(args, args.port, args.host)
+    if args.tls_cert:
+        mock.tls = tls_context(args.tls_cert, args.tls_key)
+    try:
+        asyncio.run(mock.serve())
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -40,15 +40,103 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
+#include <nginx.h>
 #include "mongo-c-driver/src/mongo.h"
 #include "mongo-c-driver/src/gridfs.h"
 #include <signal.h>
 #include <stdio.h>
+#if (NGX_ZLIB)
+#include <zlib.h>
+#endif
+#if (NGX_HTTP_GRIDFS_SNAPPY)
+#include <snappy-c.h>
+#endif
+#if (NGX_HTTP_GRIDFS_ZSTD)
+#include <zstd.h>
+#endif
+#if (NGX_HTTP_GRIDFS_SDT)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#endif
 
 #define MONGO_MAX_RETRIES_PER_REQUEST 1
 #define MONGO_RECONNECT_WAITTIME 500 //ms
 #define TRUE 1
 #define FALSE 0
+#define GRIDFS_FILTER_HASHES 7
+#define GRIDFS_FILTER_BATCH 1000 //docs per build step
+#define GRIDFS_FILTER_IDLE_INTERVAL 1000 //ms
+#define GRIDFS_FILTER_STALE_CLAIM 60 //s
+#define GRIDFS_KEY_MAX_LEN 1024
+#define GRIDFS_MAX_VARIANTS 7
+#define GRIDFS_STATS_BUCKETS 12 //latency histogram buckets, +Inf included
+#define GRIDFS_SLOW_LOG_OPS 16 //slowest operations listed per request
+#define GRIDFS_STREAM_WINDOW (8 * 1024 * 1024) //chunk bytes fetched per find, op_msg
+#define GRIDFS_STREAM_BATCH (1024 * 1024) //chunk bytes per reply, op_msg
+#define GRIDFS_UPLOAD_MAX_BATCH (8 * 1024 * 1024) //chunk bytes per insert, gridfs_upload
+#define GRIDFS_WARMUP_MAX_FILE (16 * 1024 * 1024) //size of a gridfs_warmup key file
+#define GRIDFS_WARMUP_WAIT 1000 //ms, for the connection to come up
+#define GRIDFS_CACHE_UPDATING 5000 //ms a refresh is given before another is tried
+#define GRIDFS_STALE_ERROR 0x02 //gridfs_cache_use_stale
+#define GRIDFS_STALE_CONNECTING 0x04
+#define GRIDFS_STALE_UPDATING 0x08
+#define GRIDFS_STALE_OFF 0x80000000
+#define MONGO_PROTOCOL_OP_QUERY 0
+#define MONGO_PROTOCOL_OP_MSG 1
+#define MONGO_COMPRESSOR_NOOP 0 //compressor ids of OP_COMPRESSED
+#define MONGO_COMPRESSOR_SNAPPY 1
+#define MONGO_COMPRESSOR_ZLIB 2
+#define MONGO_COMPRESSOR_ZSTD 3
+#define MONGO_TLS_SESSION_MAX 4096 //bytes of a serialized TLS session
+#define MONGO_TLS_PEER_LEN 264 //host:port a TLS session is kept for
+#define MONGO_TLS_ZONE_PAGES 32 //size of the zone sessions are kept in
+
+/* USDT probes of the nginx_gridfs provider, for bpftrace; see
+ * bpftrace/. Each has a semaphore the tracer raises while attached,
+ * so with nothing attached a probe costs a test of it and its arguments are
+ * not evaluated. Without sys/sdt.h they compile to nothing. */
+#if (NGX_HTTP_GRIDFS_SDT)
+#define GRIDFS_PROBE_SEMAPHORE(name)                                          \
+    unsigned short nginx_gridfs_##name##_semaphore                            \
+        __attribute__((unused)) __attribute__((section(".probes")))
+#define GRIDFS_PROBE_ENABLED(name) __builtin_expect(nginx_gridfs_##name##_semaphore, 0)
+#define GRIDFS_PROBE2(name, a1, a2)                                           \
+    do {                                                                      \
+        if (GRIDFS_PROBE_ENABLED(name)) {                                     \
+            DTRACE_PROBE2(nginx_gridfs, name, a1, a2);                        \
+        }                                                                     \
+    } while (0)
+#define GRIDFS_PROBE3(name, a1, a2, a3)                                       \
+    do {                                                                      \
+        if (GRIDFS_PROBE_ENABLED(name)) {                                     \
+            DTRACE_PROBE3(nginx_gridfs, name, a1, a2, a3);                    \
+        }                                                                     \
+    } while (0)
+#define GRIDFS_PROBE4(name, a1, a2, a3, a4)                                   \
+    do {                                                                      \
+        if (GRIDFS_PROBE_ENABLED(name)) {                                     \
+            DTRACE_PROBE4(nginx_gridfs, name, a1, a2, a3, a4);                \
+        }                                                                     \
+    } while (0)
+
+GRIDFS_PROBE_SEMAPHORE(request__start);
+GRIDFS_PROBE_SEMAPHORE(request__done);
+GRIDFS_PROBE_SEMAPHORE(lookup__start);
+GRIDFS_PROBE_SEMAPHORE(lookup__done);
+GRIDFS_PROBE_SEMAPHORE(chunk__start);
+GRIDFS_PROBE_SEMAPHORE(chunk__done);
+GRIDFS_PROBE_SEMAPHORE(reconnect__start);
+GRIDFS_PROBE_SEMAPHORE(reconnect__done);
+GRIDFS_PROBE_SEMAPHORE(reauth__start);
+GRIDFS_PROBE_SEMAPHORE(reauth__done);
+GRIDFS_PROBE_SEMAPHORE(output__start);
+GRIDFS_PROBE_SEMAPHORE(output__done);
+#else
+#define GRIDFS_PROBE_ENABLED(name) 0
+#define GRIDFS_PROBE2(name, a1, a2)
+#define GRIDFS_PROBE3(name, a1, a2, a3)
+#define GRIDFS_PROBE4(name, a1, a2, a3, a4)
+#endif
 
 /* Parse config directive */
 static char * ngx_http_mongo(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy);
@@ -68,16 +156,178 @@ static ngx_int_t ngx_http_gridfs_handler(ngx_http_request_t* request);
 
 static void ngx_http_gridfs_cleanup(void* data);
 
+static void ngx_http_gridfs_write_handler(ngx_http_request_t* request);
+
+static ngx_int_t ngx_http_gridfs_wait_write(ngx_http_request_t* request);
+
+static ngx_int_t ngx_http_gridfs_batch_handler(ngx_http_request_t* request);
+
+/* Parse config directive */
+static char* ngx_http_gridfs_miss_cache(ngx_conf_t* cf, ngx_command_t* command, void* void_conf);
+
+/* Parse config directive */
+static char* ngx_http_gridfs_key_filter(ngx_conf_t* cf, ngx_command_t* command, void* void_conf);
+
+static ngx_int_t ngx_http_gridfs_init_miss_zone(ngx_shm_zone_t* shm_zone, void* data);
+
+static ngx_int_t ngx_http_gridfs_init_filter_zone(ngx_shm_zone_t* shm_zone, void* data);
+
+static void ngx_http_gridfs_filter_refresh(ngx_event_t* ev);
+
+/* Parse config directive */
+static char* ngx_http_gridfs_status(ngx_conf_t* cf, ngx_command_t* command, void* void_conf);
+
+static ngx_int_t ngx_http_gridfs_init_stats(ngx_conf_t* cf);
+
+static ngx_int_t ngx_http_gridfs_init_stats_zone(ngx_shm_zone_t* shm_zone, void* data);
+
+static void ngx_http_gridfs_count(ngx_http_request_t* request, size_t field, ngx_atomic_int_t n);
+
+static void ngx_http_gridfs_count_status(ngx_http_request_t* request, ngx_int_t rc);
+
+static void ngx_http_gridfs_observe(ngx_http_request_t* request, size_t field, uint64_t usec);
+
+static uint64_t ngx_http_gridfs_usec(void);
+
+static ngx_int_t ngx_http_gridfs_add_variables(ngx_conf_t* cf);
+
+static ngx_int_t ngx_http_gridfs_init(ngx_conf_t* cf);
+
+static ngx_int_t ngx_http_gridfs_log_handler(ngx_http_request_t* request);
+
+/* Parse config directive */
+static char* ngx_http_gridfs_slow_log(ngx_conf_t* cf, ngx_command_t* command, void* void_conf);
+
+/* Parse config directive */
+static char* ngx_http_gridfs_max_inflight(ngx_conf_t* cf, ngx_command_t* command, void* void_conf);
+
+static ngx_int_t ngx_http_gridfs_serve(ngx_http_request_t* request);
+
+static void ngx_http_gridfs_admission_handler(ngx_event_t* ev);
+static void ngx_http_gridfs_admission_read(ngx_http_request_t* request);
+
+/* Parse config directive */
+static char* ngx_http_gridfs_fair_scheduling(ngx_conf_t* cf, ngx_command_t* command, void* void_conf);
+
+static void ngx_http_gridfs_turn_handler(ngx_event_t* ev);
+
+/* Parse config directive */
+static char* ngx_http_gridfs_upload(ngx_conf_t* cf, ngx_command_t* command, void* void_conf);
+
+static ngx_int_t ngx_http_gridfs_upload_handler(ngx_http_request_t* request);
+
+/* Cache of files and small bodies */
+static char* ngx_http_gridfs_cache(ngx_conf_t* cf, ngx_command_t* command, void* void_conf);
+
+static char* ngx_http_gridfs_warmup(ngx_conf_t* cf, ngx_command_t* command, void* void_conf);
+
+static ngx_int_t ngx_http_gridfs_init_cache_zone(ngx_shm_zone_t* shm_zone, void* data);
+
+static void ngx_http_gridfs_warmup_handler(ngx_event_t* ev);
+
+static void ngx_http_gridfs_refresh_handler(ngx_event_t* ev);
+
+/* Requests in flight on a location, or on all the locations using a mongo,
+ * in one worker. Requests over the limit wait in a FIFO queue. */
+typedef struct {
+    ngx_uint_t max;
+    ngx_uint_t queue_max;
+    ngx_msec_t timeout;
+    time_t retry_after;
+    ngx_uint_t active;
+    ngx_uint_t waiting;
+    ngx_queue_t queue; /* ngx_http_gridfs_ctx_t */
+} ngx_http_gridfs_admission_t;
+
+typedef struct ngx_http_mongo_connection_s ngx_http_mongo_connection_t;
+
+#if (NGX_OPENSSL)
+/* TLS to a mongo, from the parameters of its first 'mongo' directive. */
+typedef struct {
+    ngx_ssl_t ssl;
+    ngx_flag_t verify; /* the certificate chain and the host name */
+    u_char context[16]; /* md5 of the parameters, sessions are kept by it */
+    ngx_shm_zone_t* sessions; /* ngx_http_mongo_tls_shctx_t */
+} ngx_http_mongo_tls_t;
+
+/* A session to resume with one server. Sessions live in a zone shared by
+ * the workers and kept across reloads, so that a new worker, or one
+ * reconnecting after a failover, skips the full handshake. */
+typedef struct ngx_http_mongo_tls_session_s ngx_http_mongo_tls_session_t;
+
+struct ngx_http_mongo_tls_session_s {
+    ngx_http_mongo_tls_session_t* next;
+    u_char peer[MONGO_TLS_PEER_LEN];
+    u_char context[16]; /* of the TLS parameters it was made with */
+    size_t len;
+    u_char der[MONGO_TLS_SESSION_MAX];
+};
+
+typedef struct {
+    ngx_http_mongo_tls_session_t* head;
+} ngx_http_mongo_tls_shctx_t;
+#endif
+
 typedef struct {
     ngx_str_t db;
     ngx_str_t root_collection;
     ngx_str_t field;
     ngx_uint_t type;
+    ngx_http_complex_value_t* key; /* gridfs_key, the URI past the location if NULL */
+    u_char* query; /* { field: key } up to the key, see ngx_http_gridfs_key_query */
+    size_t query_len;
     ngx_str_t user;
     ngx_str_t pass;
     ngx_str_t mongo;
+    ngx_http_mongo_connection_t* mongo_conn; /* resolved at worker start */
     ngx_array_t* mongods; /* ngx_http_mongod_server_t */
     ngx_str_t replset; /* Name of the replica set, if connecting. */
+    ngx_uint_t mongo_protocol;
+    ngx_array_t* mongo_compressors; /* ngx_uint_t, by preference */
+#if (NGX_OPENSSL)
+    ngx_http_mongo_tls_t* mongo_tls; /* NULL for plain TCP */
+#endif
+    ngx_shm_zone_t* miss_zone; /* ngx_http_gridfs_miss_cache_t */
+    ngx_msec_t miss_ttl;
+    ngx_shm_zone_t* filter_zone; /* ngx_http_gridfs_filter_t */
+    time_t filter_refresh;
+    time_t filter_max_age;
+    ngx_uint_t filter_rechecks;
+    ngx_flag_t static_variants;
+    ngx_flag_t gunzip;
+    ngx_bufs_t gunzip_bufs;
+    ngx_flag_t batch;
+    ngx_uint_t batch_max_keys;
+    size_t batch_max_size;
+    ngx_flag_t mp4;
+    size_t mp4_max_buffer_size;
+    ngx_msec_t slow_log; /* threshold, 0 if off */
+    ngx_uint_t max_inflight; /* 0 if unlimited */
+    ngx_uint_t inflight_queue;
+    ngx_msec_t inflight_timeout;
+    time_t retry_after;
+    ngx_flag_t inflight_backend; /* the limit is shared by the mongo's locations */
+    ngx_http_gridfs_admission_t* admission;
+    size_t fair_quantum; /* bytes fetched per turn, 0 if off */
+    size_t fair_small; /* responses up to this size don't take turns */
+    ngx_flag_t upload;
+    size_t upload_chunk_size;
+    ngx_uint_t upload_batch; /* chunks per insert */
+    ngx_flag_t upload_indexed; /* set by a worker once the chunks index is ensured */
+    ngx_shm_zone_t* cache_zone; /* ngx_http_gridfs_miss_cache_t */
+    ngx_msec_t cache_valid;
+    size_t cache_max_size; /* largest body cached */
+    ngx_uint_t cache_use_stale; /* GRIDFS_STALE_* */
+    ngx_flag_t buffering; /* spill to temp_path when the client is slow */
+    ngx_path_t* temp_path;
+    size_t max_temp_file_size;
+    ngx_str_t warmup_file; /* keys to warm, one per line */
+    ngx_uint_t warmup_top; /* or the first files by warmup_sort */
+    ngx_str_t warmup_sort;
+    ngx_uint_t warmup_rate; /* files per second, 0 if no warmup */
+    ngx_str_t name; /* of the location, for gridfs_status */
+    ngx_uint_t stats_index;
+    ngx_uint_t backend_index;
 } ngx_http_gridfs_loc_conf_t;
 
 typedef struct {
@@ -86,11 +336,35 @@ typedef struct {
     ngx_str_t pass;
 } ngx_http_mongo_auth_t;
 
+/* An OP_MSG reply, freed once the chunks it holds have been sent. */
 typedef struct {
+    ngx_uint_t refs;
+    uint32_t flags;
+    const char* doc; /* body section */
+    size_t len;
+    u_char data[1];
+} ngx_http_mongo_msg_t;
+
+struct ngx_http_mongo_connection_s {
     ngx_str_t name;
     mongo conn;
     ngx_array_t *auths; /* ngx_http_mongo_auth_t */
-} ngx_http_mongo_connection_t;
+    ngx_array_t *dbs; /* ngx_str_t, checked once connected */
+    ngx_http_gridfs_loc_conf_t *conf; /* first location using it, for the seeds */
+    ngx_flag_t connecting; /* set up in the background, answer 503 meanwhile */
+    ngx_uint_t compressor; /* agreed with mongod for OP_MSG, 0 if none */
+    int32_t response_to; /* requestID the next OP_MSG reply must answer */
+#if (NGX_OPENSSL)
+    ngx_ssl_conn_t* ssl_conn; /* on conn.sock, once the handshake is done */
+    u_char peer[MONGO_TLS_PEER_LEN]; /* host:port of conn.sock */
+#endif
+};
+
+/* Connect of one backend at worker start, in the thread pool if any. */
+typedef struct {
+    ngx_http_mongo_connection_t* mongo_conn;
+    ngx_int_t rc;
+} ngx_http_mongo_bootstrap_t;
 
 /* Maybe we should store a list of addresses instead. */
 typedef struct {
@@ -98,14 +372,354 @@ typedef struct {
     in_port_t port;
 } ngx_http_mongod_server_t;
 
+/* Latency histogram, in microseconds. Buckets are not cumulative. */
+typedef struct {
+    ngx_atomic_t buckets[GRIDFS_STATS_BUCKETS];
+    ngx_atomic_t sum;
+} ngx_http_gridfs_histogram_t;
+
+/* Counters of a location or a backend, shared between workers. */
+typedef struct {
+    ngx_atomic_t requests;
+    ngx_atomic_t not_found;
+    ngx_atomic_t unavailable;
+    ngx_atomic_t reconnects;
+    ngx_atomic_t reauths;
+    ngx_atomic_t chunks;
+    ngx_atomic_t bytes;
+    ngx_http_gridfs_histogram_t lookup;
+    ngx_http_gridfs_histogram_t chunk_fetch;
+} ngx_http_gridfs_stats_t;
+
+#define GRIDFS_STAT(field) offsetof(ngx_http_gridfs_stats_t, field)
+
 typedef struct {
     ngx_array_t loc_confs; /* ngx_http_gridfs_loc_conf_t */
+    ngx_flag_t status; /* gridfs_status is used */
+    ngx_array_t backends; /* ngx_str_t, one per mongo */
+    ngx_http_gridfs_stats_t* stats; /* locations, then backends */
+#if (NGX_THREADS)
+    ngx_thread_pool_t* thread_pool; /* connects backends at worker start */
+#endif
 } ngx_http_gridfs_main_conf_t;
 
+/* State of a file being written from the request body. The body is cut
+ * into chunks as it arrives and the chunks are inserted a batch at a time,
+ * so an upload holds at most one chunk and one insert in memory. */
+typedef struct {
+    ngx_http_request_t* request;
+    ngx_http_mongo_connection_t* mongo_conn;
+    char* key;
+    bson id; /* { _id: the new file's id } */
+    bson_oid_t files_id; /* of the chunks, this upload's alone */
+    char* files_ns;
+    char* chunks_ns;
+    u_char* chunk;
+    size_t chunk_size;
+    size_t chunk_len;
+    bson cmd; /* insert of the chunks batched so far */
+    ngx_uint_t batched;
+    ngx_uint_t n; /* number of the next chunk */
+    uint64_t length;
+    ngx_md5_t md5;
+    unsigned id_init:1;
+    unsigned cmd_init:1;
+    unsigned written:1; /* chunks may be in mongod */
+    unsigned done:1;
+    unsigned relink:1; /* the chunks move to the key once the file is in */
+} ngx_http_gridfs_upload_t;
+
+/* A round trip to mongod, kept for the slow log. */
+typedef struct {
+    ngx_uint_t seq; /* order it was made in */
+    const char* op;
+    const char* ns; /* NULL if none */
+    ngx_int_t n; /* chunk number, -1 if none */
+    uint64_t usec;
+    size_t reply;
+    ngx_str_t* member; /* NULL if unknown */
+} ngx_http_gridfs_op_t;
+
+/* State of a file being streamed to the client. Chunks are fetched one at a
+ * time and a chunk's cursor, which owns its data, is released as soon as
+ * everything pointing into it has been written out. */
+typedef struct {
+    gridfs gfs;
+    gridfile gfile;
+    ngx_http_mongo_connection_t* mongo_conn;
+    mongo_cursor** cursors;
+    ngx_http_mongo_msg_t** msgs; /* reply holding each chunk, op_msg */
+    const char** docs; /* chunk documents, op_msg */
+    ngx_uint_t fetched; /* chunks below this are in msgs, op_msg */
+    ngx_buf_t** bufs; /* buffer handed out for each chunk, NULL if none */
+    ngx_uint_t numchunks;
+    ngx_uint_t chunk; /* next chunk to fetch */
+    ngx_uint_t released; /* chunks below this have been freed */
+    ngx_uint_t ecounter;
+    uint64_t range_start;
+    uint64_t range_end;
+    uint64_t offset; /* file offset of the next chunk */
+    ngx_chain_t* prefix; /* sent ahead of the chunks, e.g. a cut mp4 header */
+    off_t prefix_len;
+    /* Backend accounting, for the $gridfs_* variables. Times are in usec. */
+    uint64_t start;
+    uint64_t lookup_time;
+    uint64_t first_chunk_time;
+    uint64_t backend_time;
+    uint64_t chunks_fetched;
+    uint64_t backend_bytes;
+    uint64_t retries;
+    ngx_str_t cache_status;
+    ngx_http_gridfs_op_t* ops; /* the GRIDFS_SLOW_LOG_OPS slowest, for gridfs_slow_log */
+    ngx_uint_t nops; /* operations made */
+    ngx_str_t* member; /* last member an operation went to */
+    ngx_http_gridfs_admission_t* admission;
+    ngx_queue_t queue; /* in admission->queue while waiting */
+    ngx_event_t wait; /* queue timeout, posted once admitted */
+    size_t quantum; /* fair scheduling, 0 if not taking turns */
+    size_t deficit; /* bytes left to fetch in this turn */
+    size_t chunk_size;
+    ngx_event_t turn; /* posted when the request gave up its turn */
+    ngx_http_gridfs_upload_t* upload;
+    bson* body; /* every chunk, { "0": data, ... }, from gridfs_cache */
+    ngx_temp_file_t* temp_file; /* chunks are spilled to it, gridfs_buffering */
+#if (NGX_ZLIB)
+    z_stream zstream;
+    ngx_chain_t* free;
+    ngx_chain_t* busy;
+    ngx_int_t nbufs;
+#endif
+    unsigned gfs_init:1;
+    unsigned gfile_init:1;
+    unsigned ranged:1;
+    unsigned blocked:1; /* waiting for the client to drain the output */
+    unsigned done:1;
+    unsigned gunzip:1;
+    unsigned zstream_init:1;
+    unsigned zpending:1; /* input left in the current chunk */
+    unsigned zlast:1; /* the current chunk is the last one */
+    unsigned admitted:1;
+    unsigned queued:1;
+    unsigned yielded:1; /* waiting for its next turn */
+    unsigned body_owned:1; /* body was fetched, not copied from the cache */
+} ngx_http_gridfs_ctx_t;
+
+static ngx_int_t ngx_http_gridfs_send_chunks(ngx_http_request_t* request, ngx_http_gridfs_ctx_t* ctx);
+
+static ngx_int_t ngx_http_gridfs_stream_chunk(ngx_http_request_t* request, ngx_http_gridfs_ctx_t* ctx, bson_iterator* it);
+
+static void ngx_http_mongo_msg_release(ngx_http_mongo_msg_t* msg);
+
+static void ngx_http_mongo_put32(u_char* p, uint32_t v);
+
+static ngx_int_t ngx_http_mongo_negotiate(ngx_log_t* log, ngx_http_mongo_connection_t* mongo_conn);
+
+static ngx_int_t ngx_http_mongo_check_connection(ngx_conf_t* cf, ngx_http_gridfs_loc_conf_t* a, ngx_http_gridfs_loc_conf_t* b);
+
+#if (NGX_OPENSSL)
+static ngx_int_t ngx_http_mongo_tls(ngx_conf_t* cf, ngx_http_gridfs_loc_conf_t* gridfs_loc_conf, ngx_str_t* ca, ngx_str_t* cert, ngx_str_t* key, ngx_flag_t insecure);
+
+static ngx_int_t ngx_http_mongo_init_tls_zone(ngx_shm_zone_t* shm_zone, void* data);
+
+static int ngx_http_mongo_tls_new_session(ngx_ssl_conn_t* ssl_conn, ngx_ssl_session_t* ssl_session);
+#endif
+
+static ngx_int_t ngx_http_mongo_msg_send(ngx_log_t* log, ngx_http_mongo_connection_t* mongo_conn, bson* cmd, uint32_t flags);
+
+static ngx_int_t ngx_http_mongo_msg_recv(ngx_log_t* log, ngx_http_mongo_connection_t* mongo_conn, ngx_http_mongo_msg_t** out);
+
+static void ngx_http_gridfs_upload_cleanup(ngx_http_gridfs_upload_t* up);
+
+static void ngx_http_gridfs_trace(ngx_http_request_t* request, ngx_http_mongo_connection_t* mongo_conn, const char* op, const char* ns, ngx_int_t n, uint64_t usec, size_t reply);
+
+static ngx_int_t ngx_http_gridfs_admit(ngx_http_request_t* request, ngx_http_gridfs_ctx_t* ctx, ngx_http_gridfs_admission_t* admission);
+
+static void ngx_http_gridfs_release(ngx_http_gridfs_ctx_t* ctx);
+
+/* One key of a batch request and the file it resolved to. */
 typedef struct {
-    mongo_cursor ** cursors;
+    char* key;
+    ngx_uint_t status; /* 0 while unresolved */
+    ngx_uint_t found;
+    bson doc;
+    bson_iterator id;
+    u_char* data;
+    gridfs_offset length;
+    gridfs_offset chunk_size;
     ngx_uint_t numchunks;
-} ngx_http_gridfs_cleanup_t;
+    ngx_uint_t received; /* distinct chunks */
+    u_char* seen; /* a bit per chunk */
+} ngx_http_gridfs_batch_file_t;
+
+/* A track of an mp4 being cut, pointing into the buffered moov. */
+typedef struct {
+    u_char* trak;
+    u_char* tkhd;
+    u_char* mdhd;
+    u_char* stts;
+    u_char* ctts;
+    u_char* stss;
+    u_char* stsc;
+    u_char* stsz;
+    u_char* stco; /* stco or co64 */
+    ngx_uint_t co64;
+    uint32_t timescale;
+    ngx_uint_t nsamples;
+    ngx_uint_t nchunks;
+    ngx_uint_t* chunk_samples; /* stsc expanded to one entry per chunk */
+    uint32_t* chunk_desc;
+    /* Where the cut track starts */
+    ngx_uint_t start_sample;
+    ngx_uint_t start_chunk;
+    ngx_uint_t chunk_skip; /* samples of start_chunk before start_sample */
+    uint64_t start_offset;
+    uint64_t max_offset;
+    uint64_t duration; /* what is left of it, in the media timescale */
+    ngx_uint_t out_co64;
+    u_char* out_offsets;
+} ngx_http_gridfs_mp4_trak_t;
+
+typedef struct {
+    ngx_http_request_t* request;
+    ngx_http_gridfs_ctx_t* ctx;
+    gridfs_offset chunk_size;
+    ngx_int_t cached; /* index of the chunk in cache, -1 if none */
+    u_char* cache;
+    size_t cache_len;
+    u_char* ftyp;
+    u_char* moov; /* the rewritten moov */
+    size_t moov_len;
+    u_char* mvhd;
+    uint32_t timescale;
+    uint64_t duration;
+    ngx_array_t traks; /* ngx_http_gridfs_mp4_trak_t */
+    uint64_t mdat_start;
+    uint64_t mdat_end;
+    uint64_t data_start; /* first byte of mdat we keep */
+    int64_t shift;
+} ngx_http_gridfs_mp4_t;
+
+static ngx_int_t ngx_http_gridfs_mp4(ngx_http_request_t* request, ngx_http_gridfs_ctx_t* ctx, ngx_str_t* arg, gridfs_offset length);
+
+/* Negative lookup cache, shared between workers. Nodes are keyed by the
+ * namespace, query field and key of the lookup that came back empty.
+ * gridfs_cache zones hold the same nodes with the files document, and the
+ * body if it is small, after the key. */
+typedef struct {
+    u_char color;
+    u_char body; /* a body follows the files document, gridfs_cache */
+    u_short len;
+    ngx_queue_t queue;
+    ngx_msec_t expire;
+    ngx_msec_t updating; /* when a refresh was claimed, gridfs_cache */
+    u_char data[1];
+} ngx_http_gridfs_miss_node_t;
+
+typedef struct {
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+    ngx_queue_t queue;
+} ngx_http_gridfs_miss_shctx_t;
+
+typedef struct {
+    ngx_http_gridfs_miss_shctx_t* sh;
+    ngx_slab_pool_t* shpool;
+} ngx_http_gridfs_miss_cache_t;
+
+/* Bloom filter of the keys present in a GridFS collection. Two bitsets are
+ * kept so that one worker can rebuild the inactive one from fs.files while
+ * the others keep answering from the active one. */
+typedef struct {
+    ngx_atomic_t builder; /* pid of the worker rebuilding, 0 if none */
+    ngx_atomic_t heartbeat; /* last time the builder made progress */
+    ngx_atomic_t next_refresh;
+    ngx_atomic_t active; /* index of the bitset in use */
+    ngx_atomic_t ready;
+    ngx_atomic_t recheck_time; /* second the rechecks are counted for */
+    ngx_atomic_t rechecks;
+    ngx_atomic_t synced; /* when the active bitset last caught up with fs.files */
+    ngx_atomic_t syncer; /* pid of the worker catching up, 0 if none */
+    ngx_uint_t nbits;
+    ngx_atomic_uint_t* bits[2];
+} ngx_http_gridfs_filter_shctx_t;
+
+typedef struct {
+    ngx_http_gridfs_filter_shctx_t* sh;
+    ngx_slab_pool_t* shpool;
+    ngx_http_gridfs_loc_conf_t* gridfs_loc_conf;
+    /* Worker-local build state */
+    ngx_event_t event;
+    ngx_uint_t building;
+    bson last; /* { _id: of the last document read }, kept for catching up */
+    ngx_uint_t last_init;
+    bson fields;
+    char* ns;
+} ngx_http_gridfs_filter_t;
+
+/* State of a location's gridfs_warmup, in the one worker running it. */
+typedef struct {
+    ngx_http_gridfs_loc_conf_t* gridfs_loc_conf;
+    ngx_event_t event;
+    char* files_ns;
+    char* chunks_ns;
+    u_char* keys; /* contents of the key file */
+    u_char* pos;
+    u_char* last;
+    mongo_cursor* cursor; /* or the top files */
+    ngx_uint_t warmed;
+    ngx_uint_t started;
+} ngx_http_gridfs_warmup_t;
+
+/* Background revalidation of a stale gridfs_cache entry. */
+typedef struct {
+    ngx_http_gridfs_loc_conf_t* gridfs_loc_conf;
+    ngx_event_t event;
+    ngx_str_t key; /* of the cache entry */
+    char* value; /* the file's key */
+} ngx_http_gridfs_refresh_t;
+
+static ngx_conf_bitmask_t ngx_http_gridfs_use_stale_masks[] = {
+    { ngx_string("off"), GRIDFS_STALE_OFF },
+    { ngx_string("error"), GRIDFS_STALE_ERROR },
+    { ngx_string("connecting"), GRIDFS_STALE_CONNECTING },
+    { ngx_string("updating"), GRIDFS_STALE_UPDATING },
+    { ngx_null_string, 0 }
+};
+
+static ngx_path_init_t ngx_http_gridfs_temp_path = {
+    ngx_string("gridfs_temp"), { 1, 2, 0 }
+};
+
+/* A stored representation of the requested file. */
+typedef struct {
+    ngx_str_t* encoding; /* NULL for the identity */
+    char* key;
+    bson doc;
+    ngx_uint_t found;
+    ngx_uint_t absent; /* per gridfs_miss_cache or gridfs_key_filter */
+    ngx_str_t miss_key;
+} ngx_http_gridfs_variant_t;
+
+/* Content codings we look for, smallest first when sizes are equal. */
+static ngx_str_t ngx_http_gridfs_encodings[] = {
+    ngx_string("br"),
+    ngx_string("zstd"),
+    ngx_string("gzip"),
+    ngx_null_string
+};
+
+#if (NGX_ZLIB)
+/* The coding gridfs_gunzip checks the client for. */
+static ngx_str_t ngx_http_gridfs_gzip = ngx_string("gzip");
+#endif
+
+/* Suffixes of sibling files holding each coding, in the same order. */
+static ngx_str_t ngx_http_gridfs_encoding_exts[] = {
+    ngx_string(".br"),
+    ngx_string(".zst"),
+    ngx_string(".gz"),
+    ngx_null_string
+};
 
 /* Array specifying how to handle configuration directives. */
 static ngx_command_t ngx_http_gridfs_commands[] = {
@@ -128,13 +742,211 @@ static ngx_command_t ngx_http_gridfs_commands[] = {
         NULL
     },
 
+    {
+        ngx_string("gridfs_key"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_http_set_complex_value_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_gridfs_loc_conf_t, key),
+        NULL
+    },
+
+    {
+        ngx_string("gridfs_static_variants"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_gridfs_loc_conf_t, static_variants),
+        NULL
+    },
+
+    {
+        ngx_string("gridfs_gunzip"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_gridfs_loc_conf_t, gunzip),
+        NULL
+    },
+
+    {
+        ngx_string("gridfs_gunzip_buffers"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE2,
+        ngx_conf_set_bufs_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_gridfs_loc_conf_t, gunzip_bufs),
+        NULL
+    },
+
+    {
+        ngx_string("gridfs_batch"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_gridfs_loc_conf_t, batch),
+        NULL
+    },
+
+    {
+        ngx_string("gridfs_batch_max_keys"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_gridfs_loc_conf_t, batch_max_keys),
+        NULL
+    },
+
+    {
+        ngx_string("gridfs_batch_max_size"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_size_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_gridfs_loc_conf_t, batch_max_size),
+        NULL
+    },
+
+    {
+        ngx_string("gridfs_mp4"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_gridfs_loc_conf_t, mp4),
+        NULL
+    },
+
+    {
+        ngx_string("gridfs_mp4_max_buffer_size"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_size_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_gridfs_loc_conf_t, mp4_max_buffer_size),
+        NULL
+    },
+
+    {
+        ngx_string("gridfs_status"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+        ngx_http_gridfs_status,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+
+    {
+        ngx_string("gridfs_slow_log"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_http_gridfs_slow_log,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+
+    {
+        ngx_string("gridfs_max_inflight"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+        ngx_http_gridfs_max_inflight,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+
+    {
+        ngx_string("gridfs_fair_scheduling"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+        ngx_http_gridfs_fair_scheduling,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+
+    {
+        ngx_string("gridfs_upload"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+        ngx_http_gridfs_upload,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+
+    {
+        ngx_string("gridfs_buffering"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_gridfs_loc_conf_t, buffering),
+        NULL
+    },
+
+    {
+        ngx_string("gridfs_temp_path"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1234,
+        ngx_conf_set_path_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_gridfs_loc_conf_t, temp_path),
+        NULL
+    },
+
+    {
+        ngx_string("gridfs_max_temp_file_size"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_size_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_gridfs_loc_conf_t, max_temp_file_size),
+        NULL
+    },
+
+    {
+        ngx_string("gridfs_miss_cache"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+        ngx_http_gridfs_miss_cache,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+
+    {
+        ngx_string("gridfs_key_filter"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+        ngx_http_gridfs_key_filter,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+
+    {
+        ngx_string("gridfs_cache"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+        ngx_http_gridfs_cache,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+
+    {
+        ngx_string("gridfs_cache_use_stale"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+        ngx_conf_set_bitmask_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_gridfs_loc_conf_t, cache_use_stale),
+        &ngx_http_gridfs_use_stale_masks
+    },
+
+    {
+        ngx_string("gridfs_warmup"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+        ngx_http_gridfs_warmup,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+
     ngx_null_command
 };
 
 /* Module context. */
 static ngx_http_module_t ngx_http_gridfs_module_ctx = {
-    NULL, /* preconfiguration */
-    NULL, /* postconfiguration */
+    ngx_http_gridfs_add_variables, /* preconfiguration */
+    ngx_http_gridfs_init, /* postconfiguration */
     ngx_http_gridfs_create_main_conf,
     NULL, /* init main configuration */
     NULL, /* create server configuration */
@@ -161,56 +973,329 @@ ngx_module_t ngx_http_gridfs_module = {
 
 ngx_array_t ngx_http_mongo_connections;
 
-/* Parse the 'mongo' directive. */
-static char * ngx_http_mongo(ngx_conf_t *cf, ngx_command_t *cmd, void *void_conf) {
-    ngx_str_t *value;
-    ngx_url_t u;
-    ngx_uint_t i;
-    ngx_uint_t start;
-    ngx_http_mongod_server_t *mongod_server;
-    ngx_http_gridfs_loc_conf_t *gridfs_loc_conf;
-
-    gridfs_loc_conf = void_conf;
+#if (NGX_OPENSSL)
+/* Index of the backend in the ex_data of its TLS connection. */
+static int ngx_http_mongo_tls_index = -1;
+#endif
 
-    value = cf->args->elts;
-    gridfs_loc_conf->mongo = value[1];
-    gridfs_loc_conf->mongods = ngx_array_create(cf->pool, 7,
-                                                sizeof(ngx_http_mongod_server_t));
-    if (gridfs_loc_conf->mongods == NULL) {
-        return NULL;
-    }
+static ngx_str_t ngx_http_mongo_compressor_names[] = {
+    ngx_string("noop"),
+    ngx_string("snappy"),
+    ngx_string("zlib"),
+    ngx_string("zstd")
+};
 
-    /* If nelts is greater than 3, then the user has specified more than one
-     * setting in the 'mongo' directive. So we assume that we're connecting
-     * to a replica set and that the first string of the directive is the replica
-     * set name. We also start looking for host-port pairs at position 2; otherwise,
-     * we start at position 1.
-     */
-    if( cf->args->nelts >= 3 ) {
-        gridfs_loc_conf->replset.len = strlen( (char *)(value + 1)->data );
-        gridfs_loc_conf->replset.data = ngx_pstrdup( cf->pool, value + 1 );
-        start = 2;
-    } else
-        start = 1;
+/* Parse the compressors= parameter of the 'mongo' directive. */
+static ngx_int_t ngx_http_mongo_compressors(ngx_conf_t* cf, ngx_http_gridfs_loc_conf_t* gridfs_loc_conf, ngx_str_t* param) {
+    u_char *p, *last, *comma;
+    ngx_uint_t *compressor, id;
+    ngx_str_t name;
 
-    for (i = start; i < cf->args->nelts; i++) {
+    gridfs_loc_conf->mongo_compressors = ngx_array_create(cf->pool, 3, sizeof(ngx_uint_t));
+    if (gridfs_loc_conf->mongo_compressors == NULL) {
+        return NGX_ERROR;
+    }
 
-        ngx_memzero(&u, sizeof(ngx_url_t));
+    p = param->data + 12;
+    last = param->data + param->len;
 
-        u.url = value[i];
-        u.default_port = 27017;
+    while (p < last) {
+        comma = ngx_strlchr(p, last, ',');
+        if (comma == NULL) {
+            comma = last;
+        }
+        name.data = p;
+        name.len = comma - p;
+        p = comma + 1;
 
-        if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
-            if (u.err) {
-                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                                   "%s in mongo \"%V\"", u.err, &u.url);
+        for (id = MONGO_COMPRESSOR_SNAPPY; id <= MONGO_COMPRESSOR_ZSTD; id++) {
+            if (name.len == ngx_http_mongo_compressor_names[id].len
+                && ngx_strncmp(name.data, ngx_http_mongo_compressor_names[id].data, name.len) == 0) {
+                break;
             }
-            return NGX_CONF_ERROR;
         }
 
-        mongod_server = ngx_array_push(gridfs_loc_conf->mongods);
-        mongod_server->host = u.host;
-        mongod_server->port = u.port;
+        if (id > MONGO_COMPRESSOR_ZSTD) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "unknown compressor \"%V\"", &name);
+            return NGX_ERROR;
+        }
+
+#if !(NGX_HTTP_GRIDFS_SNAPPY)
+        if (id == MONGO_COMPRESSOR_SNAPPY) {
+            goto not_built;
+        }
+#endif
+#if !(NGX_ZLIB)
+        if (id == MONGO_COMPRESSOR_ZLIB) {
+            goto not_built;
+        }
+#endif
+#if !(NGX_HTTP_GRIDFS_ZSTD)
+        if (id == MONGO_COMPRESSOR_ZSTD) {
+            goto not_built;
+        }
+#endif
+
+        compressor = ngx_array_push(gridfs_loc_conf->mongo_compressors);
+        if (compressor == NULL) {
+            return NGX_ERROR;
+        }
+        *compressor = id;
+    }
+
+    if (gridfs_loc_conf->mongo_compressors->nelts == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no compressor in \"%V\"", param);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+
+#if !(NGX_HTTP_GRIDFS_SNAPPY && NGX_ZLIB && NGX_HTTP_GRIDFS_ZSTD)
+not_built:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "the module was built without %V", &name);
+    return NGX_ERROR;
+#endif
+}
+
+#if (NGX_OPENSSL)
+/* Set up the TLS context for the tls parameters of the 'mongo' directive.
+ * The server's certificate is checked against tls_ca, or else the system's
+ * CAs, unless tls_insecure. */
+static ngx_int_t ngx_http_mongo_tls(ngx_conf_t* cf, ngx_http_gridfs_loc_conf_t* gridfs_loc_conf, ngx_str_t* ca, ngx_str_t* cert, ngx_str_t* key, ngx_flag_t insecure) {
+    ngx_http_mongo_tls_t* tls;
+    ngx_pool_cleanup_t* cln;
+    ngx_md5_t md5;
+    ngx_str_t name = ngx_string("gridfs_mongo_tls");
+
+    if (ngx_http_mongo_tls_index == -1) {
+        ngx_http_mongo_tls_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+        if (ngx_http_mongo_tls_index == -1) {
+            ngx_ssl_error(NGX_LOG_EMERG, cf->log, 0, "SSL_get_ex_new_index() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    tls = ngx_pcalloc(cf->pool, sizeof(ngx_http_mongo_tls_t));
+    if (tls == NULL) {
+        return NGX_ERROR;
+    }
+    tls->ssl.log = cf->log;
+
+    if (ngx_ssl_create(&tls->ssl, NGX_SSL_TLSv1_2 | NGX_SSL_TLSv1_3, NULL) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        ngx_ssl_cleanup_ctx(&tls->ssl);
+        return NGX_ERROR;
+    }
+    cln->handler = ngx_ssl_cleanup_ctx;
+    cln->data = &tls->ssl;
+
+    if (cert->len) {
+        if (ngx_ssl_certificate(cf, &tls->ssl, cert, key->len ? key : cert, NULL)
+            != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (ca->len) {
+        if (ngx_ssl_trusted_certificate(cf, &tls->ssl, ca, 9) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    } else if (!insecure && SSL_CTX_set_default_verify_paths(tls->ssl.ctx) == 0) {
+        ngx_ssl_error(NGX_LOG_EMERG, cf->log, 0, "SSL_CTX_set_default_verify_paths() failed");
+        return NGX_ERROR;
+    }
+    tls->verify = !insecure;
+
+    /* A session is only resumed by the context it was made with: one
+     * made without verification mustn't skip it for another location */
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, ca->data, ca->len);
+    ngx_md5_update(&md5, "", 1);
+    ngx_md5_update(&md5, cert->data, cert->len);
+    ngx_md5_update(&md5, "", 1);
+    ngx_md5_update(&md5, key->data, key->len);
+    ngx_md5_update(&md5, &tls->verify, sizeof(ngx_flag_t));
+    ngx_md5_final(tls->context, &md5);
+
+    /* OpenSSL hands each new session over, sessions are kept in the zone
+     * rather than in the context so that every worker can resume them. */
+    SSL_CTX_set_session_cache_mode(tls->ssl.ctx,
+                                   SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_sess_set_new_cb(tls->ssl.ctx, ngx_http_mongo_tls_new_session);
+
+    tls->sessions = ngx_shared_memory_add(cf, &name, MONGO_TLS_ZONE_PAGES * ngx_pagesize,
+                                          &ngx_http_gridfs_module);
+    if (tls->sessions == NULL) {
+        return NGX_ERROR;
+    }
+    tls->sessions->init = ngx_http_mongo_init_tls_zone;
+
+    gridfs_loc_conf->mongo_tls = tls;
+
+    return NGX_OK;
+}
+#endif
+
+/* Parse the 'mongo' directive. */
+static char * ngx_http_mongo(ngx_conf_t *cf, ngx_command_t *cmd, void *void_conf) {
+    ngx_str_t *value;
+    ngx_url_t u;
+    ngx_uint_t i;
+    ngx_uint_t start;
+    ngx_http_mongod_server_t *mongod_server;
+    ngx_http_gridfs_loc_conf_t *gridfs_loc_conf;
+    ngx_str_t tls_ca, tls_cert, tls_key;
+    ngx_flag_t tls, tls_insecure;
+
+    ngx_uint_t nelts;
+
+    gridfs_loc_conf = void_conf;
+
+    tls = 0;
+    tls_insecure = 0;
+    ngx_str_null(&tls_ca);
+    ngx_str_null(&tls_cert);
+    ngx_str_null(&tls_key);
+
+    value = cf->args->elts;
+    gridfs_loc_conf->mongo = value[1];
+
+    /* Parameters come after the hosts */
+    for (nelts = cf->args->nelts; nelts > 2; nelts--) {
+        if (ngx_strncmp(value[nelts - 1].data, "compressors=", 12) == 0) {
+            if (ngx_http_mongo_compressors(cf, gridfs_loc_conf, &value[nelts - 1]) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[nelts - 1].data, "protocol=", 9) == 0) {
+            if (ngx_strcmp(value[nelts - 1].data + 9, "op_msg") == 0) {
+                gridfs_loc_conf->mongo_protocol = MONGO_PROTOCOL_OP_MSG;
+            } else if (ngx_strcmp(value[nelts - 1].data + 9, "op_query") == 0) {
+                gridfs_loc_conf->mongo_protocol = MONGO_PROTOCOL_OP_QUERY;
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid protocol \"%V\"", &value[nelts - 1]);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        if (ngx_strcmp(value[nelts - 1].data, "tls") == 0) {
+            tls = 1;
+            continue;
+        }
+
+        if (ngx_strcmp(value[nelts - 1].data, "tls_insecure") == 0) {
+            tls_insecure = 1;
+            tls = 1;
+            continue;
+        }
+
+        if (ngx_strncmp(value[nelts - 1].data, "tls_ca=", 7) == 0) {
+            tls_ca.data = value[nelts - 1].data + 7;
+            tls_ca.len = value[nelts - 1].len - 7;
+            tls = 1;
+            continue;
+        }
+
+        if (ngx_strncmp(value[nelts - 1].data, "tls_cert=", 9) == 0) {
+            tls_cert.data = value[nelts - 1].data + 9;
+            tls_cert.len = value[nelts - 1].len - 9;
+            tls = 1;
+            continue;
+        }
+
+        if (ngx_strncmp(value[nelts - 1].data, "tls_key=", 8) == 0) {
+            tls_key.data = value[nelts - 1].data + 8;
+            tls_key.len = value[nelts - 1].len - 8;
+            tls = 1;
+            continue;
+        }
+        break;
+    }
+
+    if (tls_key.len && tls_cert.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"tls_key\" requires \"tls_cert\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if (tls_insecure && tls_ca.len) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"tls_insecure\" and \"tls_ca\" are exclusive");
+        return NGX_CONF_ERROR;
+    }
+
+#if (NGX_OPENSSL)
+    gridfs_loc_conf->mongo_tls = NULL;
+    if (tls && ngx_http_mongo_tls(cf, gridfs_loc_conf, &tls_ca, &tls_cert, &tls_key,
+                                  tls_insecure) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+#else
+    if (tls) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"tls\" requires nginx built with OpenSSL, "
+                           "e.g. --with-http_ssl_module");
+        return NGX_CONF_ERROR;
+    }
+#endif
+
+    gridfs_loc_conf->mongods = ngx_array_create(cf->pool, 7,
+                                                sizeof(ngx_http_mongod_server_t));
+    if (gridfs_loc_conf->mongods == NULL) {
+        return NULL;
+    }
+
+    if (gridfs_loc_conf->mongo_compressors != NGX_CONF_UNSET_PTR
+        && gridfs_loc_conf->mongo_protocol != MONGO_PROTOCOL_OP_MSG)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"compressors\" requires \"protocol=op_msg\"");
+        return NGX_CONF_ERROR;
+    }
+
+    /* If nelts is greater than 3, then the user has specified more than one
+     * setting in the 'mongo' directive. So we assume that we're connecting
+     * to a replica set and that the first string of the directive is the replica
+     * set name. We also start looking for host-port pairs at position 2; otherwise,
+     * we start at position 1.
+     */
+    if( nelts >= 3 ) {
+        gridfs_loc_conf->replset.len = strlen( (char *)(value + 1)->data );
+        gridfs_loc_conf->replset.data = ngx_pstrdup( cf->pool, value + 1 );
+        start = 2;
+    } else
+        start = 1;
+
+    for (i = start; i < nelts; i++) {
+
+        ngx_memzero(&u, sizeof(ngx_url_t));
+
+        u.url = value[i];
+        u.default_port = 27017;
+
+        if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+            if (u.err) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "%s in mongo \"%V\"", u.err, &u.url);
+            }
+            return NGX_CONF_ERROR;
+        }
+
+        mongod_server = ngx_array_push(gridfs_loc_conf->mongods);
+        mongod_server->host = u.host;
+        mongod_server->port = u.port;
 
     }
 
@@ -317,883 +1402,8711 @@ static char* ngx_http_gridfs(ngx_conf_t* cf, ngx_command_t* command, void* void_
     return NGX_CONF_OK;
 }
 
-static void *ngx_http_gridfs_create_main_conf(ngx_conf_t *cf) {
-    ngx_http_gridfs_main_conf_t  *gridfs_main_conf;
+/* Parse the zone=NAME:SIZE parameter shared by the cache directives. */
+static ngx_shm_zone_t* ngx_http_gridfs_parse_zone(ngx_conf_t* cf, ngx_str_t* param, ngx_shm_zone_init_pt init) {
+    ngx_str_t name, s;
+    ssize_t size;
+    u_char *p;
+    ngx_shm_zone_t *shm_zone;
 
-    gridfs_main_conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_gridfs_main_conf_t));
-    if (gridfs_main_conf == NULL) {
+    name.data = param->data + 5;
+    p = (u_char *) ngx_strchr(name.data, ':');
+    if (p == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", param);
         return NULL;
     }
+    name.len = p - name.data;
 
-    if (ngx_array_init(&gridfs_main_conf->loc_confs, cf->pool, 4,
-                       sizeof(ngx_http_gridfs_loc_conf_t *))
-        != NGX_OK) {
+    s.data = p + 1;
+    s.len = param->data + param->len - s.data;
+
+    size = ngx_parse_size(&s);
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", param);
         return NULL;
     }
 
-    return gridfs_main_conf;
-}
-
-static void* ngx_http_gridfs_create_loc_conf(ngx_conf_t* directive) {
-    ngx_http_gridfs_loc_conf_t* gridfs_conf;
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small", param);
+        return NULL;
+    }
 
-    gridfs_conf = ngx_pcalloc(directive->pool, sizeof(ngx_http_gridfs_loc_conf_t));
-    if (gridfs_conf == NULL) {
-        ngx_conf_log_error(NGX_LOG_EMERG, directive, 0,
-                           "Failed to allocate memory for GridFS Location Config.");
-        return NGX_CONF_ERROR;
+    shm_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_gridfs_module);
+    if (shm_zone == NULL) {
+        return NULL;
     }
 
-    gridfs_conf->db.data = NULL;
-    gridfs_conf->db.len = 0;
-    gridfs_conf->root_collection.data = NULL;
-    gridfs_conf->root_collection.len = 0;
-    gridfs_conf->field.data = NULL;
-    gridfs_conf->field.len = 0;
-    gridfs_conf->type = NGX_CONF_UNSET_UINT;
-    gridfs_conf->user.data = NULL;
-    gridfs_conf->user.len = 0;
-    gridfs_conf->pass.data = NULL;
-    gridfs_conf->pass.len = 0;
-    gridfs_conf->mongo.data = NULL;
-    gridfs_conf->mongo.len = 0;
-    gridfs_conf->mongods = NGX_CONF_UNSET_PTR;
+    if (shm_zone->init != NULL && shm_zone->init != init) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is already used by another directive", &name);
+        return NULL;
+    }
 
-    return gridfs_conf;
+    return shm_zone;
 }
 
-static char* ngx_http_gridfs_merge_loc_conf(ngx_conf_t* cf, void* void_parent, void* void_child) {
-    ngx_http_gridfs_loc_conf_t *parent = void_parent;
-    ngx_http_gridfs_loc_conf_t *child = void_child;
-    ngx_http_gridfs_main_conf_t *gridfs_main_conf = ngx_http_conf_get_module_main_conf(cf, ngx_http_gridfs_module);
-    ngx_http_gridfs_loc_conf_t **gridfs_loc_conf;
-    ngx_http_mongod_server_t *mongod_server;
+/* Parse the 'gridfs_miss_cache' directive. */
+static char* ngx_http_gridfs_miss_cache(ngx_conf_t* cf, ngx_command_t* command, void* void_conf) {
+    ngx_http_gridfs_loc_conf_t *gridfs_loc_conf = void_conf;
+    ngx_http_gridfs_miss_cache_t *cache;
+    ngx_str_t *value, s;
+    ngx_shm_zone_t *shm_zone = NULL;
+    ngx_int_t ttl = 5000;
+    ngx_uint_t i;
 
-    ngx_conf_merge_str_value(child->db, parent->db, NULL);
-    ngx_conf_merge_str_value(child->root_collection, parent->root_collection, "fs");
-    ngx_conf_merge_str_value(child->field, parent->field, "_id");
-    ngx_conf_merge_uint_value(child->type, parent->type, BSON_OID);
-    ngx_conf_merge_str_value(child->user, parent->user, NULL);
-    ngx_conf_merge_str_value(child->pass, parent->pass, NULL);
-    ngx_conf_merge_str_value(child->mongo, parent->mongo, "127.0.0.1:27017");
+    if (gridfs_loc_conf->miss_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
 
-    if (child->mongods == NGX_CONF_UNSET_PTR) {
-        if (parent->mongods != NGX_CONF_UNSET_PTR) {
-            child->mongods = parent->mongods;
-        } else {
-            child->mongods = ngx_array_create(cf->pool, 4,
-                                              sizeof(ngx_http_mongod_server_t));
-            mongod_server = ngx_array_push(child->mongods);
-            mongod_server->host.data = (u_char *)"127.0.0.1";
-            mongod_server->host.len = sizeof("127.0.0.1") - 1;
-            mongod_server->port = 27017;
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+            shm_zone = ngx_http_gridfs_parse_zone(cf, &value[i],
+                                                  ngx_http_gridfs_init_miss_zone);
+            if (shm_zone == NULL) {
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ttl=", 4) == 0) {
+            s.data = value[i].data + 4;
+            s.len = value[i].len - 4;
+            ttl = ngx_parse_time(&s, 0);
+            if (ttl == NGX_ERROR || ttl == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid ttl \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            continue;
         }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
     }
 
-    // Add the local gridfs conf to the main gridfs conf
-    if (child->db.data) {
-        gridfs_loc_conf = ngx_array_push(&gridfs_main_conf->loc_confs);
-        *gridfs_loc_conf = child;
+    if (shm_zone == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter", &command->name);
+        return NGX_CONF_ERROR;
+    }
+
+    /* The zone may be shared by several locations: the node key carries the
+     * namespace and field, so lookups from different collections never mix. */
+    if (shm_zone->data == NULL) {
+        cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_gridfs_miss_cache_t));
+        if (cache == NULL) {
+            return NGX_CONF_ERROR;
+        }
+        shm_zone->init = ngx_http_gridfs_init_miss_zone;
+        shm_zone->data = cache;
     }
 
+    gridfs_loc_conf->miss_zone = shm_zone;
+    gridfs_loc_conf->miss_ttl = (ngx_msec_t) ttl;
+
     return NGX_CONF_OK;
 }
 
-ngx_http_mongo_connection_t* ngx_http_get_mongo_connection( ngx_str_t name ) {
-    ngx_http_mongo_connection_t *mongo_conns;
+/* Parse the 'gridfs_key_filter' directive. */
+static char* ngx_http_gridfs_key_filter(ngx_conf_t* cf, ngx_command_t* command, void* void_conf) {
+    ngx_http_gridfs_loc_conf_t *gridfs_loc_conf = void_conf;
+    ngx_http_gridfs_filter_t *filter;
+    ngx_str_t *value, s;
+    ngx_shm_zone_t *shm_zone = NULL;
+    ngx_int_t refresh = 600;
+    ngx_int_t max_age = 10;
+    ngx_int_t rechecks = 100;
     ngx_uint_t i;
 
-    mongo_conns = ngx_http_mongo_connections.elts;
-
-    for ( i = 0; i < ngx_http_mongo_connections.nelts; i++ ) {
-        if ( name.len == mongo_conns[i].name.len
-             && ngx_strncmp(name.data, mongo_conns[i].name.data, name.len) == 0 ) {
-            return &mongo_conns[i];
-        }
+    if (gridfs_loc_conf->filter_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
     }
 
-    return NULL;
-}
+    value = cf->args->elts;
 
-static ngx_int_t ngx_http_mongo_authenticate(ngx_log_t *log, ngx_http_gridfs_loc_conf_t *gridfs_loc_conf) {
-    ngx_http_mongo_connection_t* mongo_conn;
-    ngx_http_mongo_auth_t *mongo_auth;
-    mongo_cursor *cursor = NULL;
-    bson empty;
-    char *test;
-    int error;
+    for (i = 1; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+            shm_zone = ngx_http_gridfs_parse_zone(cf, &value[i],
+                                                  ngx_http_gridfs_init_filter_zone);
+            if (shm_zone == NULL) {
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
 
-    mongo_conn = ngx_http_get_mongo_connection( gridfs_loc_conf->mongo );
-    if (mongo_conn == NULL) {
-        ngx_log_error(NGX_LOG_ERR, log, 0,
-                  "Mongo Connection not found: \"%V\"", &gridfs_loc_conf->mongo);
-    }
+        if (ngx_strncmp(value[i].data, "refresh=", 8) == 0) {
+            s.data = value[i].data + 8;
+            s.len = value[i].len - 8;
+            refresh = ngx_parse_time(&s, 1);
+            if (refresh == NGX_ERROR || refresh == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid refresh \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
 
-    // Authenticate
-    if (gridfs_loc_conf->user.data != NULL && gridfs_loc_conf->pass.data != NULL) {
-        if (mongo_cmd_authenticate( &mongo_conn->conn,
-				    (const char*)gridfs_loc_conf->db.data,
-				    (const char*)gridfs_loc_conf->user.data,
-				    (const char*)gridfs_loc_conf->pass.data )
-	    != MONGO_OK) {
-            ngx_log_error(NGX_LOG_ERR, log, 0,
-                          "Invalid mongo user/pass: %s/%s",
-                          gridfs_loc_conf->user.data,
-                          gridfs_loc_conf->pass.data);
-            return NGX_ERROR;
+        if (ngx_strncmp(value[i].data, "max_age=", 8) == 0) {
+            s.data = value[i].data + 8;
+            s.len = value[i].len - 8;
+            max_age = ngx_parse_time(&s, 1);
+            if (max_age == NGX_ERROR || max_age == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid max_age \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "rechecks=", 9) == 0) {
+            rechecks = ngx_atoi(value[i].data + 9, value[i].len - 9);
+            if (rechecks == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid rechecks \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            continue;
         }
 
-        mongo_auth = ngx_array_push(mongo_conn->auths);
-        mongo_auth->db = gridfs_loc_conf->db;
-        mongo_auth->user = gridfs_loc_conf->user;
-        mongo_auth->pass = gridfs_loc_conf->pass;
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
     }
 
-    // Run a test command to test authentication.
-    test = (char*)malloc( gridfs_loc_conf->db.len + sizeof(".test"));
-    ngx_cpystrn((u_char*)test, (u_char*)gridfs_loc_conf->db.data, gridfs_loc_conf->db.len+1);
-    ngx_cpystrn((u_char*)(test+gridfs_loc_conf->db.len),(u_char*)".test", sizeof(".test"));
-    bson_empty(&empty);
-    cursor = mongo_find(&mongo_conn->conn, test, &empty, NULL, 0, 0, 0);
-    error =  mongo_cmd_get_last_error(&mongo_conn->conn, (char*)gridfs_loc_conf->db.data, NULL);
-    free(test);
-    mongo_cursor_destroy(cursor);
-    if (error) {
-        ngx_log_error(NGX_LOG_ERR, log, 0, "Authentication Required");
-        return NGX_ERROR;
+    if (shm_zone == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter", &command->name);
+        return NGX_CONF_ERROR;
     }
 
-    return NGX_OK;
-}
+    /* A filter describes exactly one collection. */
+    if (shm_zone->data != NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "gridfs_key_filter zone \"%V\" is already used",
+                           &shm_zone->shm.name);
+        return NGX_CONF_ERROR;
+    }
 
-static ngx_int_t ngx_http_mongo_add_connection(ngx_cycle_t* cycle, ngx_http_gridfs_loc_conf_t* gridfs_loc_conf) {
-    ngx_http_mongo_connection_t* mongo_conn;
-    int status;
-    ngx_http_mongod_server_t *mongods;
-    volatile ngx_uint_t i;
-    u_char host[255];
+    filter = ngx_pcalloc(cf->pool, sizeof(ngx_http_gridfs_filter_t));
+    if (filter == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    filter->gridfs_loc_conf = gridfs_loc_conf;
 
-    mongods = gridfs_loc_conf->mongods->elts;
+    shm_zone->init = ngx_http_gridfs_init_filter_zone;
+    shm_zone->data = filter;
 
-    mongo_conn = ngx_http_get_mongo_connection( gridfs_loc_conf->mongo );
-    if (mongo_conn != NULL) {
-        return NGX_OK;
-    }
+    gridfs_loc_conf->filter_zone = shm_zone;
+    gridfs_loc_conf->filter_refresh = (time_t) refresh;
+    gridfs_loc_conf->filter_max_age = (time_t) max_age;
+    gridfs_loc_conf->filter_rechecks = (ngx_uint_t) rechecks;
 
-    mongo_conn = ngx_array_push(&ngx_http_mongo_connections);
-    if (mongo_conn == NULL) {
-        return NGX_ERROR;
+    return NGX_CONF_OK;
+}
+
+/* Parse the 'gridfs_cache' directive. */
+static char* ngx_http_gridfs_cache(ngx_conf_t* cf, ngx_command_t* command, void* void_conf) {
+    ngx_http_gridfs_loc_conf_t *gridfs_loc_conf = void_conf;
+    ngx_http_gridfs_miss_cache_t *cache;
+    ngx_str_t *value, s;
+    ngx_shm_zone_t *shm_zone = NULL;
+    ngx_int_t valid = 600000;
+    ssize_t max_size = 64 * 1024;
+    ngx_uint_t i;
+
+    if (gridfs_loc_conf->cache_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
     }
 
-    mongo_conn->name = gridfs_loc_conf->mongo;
-    mongo_conn->auths = ngx_array_create(cycle->pool, 4, sizeof(ngx_http_mongo_auth_t));
+    value = cf->args->elts;
 
-    if ( gridfs_loc_conf->mongods->nelts == 1 ) {
-        ngx_cpystrn( host, mongods[0].host.data, mongods[0].host.len + 1 );
-        status = mongo_client( &mongo_conn->conn, (const char*)host, mongods[0].port );
-    } else if ( gridfs_loc_conf->mongods->nelts >= 2 && gridfs_loc_conf->mongods->nelts < 9 ) {
+    for (i = 1; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+            shm_zone = ngx_http_gridfs_parse_zone(cf, &value[i],
+                                                  ngx_http_gridfs_init_cache_zone);
+            if (shm_zone == NULL) {
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
 
-        /* Initiate replica set connection. */
-        mongo_replica_set_init( &mongo_conn->conn, (const char *)gridfs_loc_conf->replset.data );
+        if (ngx_strncmp(value[i].data, "valid=", 6) == 0) {
+            s.data = value[i].data + 6;
+            s.len = value[i].len - 6;
+            valid = ngx_parse_time(&s, 0);
+            if (valid == NGX_ERROR || valid == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid valid \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
 
-        /* Add replica set seeds. */
-        for( i=0; i<gridfs_loc_conf->mongods->nelts; ++i ) {
-            ngx_cpystrn( host, mongods[i].host.data, mongods[i].host.len + 1 );
-            mongo_replica_set_add_seed( &mongo_conn->conn, (const char *)host, mongods[i].port );
+        if (ngx_strncmp(value[i].data, "max_size=", 9) == 0) {
+            s.data = value[i].data + 9;
+            s.len = value[i].len - 9;
+            max_size = ngx_parse_size(&s);
+            if (max_size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid max_size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            continue;
         }
-        status = mongo_replica_set_client( &mongo_conn->conn );
-    } else {
-        ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
-                          "Mongo Nginx Exception: Too many strings provided in 'mongo' directive.");
-        return NGX_ERROR;
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
     }
 
-    switch (status) {
-        case MONGO_CONN_SUCCESS:
-            break;
-        case MONGO_CONN_NO_SOCKET:
-            ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
-                          "Mongo Exception: No Socket");
-            return NGX_ERROR;
-        case MONGO_CONN_FAIL:
-            ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
-                          "Mongo Exception: Connection Failure.");
-            return NGX_ERROR;
-        case MONGO_CONN_ADDR_FAIL:
-            ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
-                          "Mongo Exception: getaddrinfo Failure.");
-            return NGX_ERROR;
-        case MONGO_CONN_NOT_MASTER:
-            ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
-                          "Mongo Exception: Not Master");
-            return NGX_ERROR;
-        case MONGO_CONN_BAD_SET_NAME:
-            ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
-                          "Mongo Exception: Replica set name %s does not match.", gridfs_loc_conf->replset.data);
-            return NGX_ERROR;
-        case MONGO_CONN_NO_PRIMARY:
-            ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
-                          "Mongo Exception: Cannot connect to primary node.");
-            return NGX_ERROR;
-        default:
-            ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
-                          "Mongo Exception: Unknown Error");
-            return NGX_ERROR;
+    if (shm_zone == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter", &command->name);
+        return NGX_CONF_ERROR;
     }
 
-    return NGX_OK;
+    /* Shared like the miss cache: entries are keyed by namespace and field. */
+    if (shm_zone->data == NULL) {
+        cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_gridfs_miss_cache_t));
+        if (cache == NULL) {
+            return NGX_CONF_ERROR;
+        }
+        shm_zone->init = ngx_http_gridfs_init_cache_zone;
+        shm_zone->data = cache;
+    }
+
+    gridfs_loc_conf->cache_zone = shm_zone;
+    gridfs_loc_conf->cache_valid = (ngx_msec_t) valid;
+    gridfs_loc_conf->cache_max_size = (size_t) max_size;
+
+    return NGX_CONF_OK;
 }
 
-static ngx_int_t ngx_http_gridfs_init_worker(ngx_cycle_t* cycle) {
-    ngx_http_gridfs_main_conf_t* gridfs_main_conf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_gridfs_module);
-    ngx_http_gridfs_loc_conf_t** gridfs_loc_confs;
+/* Parse the 'gridfs_warmup' directive. */
+static char* ngx_http_gridfs_warmup(ngx_conf_t* cf, ngx_command_t* command, void* void_conf) {
+    ngx_http_gridfs_loc_conf_t *gridfs_loc_conf = void_conf;
+    ngx_str_t *value;
+    ngx_int_t n;
     ngx_uint_t i;
 
-    signal(SIGPIPE, SIG_IGN);
+    if (gridfs_loc_conf->warmup_rate) {
+        return "is duplicate";
+    }
 
-    gridfs_loc_confs = gridfs_main_conf->loc_confs.elts;
+    value = cf->args->elts;
 
-    ngx_array_init(&ngx_http_mongo_connections, cycle->pool, 4, sizeof(ngx_http_mongo_connection_t));
+    gridfs_loc_conf->warmup_rate = 20;
+    ngx_str_set(&gridfs_loc_conf->warmup_sort, "uploadDate");
 
-    for (i = 0; i < gridfs_main_conf->loc_confs.nelts; i++) {
-        if (ngx_http_mongo_add_connection(cycle, gridfs_loc_confs[i]) == NGX_ERROR) {
-            return NGX_OK;
+    for (i = 1; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "file=", 5) == 0) {
+            gridfs_loc_conf->warmup_file.data = value[i].data + 5;
+            gridfs_loc_conf->warmup_file.len = value[i].len - 5;
+            if (gridfs_loc_conf->warmup_file.len == 0
+                || ngx_conf_full_name(cf->cycle, &gridfs_loc_conf->warmup_file, 1) != NGX_OK) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid file \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            continue;
         }
-        if (ngx_http_mongo_authenticate(cycle->log, gridfs_loc_confs[i]) == NGX_ERROR) {
-            return NGX_OK;
+
+        if (ngx_strncmp(value[i].data, "top=", 4) == 0) {
+            n = ngx_atoi(value[i].data + 4, value[i].len - 4);
+            if (n == NGX_ERROR || n == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid top \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            gridfs_loc_conf->warmup_top = n;
+            continue;
         }
-    }
 
-    return NGX_OK;
-}
+        if (ngx_strncmp(value[i].data, "sort=", 5) == 0 && value[i].len > 5) {
+            gridfs_loc_conf->warmup_sort.data = value[i].data + 5;
+            gridfs_loc_conf->warmup_sort.len = value[i].len - 5;
+            continue;
+        }
 
-static ngx_int_t ngx_http_mongo_reconnect(ngx_log_t *log, ngx_http_mongo_connection_t *mongo_conn) {
-    volatile int status = MONGO_CONN_FAIL;
+        if (ngx_strncmp(value[i].data, "rate=", 5) == 0) {
+            n = ngx_atoi(value[i].data + 5, value[i].len - 5);
+            if (n == NGX_ERROR || n == 0 || n > 1000) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid rate \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            gridfs_loc_conf->warmup_rate = n;
+            continue;
+        }
 
-    if (&mongo_conn->conn.connected) {
-        mongo_disconnect(&mongo_conn->conn);
-        ngx_msleep(MONGO_RECONNECT_WAITTIME);
-        status = mongo_reconnect(&mongo_conn->conn);
-    } else {
-        status = MONGO_CONN_FAIL;
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
     }
 
-    switch (status) {
-        case MONGO_CONN_SUCCESS:
-            break;
-        case MONGO_CONN_NO_SOCKET:
-            ngx_log_error(NGX_LOG_ERR, log, 0,
-                          "Mongo Exception: No Socket");
-            return NGX_ERROR;
-        case MONGO_CONN_FAIL:
-            ngx_log_error(NGX_LOG_ERR, log, 0,
-                          "Mongo Exception: Connection Failure %s:%i;",
-                          mongo_conn->conn.primary->host,
-                          mongo_conn->conn.primary->port);
-            return NGX_ERROR;
-        case MONGO_CONN_ADDR_FAIL:
-            ngx_log_error(NGX_LOG_ERR, log, 0,
-                          "Mongo Exception: getaddrinfo Failure");
-            return NGX_ERROR;
-        case MONGO_CONN_NOT_MASTER:
-            ngx_log_error(NGX_LOG_ERR, log, 0,
-                          "Mongo Exception: Not Master");
-            return NGX_ERROR;
-        default:
-            ngx_log_error(NGX_LOG_ERR, log, 0,
-                          "Mongo Exception: Unknown Error");
-            return NGX_ERROR;
+    if ((gridfs_loc_conf->warmup_file.len == 0) == (gridfs_loc_conf->warmup_top == 0)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have either \"file\" or \"top\" parameter",
+                           &command->name);
+        return NGX_CONF_ERROR;
     }
 
-    return NGX_OK;
+    return NGX_CONF_OK;
 }
 
-static ngx_int_t ngx_http_mongo_reauth(ngx_log_t *log, ngx_http_mongo_connection_t *mongo_conn) {
-    ngx_http_mongo_auth_t *auths;
-    volatile ngx_uint_t i;
-    volatile ngx_int_t status = 0;
-    auths = mongo_conn->auths->elts;
+/* Parse the 'gridfs_slow_log' directive. */
+static char* ngx_http_gridfs_slow_log(ngx_conf_t* cf, ngx_command_t* command, void* void_conf) {
+    ngx_http_gridfs_loc_conf_t *gridfs_loc_conf = void_conf;
+    ngx_str_t *value, s;
+    ngx_int_t threshold;
 
-    for (i = 0; i < mongo_conn->auths->nelts; i++) {
-        status = mongo_cmd_authenticate( &mongo_conn->conn,
-					 (const char*)auths[i].db.data,
-					 (const char*)auths[i].user.data,
-					 (const char*)auths[i].pass.data );
-        if (status != MONGO_OK) {
-            ngx_log_error(NGX_LOG_ERR, log, 0,
-                          "Invalid mongo user/pass: %s/%s, during reauth",
-                          auths[i].user.data,
-                          auths[i].pass.data);
-            return NGX_ERROR;
-        }
+    if (gridfs_loc_conf->slow_log != NGX_CONF_UNSET_MSEC) {
+        return "is duplicate";
     }
 
-    return NGX_OK;
-}
+    value = cf->args->elts;
 
-static char h_digit(char hex) {
-    return (hex >= '0' && hex <= '9') ? hex - '0': ngx_tolower(hex)-'a'+10;
-}
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        gridfs_loc_conf->slow_log = 0;
+        return NGX_CONF_OK;
+    }
 
-static int htoi(char* h) {
-    char ok[] = "0123456789AaBbCcDdEeFf";
+    if (ngx_strncmp(value[1].data, "threshold=", 10) != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
 
-    if (ngx_strchr(ok, h[0]) == NULL || ngx_strchr(ok,h[1]) == NULL) { return -1; }
-    return h_digit(h[0])*16 + h_digit(h[1]);
+    s.data = value[1].data + 10;
+    s.len = value[1].len - 10;
+    threshold = ngx_parse_time(&s, 0);
+    if (threshold == NGX_ERROR || threshold == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid threshold \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    gridfs_loc_conf->slow_log = (ngx_msec_t) threshold;
+
+    return NGX_CONF_OK;
 }
 
-static int url_decode(char * filename) {
-    char * read = filename;
-    char * write = filename;
-    char hex[3];
-    int c;
+/* Parse the 'gridfs_max_inflight' directive. */
+static char* ngx_http_gridfs_max_inflight(ngx_conf_t* cf, ngx_command_t* command, void* void_conf) {
+    ngx_http_gridfs_loc_conf_t *gridfs_loc_conf = void_conf;
+    ngx_str_t *value, s;
+    ngx_int_t n;
+    ngx_uint_t i;
 
-    hex[2] = '\0';
-    while (*read != '\0'){
-        if (*read == '%') {
-            hex[0] = *(++read);
-            if (hex[0] == '\0') return 0;
-            hex[1] = *(++read);
-            if (hex[1] == '\0') return 0;
+    if (gridfs_loc_conf->max_inflight != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts > 2) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+        gridfs_loc_conf->max_inflight = 0;
+        return NGX_CONF_OK;
+    }
+
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+    gridfs_loc_conf->max_inflight = n;
+    gridfs_loc_conf->inflight_queue = 0;
+    gridfs_loc_conf->inflight_timeout = 5000;
+    gridfs_loc_conf->retry_after = 1;
+    gridfs_loc_conf->inflight_backend = 0;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "queue=", 6) == 0) {
+            n = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (n == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid queue \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            gridfs_loc_conf->inflight_queue = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+            s.data = value[i].data + 8;
+            s.len = value[i].len - 8;
+            n = ngx_parse_time(&s, 0);
+            if (n == NGX_ERROR || n == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid timeout \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            gridfs_loc_conf->inflight_timeout = (ngx_msec_t) n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "retry_after=", 12) == 0) {
+            s.data = value[i].data + 12;
+            s.len = value[i].len - 12;
+            n = ngx_parse_time(&s, 1);
+            if (n == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid retry_after \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            gridfs_loc_conf->retry_after = (time_t) n;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "backend") == 0) {
+            gridfs_loc_conf->inflight_backend = 1;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/* Parse the 'gridfs_fair_scheduling' directive. */
+static char* ngx_http_gridfs_fair_scheduling(ngx_conf_t* cf, ngx_command_t* command, void* void_conf) {
+    ngx_http_gridfs_loc_conf_t *gridfs_loc_conf = void_conf;
+    ngx_str_t *value, s;
+    ssize_t size;
+    ngx_uint_t i;
+
+    if (gridfs_loc_conf->fair_quantum != NGX_CONF_UNSET_SIZE) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0 && cf->args->nelts == 2) {
+        gridfs_loc_conf->fair_quantum = 0;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strcmp(value[1].data, "on") != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    gridfs_loc_conf->fair_quantum = 1024 * 1024;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "quantum=", 8) == 0) {
+            s.data = value[i].data + 8;
+            s.len = value[i].len - 8;
+            size = ngx_parse_size(&s);
+            if (size == NGX_ERROR || size == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid quantum \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            gridfs_loc_conf->fair_quantum = size;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "small=", 6) == 0) {
+            s.data = value[i].data + 6;
+            s.len = value[i].len - 6;
+            size = ngx_parse_size(&s);
+            if (size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid small \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            gridfs_loc_conf->fair_small = size;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/* Parse the 'gridfs_upload' directive. */
+static char* ngx_http_gridfs_upload(ngx_conf_t* cf, ngx_command_t* command, void* void_conf) {
+    ngx_http_gridfs_loc_conf_t *gridfs_loc_conf = void_conf;
+    ngx_str_t *value, s;
+    ssize_t size;
+    ngx_int_t n;
+    ngx_uint_t i;
+
+    if (gridfs_loc_conf->upload != NGX_CONF_UNSET) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0 && cf->args->nelts == 2) {
+        gridfs_loc_conf->upload = 0;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strcmp(value[1].data, "on") != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    gridfs_loc_conf->upload = 1;
+    gridfs_loc_conf->upload_chunk_size = 255 * 1024;
+    gridfs_loc_conf->upload_batch = 4;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "chunk_size=", 11) == 0) {
+            s.data = value[i].data + 11;
+            s.len = value[i].len - 11;
+            size = ngx_parse_size(&s);
+            if (size == NGX_ERROR || size == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid chunk_size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            gridfs_loc_conf->upload_chunk_size = size;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "batch=", 6) == 0) {
+            n = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (n == NGX_ERROR || n == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid batch \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            gridfs_loc_conf->upload_batch = n;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    /* An insert must stay well under mongod's 16m document limit */
+    if (gridfs_loc_conf->upload_chunk_size > GRIDFS_UPLOAD_MAX_BATCH / gridfs_loc_conf->upload_batch) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "chunk_size times batch must not exceed 8m");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static void *ngx_http_gridfs_create_main_conf(ngx_conf_t *cf) {
+    ngx_http_gridfs_main_conf_t  *gridfs_main_conf;
+
+    gridfs_main_conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_gridfs_main_conf_t));
+    if (gridfs_main_conf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&gridfs_main_conf->loc_confs, cf->pool, 4,
+                       sizeof(ngx_http_gridfs_loc_conf_t *))
+        != NGX_OK) {
+        return NULL;
+    }
+
+    return gridfs_main_conf;
+}
+
+static void* ngx_http_gridfs_create_loc_conf(ngx_conf_t* directive) {
+    ngx_http_gridfs_loc_conf_t* gridfs_conf;
+
+    gridfs_conf = ngx_pcalloc(directive->pool, sizeof(ngx_http_gridfs_loc_conf_t));
+    if (gridfs_conf == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, directive, 0,
+                           "Failed to allocate memory for GridFS Location Config.");
+        return NGX_CONF_ERROR;
+    }
+
+    gridfs_conf->db.data = NULL;
+    gridfs_conf->db.len = 0;
+    gridfs_conf->root_collection.data = NULL;
+    gridfs_conf->root_collection.len = 0;
+    gridfs_conf->field.data = NULL;
+    gridfs_conf->field.len = 0;
+    gridfs_conf->type = NGX_CONF_UNSET_UINT;
+    gridfs_conf->user.data = NULL;
+    gridfs_conf->user.len = 0;
+    gridfs_conf->pass.data = NULL;
+    gridfs_conf->pass.len = 0;
+    gridfs_conf->mongo.data = NULL;
+    gridfs_conf->mongo.len = 0;
+    gridfs_conf->mongods = NGX_CONF_UNSET_PTR;
+    gridfs_conf->mongo_protocol = NGX_CONF_UNSET_UINT;
+    gridfs_conf->mongo_compressors = NGX_CONF_UNSET_PTR;
+#if (NGX_OPENSSL)
+    gridfs_conf->mongo_tls = NGX_CONF_UNSET_PTR;
+#endif
+    gridfs_conf->miss_zone = NGX_CONF_UNSET_PTR;
+    gridfs_conf->miss_ttl = NGX_CONF_UNSET_MSEC;
+    gridfs_conf->filter_zone = NGX_CONF_UNSET_PTR;
+    gridfs_conf->filter_refresh = NGX_CONF_UNSET;
+    gridfs_conf->filter_max_age = NGX_CONF_UNSET;
+    gridfs_conf->filter_rechecks = NGX_CONF_UNSET_UINT;
+    gridfs_conf->static_variants = NGX_CONF_UNSET;
+    gridfs_conf->gunzip = NGX_CONF_UNSET;
+    gridfs_conf->batch = NGX_CONF_UNSET;
+    gridfs_conf->batch_max_keys = NGX_CONF_UNSET_UINT;
+    gridfs_conf->batch_max_size = NGX_CONF_UNSET_SIZE;
+    gridfs_conf->mp4 = NGX_CONF_UNSET;
+    gridfs_conf->mp4_max_buffer_size = NGX_CONF_UNSET_SIZE;
+    gridfs_conf->slow_log = NGX_CONF_UNSET_MSEC;
+    gridfs_conf->max_inflight = NGX_CONF_UNSET_UINT;
+    gridfs_conf->inflight_queue = NGX_CONF_UNSET_UINT;
+    gridfs_conf->inflight_timeout = NGX_CONF_UNSET_MSEC;
+    gridfs_conf->retry_after = NGX_CONF_UNSET;
+    gridfs_conf->inflight_backend = NGX_CONF_UNSET;
+    gridfs_conf->fair_quantum = NGX_CONF_UNSET_SIZE;
+    gridfs_conf->fair_small = NGX_CONF_UNSET_SIZE;
+    gridfs_conf->upload = NGX_CONF_UNSET;
+    gridfs_conf->upload_chunk_size = NGX_CONF_UNSET_SIZE;
+    gridfs_conf->upload_batch = NGX_CONF_UNSET_UINT;
+    gridfs_conf->cache_zone = NGX_CONF_UNSET_PTR;
+    gridfs_conf->cache_valid = NGX_CONF_UNSET_MSEC;
+    gridfs_conf->cache_max_size = NGX_CONF_UNSET_SIZE;
+    gridfs_conf->buffering = NGX_CONF_UNSET;
+    gridfs_conf->max_temp_file_size = NGX_CONF_UNSET_SIZE;
+
+    return gridfs_conf;
+}
+
+/* The lookup query, { <field>: <key> }, up to the key: its length is left
+ * to fill in and its element is typed already. */
+static ngx_int_t ngx_http_gridfs_query_template(ngx_conf_t* cf, ngx_http_gridfs_loc_conf_t* gridfs_conf) {
+    u_char* p;
+
+    gridfs_conf->query_len = 4 + 1 + gridfs_conf->field.len + 1;
+    gridfs_conf->query = ngx_pnalloc(cf->pool, gridfs_conf->query_len);
+    if (gridfs_conf->query == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = gridfs_conf->query + 4;
+    *p++ = (u_char) gridfs_conf->type;
+    p = ngx_cpymem(p, gridfs_conf->field.data, gridfs_conf->field.len);
+    *p = '\0';
+
+    return NGX_OK;
+}
+
+static char* ngx_http_gridfs_merge_loc_conf(ngx_conf_t* cf, void* void_parent, void* void_child) {
+    ngx_http_gridfs_loc_conf_t *parent = void_parent;
+    ngx_http_gridfs_loc_conf_t *child = void_child;
+    ngx_http_gridfs_main_conf_t *gridfs_main_conf = ngx_http_conf_get_module_main_conf(cf, ngx_http_gridfs_module);
+    ngx_http_gridfs_loc_conf_t **gridfs_loc_conf;
+    ngx_http_core_loc_conf_t *core_conf;
+    ngx_http_mongod_server_t *mongod_server;
+
+    ngx_conf_merge_str_value(child->db, parent->db, NULL);
+    ngx_conf_merge_str_value(child->root_collection, parent->root_collection, "fs");
+    ngx_conf_merge_str_value(child->field, parent->field, "_id");
+    ngx_conf_merge_uint_value(child->type, parent->type, BSON_OID);
+    if (child->key == NULL) {
+        child->key = parent->key;
+    }
+    ngx_conf_merge_str_value(child->user, parent->user, NULL);
+    ngx_conf_merge_str_value(child->pass, parent->pass, NULL);
+    ngx_conf_merge_str_value(child->mongo, parent->mongo, "127.0.0.1:27017");
+
+    if (child->mongods == NGX_CONF_UNSET_PTR) {
+        if (parent->mongods != NGX_CONF_UNSET_PTR) {
+            child->mongods = parent->mongods;
+        } else {
+            child->mongods = ngx_array_create(cf->pool, 4,
+                                              sizeof(ngx_http_mongod_server_t));
+            mongod_server = ngx_array_push(child->mongods);
+            mongod_server->host.data = (u_char *)"127.0.0.1";
+            mongod_server->host.len = sizeof("127.0.0.1") - 1;
+            mongod_server->port = 27017;
+        }
+    }
+
+    ngx_conf_merge_uint_value(child->mongo_protocol, parent->mongo_protocol,
+                              MONGO_PROTOCOL_OP_QUERY);
+    ngx_conf_merge_ptr_value(child->mongo_compressors, parent->mongo_compressors, NULL);
+#if (NGX_OPENSSL)
+    ngx_conf_merge_ptr_value(child->mongo_tls, parent->mongo_tls, NULL);
+#endif
+
+    ngx_conf_merge_ptr_value(child->miss_zone, parent->miss_zone, NULL);
+    ngx_conf_merge_msec_value(child->miss_ttl, parent->miss_ttl, 5000);
+    ngx_conf_merge_ptr_value(child->filter_zone, parent->filter_zone, NULL);
+    ngx_conf_merge_sec_value(child->filter_refresh, parent->filter_refresh, 600);
+    ngx_conf_merge_sec_value(child->filter_max_age, parent->filter_max_age, 10);
+    ngx_conf_merge_uint_value(child->filter_rechecks, parent->filter_rechecks, 100);
+    ngx_conf_merge_value(child->static_variants, parent->static_variants, 0);
+    ngx_conf_merge_value(child->gunzip, parent->gunzip, 0);
+    ngx_conf_merge_bufs_value(child->gunzip_bufs, parent->gunzip_bufs,
+                              32, 4096);
+    ngx_conf_merge_value(child->batch, parent->batch, 0);
+    ngx_conf_merge_uint_value(child->batch_max_keys, parent->batch_max_keys, 100);
+    ngx_conf_merge_size_value(child->batch_max_size, parent->batch_max_size, 1024 * 1024);
+    ngx_conf_merge_value(child->mp4, parent->mp4, 0);
+    ngx_conf_merge_size_value(child->mp4_max_buffer_size, parent->mp4_max_buffer_size,
+                              10 * 1024 * 1024);
+    ngx_conf_merge_msec_value(child->slow_log, parent->slow_log, 0);
+    ngx_conf_merge_uint_value(child->max_inflight, parent->max_inflight, 0);
+    ngx_conf_merge_uint_value(child->inflight_queue, parent->inflight_queue, 0);
+    ngx_conf_merge_msec_value(child->inflight_timeout, parent->inflight_timeout, 5000);
+    ngx_conf_merge_sec_value(child->retry_after, parent->retry_after, 1);
+    ngx_conf_merge_value(child->inflight_backend, parent->inflight_backend, 0);
+    ngx_conf_merge_size_value(child->fair_quantum, parent->fair_quantum, 0);
+    ngx_conf_merge_size_value(child->fair_small, parent->fair_small, 1024 * 1024);
+    ngx_conf_merge_value(child->upload, parent->upload, 0);
+    ngx_conf_merge_size_value(child->upload_chunk_size, parent->upload_chunk_size, 255 * 1024);
+    ngx_conf_merge_uint_value(child->upload_batch, parent->upload_batch, 4);
+    ngx_conf_merge_ptr_value(child->cache_zone, parent->cache_zone, NULL);
+    ngx_conf_merge_msec_value(child->cache_valid, parent->cache_valid, 600000);
+    ngx_conf_merge_size_value(child->cache_max_size, parent->cache_max_size, 64 * 1024);
+    ngx_conf_merge_bitmask_value(child->cache_use_stale, parent->cache_use_stale,
+                                 NGX_CONF_BITMASK_SET | GRIDFS_STALE_OFF);
+    if (child->cache_use_stale & GRIDFS_STALE_OFF) {
+        child->cache_use_stale = NGX_CONF_BITMASK_SET | GRIDFS_STALE_OFF;
+    }
+    /* gridfs_warmup is not inherited, a location warms its keys once */
+    ngx_conf_merge_value(child->buffering, parent->buffering, 0);
+    if (ngx_conf_merge_path_value(cf, &child->temp_path, parent->temp_path,
+                                  &ngx_http_gridfs_temp_path) != NGX_CONF_OK) {
+        return NGX_CONF_ERROR;
+    }
+    ngx_conf_merge_size_value(child->max_temp_file_size, parent->max_temp_file_size,
+                              1024 * 1024 * 1024);
+
+    /* Both take POST requests */
+    if (child->upload && child->batch) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"gridfs_upload\" and \"gridfs_batch\" can't be used in the same location");
+        return NGX_CONF_ERROR;
+    }
+
+    /* The cache holds the file found for a key, not one per coding */
+    if (child->cache_zone && child->static_variants) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"gridfs_cache\" and \"gridfs_static_variants\" can't be used in the same location");
+        return NGX_CONF_ERROR;
+    }
+
+    if (child->warmup_rate && (child->cache_zone == NULL || child->db.data == NULL)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"gridfs_warmup\" requires \"gridfs\" and \"gridfs_cache\"");
+        return NGX_CONF_ERROR;
+    }
+
+    // Add the local gridfs conf to the main gridfs conf
+    if (child->db.data) {
+        if (ngx_http_gridfs_query_template(cf, child) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+        gridfs_loc_conf = ngx_array_push(&gridfs_main_conf->loc_confs);
+        *gridfs_loc_conf = child;
+        core_conf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+        child->name = core_conf->name;
+        child->stats_index = gridfs_main_conf->loc_confs.nelts - 1;
+
+        /* Each location counts its own requests, even when inherited; those
+         * sharing a mongo are linked up in postconfiguration. */
+        if (child->max_inflight) {
+            child->admission = ngx_pcalloc(cf->pool, sizeof(ngx_http_gridfs_admission_t));
+            if (child->admission == NULL) {
+                return NGX_CONF_ERROR;
+            }
+            child->admission->max = child->max_inflight;
+            child->admission->queue_max = child->inflight_queue;
+            child->admission->timeout = child->inflight_timeout;
+            child->admission->retry_after = child->retry_after;
+            ngx_queue_init(&child->admission->queue);
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+static ngx_int_t ngx_http_gridfs_init(ngx_conf_t* cf) {
+    ngx_http_gridfs_main_conf_t* gridfs_main_conf;
+    ngx_http_gridfs_loc_conf_t** gridfs_loc_confs;
+    ngx_http_core_main_conf_t* core_main_conf;
+    ngx_http_handler_pt* h;
+    ngx_uint_t i, j;
+
+    gridfs_main_conf = ngx_http_conf_get_module_main_conf(cf, ngx_http_gridfs_module);
+    gridfs_loc_confs = gridfs_main_conf->loc_confs.elts;
+
+    /* Locations sharing a mongo share its connection */
+    for (i = 0; i < gridfs_main_conf->loc_confs.nelts; i++) {
+        for (j = 0; j < i; j++) {
+            if (ngx_http_mongo_check_connection(cf, gridfs_loc_confs[j], gridfs_loc_confs[i]) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    /* A backend wide limit is the first such location's, and the others
+     * must agree with it */
+    for (i = 0; i < gridfs_main_conf->loc_confs.nelts; i++) {
+        if (gridfs_loc_confs[i]->admission == NULL || !gridfs_loc_confs[i]->inflight_backend) {
+            continue;
+        }
+        for (j = 0; j < i; j++) {
+            if (gridfs_loc_confs[j]->admission && gridfs_loc_confs[j]->inflight_backend
+                && gridfs_loc_confs[j]->mongo.len == gridfs_loc_confs[i]->mongo.len
+                && ngx_strncmp(gridfs_loc_confs[j]->mongo.data, gridfs_loc_confs[i]->mongo.data,
+                               gridfs_loc_confs[i]->mongo.len) == 0) {
+                if (gridfs_loc_confs[i]->admission->max != gridfs_loc_confs[j]->admission->max
+                    || gridfs_loc_confs[i]->admission->queue_max != gridfs_loc_confs[j]->admission->queue_max
+                    || gridfs_loc_confs[i]->admission->timeout != gridfs_loc_confs[j]->admission->timeout
+                    || gridfs_loc_confs[i]->admission->retry_after != gridfs_loc_confs[j]->admission->retry_after) {
+                    ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                                  "\"gridfs_max_inflight ... backend\" for mongo \"%V\" "
+                                  "differs in locations \"%V\" and \"%V\"",
+                                  &gridfs_loc_confs[i]->mongo, &gridfs_loc_confs[j]->name,
+                                  &gridfs_loc_confs[i]->name);
+                    return NGX_ERROR;
+                }
+                gridfs_loc_confs[i]->admission = gridfs_loc_confs[j]->admission;
+                break;
+            }
+        }
+    }
+
+    /* The slow log is written once the request is over */
+    for (i = 0; i < gridfs_main_conf->loc_confs.nelts; i++) {
+        if (gridfs_loc_confs[i]->slow_log) {
+            core_main_conf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+            h = ngx_array_push(&core_main_conf->phases[NGX_HTTP_LOG_PHASE].handlers);
+            if (h == NULL) {
+                return NGX_ERROR;
+            }
+            *h = ngx_http_gridfs_log_handler;
+            break;
+        }
+    }
+
+#if (NGX_THREADS)
+    if (gridfs_main_conf->loc_confs.nelts) {
+        gridfs_main_conf->thread_pool = ngx_thread_pool_add(cf, NULL);
+        if (gridfs_main_conf->thread_pool == NULL) {
+            return NGX_ERROR;
+        }
+    }
+#endif
+
+    return ngx_http_gridfs_init_stats(cf);
+}
+
+ngx_http_mongo_connection_t* ngx_http_get_mongo_connection( ngx_str_t name ) {
+    ngx_http_mongo_connection_t *mongo_conns;
+    ngx_uint_t i;
+
+    mongo_conns = ngx_http_mongo_connections.elts;
+
+    for ( i = 0; i < ngx_http_mongo_connections.nelts; i++ ) {
+        if ( name.len == mongo_conns[i].name.len
+             && ngx_strncmp(name.data, mongo_conns[i].name.data, name.len) == 0 ) {
+            return &mongo_conns[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Authenticate with every set of credentials of the connection, then check
+ * each database it serves can be read. */
+static ngx_int_t ngx_http_mongo_authenticate(ngx_log_t *log, ngx_http_mongo_connection_t *mongo_conn) {
+    ngx_http_mongo_auth_t *auths;
+    ngx_str_t *dbs;
+    mongo_cursor *cursor = NULL;
+    bson empty;
+    char *test;
+    int error;
+    ngx_uint_t i;
+
+    // Authenticate
+    auths = mongo_conn->auths->elts;
+    for (i = 0; i < mongo_conn->auths->nelts; i++) {
+        if (mongo_cmd_authenticate( &mongo_conn->conn,
+                                    (const char*)auths[i].db.data,
+                                    (const char*)auths[i].user.data,
+                                    (const char*)auths[i].pass.data )
+            != MONGO_OK) {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "Invalid mongo user/pass: %s/%s",
+                          auths[i].user.data,
+                          auths[i].pass.data);
+            return NGX_ERROR;
+        }
+    }
+
+    // Run a test command to test authentication, once per database.
+    dbs = mongo_conn->dbs->elts;
+    for (i = 0; i < mongo_conn->dbs->nelts; i++) {
+        test = (char*)malloc( dbs[i].len + sizeof(".test"));
+        if (test == NULL) {
+            return NGX_ERROR;
+        }
+        ngx_cpystrn((u_char*)test, dbs[i].data, dbs[i].len+1);
+        ngx_cpystrn((u_char*)(test+dbs[i].len),(u_char*)".test", sizeof(".test"));
+        bson_empty(&empty);
+        cursor = mongo_find(&mongo_conn->conn, test, &empty, NULL, 0, 0, 0);
+        error =  mongo_cmd_get_last_error(&mongo_conn->conn, (char*)dbs[i].data, NULL);
+        free(test);
+        mongo_cursor_destroy(cursor);
+        if (error) {
+            ngx_log_error(NGX_LOG_ERR, log, 0, "Authentication Required");
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+/* Two locations with the same mongo get one connection, set up from the
+ * first one's 'mongo' directive, so they must agree on how to reach it. */
+static ngx_int_t ngx_http_mongo_check_connection(ngx_conf_t* cf, ngx_http_gridfs_loc_conf_t* a, ngx_http_gridfs_loc_conf_t* b) {
+    ngx_http_mongod_server_t *sa, *sb;
+    ngx_uint_t *ca, *cb;
+    ngx_uint_t i;
+    char* setting;
+
+    if (a->mongo.len != b->mongo.len
+        || ngx_strncmp(a->mongo.data, b->mongo.data, a->mongo.len) != 0) {
+        return NGX_OK;
+    }
+
+    setting = NULL;
+
+    if (a->replset.len != b->replset.len
+        || (a->replset.len && ngx_strncmp(a->replset.data, b->replset.data, a->replset.len) != 0)
+        || a->mongods->nelts != b->mongods->nelts) {
+        setting = "seeds";
+    } else {
+        sa = a->mongods->elts;
+        sb = b->mongods->elts;
+        for (i = 0; i < a->mongods->nelts; i++) {
+            if (sa[i].port != sb[i].port || sa[i].host.len != sb[i].host.len
+                || ngx_strncmp(sa[i].host.data, sb[i].host.data, sa[i].host.len) != 0) {
+                setting = "seeds";
+                break;
+            }
+        }
+    }
+
+    if (a->mongo_protocol != b->mongo_protocol) {
+        setting = "protocol";
+    }
+
+    if ((a->mongo_compressors == NULL) != (b->mongo_compressors == NULL)
+        || (a->mongo_compressors != NULL
+            && a->mongo_compressors->nelts != b->mongo_compressors->nelts)) {
+        setting = "compressors";
+    } else if (a->mongo_compressors != NULL) {
+        ca = a->mongo_compressors->elts;
+        cb = b->mongo_compressors->elts;
+        for (i = 0; i < a->mongo_compressors->nelts; i++) {
+            if (ca[i] != cb[i]) {
+                setting = "compressors";
+                break;
+            }
+        }
+    }
+
+#if (NGX_OPENSSL)
+    if ((a->mongo_tls == NULL) != (b->mongo_tls == NULL)
+        || (a->mongo_tls != NULL
+            && ngx_memcmp(a->mongo_tls->context, b->mongo_tls->context, 16) != 0)) {
+        setting = "tls";
+    }
+#endif
+
+    if (setting == NULL) {
+        return NGX_OK;
+    }
+
+    ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                  "mongo \"%V\" has different %s in locations \"%V\" and \"%V\"",
+                  &a->mongo, setting, &a->name, &b->name);
+
+    return NGX_ERROR;
+}
+
+/* Register the location's backend, one connection per mongo directive
+ * value, and the credentials and database it needs on it. Nothing is sent
+ * to mongod here. */
+static ngx_int_t ngx_http_mongo_add_connection(ngx_cycle_t* cycle, ngx_http_gridfs_loc_conf_t* gridfs_loc_conf) {
+    ngx_http_mongo_connection_t* mongo_conn;
+    ngx_http_mongo_auth_t *mongo_auth;
+    ngx_str_t *db;
+    ngx_uint_t i;
+
+    mongo_conn = ngx_http_get_mongo_connection( gridfs_loc_conf->mongo );
+    if (mongo_conn == NULL) {
+        mongo_conn = ngx_array_push(&ngx_http_mongo_connections);
+        if (mongo_conn == NULL) {
+            return NGX_ERROR;
+        }
+        ngx_memzero(mongo_conn, sizeof(ngx_http_mongo_connection_t));
+
+        mongo_conn->name = gridfs_loc_conf->mongo;
+        mongo_conn->conf = gridfs_loc_conf;
+        mongo_conn->connecting = 1;
+        mongo_conn->auths = ngx_array_create(cycle->pool, 4, sizeof(ngx_http_mongo_auth_t));
+        mongo_conn->dbs = ngx_array_create(cycle->pool, 4, sizeof(ngx_str_t));
+        if (mongo_conn->auths == NULL || mongo_conn->dbs == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (gridfs_loc_conf->user.data != NULL && gridfs_loc_conf->pass.data != NULL) {
+        mongo_auth = mongo_conn->auths->elts;
+        for (i = 0; i < mongo_conn->auths->nelts; i++) {
+            if (ngx_strcmp(mongo_auth[i].db.data, gridfs_loc_conf->db.data) == 0
+                && ngx_strcmp(mongo_auth[i].user.data, gridfs_loc_conf->user.data) == 0
+                && ngx_strcmp(mongo_auth[i].pass.data, gridfs_loc_conf->pass.data) == 0) {
+                break;
+            }
+        }
+        if (i == mongo_conn->auths->nelts) {
+            mongo_auth = ngx_array_push(mongo_conn->auths);
+            if (mongo_auth == NULL) {
+                return NGX_ERROR;
+            }
+            mongo_auth->db = gridfs_loc_conf->db;
+            mongo_auth->user = gridfs_loc_conf->user;
+            mongo_auth->pass = gridfs_loc_conf->pass;
+        }
+    }
+
+    db = mongo_conn->dbs->elts;
+    for (i = 0; i < mongo_conn->dbs->nelts; i++) {
+        if (ngx_strcmp(db[i].data, gridfs_loc_conf->db.data) == 0) {
+            return NGX_OK;
+        }
+    }
+    db = ngx_array_push(mongo_conn->dbs);
+    if (db == NULL) {
+        return NGX_ERROR;
+    }
+    *db = gridfs_loc_conf->db;
+
+    return NGX_OK;
+}
+
+/* Connect to the backend, blocking. */
+static ngx_int_t ngx_http_mongo_connect(ngx_log_t* log, ngx_http_mongo_connection_t* mongo_conn) {
+    ngx_http_gridfs_loc_conf_t* gridfs_loc_conf = mongo_conn->conf;
+    int status;
+    ngx_http_mongod_server_t *mongods;
+    volatile ngx_uint_t i;
+    u_char host[255];
+
+    mongods = gridfs_loc_conf->mongods->elts;
+
+    if ( gridfs_loc_conf->mongods->nelts == 1 ) {
+        ngx_cpystrn( host, mongods[0].host.data, mongods[0].host.len + 1 );
+        status = mongo_client( &mongo_conn->conn, (const char*)host, mongods[0].port );
+    } else if ( gridfs_loc_conf->mongods->nelts >= 2 && gridfs_loc_conf->mongods->nelts < 9 ) {
+
+        /* Initiate replica set connection. */
+        mongo_replica_set_init( &mongo_conn->conn, (const char *)gridfs_loc_conf->replset.data );
+
+        /* Add replica set seeds. */
+        for( i=0; i<gridfs_loc_conf->mongods->nelts; ++i ) {
+            ngx_cpystrn( host, mongods[i].host.data, mongods[i].host.len + 1 );
+            mongo_replica_set_add_seed( &mongo_conn->conn, (const char *)host, mongods[i].port );
+        }
+        status = mongo_replica_set_client( &mongo_conn->conn );
+    } else {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "Mongo Nginx Exception: Too many strings provided in 'mongo' directive.");
+        return NGX_ERROR;
+    }
+
+    switch (status) {
+        case MONGO_CONN_SUCCESS:
+            break;
+        case MONGO_CONN_NO_SOCKET:
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "Mongo Exception: No Socket");
+            return NGX_ERROR;
+        case MONGO_CONN_FAIL:
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "Mongo Exception: Connection Failure.");
+            return NGX_ERROR;
+        case MONGO_CONN_ADDR_FAIL:
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "Mongo Exception: getaddrinfo Failure.");
+            return NGX_ERROR;
+        case MONGO_CONN_NOT_MASTER:
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "Mongo Exception: Not Master");
+            return NGX_ERROR;
+        case MONGO_CONN_BAD_SET_NAME:
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "Mongo Exception: Replica set name %s does not match.", gridfs_loc_conf->replset.data);
+            return NGX_ERROR;
+        case MONGO_CONN_NO_PRIMARY:
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "Mongo Exception: Cannot connect to primary node.");
+            return NGX_ERROR;
+        default:
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "Mongo Exception: Unknown Error");
+            return NGX_ERROR;
+    }
+
+    return ngx_http_mongo_negotiate(log, mongo_conn);
+}
+
+// ---------- CONNECTION BOOTSTRAP ---------- //
+
+/* Connect and authenticate a backend. With threads this runs in the thread
+ * pool, so it touches nothing but its own connection; requests leave the
+ * connection alone while it is connecting. */
+static void ngx_http_mongo_bootstrap(void* data, ngx_log_t* log) {
+    ngx_http_mongo_bootstrap_t* bootstrap = data;
+    ngx_http_mongo_connection_t* mongo_conn = bootstrap->mongo_conn;
+
+    /* Traced as a reconnect, credentials included */
+    GRIDFS_PROBE2(reconnect__start, NULL, mongo_conn->name.data);
+
+    bootstrap->rc = ngx_http_mongo_connect(log, mongo_conn);
+    if (bootstrap->rc == NGX_OK) {
+        bootstrap->rc = ngx_http_mongo_authenticate(log, mongo_conn);
+        if (bootstrap->rc != NGX_OK) {
+            /* Let the next request reconnect and replay the credentials. */
+            mongo_disconnect(&mongo_conn->conn);
+        }
+    }
+
+    GRIDFS_PROBE3(reconnect__done, NULL, mongo_conn->name.data, bootstrap->rc);
+}
+
+/* Hand the connection over to requests. */
+static void ngx_http_mongo_bootstrap_finish(ngx_http_mongo_bootstrap_t* bootstrap, ngx_log_t* log) {
+    bootstrap->mongo_conn->connecting = 0;
+
+    if (bootstrap->rc != NGX_OK) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "Could not set up mongo connection \"%V\", requests will retry",
+                      &bootstrap->mongo_conn->name);
+    }
+}
+
+#if (NGX_THREADS)
+/* The thread pool is done with the backend, on the event loop. */
+static void ngx_http_mongo_bootstrap_done(ngx_event_t* ev) {
+    ngx_http_mongo_bootstrap_finish(ev->data, ev->log);
+}
+#endif
+
+/* Connect a backend in the thread pool, where there is one. Otherwise it is
+ * connected here, before the worker takes any request: the driver's connect
+ * blocks, and on the event loop it would stall every request meanwhile. */
+static ngx_int_t ngx_http_mongo_start_bootstrap(ngx_cycle_t* cycle, ngx_http_mongo_connection_t* mongo_conn) {
+    ngx_http_mongo_bootstrap_t bootstrap;
+#if (NGX_THREADS)
+    ngx_http_gridfs_main_conf_t* gridfs_main_conf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_gridfs_module);
+    ngx_http_mongo_bootstrap_t* task_bootstrap;
+    ngx_thread_task_t* task;
+
+    if (gridfs_main_conf->thread_pool) {
+        task = ngx_thread_task_alloc(cycle->pool, sizeof(ngx_http_mongo_bootstrap_t));
+        if (task == NULL) {
+            return NGX_ERROR;
+        }
+
+        task_bootstrap = task->ctx;
+        task_bootstrap->mongo_conn = mongo_conn;
+
+        task->handler = ngx_http_mongo_bootstrap;
+        task->event.handler = ngx_http_mongo_bootstrap_done;
+        task->event.data = task_bootstrap;
+        task->event.log = cycle->log;
+
+        if (ngx_thread_task_post(gridfs_main_conf->thread_pool, task) == NGX_OK) {
+            return NGX_OK;
+        }
+
+        /* The queue is full, connect it now instead. */
+    }
+#endif
+
+    bootstrap.mongo_conn = mongo_conn;
+    ngx_http_mongo_bootstrap(&bootstrap, cycle->log);
+    ngx_http_mongo_bootstrap_finish(&bootstrap, cycle->log);
+
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_gridfs_init_worker(ngx_cycle_t* cycle) {
+    ngx_http_gridfs_main_conf_t* gridfs_main_conf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_gridfs_module);
+    ngx_http_gridfs_loc_conf_t** gridfs_loc_confs;
+    ngx_http_mongo_connection_t* mongo_conns;
+    ngx_http_gridfs_filter_t* filter;
+    ngx_http_gridfs_warmup_t* warmup;
+    ngx_uint_t i;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    gridfs_loc_confs = gridfs_main_conf->loc_confs.elts;
+
+    ngx_array_init(&ngx_http_mongo_connections, cycle->pool, 4, sizeof(ngx_http_mongo_connection_t));
+
+    /* Start the key filter timers, one per zone. */
+    for (i = 0; i < gridfs_main_conf->loc_confs.nelts; i++) {
+        if (gridfs_loc_confs[i]->filter_zone == NULL) {
+            continue;
+        }
+        filter = gridfs_loc_confs[i]->filter_zone->data;
+        if (filter->event.handler != NULL) {
+            continue;
+        }
+        filter->event.handler = ngx_http_gridfs_filter_refresh;
+        filter->event.data = filter;
+        filter->event.log = cycle->log;
+        filter->event.cancelable = 1;
+        ngx_add_timer(&filter->event, 1);
+    }
+
+    /* Collect the backends first: the array mustn't move once connecting. */
+    for (i = 0; i < gridfs_main_conf->loc_confs.nelts; i++) {
+        if (ngx_http_mongo_add_connection(cycle, gridfs_loc_confs[i]) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
+    /* Requests go straight to their backend from here on */
+    for (i = 0; i < gridfs_main_conf->loc_confs.nelts; i++) {
+        gridfs_loc_confs[i]->mongo_conn = ngx_http_get_mongo_connection(gridfs_loc_confs[i]->mongo);
+    }
+
+    mongo_conns = ngx_http_mongo_connections.elts;
+    for (i = 0; i < ngx_http_mongo_connections.nelts; i++) {
+        if (ngx_http_mongo_start_bootstrap(cycle, &mongo_conns[i]) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
+    /* The caches are shared, so one worker warms them. */
+    if (ngx_worker == 0) {
+        for (i = 0; i < gridfs_main_conf->loc_confs.nelts; i++) {
+            if (!gridfs_loc_confs[i]->warmup_rate) {
+                continue;
+            }
+            warmup = ngx_pcalloc(cycle->pool, sizeof(ngx_http_gridfs_warmup_t));
+            if (warmup == NULL) {
+                return NGX_ERROR;
+            }
+            warmup->gridfs_loc_conf = gridfs_loc_confs[i];
+            warmup->event.handler = ngx_http_gridfs_warmup_handler;
+            warmup->event.data = warmup;
+            warmup->event.log = cycle->log;
+            warmup->event.cancelable = 1;
+            ngx_add_timer(&warmup->event, GRIDFS_WARMUP_WAIT);
+        }
+    }
+
+    return NGX_OK;
+}
+
+/* Reconnect a dropped connection, for a request (which traces it) or a
+ * timer. The probes fire with no request. */
+static ngx_int_t ngx_http_mongo_reconnect(ngx_log_t *log, ngx_http_mongo_connection_t *mongo_conn) {
+    volatile int status = MONGO_CONN_FAIL;
+    ngx_int_t rc = NGX_ERROR;
+
+    GRIDFS_PROBE2(reconnect__start, NULL, mongo_conn->name.data);
+
+    if (mongo_conn->conn.connected) {
+        mongo_disconnect(&mongo_conn->conn);
+        ngx_msleep(MONGO_RECONNECT_WAITTIME);
+        status = mongo_reconnect(&mongo_conn->conn);
+    } else {
+        status = MONGO_CONN_FAIL;
+    }
+
+    switch (status) {
+        case MONGO_CONN_SUCCESS:
+            break;
+        case MONGO_CONN_NO_SOCKET:
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "Mongo Exception: No Socket");
+            goto done;
+        case MONGO_CONN_FAIL:
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "Mongo Exception: Connection Failure %s:%i;",
+                          mongo_conn->conn.primary->host,
+                          mongo_conn->conn.primary->port);
+            goto done;
+        case MONGO_CONN_ADDR_FAIL:
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "Mongo Exception: getaddrinfo Failure");
+            goto done;
+        case MONGO_CONN_NOT_MASTER:
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "Mongo Exception: Not Master");
+            goto done;
+        default:
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "Mongo Exception: Unknown Error");
+            goto done;
+    }
+
+    rc = ngx_http_mongo_negotiate(log, mongo_conn);
+
+done:
+
+    GRIDFS_PROBE3(reconnect__done, NULL, mongo_conn->name.data, rc);
+
+    return rc;
+}
+
+static ngx_int_t ngx_http_mongo_reauth(ngx_log_t *log, ngx_http_mongo_connection_t *mongo_conn) {
+    ngx_http_mongo_auth_t *auths;
+    volatile ngx_uint_t i;
+    volatile ngx_int_t status = 0;
+    ngx_int_t rc = NGX_OK;
+    auths = mongo_conn->auths->elts;
+
+    if (mongo_conn->auths->nelts == 0) {
+        return NGX_OK;
+    }
+
+    GRIDFS_PROBE2(reauth__start, NULL, mongo_conn->name.data);
+
+    for (i = 0; i < mongo_conn->auths->nelts; i++) {
+        status = mongo_cmd_authenticate( &mongo_conn->conn,
+					 (const char*)auths[i].db.data,
+					 (const char*)auths[i].user.data,
+					 (const char*)auths[i].pass.data );
+        if (status != MONGO_OK) {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "Invalid mongo user/pass: %s/%s, during reauth",
+                          auths[i].user.data,
+                          auths[i].pass.data);
+            rc = NGX_ERROR;
+            break;
+        }
+    }
+
+    GRIDFS_PROBE3(reauth__done, NULL, mongo_conn->name.data, rc);
+
+    return rc;
+}
+
+static void ngx_http_gridfs_miss_rbtree_insert_value(ngx_rbtree_node_t* temp, ngx_rbtree_node_t* node, ngx_rbtree_node_t* sentinel) {
+    ngx_rbtree_node_t **p;
+    ngx_http_gridfs_miss_node_t *mn, *mnt;
+
+    for ( ;; ) {
+        if (node->key < temp->key) {
+            p = &temp->left;
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+        } else {
+            mn = (ngx_http_gridfs_miss_node_t *) &node->color;
+            mnt = (ngx_http_gridfs_miss_node_t *) &temp->color;
+            p = (ngx_memn2cmp(mn->data, mnt->data, mn->len, mnt->len) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+/* Set up a zone of miss nodes, for gridfs_miss_cache or gridfs_cache. */
+static ngx_int_t ngx_http_gridfs_init_node_zone(ngx_shm_zone_t* shm_zone, void* data, char* directive) {
+    ngx_http_gridfs_miss_cache_t *ocache = data;
+    ngx_http_gridfs_miss_cache_t *cache;
+    size_t len;
+
+    cache = shm_zone->data;
+
+    if (ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+        return NGX_OK;
+    }
+
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_http_gridfs_miss_shctx_t));
+    if (cache->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_http_gridfs_miss_rbtree_insert_value);
+    ngx_queue_init(&cache->sh->queue);
+
+    len = sizeof(" in  zone \"\"") + ngx_strlen(directive) + shm_zone->shm.name.len;
+
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->shpool->log_ctx, " in %s zone \"%V\"%Z",
+                directive, &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_gridfs_init_miss_zone(ngx_shm_zone_t* shm_zone, void* data) {
+    return ngx_http_gridfs_init_node_zone(shm_zone, data, "gridfs_miss_cache");
+}
+
+static ngx_int_t ngx_http_gridfs_init_cache_zone(ngx_shm_zone_t* shm_zone, void* data) {
+    return ngx_http_gridfs_init_node_zone(shm_zone, data, "gridfs_cache");
+}
+
+/* Find a node in the miss cache. Called with the zone mutex held. */
+static ngx_http_gridfs_miss_node_t* ngx_http_gridfs_miss_find(ngx_http_gridfs_miss_cache_t* cache, ngx_str_t* key, uint32_t hash) {
+    ngx_rbtree_node_t *node, *sentinel;
+    ngx_http_gridfs_miss_node_t *mn;
+    ngx_int_t rc;
+
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        mn = (ngx_http_gridfs_miss_node_t *) &node->color;
+
+        rc = ngx_memn2cmp(key->data, mn->data, key->len, (size_t) mn->len);
+        if (rc == 0) {
+            return mn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+/* Free a node. Called with the zone mutex held. */
+static void ngx_http_gridfs_miss_remove(ngx_http_gridfs_miss_cache_t* cache, ngx_http_gridfs_miss_node_t* mn) {
+    ngx_rbtree_node_t *node;
+
+    ngx_queue_remove(&mn->queue);
+
+    node = (ngx_rbtree_node_t *)
+               ((u_char *) mn - offsetof(ngx_rbtree_node_t, color));
+
+    ngx_rbtree_delete(&cache->sh->rbtree, node);
+    ngx_slab_free_locked(cache->shpool, node);
+}
+
+/* Drop expired nodes from the tail of the LRU queue. With force set the
+ * oldest node goes regardless, to make room for a new one. */
+static void ngx_http_gridfs_miss_expire(ngx_http_gridfs_miss_cache_t* cache, ngx_uint_t force) {
+    ngx_queue_t *q;
+    ngx_http_gridfs_miss_node_t *mn;
+    ngx_uint_t n;
+
+    for (n = 0; n < 3; n++) {
+        if (ngx_queue_empty(&cache->sh->queue)) {
+            return;
+        }
+
+        q = ngx_queue_last(&cache->sh->queue);
+        mn = ngx_queue_data(q, ngx_http_gridfs_miss_node_t, queue);
+
+        if (!force && (ngx_msec_int_t) (mn->expire - ngx_current_msec) > 0) {
+            return;
+        }
+        force = 0;
+
+        ngx_http_gridfs_miss_remove(cache, mn);
+    }
+}
+
+/* Returns NGX_OK if the key is known to be missing. */
+static ngx_int_t ngx_http_gridfs_miss_lookup(ngx_http_gridfs_loc_conf_t* gridfs_conf, ngx_str_t* key) {
+    ngx_http_gridfs_miss_cache_t *cache = gridfs_conf->miss_zone->data;
+    ngx_http_gridfs_miss_node_t *mn;
+    ngx_int_t rc = NGX_DECLINED;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    mn = ngx_http_gridfs_miss_find(cache, key, ngx_crc32_short(key->data, key->len));
+    if (mn != NULL && (ngx_msec_int_t) (mn->expire - ngx_current_msec) > 0) {
+        rc = NGX_OK;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return rc;
+}
+
+static void ngx_http_gridfs_miss_add(ngx_http_gridfs_loc_conf_t* gridfs_conf, ngx_str_t* key) {
+    ngx_http_gridfs_miss_cache_t *cache = gridfs_conf->miss_zone->data;
+    ngx_http_gridfs_miss_node_t *mn;
+    ngx_rbtree_node_t *node;
+    uint32_t hash;
+    size_t size;
+
+    if (key->len > GRIDFS_KEY_MAX_LEN) {
+        return;
+    }
+
+    hash = ngx_crc32_short(key->data, key->len);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    ngx_http_gridfs_miss_expire(cache, 0);
+
+    mn = ngx_http_gridfs_miss_find(cache, key, hash);
+    if (mn != NULL) {
+        ngx_queue_remove(&mn->queue);
+        ngx_queue_insert_head(&cache->sh->queue, &mn->queue);
+        mn->expire = ngx_current_msec + gridfs_conf->miss_ttl;
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return;
+    }
+
+    size = offsetof(ngx_rbtree_node_t, color)
+           + offsetof(ngx_http_gridfs_miss_node_t, data)
+           + key->len;
+
+    node = ngx_slab_alloc_locked(cache->shpool, size);
+    if (node == NULL) {
+        ngx_http_gridfs_miss_expire(cache, 1);
+        node = ngx_slab_alloc_locked(cache->shpool, size);
+        if (node == NULL) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return;
+        }
+    }
+
+    node->key = hash;
+    mn = (ngx_http_gridfs_miss_node_t *) &node->color;
+    mn->len = (u_short) key->len;
+    mn->expire = ngx_current_msec + gridfs_conf->miss_ttl;
+    ngx_memcpy(mn->data, key->data, key->len);
+
+    ngx_rbtree_insert(&cache->sh->rbtree, node);
+    ngx_queue_insert_head(&cache->sh->queue, &mn->queue);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+/* Forget a key once it has been written, in gridfs_miss_cache or
+ * gridfs_cache. */
+static void ngx_http_gridfs_miss_delete(ngx_http_gridfs_miss_cache_t* cache, ngx_str_t* key) {
+    ngx_http_gridfs_miss_node_t *mn;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    mn = ngx_http_gridfs_miss_find(cache, key, ngx_crc32_short(key->data, key->len));
+    if (mn != NULL) {
+        ngx_http_gridfs_miss_remove(cache, mn);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+/* Look a file up in gridfs_cache. On a hit its files document, and its body
+ * if cached, are copied into the pool; with no pool only the presence of a
+ * fresh entry is checked. Returns NGX_OK if fresh and, with
+ * gridfs_cache_use_stale, NGX_AGAIN if expired. Given update, a stale entry
+ * nobody is refreshing is claimed for a refresh, and *update set. */
+static ngx_int_t ngx_http_gridfs_cache_lookup(ngx_pool_t* pool, ngx_http_gridfs_loc_conf_t* gridfs_conf, ngx_str_t* key, bson* meta, bson** body, ngx_uint_t* update) {
+    ngx_http_gridfs_miss_cache_t *cache = gridfs_conf->cache_zone->data;
+    ngx_http_gridfs_miss_node_t *mn;
+    u_char *data;
+    size_t meta_len, body_len;
+    ngx_int_t rc = NGX_OK;
+    bson doc;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    mn = ngx_http_gridfs_miss_find(cache, key, ngx_crc32_short(key->data, key->len));
+    if (mn == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    /* Expired entries are kept, and only go when room is needed */
+    if ((ngx_msec_int_t) (mn->expire - ngx_current_msec) <= 0) {
+        if (pool == NULL || (gridfs_conf->cache_use_stale & GRIDFS_STALE_OFF)) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return NGX_DECLINED;
+        }
+        rc = NGX_AGAIN;
+
+        if (update != NULL
+            && (mn->updating == 0
+                || (ngx_msec_int_t) (ngx_current_msec - mn->updating) > GRIDFS_CACHE_UPDATING)) {
+            mn->updating = ngx_current_msec ? ngx_current_msec : 1;
+            *update = 1;
+        }
+    }
+
+    if (pool == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_OK;
+    }
+
+    ngx_queue_remove(&mn->queue);
+    ngx_queue_insert_head(&cache->sh->queue, &mn->queue);
+
+    bson_init_finished_data(&doc, (char *) mn->data + mn->len);
+    meta_len = bson_size(&doc);
+    body_len = 0;
+    if (mn->body) {
+        bson_init_finished_data(&doc, (char *) mn->data + mn->len + meta_len);
+        body_len = bson_size(&doc);
+    }
+
+    data = ngx_pnalloc(pool, meta_len + body_len);
+    if (data == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_ERROR;
+    }
+    ngx_memcpy(data, mn->data + mn->len, meta_len + body_len);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    bson_init_finished_data(meta, (char *) data);
+
+    *body = NULL;
+    if (body_len) {
+        *body = ngx_palloc(pool, sizeof(bson));
+        if (*body == NULL) {
+            return NGX_ERROR;
+        }
+        bson_init_finished_data(*body, (char *) data + meta_len);
+    }
+
+    return rc;
+}
+
+/* The cached file is still current: keep it for another cache_valid. */
+static void ngx_http_gridfs_cache_touch(ngx_http_gridfs_loc_conf_t* gridfs_conf, ngx_str_t* key) {
+    ngx_http_gridfs_miss_cache_t *cache = gridfs_conf->cache_zone->data;
+    ngx_http_gridfs_miss_node_t *mn;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    mn = ngx_http_gridfs_miss_find(cache, key, ngx_crc32_short(key->data, key->len));
+    if (mn != NULL) {
+        mn->expire = ngx_current_msec + gridfs_conf->cache_valid;
+        mn->updating = 0;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+/* Cache a file's document, and its body if small enough to have been
+ * fetched, replacing what was cached for the key. */
+static void ngx_http_gridfs_cache_store(ngx_http_gridfs_loc_conf_t* gridfs_conf, ngx_str_t* key, bson* meta, bson* body) {
+    ngx_http_gridfs_miss_cache_t *cache = gridfs_conf->cache_zone->data;
+    ngx_http_gridfs_miss_node_t *mn;
+    ngx_rbtree_node_t *node;
+    size_t meta_len, body_len, size;
+    uint32_t hash;
+
+    if (key->len > GRIDFS_KEY_MAX_LEN) {
+        return;
+    }
+
+    meta_len = bson_size(meta);
+    body_len = body ? bson_size(body) : 0;
+    hash = ngx_crc32_short(key->data, key->len);
+
+    size = offsetof(ngx_rbtree_node_t, color)
+           + offsetof(ngx_http_gridfs_miss_node_t, data)
+           + key->len + meta_len + body_len;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    /* Expired entries aren't dropped: they may be served stale */
+    mn = ngx_http_gridfs_miss_find(cache, key, hash);
+    if (mn != NULL) {
+        ngx_http_gridfs_miss_remove(cache, mn);
+    }
+
+    /* A body may need several of the oldest entries to go */
+    for ( ;; ) {
+        node = ngx_slab_alloc_locked(cache->shpool, size);
+        if (node != NULL) {
+            break;
+        }
+        if (ngx_queue_empty(&cache->sh->queue)) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return;
+        }
+        ngx_http_gridfs_miss_expire(cache, 1);
+    }
+
+    node->key = hash;
+    mn = (ngx_http_gridfs_miss_node_t *) &node->color;
+    mn->len = (u_short) key->len;
+    mn->body = (body != NULL);
+    mn->expire = ngx_current_msec + gridfs_conf->cache_valid;
+    mn->updating = 0;
+    ngx_memcpy(mn->data, key->data, key->len);
+    ngx_memcpy(mn->data + key->len, meta->data, meta_len);
+    if (body != NULL) {
+        ngx_memcpy(mn->data + key->len + meta_len, body->data, body_len);
+    }
+
+    ngx_rbtree_insert(&cache->sh->rbtree, node);
+    ngx_queue_insert_head(&cache->sh->queue, &mn->queue);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+/* The miss cache key: "db.root_collection/field/key". */
+static ngx_int_t ngx_http_gridfs_miss_key(ngx_pool_t* pool, ngx_http_gridfs_loc_conf_t* gridfs_conf, ngx_str_t* value, ngx_str_t* key) {
+    key->len = gridfs_conf->db.len + gridfs_conf->root_collection.len
+               + gridfs_conf->field.len + value->len + 3;
+    key->data = ngx_pnalloc(pool, key->len);
+    if (key->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(key->data, "%V.%V/%V/%V", &gridfs_conf->db,
+                &gridfs_conf->root_collection, &gridfs_conf->field, value);
+
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_gridfs_init_filter_zone(ngx_shm_zone_t* shm_zone, void* data) {
+    ngx_http_gridfs_filter_t *ofilter = data;
+    ngx_http_gridfs_filter_t *filter;
+    size_t size, len;
+
+    filter = shm_zone->data;
+
+    if (ofilter) {
+        filter->sh = ofilter->sh;
+        filter->shpool = ofilter->shpool;
+        return NGX_OK;
+    }
+
+    filter->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        filter->sh = filter->shpool->data;
+        return NGX_OK;
+    }
+
+    filter->sh = ngx_slab_alloc(filter->shpool, sizeof(ngx_http_gridfs_filter_shctx_t));
+    if (filter->sh == NULL) {
+        return NGX_ERROR;
+    }
+    ngx_memzero(filter->sh, sizeof(ngx_http_gridfs_filter_shctx_t));
+
+    filter->shpool->data = filter->sh;
+
+    /* Leave room for the slab bookkeeping, split the rest in two. */
+    size = shm_zone->shm.size - shm_zone->shm.size / 64 - 8 * ngx_pagesize;
+    size = (size / 2) & ~(ngx_pagesize - 1);
+
+    filter->sh->nbits = size * 8;
+    filter->sh->bits[0] = ngx_slab_alloc(filter->shpool, size);
+    filter->sh->bits[1] = ngx_slab_alloc(filter->shpool, size);
+    if (filter->sh->bits[0] == NULL || filter->sh->bits[1] == NULL) {
+        return NGX_ERROR;
+    }
+    ngx_memzero((void *) filter->sh->bits[0], size);
+    ngx_memzero((void *) filter->sh->bits[1], size);
+
+    len = sizeof(" in gridfs_key_filter zone \"\"") + shm_zone->shm.name.len;
+
+    filter->shpool->log_ctx = ngx_slab_alloc(filter->shpool, len);
+    if (filter->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(filter->shpool->log_ctx, " in gridfs_key_filter zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+/* Parse a key of type int: a decimal, maybe negative, that fits an int32. */
+static ngx_int_t ngx_http_gridfs_key_int(const u_char* p, size_t len, int32_t* n) {
+    int64_t value = 0;
+    int64_t negative = 0;
+
+    if (len && *p == '-') {
+        negative = 1;
+        p++;
+        len--;
+    }
+
+    if (len == 0 || len > NGX_INT32_LEN) {
+        return NGX_ERROR;
+    }
+
+    for ( ; len; len--, p++) {
+        if (*p < '0' || *p > '9') {
+            return NGX_ERROR;
+        }
+        value = value * 10 + (*p - '0');
+    }
+
+    if (value > (int64_t) NGX_MAX_INT32_VALUE + negative) {
+        return NGX_ERROR;
+    }
+
+    *n = (int32_t) (negative ? -value : value);
+
+    return NGX_OK;
+}
+
+/* Canonical form of a key as hashed into the filter. Integers are hashed as
+ * their decimal text so that int and long documents land on the same bits as
+ * the int query built from the request. */
+static void ngx_http_gridfs_filter_key(ngx_uint_t type, ngx_str_t* value, u_char* buf, ngx_str_t* key) {
+    bson_oid_t oid;
+    int32_t n = 0;
+
+    switch (type) {
+    case BSON_OID:
+        bson_oid_from_string(&oid, (const char*)value->data);
+        ngx_memcpy(buf, oid.bytes, 12);
+        key->data = buf;
+        key->len = 12;
+        break;
+    case BSON_INT:
+        key->data = buf;
+        (void) ngx_http_gridfs_key_int(value->data, value->len, &n);
+        key->len = ngx_sprintf(buf, "%D", n) - buf;
+        break;
+    default:
+        *key = *value;
+        break;
+    }
+}
+
+static ngx_int_t ngx_http_gridfs_filter_doc_key(bson_iterator* it, u_char* buf, ngx_str_t* key) {
+    double d;
+
+    switch (bson_iterator_type(it)) {
+    case BSON_OID:
+        ngx_memcpy(buf, bson_iterator_oid(it)->bytes, 12);
+        key->data = buf;
+        key->len = 12;
+        return NGX_OK;
+    case BSON_INT:
+        key->data = buf;
+        key->len = ngx_sprintf(buf, "%i", (ngx_int_t) bson_iterator_int(it)) - buf;
+        return NGX_OK;
+    case BSON_LONG:
+        key->data = buf;
+        key->len = ngx_sprintf(buf, "%L", (int64_t) bson_iterator_long(it)) - buf;
+        return NGX_OK;
+    case BSON_DOUBLE:
+        d = bson_iterator_double(it);
+        if (d != (double) (int64_t) d) {
+            return NGX_DECLINED;
+        }
+        key->data = buf;
+        key->len = ngx_sprintf(buf, "%L", (int64_t) d) - buf;
+        return NGX_OK;
+    case BSON_STRING:
+        key->data = (u_char *) bson_iterator_string(it);
+        key->len = bson_iterator_string_len(it) - 1;
+        return NGX_OK;
+    default:
+        return NGX_DECLINED;
+    }
+}
+
+static ngx_uint_t ngx_http_gridfs_filter_bit(ngx_str_t* key, ngx_uint_t i, ngx_uint_t nbits) {
+    uint32_t h1, h2;
+
+    h1 = ngx_murmur_hash2(key->data, key->len);
+    h2 = ngx_crc32_long(key->data, key->len) | 1;
+
+    return ((ngx_uint_t) h1 + i * (ngx_uint_t) h2) % nbits;
+}
+
+static void ngx_http_gridfs_filter_set(ngx_atomic_t* bits, ngx_uint_t nbits, ngx_str_t* key) {
+    ngx_atomic_uint_t old, mask;
+    ngx_atomic_t *word;
+    ngx_uint_t i, bit;
+
+    for (i = 0; i < GRIDFS_FILTER_HASHES; i++) {
+        bit = ngx_http_gridfs_filter_bit(key, i, nbits);
+        word = &bits[bit / (8 * sizeof(ngx_atomic_uint_t))];
+        mask = (ngx_atomic_uint_t) 1 << (bit % (8 * sizeof(ngx_atomic_uint_t)));
+
+        do {
+            old = *word;
+            if (old & mask) {
+                break;
+            }
+        } while (!ngx_atomic_cmp_set(word, old, old | mask));
+    }
+}
+
+/* Returns NGX_DECLINED if the key is not in the collection as of the last
+ * build or catch-up. The filter isn't trusted once it hasn't caught up for
+ * max_age. A file it can't know of, e.g. one written since with a custom
+ * _id, is only found among the rechecks: up to 'rechecks' turned down keys
+ * a second are looked up anyway, and added to the filter when found. */
+static ngx_int_t ngx_http_gridfs_filter_test(ngx_http_gridfs_loc_conf_t* gridfs_conf, ngx_str_t* value) {
+    ngx_http_gridfs_filter_t *filter = gridfs_conf->filter_zone->data;
+    ngx_http_gridfs_filter_shctx_t *sh = filter->sh;
+    ngx_atomic_t *bits;
+    ngx_atomic_uint_t then;
+    ngx_str_t key;
+    ngx_uint_t i, bit;
+    time_t now;
+    u_char buf[NGX_INT64_LEN + 12];
+
+    now = ngx_time();
+
+    if (!sh->ready || now - (time_t) sh->synced > filter->gridfs_loc_conf->filter_max_age) {
+        return NGX_OK;
+    }
+
+    ngx_http_gridfs_filter_key(gridfs_conf->type, value, buf, &key);
+    bits = sh->bits[sh->active];
+
+    for (i = 0; i < GRIDFS_FILTER_HASHES; i++) {
+        bit = ngx_http_gridfs_filter_bit(&key, i, sh->nbits);
+        if (!(bits[bit / (8 * sizeof(ngx_atomic_uint_t))]
+              & ((ngx_atomic_uint_t) 1 << (bit % (8 * sizeof(ngx_atomic_uint_t)))))) {
+            break;
+        }
+    }
+
+    if (i == GRIDFS_FILTER_HASHES) {
+        return NGX_OK;
+    }
+
+    then = sh->recheck_time;
+    if ((time_t) then != now
+        && ngx_atomic_cmp_set(&sh->recheck_time, then, (ngx_atomic_uint_t) now)) {
+        sh->rechecks = 0;
+    }
+
+    if (ngx_atomic_fetch_add(&sh->rechecks, 1) < filter->gridfs_loc_conf->filter_rechecks) {
+        return NGX_OK;
+    }
+
+    return NGX_DECLINED;
+}
+
+/* Add a key that was just written. Both bit sets get it, so that it survives
+ * a rebuild which had already gone past its document. */
+static void ngx_http_gridfs_filter_add(ngx_http_gridfs_loc_conf_t* gridfs_conf, ngx_str_t* value) {
+    ngx_http_gridfs_filter_t *filter = gridfs_conf->filter_zone->data;
+    ngx_http_gridfs_filter_shctx_t *sh = filter->sh;
+    ngx_str_t key;
+    u_char buf[NGX_INT64_LEN + 12];
+
+    ngx_http_gridfs_filter_key(gridfs_conf->type, value, buf, &key);
+    ngx_http_gridfs_filter_set(sh->bits[0], sh->nbits, &key);
+    ngx_http_gridfs_filter_set(sh->bits[1], sh->nbits, &key);
+}
+
+static void ngx_http_gridfs_filter_stop(ngx_http_gridfs_filter_t* filter) {
+    filter->building = 0;
+
+    if (filter->last_init) {
+        bson_destroy(&filter->last);
+        filter->last_init = 0;
+    }
+}
+
+static ngx_int_t ngx_http_gridfs_filter_start(ngx_http_gridfs_filter_t* filter, ngx_log_t* log) {
+    ngx_http_gridfs_loc_conf_t *gridfs_conf = filter->gridfs_loc_conf;
+    ngx_http_mongo_connection_t *mongo_conn;
+    ngx_http_gridfs_filter_shctx_t *sh = filter->sh;
+
+    /* The timer never reconnects on its own, requests take care of that. */
+    mongo_conn = gridfs_conf->mongo_conn;
+    if (mongo_conn == NULL || mongo_conn->connecting || mongo_conn->conn.connected == 0) {
+        return NGX_ERROR;
+    }
+
+    if (filter->ns == NULL) {
+        filter->ns = ngx_alloc(gridfs_conf->db.len + gridfs_conf->root_collection.len
+                               + sizeof("..files"), log);
+        if (filter->ns == NULL) {
+            return NGX_ERROR;
+        }
+        ngx_sprintf((u_char*)filter->ns, "%V.%V.files%Z",
+                    &gridfs_conf->db, &gridfs_conf->root_collection);
+
+        bson_init(&filter->fields);
+        bson_append_int(&filter->fields, (char*)gridfs_conf->field.data, 1);
+        bson_finish(&filter->fields);
+    }
+
+    ngx_memzero((void *) sh->bits[1 - sh->active], sh->nbits / 8);
+
+    /* The walk starts over, a catch-up position is dropped */
+    ngx_http_gridfs_filter_stop(filter);
+    filter->building = 1;
+
+    return NGX_OK;
+}
+
+/* Read the next GRIDFS_FILTER_BATCH documents in _id order into bits, with a
+ * query of their own: each step is one round trip of a bounded size, and the
+ * event loop gets back between steps. */
+static ngx_int_t ngx_http_gridfs_filter_step(ngx_http_gridfs_filter_t* filter, ngx_atomic_uint_t* bits) {
+    ngx_http_gridfs_loc_conf_t *gridfs_conf = filter->gridfs_loc_conf;
+    ngx_http_mongo_connection_t *mongo_conn;
+    ngx_http_gridfs_filter_shctx_t *sh = filter->sh;
+    mongo_cursor *cursor;
+    bson_iterator it;
+    bson query;
+    ngx_str_t key;
+    ngx_uint_t n;
+    ngx_int_t rc;
+    u_char buf[NGX_INT64_LEN + 12];
+
+    mongo_conn = gridfs_conf->mongo_conn;
+    if (mongo_conn == NULL || mongo_conn->connecting || mongo_conn->conn.connected == 0) {
+        return NGX_ERROR;
+    }
+
+    bson_init(&query);
+    bson_append_start_object(&query, "$query");
+    if (filter->last_init) {
+        bson_find(&it, &filter->last, "_id");
+        bson_append_start_object(&query, "_id");
+        bson_append_element(&query, "$gt", &it);
+        bson_append_finish_object(&query);
+    }
+    bson_append_finish_object(&query);
+    bson_append_start_object(&query, "$orderby");
+    bson_append_int(&query, "_id", 1);
+    bson_append_finish_object(&query);
+    bson_finish(&query);
+
+    mongo_clear_errors(&mongo_conn->conn);
+    cursor = mongo_find(&mongo_conn->conn, filter->ns, &query, &filter->fields,
+                        GRIDFS_FILTER_BATCH, 0, 0);
+    bson_destroy(&query);
+    if (cursor == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (n = 0; mongo_cursor_next(cursor) == MONGO_OK; n++) {
+        if (bson_find(&it, &cursor->current, "_id") != BSON_EOO) {
+            if (filter->last_init) {
+                bson_destroy(&filter->last);
+            }
+            bson_init(&filter->last);
+            bson_append_element(&filter->last, "_id", &it);
+            bson_finish(&filter->last);
+            filter->last_init = 1;
+        }
+
+        if (bson_find(&it, &cursor->current,
+                      (char*)gridfs_conf->field.data) == BSON_EOO) {
+            continue;
+        }
+
+        if (ngx_http_gridfs_filter_doc_key(&it, buf, &key) != NGX_OK) {
+            continue;
+        }
+
+        ngx_http_gridfs_filter_set(bits, sh->nbits, &key);
+    }
+
+    if (cursor->err != MONGO_CURSOR_EXHAUSTED || mongo_conn->conn.err != MONGO_CONN_SUCCESS) {
+        rc = NGX_ERROR;
+    } else {
+        rc = (n < GRIDFS_FILTER_BATCH) ? NGX_OK : NGX_AGAIN;
+    }
+
+    mongo_cursor_destroy(cursor);
+
+    return rc;
+}
+
+/* Whether reading on from the last _id finds every document written since:
+ * ObjectIds grow with time, so nothing new sorts before the last one. */
+static ngx_uint_t ngx_http_gridfs_filter_can_catch_up(ngx_http_gridfs_filter_t* filter) {
+    bson_iterator it;
+
+    return !filter->last_init || bson_find(&it, &filter->last, "_id") == BSON_OID;
+}
+
+/* Read the documents added since the last build or catch-up into the
+ * active bitset. Only the worker that made the build does, from the last
+ * _id it read. */
+static ngx_int_t ngx_http_gridfs_filter_catch_up(ngx_http_gridfs_filter_t* filter, time_t now) {
+    ngx_http_gridfs_filter_shctx_t *sh = filter->sh;
+    ngx_atomic_uint_t syncer;
+    ngx_int_t rc;
+
+    syncer = sh->syncer;
+
+    if (syncer != (ngx_atomic_uint_t) ngx_pid) {
+        /* Rebuilt by another worker since */
+        ngx_http_gridfs_filter_stop(filter);
+
+        /* The worker catching up has gone, e.g. on a reload: a rebuild
+         * gets a new one going. */
+        if (syncer != 0
+            && now - (time_t) sh->synced > filter->gridfs_loc_conf->filter_max_age
+            && ngx_atomic_cmp_set(&sh->syncer, syncer, 0)) {
+            sh->next_refresh = now;
+        }
+        return NGX_DECLINED;
+    }
+
+    rc = ngx_http_gridfs_filter_step(filter, sh->bits[sh->active]);
+
+    if (!ngx_http_gridfs_filter_can_catch_up(filter)) {
+        ngx_http_gridfs_filter_stop(filter);
+        sh->syncer = 0;
+        return NGX_DECLINED;
+    }
+
+    if (rc == NGX_OK) {
+        sh->synced = now;
+    }
+
+    return rc;
+}
+
+/* Timer driving the filter rebuild. Every worker runs it; the first one to
+ * claim a due refresh walks fs.files a batch at a time and swaps the
+ * bitsets when done. In between, the worker that made the build catches
+ * up with new documents. */
+static void ngx_http_gridfs_filter_refresh(ngx_event_t* ev) {
+    ngx_http_gridfs_filter_t *filter = ev->data;
+    ngx_http_gridfs_filter_shctx_t *sh = filter->sh;
+    ngx_atomic_uint_t builder;
+    ngx_int_t rc;
+    time_t now;
+
+    now = ngx_time();
+
+    if (!filter->building) {
+        if (ngx_exiting) {
+            goto idle;
+        }
+
+        if ((time_t) sh->next_refresh > now) {
+            if (ngx_http_gridfs_filter_catch_up(filter, now) == NGX_AGAIN) {
+                ngx_add_timer(ev, 1);
+                return;
+            }
+            goto idle;
+        }
+
+        builder = sh->builder;
+        if (builder != 0
+            && now - (time_t) sh->heartbeat < GRIDFS_FILTER_STALE_CLAIM) {
+            goto idle;
+        }
+
+        if (!ngx_atomic_cmp_set(&sh->builder, builder, (ngx_atomic_uint_t) ngx_pid)) {
+            goto idle;
+        }
+
+        sh->heartbeat = now;
+
+        if (ngx_http_gridfs_filter_start(filter, ev->log) != NGX_OK) {
+            sh->next_refresh = now + ngx_min(filter->gridfs_loc_conf->filter_refresh, 10);
+            sh->builder = 0;
+            goto idle;
+        }
+    }
+
+    if (sh->builder != (ngx_atomic_uint_t) ngx_pid || ngx_exiting) {
+        /* Claim went stale and was taken over, or we are shutting down. */
+        rc = NGX_DECLINED;
+    } else {
+        rc = ngx_http_gridfs_filter_step(filter, sh->bits[1 - sh->active]);
+        sh->heartbeat = now;
+
+        if (rc == NGX_AGAIN) {
+            ngx_add_timer(ev, 1);
+            return;
+        }
+    }
+
+    filter->building = 0;
+
+    if (rc == NGX_OK && ngx_http_gridfs_filter_can_catch_up(filter)) {
+        /* Keep reading from here */
+        sh->syncer = ngx_pid;
+    } else {
+        ngx_http_gridfs_filter_stop(filter);
+        if (rc == NGX_OK) {
+            sh->syncer = 0;
+        }
+    }
+
+    if (rc == NGX_DECLINED) {
+        goto idle;
+    }
+
+    if (rc == NGX_OK) {
+        sh->active = 1 - sh->active;
+        sh->synced = now;
+        ngx_memory_barrier();
+        sh->ready = 1;
+        sh->next_refresh = now + filter->gridfs_loc_conf->filter_refresh;
+        ngx_log_error(NGX_LOG_INFO, ev->log, 0,
+                      "gridfs key filter for \"%s\" rebuilt", filter->ns);
+    } else {
+        sh->next_refresh = now + ngx_min(filter->gridfs_loc_conf->filter_refresh, 10);
+        ngx_log_error(NGX_LOG_WARN, ev->log, 0,
+                      "gridfs key filter rebuild for \"%s\" failed", filter->ns);
+    }
+
+    ngx_memory_barrier();
+    sh->builder = 0;
+
+idle:
+    if (!ngx_exiting) {
+        ngx_add_timer(ev, GRIDFS_FILTER_IDLE_INTERVAL);
+    }
+}
+
+static char h_digit(char hex) {
+    return (hex >= '0' && hex <= '9') ? hex - '0': ngx_tolower(hex)-'a'+10;
+}
+
+static int htoi(char* h) {
+    char ok[] = "0123456789AaBbCcDdEeFf";
+
+    if (ngx_strchr(ok, h[0]) == NULL || ngx_strchr(ok,h[1]) == NULL) { return -1; }
+    return h_digit(h[0])*16 + h_digit(h[1]);
+}
+
+static int url_decode(char * filename) {
+    char * read = filename;
+    char * write = filename;
+    char hex[3];
+    int c;
+
+    hex[2] = '\0';
+    while (*read != '\0'){
+        if (*read == '%') {
+            hex[0] = *(++read);
+            if (hex[0] == '\0') return 0;
+            hex[1] = *(++read);
+            if (hex[1] == '\0') return 0;
             c = htoi(hex);
             if (c == -1) return 0;
             *write = (char)c;
         }
-        else *write = *read;
-        read++;
-        write++;
+        else *write = *read;
+        read++;
+        write++;
+    }
+    *write = '\0';
+    return 1;
+}
+
+/* Append a key to a query, converted to the configured type. */
+static void ngx_http_gridfs_append_key(bson* b, const char* name, ngx_uint_t type, const char* value) {
+    bson_oid_t oid;
+    int32_t n = 0;
+
+    switch (type) {
+    case BSON_OID:
+        bson_oid_from_string(&oid, value);
+        bson_append_oid(b, name, &oid);
+        break;
+    case BSON_INT:
+        (void) ngx_http_gridfs_key_int((u_char*) value, strlen(value), &n);
+        bson_append_int(b, name, n);
+        break;
+    case BSON_STRING:
+        bson_append_string(b, name, value);
+        break;
+    }
+}
+
+/* Whether a key can be stored as the configured type. */
+static ngx_uint_t ngx_http_gridfs_key_valid(ngx_uint_t type, char* key) {
+    size_t len = ngx_strlen(key);
+    int32_t n;
+    u_char* p;
+
+    if (len == 0 || len > GRIDFS_KEY_MAX_LEN) {
+        return FALSE;
+    }
+
+    for (p = (u_char*) key; *p; p++) {
+        if (*p < 0x20 || *p == 0x7f) {
+            return FALSE;
+        }
+        if (type == BSON_OID && ngx_hextoi(p, 1) == NGX_ERROR) {
+            return FALSE;
+        }
+    }
+
+    switch (type) {
+    case BSON_OID:
+        return len == 24;
+    case BSON_INT:
+        return ngx_http_gridfs_key_int((u_char*) key, len, &n) == NGX_OK;
+    }
+
+    return TRUE;
+}
+
+/* The lookup query for a key, from the location's template. Built in the
+ * pool and never finished by the driver: it mustn't be bson_destroy()ed. */
+static ngx_int_t ngx_http_gridfs_key_query(ngx_pool_t* pool, ngx_http_gridfs_loc_conf_t* gridfs_conf, const char* value, bson* query) {
+    bson_oid_t oid;
+    int32_t n = 0;
+    size_t len, size;
+    u_char *data, *p;
+
+    len = ngx_strlen(value);
+
+    switch (gridfs_conf->type) {
+    case BSON_OID:
+        size = 12;
+        break;
+    case BSON_INT:
+        size = 4;
+        break;
+    default:
+        size = 4 + len + 1;
+        break;
+    }
+    size += gridfs_conf->query_len + 1;
+
+    data = ngx_pnalloc(pool, size);
+    if (data == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(data, gridfs_conf->query, gridfs_conf->query_len);
+    ngx_http_mongo_put32(data, size);
+
+    switch (gridfs_conf->type) {
+    case BSON_OID:
+        bson_oid_from_string(&oid, value);
+        p = ngx_cpymem(p, oid.bytes, 12);
+        break;
+    case BSON_INT:
+        (void) ngx_http_gridfs_key_int((u_char*) value, len, &n);
+        ngx_http_mongo_put32(p, (uint32_t) n);
+        p += 4;
+        break;
+    default:
+        ngx_http_mongo_put32(p, len + 1);
+        p = ngx_cpymem(p + 4, value, len + 1);
+        break;
+    }
+    *p = '\0';
+
+    bson_init_finished_data(query, (char*) data);
+
+    return NGX_OK;
+}
+
+/* The key a request asks for: gridfs_key, or else the URI past the
+ * location, decoded in the request's pool. */
+static ngx_int_t ngx_http_gridfs_request_key(ngx_http_request_t* request, ngx_http_gridfs_loc_conf_t* gridfs_conf, char** value) {
+    ngx_http_core_loc_conf_t* core_conf;
+    ngx_str_t key;
+
+    if (gridfs_conf->key != NULL) {
+        if (ngx_http_complex_value(request, gridfs_conf->key, &key) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    } else {
+        core_conf = ngx_http_get_module_loc_conf(request, ngx_http_core_module);
+        if (request->uri.len < core_conf->name.len) {
+            ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                          "Invalid location name or uri.");
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        key.data = request->uri.data + core_conf->name.len;
+        key.len = request->uri.len - core_conf->name.len;
+    }
+
+    *value = ngx_pnalloc(request->pool, key.len + 1);
+    if (*value == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    *ngx_cpymem(*value, key.data, key.len) = '\0';
+
+    if (!url_decode(*value)) {
+        ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                      "Malformed request.");
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    return NGX_OK;
+}
+
+/* Whether a document field holds the key the query was built from. */
+static ngx_uint_t ngx_http_gridfs_key_matches(bson_iterator* it, ngx_uint_t type, const char* value) {
+    bson_oid_t oid;
+    int32_t n;
+
+    switch (type) {
+    case BSON_OID:
+        if (bson_iterator_type(it) != BSON_OID) {
+            return FALSE;
+        }
+        bson_oid_from_string(&oid, value);
+        return ngx_memcmp(oid.bytes, bson_iterator_oid(it)->bytes, 12) == 0;
+    case BSON_INT:
+        if (bson_iterator_type(it) != BSON_INT
+            && bson_iterator_type(it) != BSON_LONG
+            && bson_iterator_type(it) != BSON_DOUBLE) {
+            return FALSE;
+        }
+        return ngx_http_gridfs_key_int((u_char*) value, strlen(value), &n) == NGX_OK
+               && bson_iterator_long(it) == n;
+    case BSON_STRING:
+        if (bson_iterator_type(it) != BSON_STRING) {
+            return FALSE;
+        }
+        return ngx_strcmp(bson_iterator_string(it), value) == 0;
+    }
+
+    return FALSE;
+}
+
+/* The key held by a document field, as text the request could have sent. */
+static char* ngx_http_gridfs_key_text(ngx_pool_t* pool, bson_iterator* it, ngx_uint_t type) {
+    u_char *p;
+
+    switch (type) {
+    case BSON_OID:
+        if (bson_iterator_type(it) != BSON_OID) {
+            return NULL;
+        }
+        p = ngx_pnalloc(pool, 25);
+        if (p != NULL) {
+            bson_oid_to_string(bson_iterator_oid(it), (char*)p);
+        }
+        return (char*)p;
+    case BSON_INT:
+        if (bson_iterator_type(it) != BSON_INT && bson_iterator_type(it) != BSON_LONG) {
+            return NULL;
+        }
+        p = ngx_pnalloc(pool, NGX_INT64_LEN + 1);
+        if (p != NULL) {
+            ngx_sprintf(p, "%L%Z", (int64_t) bson_iterator_long(it));
+        }
+        return (char*)p;
+    case BSON_STRING:
+        if (bson_iterator_type(it) != BSON_STRING) {
+            return NULL;
+        }
+        p = ngx_pnalloc(pool, bson_iterator_string_len(it));
+        if (p != NULL) {
+            ngx_memcpy(p, bson_iterator_string(it), bson_iterator_string_len(it));
+        }
+        return (char*)p;
+    }
+
+    return NULL;
+}
+
+static gridfs_offset ngx_http_gridfs_doc_length(bson* doc) {
+    bson_iterator it;
+
+    switch (bson_find(&it, doc, "length")) {
+    case BSON_INT:
+    case BSON_LONG:
+    case BSON_DOUBLE:
+        return (gridfs_offset) bson_iterator_long(&it);
+    default:
+        return 0;
+    }
+}
+
+// ---------- CACHE ---------- //
+
+/* With 'gridfs_cache' the files document found for a key is kept in a shared
+ * zone, so later requests skip the lookup. Files of up to max_size are kept
+ * with their body, all the chunks in one document { "0": data, "1": data,
+ * ... }, and are served without asking mongod at all. gridfs_warmup fills the
+ * cache from a list of keys or the top files when the workers start. */
+
+/* Fetch every chunk of a small file in one query. */
+static ngx_int_t ngx_http_gridfs_fetch_body(mongo* conn, const char* chunks_ns, bson* meta, bson* body) {
+    bson_iterator it;
+    bson query;
+    mongo_cursor* cursor;
+    gridfs_offset length;
+    ngx_uint_t n, numchunks;
+    int chunk_size;
+    char name[NGX_INT_T_LEN + 1];
+
+    if (bson_find(&it, meta, "chunkSize") == BSON_EOO) {
+        return NGX_ERROR;
+    }
+    chunk_size = bson_iterator_int(&it);
+    if (chunk_size <= 0 || bson_find(&it, meta, "_id") == BSON_EOO) {
+        return NGX_ERROR;
+    }
+
+    length = ngx_http_gridfs_doc_length(meta);
+    numchunks = (length + chunk_size - 1) / chunk_size;
+
+    bson_init(body);
+
+    if (numchunks) {
+        bson_init(&query);
+        bson_append_start_object(&query, "$query");
+        bson_append_element(&query, "files_id", &it);
+        bson_append_finish_object(&query);
+        bson_append_start_object(&query, "$orderby");
+        bson_append_int(&query, "n", 1);
+        bson_append_finish_object(&query);
+        bson_finish(&query);
+
+        mongo_clear_errors(conn);
+        cursor = mongo_find(conn, chunks_ns, &query, NULL, numchunks, 0, 0);
+        bson_destroy(&query);
+        if (cursor == NULL) {
+            bson_destroy(body);
+            return NGX_ERROR;
+        }
+
+        n = 0;
+        while (n < numchunks && mongo_cursor_next(cursor) == MONGO_OK) {
+            if (bson_find(&it, &cursor->current, "data") != BSON_BINDATA) {
+                break;
+            }
+            *ngx_sprintf((u_char*) name, "%ui", n) = '\0';
+            bson_append_binary(body, name, bson_iterator_bin_type(&it),
+                               bson_iterator_bin_data(&it), bson_iterator_bin_len(&it));
+            n++;
+        }
+        mongo_cursor_destroy(cursor);
+
+        if (n != numchunks) {
+            bson_destroy(body);
+            return NGX_ERROR;
+        }
+    }
+
+    bson_finish(body);
+
+    return NGX_OK;
+}
+
+/* Find chunk n of a cached body. */
+static ngx_int_t ngx_http_gridfs_body_chunk(bson* body, ngx_uint_t n, bson_iterator* it) {
+    char name[NGX_INT_T_LEN + 1];
+
+    *ngx_sprintf((u_char*) name, "%ui", n) = '\0';
+
+    return bson_find(it, body, name) == BSON_BINDATA ? NGX_OK : NGX_ERROR;
+}
+
+/* Cache the file a request just found. The body of a small file is fetched
+ * along, then served from memory. */
+static void ngx_http_gridfs_cache_fill(ngx_http_request_t* request, ngx_http_gridfs_ctx_t* ctx, ngx_str_t* key) {
+    ngx_http_gridfs_loc_conf_t* gridfs_conf;
+    gridfs_offset length;
+    bson* body = NULL;
+    uint64_t start, usec;
+
+    gridfs_conf = ngx_http_get_module_loc_conf(request, ngx_http_gridfs_module);
+    length = gridfile_get_contentlength(&ctx->gfile);
+
+    if (request->method == NGX_HTTP_GET && length <= gridfs_conf->cache_max_size) {
+        body = ngx_palloc(request->pool, sizeof(bson));
+        if (body == NULL) {
+            return;
+        }
+
+        start = ngx_http_gridfs_usec();
+        if (ngx_http_gridfs_fetch_body(&ctx->mongo_conn->conn, ctx->gfs.chunks_ns,
+                                       ctx->gfile.meta, body) == NGX_OK) {
+            usec = ngx_http_gridfs_usec() - start;
+            ngx_http_gridfs_trace(request, ctx->mongo_conn, "body", ctx->gfs.chunks_ns, -1,
+                                  usec, bson_size(body));
+            ngx_http_gridfs_observe(request, GRIDFS_STAT(chunk_fetch), usec);
+            ngx_http_gridfs_count(request, GRIDFS_STAT(chunks),
+                                  gridfile_get_numchunks(&ctx->gfile));
+            ngx_http_gridfs_count(request, GRIDFS_STAT(bytes), length);
+            ctx->body = body;
+            ctx->body_owned = 1;
+        } else {
+            /* The chunks are fetched one by one, retrying as usual */
+            ngx_http_gridfs_trace(request, ctx->mongo_conn, "body", ctx->gfs.chunks_ns, -1,
+                                  ngx_http_gridfs_usec() - start, 0);
+            body = NULL;
+        }
+    }
+
+    ngx_http_gridfs_cache_store(gridfs_conf, key, ctx->gfile.meta, body);
+}
+
+/* Whether two files documents describe the same content. */
+static ngx_uint_t ngx_http_gridfs_same_version(bson* a, bson* b) {
+    bson_iterator ia, ib;
+    bson_type ta, tb;
+
+    ta = bson_find(&ia, a, "uploadDate");
+    tb = bson_find(&ib, b, "uploadDate");
+    if (ta != tb || (ta == BSON_DATE && bson_iterator_date(&ia) != bson_iterator_date(&ib))) {
+        return FALSE;
+    }
+
+    ta = bson_find(&ia, a, "md5");
+    tb = bson_find(&ib, b, "md5");
+    if (ta != tb
+        || (ta == BSON_STRING && ngx_strcmp(bson_iterator_string(&ia), bson_iterator_string(&ib)) != 0)) {
+        return FALSE;
+    }
+
+    return ngx_http_gridfs_doc_length(a) == ngx_http_gridfs_doc_length(b);
+}
+
+/* Revalidate a stale entry in the background, once the request that found
+ * it has been answered. */
+static void ngx_http_gridfs_refresh_start(ngx_http_request_t* request, ngx_str_t* key, char* value) {
+    ngx_http_gridfs_refresh_t* refresh;
+    size_t len;
+
+    len = ngx_strlen(value) + 1;
+
+    refresh = ngx_alloc(sizeof(ngx_http_gridfs_refresh_t) + key->len + len,
+                        request->connection->log);
+    if (refresh == NULL) {
+        return;
+    }
+    ngx_memzero(refresh, sizeof(ngx_http_gridfs_refresh_t));
+
+    refresh->gridfs_loc_conf = ngx_http_get_module_loc_conf(request, ngx_http_gridfs_module);
+    refresh->key.data = (u_char*) refresh + sizeof(ngx_http_gridfs_refresh_t);
+    refresh->key.len = key->len;
+    ngx_memcpy(refresh->key.data, key->data, key->len);
+    refresh->value = (char*) refresh->key.data + key->len;
+    ngx_memcpy(refresh->value, value, len);
+
+    refresh->event.handler = ngx_http_gridfs_refresh_handler;
+    refresh->event.data = refresh;
+    refresh->event.log = ngx_cycle->log;
+    refresh->event.cancelable = 1;
+    ngx_add_timer(&refresh->event, 1);
+}
+
+/* Look the file up again: an unchanged file is kept for another
+ * cache_valid, a changed one is cached anew and a deleted one dropped. */
+static ngx_int_t ngx_http_gridfs_revalidate(ngx_http_gridfs_refresh_t* refresh, mongo* conn, ngx_pool_t* pool) {
+    ngx_http_gridfs_loc_conf_t* gridfs_conf = refresh->gridfs_loc_conf;
+    bson query, meta, cached, body;
+    bson* cached_body;
+    char *files_ns, *chunks_ns;
+    ngx_int_t rc;
+    int status;
+
+    files_ns = ngx_pnalloc(pool, gridfs_conf->db.len + gridfs_conf->root_collection.len
+                                 + sizeof("..files"));
+    chunks_ns = ngx_pnalloc(pool, gridfs_conf->db.len + gridfs_conf->root_collection.len
+                                  + sizeof("..chunks"));
+    if (files_ns == NULL || chunks_ns == NULL) {
+        return NGX_ERROR;
+    }
+    ngx_sprintf((u_char*) files_ns, "%V.%V.files%Z",
+                &gridfs_conf->db, &gridfs_conf->root_collection);
+    ngx_sprintf((u_char*) chunks_ns, "%V.%V.chunks%Z",
+                &gridfs_conf->db, &gridfs_conf->root_collection);
+
+    if (ngx_http_gridfs_key_query(pool, gridfs_conf, refresh->value, &query) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    mongo_clear_errors(conn);
+    status = mongo_find_one(conn, files_ns, &query, NULL, &meta);
+
+    if (status != MONGO_OK) {
+        if (conn->err != MONGO_CONN_SUCCESS) {
+            return NGX_ERROR;
+        }
+        ngx_http_gridfs_miss_delete(gridfs_conf->cache_zone->data, &refresh->key);
+        return NGX_OK;
+    }
+
+    rc = ngx_http_gridfs_cache_lookup(pool, gridfs_conf, &refresh->key, &cached,
+                                      &cached_body, NULL);
+
+    if ((rc == NGX_OK || rc == NGX_AGAIN) && ngx_http_gridfs_same_version(&meta, &cached)) {
+        ngx_http_gridfs_cache_touch(gridfs_conf, &refresh->key);
+
+    } else if (ngx_http_gridfs_doc_length(&meta) > gridfs_conf->cache_max_size) {
+        ngx_http_gridfs_cache_store(gridfs_conf, &refresh->key, &meta, NULL);
+
+    } else if (ngx_http_gridfs_fetch_body(conn, chunks_ns, &meta, &body) == NGX_OK) {
+        ngx_http_gridfs_cache_store(gridfs_conf, &refresh->key, &meta, &body);
+        bson_destroy(&body);
+
+    } else if (conn->err != MONGO_CONN_SUCCESS) {
+        bson_destroy(&meta);
+        return NGX_ERROR;
+    }
+
+    bson_destroy(&meta);
+
+    return NGX_OK;
+}
+
+/* Run a refresh. It is skipped while the connection is down: reconnecting
+ * blocks, and would hold up every request on the worker. Requests that go
+ * to mongod bring the connection back. A refresh that fails or is skipped
+ * leaves the entry stale, and claimed until GRIDFS_CACHE_UPDATING passes. */
+static void ngx_http_gridfs_refresh_handler(ngx_event_t* ev) {
+    ngx_http_gridfs_refresh_t* refresh = ev->data;
+    ngx_http_gridfs_loc_conf_t* gridfs_conf = refresh->gridfs_loc_conf;
+    ngx_http_mongo_connection_t* mongo_conn;
+    ngx_pool_t* pool;
+    ngx_int_t rc = NGX_ERROR;
+
+    mongo_conn = gridfs_conf->mongo_conn;
+
+    if (mongo_conn != NULL && !mongo_conn->connecting && mongo_conn->conn.connected) {
+        pool = ngx_create_pool(1024, ev->log);
+        if (pool != NULL) {
+            rc = ngx_http_gridfs_revalidate(refresh, &mongo_conn->conn, pool);
+            ngx_destroy_pool(pool);
+        }
+    }
+
+    if (rc != NGX_OK) {
+        ngx_log_error(NGX_LOG_INFO, ev->log, 0,
+                      "gridfs_cache refresh of \"%V\" failed, serving it stale",
+                      &refresh->key);
+    }
+
+    ngx_free(refresh);
+}
+
+/* Cache a file for gridfs_warmup, unless it already is. Returns NGX_ERROR
+ * only when mongod went away. */
+static ngx_int_t ngx_http_gridfs_warm(ngx_http_gridfs_warmup_t* warmup, mongo* conn, ngx_pool_t* pool, char* value, bson* meta) {
+    ngx_http_gridfs_loc_conf_t* gridfs_conf = warmup->gridfs_loc_conf;
+    ngx_str_t key, cache_key;
+    bson body;
+
+    key.data = (u_char*) value;
+    key.len = ngx_strlen(value);
+
+    if (ngx_http_gridfs_miss_key(pool, gridfs_conf, &key, &cache_key) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_gridfs_cache_lookup(NULL, gridfs_conf, &cache_key, NULL, NULL, NULL) == NGX_OK) {
+        return NGX_OK;
+    }
+
+    if (ngx_http_gridfs_doc_length(meta) > gridfs_conf->cache_max_size) {
+        ngx_http_gridfs_cache_store(gridfs_conf, &cache_key, meta, NULL);
+        warmup->warmed++;
+        return NGX_OK;
+    }
+
+    if (ngx_http_gridfs_fetch_body(conn, warmup->chunks_ns, meta, &body) != NGX_OK) {
+        /* A file with chunks missing is left to the requests */
+        return conn->err == MONGO_CONN_SUCCESS ? NGX_OK : NGX_ERROR;
+    }
+
+    ngx_http_gridfs_cache_store(gridfs_conf, &cache_key, meta, &body);
+    bson_destroy(&body);
+    warmup->warmed++;
+
+    return NGX_OK;
+}
+
+/* Read the key file, or open a cursor over the top files. */
+static ngx_int_t ngx_http_gridfs_warmup_start(ngx_http_gridfs_warmup_t* warmup, mongo* conn, ngx_log_t* log) {
+    ngx_http_gridfs_loc_conf_t* gridfs_conf = warmup->gridfs_loc_conf;
+    ngx_file_info_t fi;
+    ngx_fd_t fd;
+    ssize_t n;
+    off_t size;
+    bson query;
+
+    warmup->files_ns = ngx_alloc(gridfs_conf->db.len + gridfs_conf->root_collection.len
+                                 + sizeof("..files"), log);
+    warmup->chunks_ns = ngx_alloc(gridfs_conf->db.len + gridfs_conf->root_collection.len
+                                  + sizeof("..chunks"), log);
+    if (warmup->files_ns == NULL || warmup->chunks_ns == NULL) {
+        return NGX_ERROR;
+    }
+    ngx_sprintf((u_char*) warmup->files_ns, "%V.%V.files%Z",
+                &gridfs_conf->db, &gridfs_conf->root_collection);
+    ngx_sprintf((u_char*) warmup->chunks_ns, "%V.%V.chunks%Z",
+                &gridfs_conf->db, &gridfs_conf->root_collection);
+
+    if (gridfs_conf->warmup_top) {
+        bson_init(&query);
+        bson_append_start_object(&query, "$query");
+        bson_append_finish_object(&query);
+        bson_append_start_object(&query, "$orderby");
+        bson_append_int(&query, (char*) gridfs_conf->warmup_sort.data, -1);
+        bson_append_finish_object(&query);
+        bson_finish(&query);
+
+        mongo_clear_errors(conn);
+        warmup->cursor = mongo_find(conn, warmup->files_ns, &query, NULL,
+                                    gridfs_conf->warmup_top, 0, 0);
+        bson_destroy(&query);
+
+        return warmup->cursor != NULL ? NGX_OK : NGX_ERROR;
+    }
+
+    fd = ngx_open_file(gridfs_conf->warmup_file.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                      ngx_open_file_n " \"%V\" failed", &gridfs_conf->warmup_file);
+        return NGX_ERROR;
+    }
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                      ngx_fd_info_n " \"%V\" failed", &gridfs_conf->warmup_file);
+        ngx_close_file(fd);
+        return NGX_ERROR;
+    }
+
+    size = ngx_file_size(&fi);
+    if (size > GRIDFS_WARMUP_MAX_FILE) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "gridfs_warmup file \"%V\" is too large", &gridfs_conf->warmup_file);
+        ngx_close_file(fd);
+        return NGX_ERROR;
+    }
+
+    warmup->keys = ngx_alloc(size + 1, log);
+    if (warmup->keys == NULL) {
+        ngx_close_file(fd);
+        return NGX_ERROR;
+    }
+
+    n = ngx_read_fd(fd, warmup->keys, size);
+    ngx_close_file(fd);
+
+    if (n != size) {
+        ngx_log_error(NGX_LOG_ERR, log, n == -1 ? ngx_errno : 0,
+                      ngx_read_fd_n " \"%V\" failed", &gridfs_conf->warmup_file);
+        return NGX_ERROR;
+    }
+
+    warmup->pos = warmup->keys;
+    warmup->last = warmup->keys + size;
+
+    return NGX_OK;
+}
+
+/* Warm the next file. Returns NGX_AGAIN while there are more. */
+static ngx_int_t ngx_http_gridfs_warmup_step(ngx_http_gridfs_warmup_t* warmup, mongo* conn, ngx_log_t* log) {
+    ngx_http_gridfs_loc_conf_t* gridfs_conf = warmup->gridfs_loc_conf;
+    ngx_pool_t* pool;
+    bson_iterator it;
+    bson query, meta;
+    u_char *p, *end;
+    char* value;
+    ngx_int_t rc = NGX_AGAIN;
+    int status;
+
+    pool = ngx_create_pool(1024, log);
+    if (pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (warmup->cursor != NULL) {
+        if (mongo_cursor_next(warmup->cursor) != MONGO_OK) {
+            rc = (warmup->cursor->err == MONGO_CURSOR_EXHAUSTED) ? NGX_OK : NGX_ERROR;
+        } else if (bson_find(&it, &warmup->cursor->current, (char*) gridfs_conf->field.data)
+                   != BSON_EOO
+                   && (value = ngx_http_gridfs_key_text(pool, &it, gridfs_conf->type)) != NULL
+                   && ngx_http_gridfs_warm(warmup, conn, pool, value,
+                                           &warmup->cursor->current) == NGX_ERROR) {
+            rc = NGX_ERROR;
+        }
+        ngx_destroy_pool(pool);
+        return rc;
+    }
+
+    /* One key per line; blank lines and # comments are skipped */
+    for ( ;; ) {
+        if (warmup->pos >= warmup->last) {
+            ngx_destroy_pool(pool);
+            return NGX_OK;
+        }
+
+        p = warmup->pos;
+        end = ngx_strlchr(p, warmup->last, '\n');
+        if (end == NULL) {
+            end = warmup->last;
+        }
+        warmup->pos = end + 1;
+
+        while (end > p && (end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t')) {
+            end--;
+        }
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        if (p < end && *p != '#' && end - p <= GRIDFS_KEY_MAX_LEN) {
+            break;
+        }
+    }
+
+    value = ngx_pnalloc(pool, end - p + 1);
+    if (value == NULL) {
+        ngx_destroy_pool(pool);
+        return NGX_ERROR;
+    }
+    *ngx_cpymem(value, p, end - p) = '\0';
+
+    if (!ngx_http_gridfs_key_valid(gridfs_conf->type, value)) {
+        ngx_destroy_pool(pool);
+        return NGX_AGAIN;
+    }
+
+    if (ngx_http_gridfs_key_query(pool, gridfs_conf, value, &query) != NGX_OK) {
+        ngx_destroy_pool(pool);
+        return NGX_ERROR;
+    }
+
+    mongo_clear_errors(conn);
+    status = mongo_find_one(conn, warmup->files_ns, &query, NULL, &meta);
+
+    if (status == MONGO_OK) {
+        if (ngx_http_gridfs_warm(warmup, conn, pool, value, &meta) == NGX_ERROR) {
+            rc = NGX_ERROR;
+        }
+        bson_destroy(&meta);
+    } else if (conn->err != MONGO_CONN_SUCCESS) {
+        rc = NGX_ERROR;
+    }
+
+    ngx_destroy_pool(pool);
+
+    return rc;
+}
+
+static void ngx_http_gridfs_warmup_done(ngx_http_gridfs_warmup_t* warmup) {
+    if (warmup->cursor != NULL) {
+        mongo_cursor_destroy(warmup->cursor);
+        warmup->cursor = NULL;
+    }
+    if (warmup->keys != NULL) {
+        ngx_free(warmup->keys);
+        warmup->keys = NULL;
+    }
+}
+
+/* One file per tick, at the configured rate, so that the warmup doesn't
+ * hold up the requests the worker is already serving. Like the key filter,
+ * it waits for the connection rather than reconnecting. */
+static void ngx_http_gridfs_warmup_handler(ngx_event_t* ev) {
+    ngx_http_gridfs_warmup_t* warmup = ev->data;
+    ngx_http_gridfs_loc_conf_t* gridfs_conf = warmup->gridfs_loc_conf;
+    ngx_http_mongo_connection_t* mongo_conn;
+    ngx_int_t rc;
+
+    if (ngx_exiting) {
+        ngx_http_gridfs_warmup_done(warmup);
+        return;
+    }
+
+    mongo_conn = gridfs_conf->mongo_conn;
+    if (mongo_conn == NULL || mongo_conn->connecting || mongo_conn->conn.connected == 0) {
+        ngx_add_timer(ev, GRIDFS_WARMUP_WAIT);
+        return;
+    }
+
+    if (!warmup->started) {
+        warmup->started = 1;
+        if (ngx_http_gridfs_warmup_start(warmup, &mongo_conn->conn, ev->log) != NGX_OK) {
+            ngx_log_error(NGX_LOG_WARN, ev->log, 0,
+                          "gridfs_warmup of \"%V\" could not start", &gridfs_conf->name);
+            ngx_http_gridfs_warmup_done(warmup);
+            return;
+        }
+    }
+
+    rc = ngx_http_gridfs_warmup_step(warmup, &mongo_conn->conn, ev->log);
+
+    if (rc == NGX_AGAIN) {
+        ngx_add_timer(ev, 1000 / gridfs_conf->warmup_rate);
+        return;
+    }
+
+    if (rc == NGX_OK) {
+        ngx_log_error(NGX_LOG_NOTICE, ev->log, 0,
+                      "gridfs_warmup of \"%V\" done, %ui files cached",
+                      &gridfs_conf->name, warmup->warmed);
+    } else {
+        ngx_log_error(NGX_LOG_WARN, ev->log, 0,
+                      "gridfs_warmup of \"%V\" stopped after %ui files, mongo: \"%V\"",
+                      &gridfs_conf->name, warmup->warmed, &gridfs_conf->mongo);
+    }
+
+    ngx_http_gridfs_warmup_done(warmup);
+}
+
+/* Whether the Accept-Encoding header allows the given content coding. */
+static ngx_uint_t ngx_http_gridfs_accepts(ngx_http_request_t* r, ngx_str_t* coding) {
+#if (NGX_HTTP_GZIP || NGX_HTTP_HEADERS)
+    u_char *p, *last, *start, *end;
+    ngx_uint_t q, star;
+
+    if (r->headers_in.accept_encoding == NULL) {
+        return FALSE;
+    }
+
+    p = r->headers_in.accept_encoding->value.data;
+    last = p + r->headers_in.accept_encoding->value.len;
+    star = FALSE;
+
+    while (p < last) {
+        while (p < last && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+
+        start = p;
+        while (p < last && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') {
+            p++;
+        }
+        end = p;
+
+        /* Any q-value made of zeroes ("0", "0.0", "0.000") disables it. */
+        q = TRUE;
+        while (p < last && *p != ',') {
+            if ((*p == 'q' || *p == 'Q') && p + 1 < last && p[1] == '=') {
+                p += 2;
+                q = FALSE;
+                while (p < last && ((*p >= '0' && *p <= '9') || *p == '.')) {
+                    if (*p >= '1' && *p <= '9') {
+                        q = TRUE;
+                    }
+                    p++;
+                }
+                continue;
+            }
+            p++;
+        }
+
+        if ((size_t) (end - start) == coding->len
+            && ngx_strncasecmp(start, coding->data, coding->len) == 0) {
+            return q;
+        }
+
+        if (end - start == 1 && *start == '*') {
+            star = q;
+        }
+    }
+
+    return star;
+#else
+    return FALSE;
+#endif
+}
+
+/* Whether a variant is known not to exist, by the location's negative
+ * caches. They hold the variants' own keys, like any other key. */
+static ngx_uint_t ngx_http_gridfs_variant_absent(ngx_http_request_t* request, ngx_http_gridfs_loc_conf_t* gridfs_conf, ngx_http_gridfs_variant_t* v) {
+    ngx_str_t key;
+
+    key.data = (u_char*) v->key;
+    key.len = ngx_strlen(v->key);
+
+    if (gridfs_conf->miss_zone) {
+        if (ngx_http_gridfs_miss_key(request->pool, gridfs_conf, &key, &v->miss_key) != NGX_OK) {
+            v->miss_key.len = 0;
+        } else if (ngx_http_gridfs_miss_lookup(gridfs_conf, &v->miss_key) == NGX_OK) {
+            return TRUE;
+        }
+    }
+
+    return gridfs_conf->filter_zone
+           && ngx_http_gridfs_filter_test(gridfs_conf, &key) == NGX_DECLINED;
+}
+
+/* Look up the given variants with a single $in query on fs.files, then
+ * update the negative caches with what was and wasn't found. */
+static void ngx_http_gridfs_variant_query(ngx_http_request_t* request, gridfs* gfs, ngx_http_gridfs_loc_conf_t* gridfs_conf, ngx_http_gridfs_variant_t* variants, ngx_uint_t first, ngx_uint_t last) {
+    mongo_cursor *cursor;
+    bson_iterator it;
+    bson query;
+    ngx_str_t key;
+    ngx_uint_t i, n;
+    char index[NGX_INT_T_LEN + 1];
+
+    for (i = first; i < last; i++) {
+        variants[i].absent = ngx_http_gridfs_variant_absent(request, gridfs_conf, &variants[i]);
+    }
+
+    bson_init(&query);
+    bson_append_start_object(&query, (char*)gridfs_conf->field.data);
+    bson_append_start_array(&query, "$in");
+    for (i = first, n = 0; i < last; i++) {
+        if (variants[i].absent) {
+            continue;
+        }
+        ngx_sprintf((u_char*)index, "%ui%Z", n++);
+        ngx_http_gridfs_append_key(&query, index, gridfs_conf->type, variants[i].key);
+    }
+    bson_append_finish_array(&query);
+    bson_append_finish_object(&query);
+    bson_finish(&query);
+
+    if (n == 0) {
+        bson_destroy(&query);
+        return;
+    }
+
+    cursor = mongo_find(gfs->client, gfs->files_ns, &query, NULL, 0, 0, 0);
+    if (cursor == NULL) {
+        bson_destroy(&query);
+        return;
+    }
+
+    while (mongo_cursor_next(cursor) == MONGO_OK) {
+        if (bson_find(&it, &cursor->current, (char*)gridfs_conf->field.data) == BSON_EOO) {
+            continue;
+        }
+        for (i = first; i < last; i++) {
+            if (!variants[i].found && !variants[i].absent
+                && ngx_http_gridfs_key_matches(&it, gridfs_conf->type, variants[i].key)) {
+                bson_copy(&variants[i].doc, &cursor->current);
+                variants[i].found = TRUE;
+                break;
+            }
+        }
+    }
+
+    /* Only remember misses the server actually answered. */
+    for (i = first; i < last; i++) {
+        if (variants[i].absent) {
+            continue;
+        }
+        if (variants[i].found) {
+            if (gridfs_conf->filter_zone) {
+                key.data = (u_char*) variants[i].key;
+                key.len = ngx_strlen(variants[i].key);
+                ngx_http_gridfs_filter_add(gridfs_conf, &key);
+            }
+        } else if (gridfs_conf->miss_zone && variants[i].miss_key.len
+                   && cursor->err == MONGO_CURSOR_EXHAUSTED
+                   && gfs->client->err == MONGO_CONN_SUCCESS) {
+            ngx_http_gridfs_miss_add(gridfs_conf, &variants[i].miss_key);
+        }
+    }
+
+    mongo_cursor_destroy(cursor);
+    bson_destroy(&query);
+}
+
+/* Find the smallest stored representation of the file that the client
+ * accepts: the file itself, its ".br"/".zst"/".gz" siblings (string keys
+ * only) or the files named in its "variants" field, e.g.
+ * { variants: { br: "style.css.br", gzip: "style.css.gz" } }. */
+static int ngx_http_gridfs_find_variant(ngx_http_request_t* request, ngx_http_gridfs_loc_conf_t* gridfs_conf, gridfs* gfs, char* value, gridfile* gfile, ngx_str_t** encoding, ngx_str_t* content_type) {
+    ngx_http_gridfs_variant_t variants[GRIDFS_MAX_VARIANTS];
+    ngx_http_gridfs_variant_t *v, *best;
+    bson_iterator it, sub;
+    ngx_uint_t n, first, i;
+    size_t len;
+
+    ngx_memzero(variants, sizeof(variants));
+    n = 0;
+
+    v = &variants[n++];
+    v->key = value;
+
+    if (gridfs_conf->type == BSON_STRING) {
+        len = strlen(value);
+        for (i = 0; ngx_http_gridfs_encodings[i].len; i++) {
+            if (!ngx_http_gridfs_accepts(request, &ngx_http_gridfs_encodings[i])) {
+                continue;
+            }
+            v = &variants[n++];
+            v->encoding = &ngx_http_gridfs_encodings[i];
+            v->key = ngx_pnalloc(request->pool, len + ngx_http_gridfs_encoding_exts[i].len + 1);
+            if (v->key == NULL) {
+                return MONGO_ERROR;
+            }
+            ngx_sprintf((u_char*)v->key, "%s%V%Z", value, &ngx_http_gridfs_encoding_exts[i]);
+        }
+    }
+
+    ngx_http_gridfs_variant_query(request, gfs, gridfs_conf, variants, 0, n);
+
+    if (variants[0].found && bson_find(&it, &variants[0].doc, "variants") == BSON_OBJECT) {
+        first = n;
+        bson_iterator_subiterator(&it, &sub);
+        while (bson_iterator_next(&sub) != BSON_EOO && n < GRIDFS_MAX_VARIANTS) {
+            for (i = 0; ngx_http_gridfs_encodings[i].len; i++) {
+                if (ngx_strcmp(bson_iterator_key(&sub), ngx_http_gridfs_encodings[i].data) == 0) {
+                    break;
+                }
+            }
+            if (ngx_http_gridfs_encodings[i].len == 0
+                || !ngx_http_gridfs_accepts(request, &ngx_http_gridfs_encodings[i])) {
+                continue;
+            }
+            v = &variants[n];
+            v->key = ngx_http_gridfs_key_text(request->pool, &sub, gridfs_conf->type);
+            if (v->key == NULL) {
+                continue;
+            }
+            v->encoding = &ngx_http_gridfs_encodings[i];
+            n++;
+        }
+        if (n > first) {
+            ngx_http_gridfs_variant_query(request, gfs, gridfs_conf, variants, first, n);
+        }
+    }
+
+    best = NULL;
+    for (i = 0; i < n; i++) {
+        if (variants[i].found
+            && (best == NULL
+                || ngx_http_gridfs_doc_length(&variants[i].doc)
+                   < ngx_http_gridfs_doc_length(&best->doc))) {
+            best = &variants[i];
+        }
+    }
+
+    /* Encoded siblings carry their own content type (application/gzip and
+     * the like); the original's is the one to send. */
+    content_type->len = 0;
+    if (best != NULL && best->encoding != NULL && variants[0].found
+        && bson_find(&it, &variants[0].doc, "contentType") == BSON_STRING) {
+        content_type->len = bson_iterator_string_len(&it) - 1;
+        content_type->data = ngx_pnalloc(request->pool, content_type->len);
+        if (content_type->data == NULL) {
+            best = NULL;
+        } else {
+            ngx_memcpy(content_type->data, bson_iterator_string(&it), content_type->len);
+        }
+    }
+
+    if (best != NULL) {
+        gridfile_init(gfs, &best->doc, gfile);
+        *encoding = best->encoding;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (variants[i].found) {
+            bson_destroy(&variants[i].doc);
+        }
+    }
+
+    return best ? MONGO_OK : MONGO_ERROR;
+}
+
+static void gridfs_parse_range(ngx_http_request_t* r, ngx_str_t* range_str, uint64_t* range_start, uint64_t* range_end, gridfs_offset content_length) {
+    u_char *p, *last;
+    off_t start, end;
+    ngx_uint_t bad;
+    enum {
+        sw_start = 0,
+        sw_first_byte_pos,
+        sw_first_byte_pos_n,
+        sw_last_byte_pos,
+        sw_last_byte_pos_n,
+        sw_done
+    } state = 0;
+
+    p = (u_char *) ngx_strnstr(range_str->data, "bytes=", range_str->len);
+
+    if (p == NULL) {
+        return;
+    }
+
+    p += sizeof("bytes=") - 1;
+    last = range_str->data + range_str->len;
+
+    /*
+     * bytes= contain ranges compatible with RFC 2616, "14.35.1 Byte Ranges",
+     * but no whitespaces permitted
+     */
+
+    bad = 0;
+    start = 0;
+    end = 0;
+
+    while (p < last) {
+
+        switch (state) {
+
+        case sw_start:
+        case sw_first_byte_pos:
+            if (*p == '-') {
+                p++;
+                state = sw_last_byte_pos;
+                break;
+            }
+            start = 0;
+            state = sw_first_byte_pos_n;
+
+            /* fall through */
+
+        case sw_first_byte_pos_n:
+            if (*p == '-') {
+                p++;
+                state = sw_last_byte_pos;
+                break;
+            }
+            if (*p < '0' || *p > '9') {
+                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                               "bytes header filter: unexpected char '%c'"
+                               " (expected first-byte-pos)", *p);
+                bad = 1;
+                break;
+            }
+            start = start * 10 + *p - '0';
+            p++;
+            break;
+
+        case sw_last_byte_pos:
+            if (*p == ',' || *p == '&' || *p == ';') {
+                /* no last byte pos, assume end of file */
+                end = content_length - 1;
+                state = sw_done;
+                break;
+            }
+            end = 0;
+            state = sw_last_byte_pos_n;
+
+            /* fall though */
+
+        case sw_last_byte_pos_n:
+            if (*p == ',' || *p == '&' || *p == ';') {
+                state = sw_done;
+                break;
+            }
+            if (*p < '0' || *p > '9') {
+                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                               "bytes header filter: unexpected char '%c'"
+                               " (expected last-byte-pos)", *p);
+                bad = 1;
+                break;
+            }
+            end = end * 10 + *p - '0';
+            p++;
+            break;
+
+        case sw_done:
+            *range_start = start;
+            *range_end = end;
+
+            break;
+        }
+
+        if (bad) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "bytes header filter: invalid range specification");
+            return;
+        }
+    }
+
+    switch (state) {
+
+    case sw_last_byte_pos:
+        end = content_length - 1;
+
+    case sw_last_byte_pos_n:
+        if (start > end) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "bytes header filter: invalid range specification");
+            return;
+        }
+
+        *range_start = start;
+        *range_end = end;
+        break;
+
+    default:
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "bytes header filter: invalid range specification");
+        return;
+
+    }
+}
+
+/* Pass output down the filter chain, between the output probes. */
+static ngx_int_t ngx_http_gridfs_output_filter(ngx_http_request_t* request, ngx_chain_t* in) {
+#if (NGX_HTTP_GRIDFS_SDT)
+    ngx_chain_t* cl;
+    off_t size;
+    ngx_int_t rc;
+
+    if (!GRIDFS_PROBE_ENABLED(output__start) && !GRIDFS_PROBE_ENABLED(output__done)) {
+        return ngx_http_output_filter(request, in);
+    }
+
+    size = 0;
+    for (cl = in; cl; cl = cl->next) {
+        size += ngx_buf_size(cl->buf);
+    }
+
+    GRIDFS_PROBE2(output__start, request, size);
+    rc = ngx_http_output_filter(request, in);
+    GRIDFS_PROBE2(output__done, request, rc);
+
+    return rc;
+#else
+    return ngx_http_output_filter(request, in);
+#endif
+}
+
+/* Reconnect to mongod, counting and tracing the attempt. */
+static ngx_int_t ngx_http_gridfs_connect(ngx_http_request_t* request, ngx_http_mongo_connection_t* mongo_conn) {
+    uint64_t start;
+    ngx_int_t rc;
+
+    ngx_http_gridfs_count(request, GRIDFS_STAT(reconnects), 1);
+
+    start = ngx_http_gridfs_usec();
+    rc = ngx_http_mongo_reconnect(request->connection->log, mongo_conn);
+    ngx_http_gridfs_trace(request, mongo_conn, "connect", NULL, -1,
+                          ngx_http_gridfs_usec() - start, 0);
+
+    return rc;
+}
+
+/* Replay the connection's credentials after a reconnect. */
+static ngx_int_t ngx_http_gridfs_reauth(ngx_http_request_t* request, ngx_http_mongo_connection_t* mongo_conn) {
+    uint64_t start;
+    ngx_int_t rc;
+
+    if (mongo_conn->auths->nelts == 0) {
+        return NGX_OK;
+    }
+
+    ngx_http_gridfs_count(request, GRIDFS_STAT(reauths), 1);
+
+    start = ngx_http_gridfs_usec();
+    rc = ngx_http_mongo_reauth(request->connection->log, mongo_conn);
+    ngx_http_gridfs_trace(request, mongo_conn, "reauth", NULL, -1,
+                          ngx_http_gridfs_usec() - start, 0);
+
+    return rc;
+}
+
+/* Find the location's mongo connection, reconnecting if it dropped.
+ * Returns NGX_OK or the status to answer with. */
+static ngx_int_t ngx_http_gridfs_get_connection(ngx_http_request_t* request, ngx_http_gridfs_loc_conf_t* gridfs_conf, ngx_http_mongo_connection_t** conn) {
+    ngx_http_mongo_connection_t *mongo_conn;
+
+    mongo_conn = gridfs_conf->mongo_conn;
+    if (mongo_conn == NULL) {
+        ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                      "Mongo Connection not found: \"%V\"", &gridfs_conf->mongo);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* Set even on failure, for the caller to tell why */
+    *conn = mongo_conn;
+
+    if (mongo_conn->connecting) {
+        ngx_log_error(NGX_LOG_INFO, request->connection->log, 0,
+                      "Mongo connection still being set up: \"%V\"", &gridfs_conf->mongo);
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    if (mongo_conn->conn.connected == 0) {
+        if (ngx_http_gridfs_connect(request, mongo_conn) == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                          "Could not connect to mongo: \"%V\"", &gridfs_conf->mongo);
+            if(mongo_conn->conn.connected) { mongo_disconnect(&mongo_conn->conn); }
+            return NGX_HTTP_SERVICE_UNAVAILABLE;
+        }
+        if (ngx_http_gridfs_reauth(request, mongo_conn) == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                          "Failed to reauth to mongo: \"%V\"", &gridfs_conf->mongo);
+            if(mongo_conn->conn.connected) { mongo_disconnect(&mongo_conn->conn); }
+            return NGX_HTTP_SERVICE_UNAVAILABLE;
+        }
+    }
+
+    return NGX_OK;
+}
+
+/* Reconnect and reauthenticate after an operation failed. */
+static ngx_int_t ngx_http_gridfs_reconnect(ngx_http_request_t* request, ngx_http_mongo_connection_t* mongo_conn) {
+    if (ngx_http_gridfs_connect(request, mongo_conn) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_gridfs_reauth(request, mongo_conn);
+}
+
+/* With gridfs_cache_use_stale, answer from the expired copy of a file when
+ * mongod fails for the given reason. */
+static ngx_uint_t ngx_http_gridfs_use_stale(ngx_http_request_t* request, bson* stale, ngx_uint_t reason) {
+    ngx_http_gridfs_loc_conf_t* gridfs_conf;
+    ngx_http_gridfs_ctx_t* ctx;
+
+    gridfs_conf = ngx_http_get_module_loc_conf(request, ngx_http_gridfs_module);
+    if (stale == NULL || !(gridfs_conf->cache_use_stale & reason)) {
+        return FALSE;
+    }
+
+    ctx = ngx_http_get_module_ctx(request, ngx_http_gridfs_module);
+    ctx->body = stale;
+    ngx_str_set(&ctx->cache_status, "STALE");
+
+    ngx_log_error(NGX_LOG_WARN, request->connection->log, 0,
+                  "serving a stale copy, mongo: \"%V\"", &gridfs_conf->mongo);
+
+    return TRUE;
+}
+
+static ngx_int_t ngx_http_gridfs_file_handler(ngx_http_request_t* request) {
+    ngx_http_gridfs_loc_conf_t* gridfs_conf;
+    ngx_buf_t* buffer;
+    ngx_chain_t out;
+    char* value;
+    ngx_str_t key;
+    ngx_str_t miss_key;
+    ngx_http_mongo_connection_t *mongo_conn;
+    ngx_http_gridfs_ctx_t* ctx;
+    gridfs_offset length;
+    ngx_uint_t numchunks;
+    char* contenttype;
+    char* md5;
+    bson_date_t last_modified;
+
+    ngx_int_t rc = NGX_OK;
+    bson query;
+    ngx_str_t* encoding = NULL;
+    ngx_str_t variant_type = ngx_null_string;
+    ngx_table_elt_t* vary;
+    int status;
+    ngx_uint_t gzipped;
+    volatile ngx_uint_t e = FALSE;
+    uint64_t range_start = 0;
+    uint64_t range_end   = 0;
+    ngx_str_t start;
+    uint64_t lookup_start, op_start;
+    ngx_uint_t hit = FALSE;
+    ngx_uint_t update = 0;
+    bson cached;
+    bson* body = NULL;
+    bson* stale = NULL; /* body to answer with if mongod fails */
+
+    gridfs_conf = ngx_http_get_module_loc_conf(request, ngx_http_gridfs_module);
+    ctx = ngx_http_get_module_ctx(request, ngx_http_gridfs_module);
+
+    // ---------- RETRIEVE KEY ---------- //
+
+    rc = ngx_http_gridfs_request_key(request, gridfs_conf, &value);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    /* No file can have it, mongod needn't be asked */
+    if (!ngx_http_gridfs_key_valid(gridfs_conf->type, value)) {
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    // ---------- CHECK THE CACHES ---------- //
+
+    key.data = (u_char*)value;
+    key.len = strlen(value);
+
+    if (gridfs_conf->miss_zone || gridfs_conf->cache_zone) {
+        if (ngx_http_gridfs_miss_key(request->pool, gridfs_conf, &key, &miss_key) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    if (gridfs_conf->cache_zone) {
+        rc = ngx_http_gridfs_cache_lookup(request->pool, gridfs_conf, &miss_key, &cached, &body,
+                                          (gridfs_conf->cache_use_stale & GRIDFS_STALE_UPDATING)
+                                          ? &update : NULL);
+        if (rc == NGX_ERROR) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        hit = (rc == NGX_OK);
+
+        if (rc == NGX_AGAIN) {
+            if (gridfs_conf->cache_use_stale & GRIDFS_STALE_UPDATING) {
+                /* Served as is while one refresh revalidates it */
+                hit = TRUE;
+                ngx_str_set(&ctx->cache_status, "UPDATING");
+                if (update) {
+                    ngx_http_gridfs_refresh_start(request, &miss_key, value);
+                }
+            } else {
+                stale = body;
+            }
+        }
+
+        if (hit) {
+            ctx->body = body;
+        }
+    }
+
+    /* With static variants each candidate is checked on its own key */
+    if (!hit && gridfs_conf->miss_zone && !gridfs_conf->static_variants
+        && ngx_http_gridfs_miss_lookup(gridfs_conf, &miss_key) == NGX_OK) {
+        ngx_str_set(&ctx->cache_status, "NEGATIVE");
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    if (!hit && gridfs_conf->filter_zone && !gridfs_conf->static_variants
+        && ngx_http_gridfs_filter_test(gridfs_conf, &key) == NGX_DECLINED) {
+        ngx_str_set(&ctx->cache_status, "FILTERED");
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    if (hit) {
+        if (ctx->cache_status.len == 0) {
+            ngx_str_set(&ctx->cache_status, "HIT");
+        }
+    } else if (gridfs_conf->miss_zone || gridfs_conf->filter_zone || gridfs_conf->cache_zone) {
+        ngx_str_set(&ctx->cache_status, "MISS");
+    }
+
+    /* A cached body is served without mongod */
+    if (ctx->body != NULL) {
+        goto found;
+    }
+
+    // ---------- ENSURE MONGO CONNECTION ---------- //
+
+    rc = ngx_http_gridfs_get_connection(request, gridfs_conf, &mongo_conn);
+    if (rc != NGX_OK) {
+        if (rc == NGX_HTTP_SERVICE_UNAVAILABLE
+            && ngx_http_gridfs_use_stale(request, stale, mongo_conn->connecting
+                                         ? GRIDFS_STALE_CONNECTING : GRIDFS_STALE_ERROR)) {
+            hit = TRUE;
+            goto found;
+        }
+        return rc;
+    }
+
+    // ---------- RETRIEVE GRIDFILE ---------- //
+
+    ctx->mongo_conn = mongo_conn;
+
+    lookup_start = ngx_http_gridfs_usec();
+
+    do {
+        e = FALSE;
+        op_start = ngx_http_gridfs_usec();
+        status = gridfs_init(&mongo_conn->conn,
+                             (const char*)gridfs_conf->db.data,
+                             (const char*)gridfs_conf->root_collection.data,
+                             &ctx->gfs);
+        ngx_http_gridfs_trace(request, mongo_conn, "gridfs_init",
+                              status == MONGO_OK ? ctx->gfs.chunks_ns : NULL, -1,
+                              ngx_http_gridfs_usec() - op_start, 0);
+        if (status != MONGO_OK) {
+            e = TRUE; ctx->ecounter++;
+            if (ctx->ecounter > MONGO_MAX_RETRIES_PER_REQUEST
+                || ngx_http_gridfs_reconnect(request, mongo_conn) == NGX_ERROR) {
+                ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                              "Mongo connection dropped, could not reconnect");
+                if(mongo_conn->conn.connected) { mongo_disconnect(&mongo_conn->conn); }
+                if (ngx_http_gridfs_use_stale(request, stale, GRIDFS_STALE_ERROR)) {
+                    hit = TRUE;
+                    goto found;
+                }
+                return NGX_HTTP_SERVICE_UNAVAILABLE;
+            }
+        }
+    } while (e);
+    ctx->gfs_init = 1;
+
+    /* The document is cached, the chunks are fetched as usual */
+    if (hit) {
+        goto found;
+    }
+
+    mongo_clear_errors(&mongo_conn->conn);
+
+    GRIDFS_PROBE2(lookup__start, request, value);
+
+    op_start = ngx_http_gridfs_usec();
+
+    if (gridfs_conf->static_variants) {
+        status = ngx_http_gridfs_find_variant(request, gridfs_conf, &ctx->gfs, value,
+                                              &ctx->gfile, &encoding, &variant_type);
+    } else {
+        if (ngx_http_gridfs_key_query(request->pool, gridfs_conf, value, &query) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        status = gridfs_find_query(&ctx->gfs, &query, &ctx->gfile);
+    }
+
+    ngx_http_gridfs_trace(request, mongo_conn, "find", ctx->gfs.files_ns, -1,
+                          ngx_http_gridfs_usec() - op_start,
+                          status == MONGO_OK ? bson_size(ctx->gfile.meta) : 0);
+    ngx_http_gridfs_observe(request, GRIDFS_STAT(lookup),
+                            ngx_http_gridfs_usec() - lookup_start);
+
+    GRIDFS_PROBE4(lookup__done, request, value, status == MONGO_OK,
+                  status == MONGO_OK ? gridfile_get_contentlength(&ctx->gfile) : 0);
+
+    if(status == MONGO_ERROR) {
+        if (mongo_conn->conn.err != MONGO_CONN_SUCCESS
+            && ngx_http_gridfs_use_stale(request, stale, GRIDFS_STALE_ERROR)) {
+            hit = TRUE;
+            goto found;
+        }
+        /* Only remember misses the server actually answered. */
+        if (gridfs_conf->miss_zone && !gridfs_conf->static_variants
+            && mongo_conn->conn.err == MONGO_CONN_SUCCESS) {
+            ngx_http_gridfs_miss_add(gridfs_conf, &miss_key);
+        }
+        return NGX_HTTP_NOT_FOUND;
+    }
+    ctx->gfile_init = 1;
+
+    /* Known from now on if the filter was missing it */
+    if (gridfs_conf->filter_zone && !gridfs_conf->static_variants) {
+        ngx_http_gridfs_filter_add(gridfs_conf, &key);
+    }
+
+    if (gridfs_conf->cache_zone) {
+        ngx_http_gridfs_cache_fill(request, ctx, &miss_key);
+    }
+
+found:
+
+    if (hit) {
+        if (gridfile_init(&ctx->gfs, &cached, &ctx->gfile) != MONGO_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        ctx->gfile_init = 1;
+    }
+
+    /* Get information about the file */
+    length = gridfile_get_contentlength(&ctx->gfile);
+    numchunks = gridfile_get_numchunks(&ctx->gfile);
+
+    // NaN workaround
+    if (numchunks > INT_MAX)
+    {
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    contenttype = (char*)gridfile_get_contenttype(&ctx->gfile);
+
+    md5 = (char*)gridfile_get_md5(&ctx->gfile);
+    last_modified = gridfile_get_uploaddate(&ctx->gfile);
+
+    gzipped = (encoding == NULL && gridfile_get_boolean(&ctx->gfile, "gzipped"));
+
+#if (NGX_ZLIB)
+    /* Inflate stored gzip for clients that can't take it as is */
+    if (gzipped && gridfs_conf->gunzip
+        && !ngx_http_gridfs_accepts(request, &ngx_http_gridfs_gzip)) {
+        ctx->gunzip = 1;
+        gzipped = FALSE;
+    }
+#endif
+
+    // ---------- Partial Range
+    // set follow-fork-mode child
+    // attach (pid)
+    // break ngx_http_gridfs_module.c:959
+
+    /* Pseudo-streaming from ?start=seconds */
+    if (gridfs_conf->mp4 && encoding == NULL && !gzipped && !ctx->gunzip
+        && ngx_http_arg(request, (u_char*)"start", sizeof("start") - 1, &start) == NGX_OK) {
+        rc = ngx_http_gridfs_mp4(request, ctx, &start, length);
+        if (rc != NGX_OK && rc != NGX_DECLINED) {
+            return rc;
+        }
+    }
+
+    /* Offsets into the inflated body are unknown, so send it whole */
+    if (request->headers_in.range && !ctx->gunzip && ctx->prefix == NULL) {
+        gridfs_parse_range(request, &request->headers_in.range->value, &range_start, &range_end, length);
+    }
+
+    // ---------- SEND THE HEADERS ---------- //
+
+    if (ctx->prefix != NULL) {
+        request->headers_out.status = NGX_HTTP_OK;
+        request->headers_out.content_length_n = ctx->prefix_len
+            + (ctx->range_end - ctx->range_start + 1);
+    } else if (range_start == 0 && range_end == 0) {
+        request->headers_out.status = NGX_HTTP_OK;
+        request->headers_out.content_length_n = ctx->gunzip ? -1 : (off_t) length;
+    } else {
+        request->headers_out.status = NGX_HTTP_PARTIAL_CONTENT;
+        request->headers_out.content_length_n = length;
+        //request->headers_out.content_range = range_end - range_start + 1;
+
+        ngx_table_elt_t   *content_range;
+
+        content_range = ngx_list_push(&request->headers_out.headers);
+        if (content_range == NULL) {
+            return NGX_ERROR;
+        }
+
+        request->headers_out.content_range = content_range;
+
+        content_range->hash = 1;
+        ngx_str_set(&content_range->key, "Content-Range");
+
+        content_range->value.data = ngx_pnalloc(request->pool,sizeof("bytes -/") - 1 + 3 * NGX_OFF_T_LEN);
+        if (content_range->value.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        /* "Content-Range: bytes SSSS-EEEE/TTTT" header */
+        content_range->value.len = ngx_sprintf(content_range->value.data,
+                                               "bytes %O-%O/%O",
+                                               range_start, range_end,
+                                               request->headers_out.content_length_n)
+            - content_range->value.data;
+
+        request->headers_out.content_length_n = range_end - range_start + 1;
+        ctx->ranged = 1;
+        ctx->range_start = range_start;
+        ctx->range_end = range_end;
+    }
+    if (variant_type.len) {
+        request->headers_out.content_type = variant_type;
+    }
+    else if (contenttype != NULL && encoding == NULL) {
+        request->headers_out.content_type.len = strlen(contenttype);
+        request->headers_out.content_type.data = (u_char*)contenttype;
+    }
+    else ngx_http_set_content_type(request);
+
+    // use md5 field as ETag if possible, weak if we change the bytes
+    if (md5 != NULL && ctx->prefix == NULL) {
+        request->headers_out.etag = ngx_list_push(&request->headers_out.headers);
+        if (request->headers_out.etag == NULL) {
+            return NGX_ERROR;
+        }
+        request->headers_out.etag->hash = 1;
+        request->headers_out.etag->key.len = sizeof("ETag") - 1;
+        request->headers_out.etag->key.data = (u_char*)"ETag";
+
+        ngx_buf_t *b;
+        b = ngx_create_temp_buf(request->pool, strlen(md5) + sizeof("W/\"\"") - 1);
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+        b->last = ngx_sprintf(b->last, ctx->gunzip ? "W/\"%s\"" : "\"%s\"", md5);
+        request->headers_out.etag->value.len = b->last - b->pos;
+        request->headers_out.etag->value.data = b->start;
+    }
+
+    // use uploadDate field as last_modified if possible
+    if (last_modified) {
+        request->headers_out.last_modified_time = (time_t)(last_modified/1000);
+    }
+
+    /* The representation depends on Accept-Encoding */
+    if (gridfs_conf->static_variants || ctx->gunzip || (gzipped && gridfs_conf->gunzip)) {
+        vary = ngx_list_push(&request->headers_out.headers);
+        if (vary == NULL) {
+            return NGX_ERROR;
+        }
+        vary->hash = 1;
+        ngx_str_set(&vary->key, "Vary");
+        ngx_str_set(&vary->value, "Accept-Encoding");
+    }
+
+    if (encoding != NULL) {
+        request->headers_out.content_encoding = ngx_list_push(&request->headers_out.headers);
+        if (request->headers_out.content_encoding == NULL) {
+            return NGX_ERROR;
+        }
+        request->headers_out.content_encoding->hash = 1;
+        ngx_str_set(&request->headers_out.content_encoding->key, "Content-Encoding");
+        request->headers_out.content_encoding->value = *encoding;
+    }
+
+    /* Determine if content is gzipped, set headers accordingly */
+    else if (gzipped) {
+        request->headers_out.content_encoding = ngx_list_push(&request->headers_out.headers);
+        if (request->headers_out.content_encoding == NULL) {
+            return NGX_ERROR;
+        }
+        request->headers_out.content_encoding->hash = 1;
+        request->headers_out.content_encoding->key.len = sizeof("Content-Encoding") - 1;
+        request->headers_out.content_encoding->key.data = (u_char *) "Content-Encoding";
+        request->headers_out.content_encoding->value.len = sizeof("gzip") - 1;
+        request->headers_out.content_encoding->value.data = (u_char *) "gzip";
+    }
+
+    rc = ngx_http_send_header(request);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || request->header_only) {
+        return rc;
+    }
+
+    // ---------- SEND THE BODY ---------- //
+
+    /* Empty file */
+    if (numchunks == 0) {
+        /* Allocate space for the response buffer */
+        buffer = ngx_pcalloc(request->pool, sizeof(ngx_buf_t));
+        if (buffer == NULL) {
+            ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                          "Failed to allocate response buffer");
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        buffer->pos = NULL;
+        buffer->last = NULL;
+        buffer->memory = 1;
+        buffer->last_buf = 1;
+        out.buf = buffer;
+        out.next = NULL;
+
+        return ngx_http_gridfs_output_filter(request, &out);
+    }
+
+    ctx->numchunks = numchunks;
+    ctx->bufs = ngx_pcalloc(request->pool, sizeof(ngx_buf_t *) * numchunks);
+    if (ctx->bufs == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    if (ctx->body == NULL && ctx->mongo_conn->conf->mongo_protocol == MONGO_PROTOCOL_OP_MSG) {
+        ctx->msgs = ngx_pcalloc(request->pool, sizeof(ngx_http_mongo_msg_t *) * numchunks);
+        ctx->docs = ngx_pcalloc(request->pool, sizeof(char *) * numchunks);
+        if (ctx->msgs == NULL || ctx->docs == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    } else {
+        ctx->cursors = ngx_pcalloc(request->pool, sizeof(mongo_cursor *) * numchunks);
+        if (ctx->cursors == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    /* Large downloads take turns with the other requests of the worker */
+    ctx->chunk_size = gridfile_get_chunksize(&ctx->gfile);
+    if (gridfs_conf->fair_quantum
+        && (gridfs_offset) numchunks * ctx->chunk_size > gridfs_conf->fair_small)
+    {
+        ctx->quantum = gridfs_conf->fair_quantum;
+        ctx->deficit = ctx->quantum;
+    }
+
+    if (ctx->prefix != NULL) {
+        rc = ngx_http_gridfs_output_filter(request, ctx->prefix);
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+        ctx->blocked = (rc == NGX_AGAIN);
+    }
+
+#if (NGX_ZLIB)
+    if (ctx->gunzip) {
+        /* 16 + MAX_WBITS: expect a gzip header and trailer */
+        if (inflateInit2(&ctx->zstream, MAX_WBITS + 16) != Z_OK) {
+            ngx_log_error(NGX_LOG_ALERT, request->connection->log, 0,
+                          "inflateInit2() failed");
+            return NGX_ERROR;
+        }
+        ctx->zstream_init = 1;
+    }
+#endif
+
+    rc = ngx_http_gridfs_send_chunks(request, ctx);
+
+    if (rc == NGX_ERROR || ctx->done) {
+        return rc;
+    }
+
+    /* The client is slower than mongo: continue on write events */
+    if (!ctx->yielded && ngx_http_gridfs_wait_write(request) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    request->main->count++;
+    request->write_event_handler = ngx_http_gridfs_write_handler;
+
+    return NGX_DONE;
+}
+
+#if (NGX_HTTP_GRIDFS_SDT)
+/* Fire request__done as the request is freed, once everything is sent. */
+static void ngx_http_gridfs_probe_done(void* data) {
+    ngx_http_request_t* request = data;
+
+    GRIDFS_PROBE3(request__done, request,
+                  request->err_status ? request->err_status : request->headers_out.status,
+                  request->connection->sent);
+}
+#endif
+
+static ngx_int_t ngx_http_gridfs_handler(ngx_http_request_t* request) {
+    ngx_http_gridfs_loc_conf_t* gridfs_conf;
+    ngx_http_gridfs_ctx_t* ctx;
+    ngx_pool_cleanup_t* gridfs_cln;
+    ngx_int_t rc;
+
+    gridfs_conf = ngx_http_get_module_loc_conf(request, ngx_http_gridfs_module);
+
+    ctx = ngx_pcalloc(request->pool, sizeof(ngx_http_gridfs_ctx_t));
+    gridfs_cln = ngx_pool_cleanup_add(request->pool, 0);
+    if (ctx == NULL || gridfs_cln == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    gridfs_cln->handler = ngx_http_gridfs_cleanup;
+    gridfs_cln->data = ctx;
+    ctx->start = ngx_http_gridfs_usec();
+    ngx_http_set_ctx(request, ctx, ngx_http_gridfs_module);
+
+    GRIDFS_PROBE3(request__start, request, request->uri.data, request->uri.len);
+#if (NGX_HTTP_GRIDFS_SDT)
+    if (GRIDFS_PROBE_ENABLED(request__done)) {
+        gridfs_cln = ngx_pool_cleanup_add(request->pool, 0);
+        if (gridfs_cln != NULL) {
+            gridfs_cln->handler = ngx_http_gridfs_probe_done;
+            gridfs_cln->data = request;
+        }
+    }
+#endif
+
+    ngx_http_gridfs_count(request, GRIDFS_STAT(requests), 1);
+
+    if (gridfs_conf->admission) {
+        rc = ngx_http_gridfs_admit(request, ctx, gridfs_conf->admission);
+        if (rc != NGX_OK) {
+            if (rc != NGX_DONE) {
+                ngx_http_gridfs_count_status(request, rc);
+            }
+            return rc;
+        }
+    }
+
+    return ngx_http_gridfs_serve(request);
+}
+
+/* Answer the request, once admitted. */
+static ngx_int_t ngx_http_gridfs_serve(ngx_http_request_t* request) {
+    ngx_http_gridfs_loc_conf_t* gridfs_conf;
+    ngx_int_t rc;
+
+    gridfs_conf = ngx_http_get_module_loc_conf(request, ngx_http_gridfs_module);
+
+    if (gridfs_conf->batch) {
+        rc = ngx_http_gridfs_batch_handler(request);
+    } else if (gridfs_conf->upload && (request->method & (NGX_HTTP_PUT | NGX_HTTP_POST))) {
+        rc = ngx_http_gridfs_upload_handler(request);
+    } else {
+        rc = ngx_http_gridfs_file_handler(request);
+    }
+
+    ngx_http_gridfs_count_status(request, rc);
+
+    return rc;
+}
+
+/* Resume streaming once the client has drained some output. */
+static void ngx_http_gridfs_write_handler(ngx_http_request_t* request) {
+    ngx_http_gridfs_ctx_t* ctx;
+    ngx_http_core_loc_conf_t* core_conf;
+    ngx_event_t* wev;
+    ngx_int_t rc;
+
+    wev = request->connection->write;
+    core_conf = ngx_http_get_module_loc_conf(request, ngx_http_core_module);
+
+    if (wev->timedout) {
+        if (!wev->delayed) {
+            ngx_log_error(NGX_LOG_INFO, request->connection->log, NGX_ETIMEDOUT,
+                          "client timed out");
+            request->connection->timedout = 1;
+            ngx_http_finalize_request(request, NGX_HTTP_REQUEST_TIME_OUT);
+            return;
+        }
+        wev->timedout = 0;
+        wev->delayed = 0;
+    }
+
+    /* Held back by limit_rate */
+    if (wev->delayed) {
+        if (ngx_handle_write_event(wev, core_conf->send_lowat) != NGX_OK) {
+            ngx_http_finalize_request(request, NGX_ERROR);
+        }
+        return;
+    }
+
+    ctx = ngx_http_get_module_ctx(request, ngx_http_gridfs_module);
+
+    /* Resumed by the next turn */
+    if (ctx->yielded) {
+        return;
+    }
+
+    rc = ngx_http_gridfs_send_chunks(request, ctx);
+
+    if (rc == NGX_ERROR) {
+        ngx_http_finalize_request(request, NGX_ERROR);
+        return;
+    }
+
+    if (!ctx->done) {
+        if (!ctx->yielded && ngx_http_gridfs_wait_write(request) != NGX_OK) {
+            ngx_http_finalize_request(request, NGX_ERROR);
+        }
+        return;
+    }
+
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    ngx_http_finalize_request(request, rc);
+}
+
+/* Give the other requests of the worker a turn before fetching more
+ * chunks: deficit round robin, a turn fetches up to a quantum of bytes. */
+static void ngx_http_gridfs_yield(ngx_http_request_t* request, ngx_http_gridfs_ctx_t* ctx) {
+    ctx->yielded = 1;
+    ctx->turn.handler = ngx_http_gridfs_turn_handler;
+    ctx->turn.data = request;
+    ctx->turn.log = request->connection->log;
+
+#if (nginx_version >= 1017005)
+    /* After the events already pending */
+    ngx_post_event(&ctx->turn, &ngx_posted_next_events);
+#else
+    ngx_add_timer(&ctx->turn, 1);
+#endif
+}
+
+static void ngx_http_gridfs_turn_handler(ngx_event_t* ev) {
+    ngx_http_request_t* request = ev->data;
+    ngx_connection_t* c = request->connection;
+    ngx_http_gridfs_ctx_t* ctx;
+
+    ctx = ngx_http_get_module_ctx(request, ngx_http_gridfs_module);
+    ctx->yielded = 0;
+    /* Capped, so that waiting on the client doesn't add up turns */
+    ctx->deficit = ngx_min(ctx->deficit + ctx->quantum, ctx->quantum + ctx->chunk_size);
+
+    ngx_http_set_log_request(c->log, request);
+
+    ngx_http_gridfs_write_handler(request);
+    ngx_http_run_posted_requests(c);
+}
+
+static ngx_int_t ngx_http_gridfs_wait_write(ngx_http_request_t* request) {
+    ngx_http_core_loc_conf_t* core_conf;
+    ngx_event_t* wev;
+
+    wev = request->connection->write;
+    core_conf = ngx_http_get_module_loc_conf(request, ngx_http_core_module);
+
+    if (!wev->delayed) {
+        ngx_add_timer(wev, core_conf->send_timeout);
+    }
+
+    return ngx_handle_write_event(wev, core_conf->send_lowat);
+}
+
+/* Read chunk ctx->chunk, reconnecting if the connection dropped. */
+static ngx_int_t ngx_http_gridfs_read_chunk(ngx_http_request_t* request, ngx_http_gridfs_ctx_t* ctx, bson_iterator* it) {
+    mongo_cursor* cursor;
+    uint64_t start, usec;
+
+    if (ctx->body != NULL) {
+        return ngx_http_gridfs_body_chunk(ctx->body, ctx->chunk, it);
+    }
+
+    for ( ;; ) {
+        if (ctx->msgs != NULL) {
+            if (ngx_http_gridfs_stream_chunk(request, ctx, it) == NGX_OK) {
+                return NGX_OK;
+            }
+        } else {
+            start = ngx_http_gridfs_usec();
+            cursor = gridfile_get_chunks(&ctx->gfile, ctx->chunk, 1);
+            if (cursor && mongo_cursor_next(cursor) == MONGO_OK) {
+                usec = ngx_http_gridfs_usec() - start;
+                ctx->cursors[ctx->chunk] = cursor;
+                bson_find(it, &cursor->current, "data");
+                ngx_http_gridfs_trace(request, ctx->mongo_conn, "chunk", ctx->gfs.chunks_ns,
+                                      ctx->chunk, usec, bson_size(&cursor->current));
+                ngx_http_gridfs_observe(request, GRIDFS_STAT(chunk_fetch), usec);
+                ngx_http_gridfs_count(request, GRIDFS_STAT(chunks), 1);
+                ngx_http_gridfs_count(request, GRIDFS_STAT(bytes), bson_iterator_bin_len(it));
+                return NGX_OK;
+            }
+
+            mongo_cursor_destroy(cursor);
+            ngx_http_gridfs_trace(request, ctx->mongo_conn, "chunk", ctx->gfs.chunks_ns,
+                                  ctx->chunk, ngx_http_gridfs_usec() - start, 0);
+        }
+
+        ctx->ecounter++;
+        if (ctx->ecounter > MONGO_MAX_RETRIES_PER_REQUEST
+            || ngx_http_gridfs_reconnect(request, ctx->mongo_conn) == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                          "Mongo connection dropped, could not reconnect");
+            if(ctx->mongo_conn->conn.connected) { mongo_disconnect(&ctx->mongo_conn->conn); }
+            return NGX_ERROR;
+        }
+    }
+}
+
+/* Fetch chunk ctx->chunk, between the chunk probes. */
+static ngx_int_t ngx_http_gridfs_fetch_chunk(ngx_http_request_t* request, ngx_http_gridfs_ctx_t* ctx, bson_iterator* it) {
+    ngx_int_t rc;
+
+    GRIDFS_PROBE2(chunk__start, request, ctx->chunk);
+
+    rc = ngx_http_gridfs_read_chunk(request, ctx, it);
+
+    GRIDFS_PROBE4(chunk__done, request, ctx->chunk,
+                  rc == NGX_OK ? bson_iterator_bin_len(it) : 0, rc);
+
+    return rc;
+}
+
+static void ngx_http_gridfs_free_chunk(ngx_http_gridfs_ctx_t* ctx, ngx_uint_t n) {
+    if (ctx->msgs != NULL) {
+        ngx_http_mongo_msg_release(ctx->msgs[n]);
+        ctx->msgs[n] = NULL;
+    } else {
+        mongo_cursor_destroy(ctx->cursors[n]);
+        ctx->cursors[n] = NULL;
+    }
+}
+
+/* Free the chunks whose data has been written out, oldest first. */
+static void ngx_http_gridfs_release_chunks(ngx_http_gridfs_ctx_t* ctx) {
+    ngx_buf_t* b;
+
+    while (ctx->released < ctx->chunk) {
+        b = ctx->bufs[ctx->released];
+        if (b != NULL && b->pos != b->last) {
+            break;
+        }
+        ngx_http_gridfs_free_chunk(ctx, ctx->released);
+        ctx->released++;
+    }
+}
+
+/* The client takes less than mongod gives: with gridfs_buffering, the rest
+ * of the response goes to a temp file instead of waiting, so that the
+ * request is done with mongod at mongod's pace. Declined when there is no
+ * backend to let go of or the rest is over gridfs_max_temp_file_size. */
+static ngx_int_t ngx_http_gridfs_spill_start(ngx_http_request_t* request, ngx_http_gridfs_ctx_t* ctx) {
+    ngx_http_gridfs_loc_conf_t* gridfs_conf;
+    ngx_temp_file_t* tf;
+    uint64_t end;
+
+    gridfs_conf = ngx_http_get_module_loc_conf(request, ngx_http_gridfs_module);
+
+    if (!gridfs_conf->buffering || ctx->done || ctx->body != NULL || ctx->gunzip) {
+        return NGX_DECLINED;
+    }
+
+    end = ctx->ranged ? ctx->range_end + 1 : gridfile_get_contentlength(&ctx->gfile);
+    if (end - ctx->offset > gridfs_conf->max_temp_file_size) {
+        return NGX_DECLINED;
+    }
+
+    tf = ngx_pcalloc(request->pool, sizeof(ngx_temp_file_t));
+    if (tf == NULL) {
+        return NGX_ERROR;
+    }
+
+    tf->file.fd = NGX_INVALID_FILE;
+    tf->file.log = request->connection->log;
+    tf->path = gridfs_conf->temp_path;
+    tf->pool = request->pool;
+    tf->warn = "a gridfs response is buffered to a temporary file";
+    tf->log_level = NGX_LOG_INFO;
+    tf->clean = 1;
+
+    ctx->temp_file = tf;
+
+    return NGX_OK;
+}
+
+/* Write a chunk's part of the response to the temp file and point buffer
+ * there instead, so that the chunk can be freed right away. */
+static ngx_int_t ngx_http_gridfs_spill_chunk(ngx_http_gridfs_ctx_t* ctx, ngx_buf_t* buffer) {
+    ngx_temp_file_t* tf = ctx->temp_file;
+    ngx_chain_t cl;
+    ngx_buf_t b;
+    off_t start;
+
+    b = *buffer;
+    cl.buf = &b;
+    cl.next = NULL;
+
+    start = tf->offset;
+    if (ngx_write_chain_to_temp_file(tf, &cl) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    buffer->pos = NULL;
+    buffer->last = NULL;
+    buffer->memory = 0;
+    buffer->in_file = 1;
+    buffer->file = &tf->file;
+    buffer->file_pos = start;
+    buffer->file_last = tf->offset;
+
+    return NGX_OK;
+}
+
+#if (NGX_ZLIB)
+/* Inflate what is left of the current chunk into the gunzip buffers. */
+static ngx_int_t ngx_http_gridfs_gunzip(ngx_http_request_t* request, ngx_http_gridfs_ctx_t* ctx) {
+    ngx_http_gridfs_loc_conf_t* gridfs_conf;
+    ngx_chain_t* cl;
+    ngx_buf_t* b;
+    ngx_int_t rc = NGX_OK;
+    int zrc;
+
+    gridfs_conf = ngx_http_get_module_loc_conf(request, ngx_http_gridfs_module);
+
+    while (ctx->zpending) {
+        if (ctx->free) {
+            cl = ctx->free;
+            ctx->free = cl->next;
+            cl->next = NULL;
+            b = cl->buf;
+
+        } else if (ctx->nbufs < gridfs_conf->gunzip_bufs.num) {
+            b = ngx_create_temp_buf(request->pool, gridfs_conf->gunzip_bufs.size);
+            cl = ngx_alloc_chain_link(request->pool);
+            if (b == NULL || cl == NULL) {
+                return NGX_ERROR;
+            }
+            b->tag = (ngx_buf_tag_t) &ngx_http_gridfs_module;
+            b->recycled = 1;
+            cl->buf = b;
+            cl->next = NULL;
+            ctx->nbufs++;
+
+        } else {
+            /* Every buffer is still on its way to the client */
+            ctx->blocked = 1;
+            return NGX_AGAIN;
+        }
+
+        ctx->zstream.next_out = b->last;
+        ctx->zstream.avail_out = b->end - b->last;
+
+        zrc = inflate(&ctx->zstream, Z_NO_FLUSH);
+
+        if (zrc == Z_STREAM_END && ctx->zstream.avail_in) {
+            /* Another gzip member follows */
+            inflateReset(&ctx->zstream);
+
+        } else if (zrc != Z_OK && zrc != Z_STREAM_END && zrc != Z_BUF_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                          "inflate() failed: %d", zrc);
+            return NGX_ERROR;
+        }
+
+        b->last = ctx->zstream.next_out;
+
+        if (ctx->zstream.avail_in == 0) {
+            ctx->zpending = 0;
+            ctx->done = ctx->zlast;
+        }
+
+        if (b->pos == b->last) {
+            cl->next = ctx->free;
+            ctx->free = cl;
+
+            if (!ctx->done) {
+                continue;
+            }
+
+            b = ngx_calloc_buf(request->pool);
+            cl = ngx_alloc_chain_link(request->pool);
+            if (b == NULL || cl == NULL) {
+                return NGX_ERROR;
+            }
+            cl->buf = b;
+            cl->next = NULL;
+        }
+
+        b->last_buf = ctx->done;
+
+        /* Make sure the writer doesn't sit on the last free buffer */
+        b->flush = (ctx->free == NULL && ctx->nbufs == gridfs_conf->gunzip_bufs.num);
+
+        rc = ngx_http_gridfs_output_filter(request, cl);
+
+        ngx_chain_update_chains(request->pool, &ctx->free, &ctx->busy, &cl,
+                                (ngx_buf_tag_t) &ngx_http_gridfs_module);
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_AGAIN) {
+            ctx->blocked = 1;
+            return NGX_AGAIN;
+        }
+    }
+
+    return rc;
+}
+#endif
+
+/* Send as many chunks as the client takes without blocking. Returns
+ * NGX_AGAIN with ctx->done unset when it has to wait for a write event. */
+static ngx_int_t ngx_http_gridfs_send_chunks(ngx_http_request_t* request, ngx_http_gridfs_ctx_t* ctx) {
+    ngx_buf_t* buffer;
+    ngx_chain_t out;
+#if (NGX_ZLIB)
+    ngx_chain_t* cl;
+#endif
+    bson_iterator it;
+    gridfs_offset chunk_len;
+    u_char* chunk_data;
+    u_char* pos;
+    u_char* end;
+    ngx_uint_t last;
+    ngx_int_t rc = NGX_OK;
+
+    for ( ;; ) {
+        /* While spilling, the chunks handed out below flush the output */
+        if (ctx->blocked && ctx->temp_file == NULL) {
+            rc = ngx_http_gridfs_output_filter(request, NULL);
+#if (NGX_ZLIB)
+            cl = NULL;
+            ngx_chain_update_chains(request->pool, &ctx->free, &ctx->busy, &cl,
+                                    (ngx_buf_tag_t) &ngx_http_gridfs_module);
+#endif
+            ngx_http_gridfs_release_chunks(ctx);
+            if (rc == NGX_AGAIN) {
+                rc = ngx_http_gridfs_spill_start(request, ctx);
+                if (rc != NGX_OK) {
+                    return (rc == NGX_DECLINED) ? NGX_AGAIN : NGX_ERROR;
+                }
+                rc = NGX_AGAIN;
+            } else if (rc != NGX_OK) {
+                return rc;
+            } else {
+                ctx->blocked = 0;
+            }
+        }
+
+        if (ctx->done) {
+            return rc;
+        }
+
+#if (NGX_ZLIB)
+        if (ctx->zpending) {
+            rc = ngx_http_gridfs_gunzip(request, ctx);
+            if (rc == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+            if (!ctx->zpending) {
+                ctx->chunk++;
+                ngx_http_gridfs_release_chunks(ctx);
+            }
+            if (ctx->blocked) {
+                return NGX_AGAIN;
+            }
+            continue;
+        }
+#endif
+
+        /* Out of turn */
+        if (ctx->quantum) {
+            if (ctx->deficit < ctx->chunk_size) {
+                ngx_http_gridfs_yield(request, ctx);
+                return NGX_AGAIN;
+            }
+            ctx->deficit -= ctx->chunk_size;
+        }
+
+        /* Fetch the chunk from mongo */
+        if (ngx_http_gridfs_fetch_chunk(request, ctx, &it) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        chunk_len = bson_iterator_bin_len(&it);
+        chunk_data = (u_char*)bson_iterator_bin_data(&it);
+        last = (ctx->chunk == ctx->numchunks - 1);
+
+#if (NGX_ZLIB)
+        if (ctx->gunzip) {
+            ctx->zstream.next_in = chunk_data;
+            ctx->zstream.avail_in = chunk_len;
+            ctx->zpending = 1;
+            ctx->zlast = last;
+            continue;
+        }
+#endif
+
+        pos = chunk_data;
+        end = chunk_data + chunk_len;
+
+        if (ctx->ranged) {
+            if (ctx->range_start >= ctx->offset + chunk_len) {
+                /* Before the range */
+                pos = end;
+            } else {
+                if (ctx->range_start > ctx->offset) {
+                    pos += ctx->range_start - ctx->offset;
+                }
+                if (ctx->range_end < ctx->offset + chunk_len) {
+                    end = chunk_data + (ctx->range_end - ctx->offset + 1);
+                    last = 1;
+                }
+            }
+        }
+
+        ctx->offset += chunk_len;
+
+        buffer = NULL;
+        if (pos != end || last) {
+            buffer = ngx_calloc_buf(request->pool);
+            if (buffer == NULL) {
+                ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                              "Failed to allocate response buffer");
+                return NGX_ERROR;
+            }
+            if (pos != end) {
+                buffer->pos = pos;
+                buffer->last = end;
+                buffer->memory = 1;
+            }
+            buffer->last_buf = last;
+        }
+
+        if (ctx->temp_file != NULL) {
+            if (pos != end && ngx_http_gridfs_spill_chunk(ctx, buffer) != NGX_OK) {
+                return NGX_ERROR;
+            }
+            ngx_http_gridfs_free_chunk(ctx, ctx->chunk);
+        }
+
+        ctx->bufs[ctx->chunk++] = buffer;
+        ctx->done = last;
+
+        /* The rest is in the temp file, the request is done with mongod */
+        if (ctx->done && ctx->temp_file != NULL && ctx->admission) {
+            ngx_http_gridfs_release(ctx);
+        }
+
+        /* Serve the Chunk */
+        if (buffer != NULL) {
+            out.buf = buffer;
+            out.next = NULL;
+
+            rc = ngx_http_gridfs_output_filter(request, &out);
+
+            if (rc == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+            ctx->blocked = (rc == NGX_AGAIN);
+        }
+
+        ngx_http_gridfs_release_chunks(ctx);
+
+        if (ctx->blocked && ctx->temp_file == NULL) {
+            rc = ngx_http_gridfs_spill_start(request, ctx);
+            if (rc != NGX_OK) {
+                return (rc == NGX_DECLINED) ? NGX_AGAIN : NGX_ERROR;
+            }
+            rc = NGX_AGAIN;
+        }
+    }
+}
+
+static void ngx_http_gridfs_cleanup(void* data) {
+    ngx_http_gridfs_ctx_t* ctx;
+    ngx_uint_t i;
+
+    ctx = data;
+
+    if (ctx->admission) {
+        ngx_http_gridfs_release(ctx);
+    }
+
+    if (ctx->upload) {
+        ngx_http_gridfs_upload_cleanup(ctx->upload);
+    }
+
+    if (ctx->turn.timer_set) {
+        ngx_del_timer(&ctx->turn);
+    }
+    if (ctx->turn.posted) {
+        ngx_delete_posted_event(&ctx->turn);
+    }
+
+    for (i = ctx->released; i < ctx->numchunks; i++) {
+        if (ctx->msgs != NULL) {
+            ngx_http_mongo_msg_release(ctx->msgs[i]);
+        } else {
+            mongo_cursor_destroy(ctx->cursors[i]);
+        }
+    }
+
+#if (NGX_ZLIB)
+    if (ctx->zstream_init) {
+        inflateEnd(&ctx->zstream);
+    }
+#endif
+
+    if (ctx->body_owned) {
+        bson_destroy(ctx->body);
+    }
+
+    if (ctx->gfile_init) {
+        gridfile_destroy(&ctx->gfile);
+    }
+
+    if (ctx->gfs_init) {
+        gridfs_destroy(&ctx->gfs);
+    }
+}
+
+// ---------- OP_MSG ---------- //
+
+/* With 'mongo ... protocol=op_msg' the chunks of a file are fetched over
+ * OP_MSG, in windows of GRIDFS_STREAM_WINDOW bytes: a find returns the first
+ * batch of the window and an exhaust getMore has mongod push the others
+ * without waiting to be asked, so a window costs two round trips whatever the
+ * number of batches. Everything else goes through the driver. The window is
+ * read whole before the connection is used for anything else. */
+
+#define MONGO_OP_COMPRESSED 2012
+#define MONGO_OP_MSG 2013
+#define MONGO_MSG_CHECKSUM_PRESENT 0x1
+#define MONGO_MSG_MORE_TO_COME 0x2
+#define MONGO_MSG_EXHAUST_ALLOWED 0x10000
+#define MONGO_MSG_MAX_SIZE (48 * 1000 * 1000)
+
+static int32_t ngx_http_mongo_request_id;
+
+static void ngx_http_mongo_put32(u_char* p, uint32_t v) {
+    p[0] = (u_char) v;
+    p[1] = (u_char) (v >> 8);
+    p[2] = (u_char) (v >> 16);
+    p[3] = (u_char) (v >> 24);
+}
+
+static uint32_t ngx_http_mongo_get32(const u_char* p) {
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16
+           | (uint32_t) p[3] << 24;
+}
+
+// ---------- TLS ---------- //
+
+/* The driver's socket layer is built from ngx_http_gridfs_net.c under these
+ * names. The driver calls the functions below instead, which go through TLS
+ * for the mongos that have it. */
+int ngx_http_mongo_plain_socket_connect(mongo* conn, const char* host, int port);
+
+int ngx_http_mongo_plain_write_socket(mongo* conn, const void* buf, int len);
+
+int ngx_http_mongo_plain_read_socket(mongo* conn, void* buf, int len);
+
+#if (NGX_OPENSSL)
+
+/* Sessions outlive the workers and, when the zone keeps its size, reloads. */
+static ngx_int_t ngx_http_mongo_init_tls_zone(ngx_shm_zone_t* shm_zone, void* data) {
+    ngx_slab_pool_t* shpool = (ngx_slab_pool_t*) shm_zone->shm.addr;
+    ngx_http_mongo_tls_shctx_t* sh;
+
+    shm_zone->data = shpool;
+
+    if (data != NULL || shm_zone->shm.exists) {
+        return NGX_OK;
+    }
+
+    sh = ngx_slab_calloc(shpool, sizeof(ngx_http_mongo_tls_shctx_t));
+    if (sh == NULL) {
+        return NGX_ERROR;
+    }
+    shpool->data = sh;
+
+    return NGX_OK;
+}
+
+/* The backend owning a driver connection, if it talks TLS. */
+static ngx_http_mongo_connection_t* ngx_http_mongo_tls_connection(mongo* conn) {
+    ngx_http_mongo_connection_t* mongo_conns = ngx_http_mongo_connections.elts;
+    ngx_uint_t i;
+
+    for (i = 0; i < ngx_http_mongo_connections.nelts; i++) {
+        if (&mongo_conns[i].conn == conn) {
+            return mongo_conns[i].conf->mongo_tls != NULL ? &mongo_conns[i] : NULL;
+        }
+    }
+
+    return NULL;
+}
+
+/* The entry of a server and TLS context in the sessions zone, the zone
+ * being locked. */
+static ngx_http_mongo_tls_session_t* ngx_http_mongo_tls_lookup(ngx_slab_pool_t* shpool, ngx_http_mongo_connection_t* mongo_conn) {
+    ngx_http_mongo_tls_shctx_t* sh = shpool->data;
+    ngx_http_mongo_tls_session_t* session;
+
+    for (session = sh->head; session != NULL; session = session->next) {
+        if (ngx_strcmp(session->peer, mongo_conn->peer) == 0
+            && ngx_memcmp(session->context, mongo_conn->conf->mongo_tls->context, 16) == 0) {
+            return session;
+        }
+    }
+
+    return NULL;
+}
+
+/* Keep a session the server has just issued, for the next connect to it
+ * from any worker. With TLS 1.3 it comes after the handshake, with the
+ * first reply read. */
+static int ngx_http_mongo_tls_new_session(ngx_ssl_conn_t* ssl_conn, ngx_ssl_session_t* ssl_session) {
+    ngx_http_mongo_connection_t* mongo_conn;
+    ngx_http_mongo_tls_session_t* session;
+    ngx_http_mongo_tls_shctx_t* sh;
+    ngx_slab_pool_t* shpool;
+    u_char buf[MONGO_TLS_SESSION_MAX], *p;
+    int len;
+
+    mongo_conn = SSL_get_ex_data(ssl_conn, ngx_http_mongo_tls_index);
+    if (mongo_conn == NULL) {
+        return 0;
+    }
+
+    len = i2d_SSL_SESSION(ssl_session, NULL);
+    if (len <= 0 || len > MONGO_TLS_SESSION_MAX) {
+        return 0;
+    }
+    p = buf;
+    i2d_SSL_SESSION(ssl_session, &p);
+
+    shpool = mongo_conn->conf->mongo_tls->sessions->data;
+    sh = shpool->data;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    session = ngx_http_mongo_tls_lookup(shpool, mongo_conn);
+    if (session == NULL) {
+        session = ngx_slab_alloc_locked(shpool, sizeof(ngx_http_mongo_tls_session_t));
+        if (session != NULL) {
+            ngx_cpystrn(session->peer, mongo_conn->peer, MONGO_TLS_PEER_LEN);
+            ngx_memcpy(session->context, mongo_conn->conf->mongo_tls->context, 16);
+            session->next = sh->head;
+            sh->head = session;
+        }
+    }
+    if (session != NULL) {
+        ngx_memcpy(session->der, buf, len);
+        session->len = len;
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    /* no reference kept on ssl_session */
+    return 0;
+}
+
+/* The session last kept for the server, NULL if none. */
+static ngx_ssl_session_t* ngx_http_mongo_tls_session(ngx_http_mongo_connection_t* mongo_conn) {
+    ngx_http_mongo_tls_session_t* session;
+    ngx_slab_pool_t* shpool;
+    u_char buf[MONGO_TLS_SESSION_MAX];
+    const u_char* p;
+    size_t len = 0;
+
+    shpool = mongo_conn->conf->mongo_tls->sessions->data;
+
+    ngx_shmtx_lock(&shpool->mutex);
+    session = ngx_http_mongo_tls_lookup(shpool, mongo_conn);
+    if (session != NULL) {
+        len = session->len;
+        ngx_memcpy(buf, session->der, len);
+    }
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (len == 0) {
+        return NULL;
+    }
+
+    p = buf;
+    return d2i_SSL_SESSION(NULL, &p, len);
+}
+
+/* Handshake on the socket the driver has just connected, blocking like the
+ * driver, resuming the server's session when one is kept. */
+static ngx_int_t ngx_http_mongo_tls_handshake(ngx_http_mongo_connection_t* mongo_conn, const char* host, int port) {
+    ngx_http_mongo_tls_t* tls = mongo_conn->conf->mongo_tls;
+    ngx_ssl_conn_t* ssl_conn;
+    ngx_ssl_session_t* session;
+    X509_VERIFY_PARAM* param;
+    ngx_flag_t addr;
+    size_t len;
+
+    if (mongo_conn->ssl_conn != NULL) {
+        SSL_free(mongo_conn->ssl_conn);
+        mongo_conn->ssl_conn = NULL;
+    }
+
+    ngx_snprintf(mongo_conn->peer, MONGO_TLS_PEER_LEN - 1, "%s:%d%Z", host, port);
+    mongo_conn->peer[MONGO_TLS_PEER_LEN - 1] = '\0';
+
+    ssl_conn = SSL_new(tls->ssl.ctx);
+    if (ssl_conn == NULL) {
+        ngx_ssl_error(NGX_LOG_ERR, ngx_cycle->log, 0, "SSL_new() failed");
+        return NGX_ERROR;
+    }
+
+    if (SSL_set_fd(ssl_conn, mongo_conn->conn.sock) == 0
+        || SSL_set_ex_data(ssl_conn, ngx_http_mongo_tls_index, mongo_conn) == 0) {
+        ngx_ssl_error(NGX_LOG_ERR, ngx_cycle->log, 0, "SSL_set_fd() failed");
+        SSL_free(ssl_conn);
+        return NGX_ERROR;
+    }
+
+    len = ngx_strlen(host);
+    addr = ngx_inet_addr((u_char*) host, len) != INADDR_NONE
+           || ngx_strlchr((u_char*) host, (u_char*) host + len, ':') != NULL;
+
+    /* SNI is for names only */
+    if (!addr) {
+        SSL_set_tlsext_host_name(ssl_conn, (char*) host);
+    }
+
+    if (tls->verify) {
+        SSL_set_verify(ssl_conn, SSL_VERIFY_PEER, NULL);
+        param = SSL_get0_param(ssl_conn);
+        if (addr) {
+            X509_VERIFY_PARAM_set1_ip_asc(param, host);
+        } else {
+            X509_VERIFY_PARAM_set1_host(param, host, len);
+        }
+    }
+
+    session = ngx_http_mongo_tls_session(mongo_conn);
+    if (session != NULL) {
+        SSL_set_session(ssl_conn, session);
+        ngx_ssl_free_session(session);
+    }
+
+    ERR_clear_error();
+
+    if (SSL_connect(ssl_conn) != 1) {
+        ngx_ssl_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                      "SSL_connect() to mongod %s failed", mongo_conn->peer);
+        SSL_free(ssl_conn);
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "gridfs: TLS to %s, session %s", mongo_conn->peer,
+                   SSL_session_reused(ssl_conn) ? "resumed" : "new");
+
+    mongo_conn->ssl_conn = ssl_conn;
+
+    return NGX_OK;
+}
+
+/* Failures only come with the error queue filled when TLS itself failed;
+ * the rest is a closed or timed out socket, which the callers report. */
+static void ngx_http_mongo_tls_error(ngx_http_mongo_connection_t* mongo_conn, int n, char* op) {
+    if (SSL_get_error(mongo_conn->ssl_conn, n) == SSL_ERROR_SSL) {
+        ngx_ssl_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                      "%s() on mongod %s failed", op, mongo_conn->peer);
+        return;
+    }
+    ERR_clear_error();
+}
+
+static ngx_int_t ngx_http_mongo_tls_send(ngx_http_mongo_connection_t* mongo_conn, const u_char* buf, size_t len) {
+    int n;
+
+    if (mongo_conn->ssl_conn == NULL
+        || SSL_get_fd(mongo_conn->ssl_conn) != mongo_conn->conn.sock) {
+        return NGX_ERROR;
+    }
+
+    while (len) {
+        n = SSL_write(mongo_conn->ssl_conn, buf, (int) ngx_min(len, NGX_MAX_INT32_VALUE));
+        if (n <= 0) {
+            ngx_http_mongo_tls_error(mongo_conn, n, "SSL_write");
+            return NGX_ERROR;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_mongo_tls_recv(ngx_http_mongo_connection_t* mongo_conn, u_char* buf, size_t len) {
+    int n;
+
+    if (mongo_conn->ssl_conn == NULL
+        || SSL_get_fd(mongo_conn->ssl_conn) != mongo_conn->conn.sock) {
+        return NGX_ERROR;
+    }
+
+    while (len) {
+        n = SSL_read(mongo_conn->ssl_conn, buf, (int) ngx_min(len, NGX_MAX_INT32_VALUE));
+        if (n <= 0) {
+            ngx_http_mongo_tls_error(mongo_conn, n, "SSL_read");
+            return NGX_ERROR;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+int mongo_socket_connect(mongo* conn, const char* host, int port) {
+#if (NGX_OPENSSL)
+    ngx_http_mongo_connection_t* mongo_conn;
+#endif
+
+    if (ngx_http_mongo_plain_socket_connect(conn, host, port) != MONGO_OK) {
+        return MONGO_ERROR;
+    }
+
+#if (NGX_OPENSSL)
+    mongo_conn = ngx_http_mongo_tls_connection(conn);
+    if (mongo_conn != NULL && ngx_http_mongo_tls_handshake(mongo_conn, host, port) != NGX_OK) {
+        ngx_close_socket(conn->sock);
+        conn->sock = 0;
+        conn->connected = 0;
+        conn->err = MONGO_CONN_FAIL;
+        return MONGO_ERROR;
+    }
+#endif
+
+    return MONGO_OK;
+}
+
+int mongo_write_socket(mongo* conn, const void* buf, int len) {
+#if (NGX_OPENSSL)
+    ngx_http_mongo_connection_t* mongo_conn;
+
+    mongo_conn = ngx_http_mongo_tls_connection(conn);
+    if (mongo_conn != NULL) {
+        if (ngx_http_mongo_tls_send(mongo_conn, buf, len) != NGX_OK) {
+            conn->err = MONGO_IO_ERROR;
+            return MONGO_ERROR;
+        }
+        return MONGO_OK;
+    }
+#endif
+
+    return ngx_http_mongo_plain_write_socket(conn, buf, len);
+}
+
+int mongo_read_socket(mongo* conn, void* buf, int len) {
+#if (NGX_OPENSSL)
+    ngx_http_mongo_connection_t* mongo_conn;
+
+    mongo_conn = ngx_http_mongo_tls_connection(conn);
+    if (mongo_conn != NULL) {
+        if (ngx_http_mongo_tls_recv(mongo_conn, buf, len) != NGX_OK) {
+            conn->err = MONGO_IO_ERROR;
+            return MONGO_ERROR;
+        }
+        return MONGO_OK;
+    }
+#endif
+
+    return ngx_http_mongo_plain_read_socket(conn, buf, len);
+}
+
+static ngx_int_t ngx_http_mongo_send(ngx_http_mongo_connection_t* mongo_conn, u_char* buf, size_t len) {
+    ssize_t n;
+
+#if (NGX_OPENSSL)
+    if (mongo_conn->conf->mongo_tls != NULL) {
+        return ngx_http_mongo_tls_send(mongo_conn, buf, len);
+    }
+#endif
+
+    while (len) {
+        n = send(mongo_conn->conn.sock, buf, len, 0);
+        if (n == -1) {
+            if (ngx_socket_errno == NGX_EINTR) {
+                continue;
+            }
+            return NGX_ERROR;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_mongo_recv(ngx_http_mongo_connection_t* mongo_conn, u_char* buf, size_t len) {
+    ssize_t n;
+
+#if (NGX_OPENSSL)
+    if (mongo_conn->conf->mongo_tls != NULL) {
+        return ngx_http_mongo_tls_recv(mongo_conn, buf, len);
+    }
+#endif
+
+    while (len) {
+        n = recv(mongo_conn->conn.sock, buf, len, 0);
+        if (n == -1 && ngx_socket_errno == NGX_EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return NGX_ERROR;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return NGX_OK;
+}
+
+/* Compress len bytes at src into a buffer from ngx_alloc(), whose length
+ * is put in *out_len. */
+static u_char* ngx_http_mongo_compress(ngx_log_t* log, ngx_uint_t compressor, u_char* src, size_t len, size_t* out_len) {
+    u_char* out = NULL;
+#if (NGX_ZLIB)
+    uLongf zlen;
+#endif
+#if (NGX_HTTP_GRIDFS_ZSTD)
+    size_t n;
+#endif
+
+    switch (compressor) {
+#if (NGX_HTTP_GRIDFS_SNAPPY)
+    case MONGO_COMPRESSOR_SNAPPY:
+        *out_len = snappy_max_compressed_length(len);
+        out = ngx_alloc(*out_len, log);
+        if (out != NULL
+            && snappy_compress((const char*) src, len, (char*) out, out_len) != SNAPPY_OK) {
+            ngx_free(out);
+            out = NULL;
+        }
+        break;
+#endif
+#if (NGX_ZLIB)
+    case MONGO_COMPRESSOR_ZLIB:
+        zlen = compressBound(len);
+        out = ngx_alloc(zlen, log);
+        if (out != NULL && compress(out, &zlen, src, len) != Z_OK) {
+            ngx_free(out);
+            out = NULL;
+        }
+        *out_len = zlen;
+        break;
+#endif
+#if (NGX_HTTP_GRIDFS_ZSTD)
+    case MONGO_COMPRESSOR_ZSTD:
+        n = ZSTD_compressBound(len);
+        out = ngx_alloc(n, log);
+        if (out != NULL) {
+            n = ZSTD_compress(out, n, src, len, ZSTD_CLEVEL_DEFAULT);
+            if (ZSTD_isError(n)) {
+                ngx_free(out);
+                out = NULL;
+            }
+        }
+        *out_len = n;
+        break;
+#endif
+    }
+
+    if (out == NULL) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "mongo %V compression failed",
+                      &ngx_http_mongo_compressor_names[compressor]);
+    }
+
+    return out;
+}
+
+/* Decompress len bytes at src into exactly dst_len bytes at dst. */
+static ngx_int_t ngx_http_mongo_decompress(ngx_log_t* log, ngx_uint_t compressor, u_char* src, size_t len, u_char* dst, size_t dst_len) {
+    ngx_int_t rc = NGX_ERROR;
+#if (NGX_HTTP_GRIDFS_SNAPPY)
+    size_t slen;
+#endif
+#if (NGX_ZLIB)
+    uLongf zlen;
+#endif
+
+    switch (compressor) {
+    case MONGO_COMPRESSOR_NOOP:
+        if (len == dst_len) {
+            ngx_memcpy(dst, src, len);
+            rc = NGX_OK;
+        }
+        break;
+#if (NGX_HTTP_GRIDFS_SNAPPY)
+    case MONGO_COMPRESSOR_SNAPPY:
+        slen = dst_len;
+        if (snappy_uncompress((const char*) src, len, (char*) dst, &slen) == SNAPPY_OK
+            && slen == dst_len) {
+            rc = NGX_OK;
+        }
+        break;
+#endif
+#if (NGX_ZLIB)
+    case MONGO_COMPRESSOR_ZLIB:
+        zlen = dst_len;
+        if (uncompress(dst, &zlen, src, len) == Z_OK && zlen == dst_len) {
+            rc = NGX_OK;
+        }
+        break;
+#endif
+#if (NGX_HTTP_GRIDFS_ZSTD)
+    case MONGO_COMPRESSOR_ZSTD:
+        if (ZSTD_decompress(dst, dst_len, src, len) == dst_len) {
+            rc = NGX_OK;
+        }
+        break;
+#endif
+    default:
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "mongo reply with unknown compressor %ui", compressor);
+        return NGX_ERROR;
+    }
+
+    if (rc != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "mongo %V decompression failed",
+                      &ngx_http_mongo_compressor_names[compressor]);
+    }
+
+    return rc;
+}
+
+/* Send a command as an OP_MSG with a single body section, wrapped in an
+ * OP_COMPRESSED if a compressor was agreed on. */
+static ngx_int_t ngx_http_mongo_msg_send(ngx_log_t* log, ngx_http_mongo_connection_t* mongo_conn, bson* cmd, uint32_t flags) {
+    u_char *buf, *wire, *compressed;
+    size_t len, clen;
+    ngx_int_t rc;
+
+    len = 16 + 4 + 1 + bson_size(cmd);
+    buf = ngx_alloc(len, log);
+    if (buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    mongo_conn->response_to = ++ngx_http_mongo_request_id;
+
+    ngx_http_mongo_put32(buf, len);
+    ngx_http_mongo_put32(buf + 4, mongo_conn->response_to);
+    ngx_http_mongo_put32(buf + 8, 0);
+    ngx_http_mongo_put32(buf + 12, MONGO_OP_MSG);
+    ngx_http_mongo_put32(buf + 16, flags);
+    buf[20] = 0;
+    ngx_memcpy(buf + 21, cmd->data, bson_size(cmd));
+
+    wire = buf;
+
+    /* mongod compresses its replies the way the request was */
+    if (mongo_conn->compressor) {
+        compressed = ngx_http_mongo_compress(log, mongo_conn->compressor, buf + 16,
+                                             len - 16, &clen);
+        if (compressed == NULL) {
+            ngx_free(buf);
+            return NGX_ERROR;
+        }
+
+        wire = ngx_alloc(16 + 9 + clen, log);
+        if (wire == NULL) {
+            ngx_free(compressed);
+            ngx_free(buf);
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(wire, buf, 16);
+        ngx_http_mongo_put32(wire, 16 + 9 + clen);
+        ngx_http_mongo_put32(wire + 12, MONGO_OP_COMPRESSED);
+        ngx_http_mongo_put32(wire + 16, MONGO_OP_MSG);
+        ngx_http_mongo_put32(wire + 20, len - 16);
+        wire[24] = (u_char) mongo_conn->compressor;
+        ngx_memcpy(wire + 25, compressed, clen);
+        ngx_free(compressed);
+        len = 16 + 9 + clen;
+    }
+
+    rc = ngx_http_mongo_send(mongo_conn, wire, len);
+    if (rc != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_socket_errno, "mongo OP_MSG send failed");
+    }
+
+    if (wire != buf) {
+        ngx_free(wire);
+    }
+    ngx_free(buf);
+    return rc;
+}
+
+/* Read the next OP_MSG off the connection. A compressed one is inflated
+ * straight into the message, which the chunk buffers point into. */
+static ngx_int_t ngx_http_mongo_msg_recv(ngx_log_t* log, ngx_http_mongo_connection_t* mongo_conn, ngx_http_mongo_msg_t** out) {
+    ngx_http_mongo_msg_t* msg;
+    u_char header[16 + 9];
+    u_char* compressed;
+    uint32_t opcode;
+    int32_t request_id;
+    size_t len, clen;
+    ngx_int_t rc;
+
+    if (ngx_http_mongo_recv(mongo_conn, header, 16) != NGX_OK) {
+        goto failed;
+    }
+
+    len = ngx_http_mongo_get32(header);
+    request_id = (int32_t) ngx_http_mongo_get32(header + 4);
+    opcode = ngx_http_mongo_get32(header + 12);
+
+    /* A reply to anything else means the stream is out of step */
+    if ((int32_t) ngx_http_mongo_get32(header + 8) != mongo_conn->response_to) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "mongo reply to request %D, expected %D",
+                      (int32_t) ngx_http_mongo_get32(header + 8),
+                      mongo_conn->response_to);
+        mongo_disconnect(&mongo_conn->conn);
+        mongo_conn->conn.err = MONGO_IO_ERROR;
+        return NGX_ERROR;
+    }
+
+    if (opcode == MONGO_OP_COMPRESSED && len > 16 + 9) {
+        if (ngx_http_mongo_recv(mongo_conn, header + 16, 9) != NGX_OK) {
+            goto failed;
+        }
+        opcode = ngx_http_mongo_get32(header + 16);
+        clen = len - 16 - 9;
+        len = 16 + ngx_http_mongo_get32(header + 20);
+    } else {
+        clen = 0;
+    }
+
+    if (opcode != MONGO_OP_MSG || len < 16 + 4 + 1 + 5 || len > MONGO_MSG_MAX_SIZE
+        || clen > MONGO_MSG_MAX_SIZE)
+    {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "unexpected reply from mongo: opcode %uD, length %uz",
+                      opcode, len);
+        return NGX_ERROR;
+    }
+    len -= 16;
+
+    msg = ngx_alloc(offsetof(ngx_http_mongo_msg_t, data) + len, log);
+    if (msg == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (clen) {
+        compressed = ngx_alloc(clen, log);
+        if (compressed == NULL) {
+            ngx_free(msg);
+            return NGX_ERROR;
+        }
+        rc = ngx_http_mongo_recv(mongo_conn, compressed, clen);
+        if (rc == NGX_OK) {
+            rc = ngx_http_mongo_decompress(log, header[24], compressed, clen, msg->data, len);
+            if (rc != NGX_OK) {
+                ngx_free(compressed);
+                ngx_free(msg);
+                return NGX_ERROR;
+            }
+        }
+        ngx_free(compressed);
+    } else {
+        rc = ngx_http_mongo_recv(mongo_conn, msg->data, len);
+    }
+
+    if (rc != NGX_OK) {
+        ngx_free(msg);
+        goto failed;
+    }
+
+    msg->refs = 1;
+    msg->flags = ngx_http_mongo_get32(msg->data);
+    msg->doc = (const char*) msg->data + 5;
+    msg->len = len;
+    if (msg->flags & MONGO_MSG_CHECKSUM_PRESENT) {
+        len -= 4;
+    }
+
+    /* Replies carry one body section */
+    if (msg->data[4] != 0 || ngx_http_mongo_get32(msg->data + 5) > len - 5) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "malformed OP_MSG from mongo");
+        ngx_free(msg);
+        return NGX_ERROR;
+    }
+
+    /* The next exhaust reply answers this one */
+    if (msg->flags & MONGO_MSG_MORE_TO_COME) {
+        mongo_conn->response_to = request_id;
+    }
+
+    *out = msg;
+    return NGX_OK;
+
+failed:
+
+    ngx_log_error(NGX_LOG_ERR, log, ngx_socket_errno, "mongo OP_MSG recv failed");
+    return NGX_ERROR;
+}
+
+static void ngx_http_mongo_msg_release(ngx_http_mongo_msg_t* msg) {
+    if (msg != NULL && --msg->refs == 0) {
+        ngx_free(msg);
+    }
+}
+
+/* Agree on a compressor for the OP_MSG traffic, with an isMaster listing
+ * the configured ones; mongod answers with those it supports, in order. */
+static ngx_int_t ngx_http_mongo_negotiate(ngx_log_t* log, ngx_http_mongo_connection_t* mongo_conn) {
+    ngx_array_t* compressors = mongo_conn->conf->mongo_compressors;
+    ngx_http_mongo_msg_t* msg;
+    ngx_uint_t *id, i;
+    bson_iterator it, sub;
+    const char* name;
+    char key[NGX_INT_T_LEN + 1];
+    bson cmd;
+    ngx_int_t rc;
+
+    mongo_conn->compressor = MONGO_COMPRESSOR_NOOP;
+
+    if (compressors == NULL) {
+        return NGX_OK;
+    }
+
+    id = compressors->elts;
+
+    bson_init(&cmd);
+    bson_append_int(&cmd, "isMaster", 1);
+    bson_append_start_array(&cmd, "compression");
+    for (i = 0; i < compressors->nelts; i++) {
+        *ngx_sprintf((u_char*) key, "%ui", i) = '\0';
+        bson_append_string(&cmd, key, (const char*) ngx_http_mongo_compressor_names[id[i]].data);
+    }
+    bson_append_finish_array(&cmd);
+    bson_append_string(&cmd, "$db", "admin");
+    bson_finish(&cmd);
+
+    rc = ngx_http_mongo_msg_send(log, mongo_conn, &cmd, 0);
+    bson_destroy(&cmd);
+    if (rc == NGX_OK) {
+        rc = ngx_http_mongo_msg_recv(log, mongo_conn, &msg);
+    }
+    if (rc != NGX_OK) {
+        mongo_disconnect(&mongo_conn->conn);
+        return NGX_ERROR;
+    }
+
+    bson_iterator_from_buffer(&it, msg->doc);
+    while (bson_iterator_next(&it)) {
+        if (ngx_strcmp(bson_iterator_key(&it), "compression") != 0) {
+            continue;
+        }
+        bson_iterator_subiterator(&it, &sub);
+        while (mongo_conn->compressor == MONGO_COMPRESSOR_NOOP && bson_iterator_next(&sub)) {
+            name = bson_iterator_string(&sub);
+            for (i = 0; i < compressors->nelts; i++) {
+                if (ngx_strcmp(name, ngx_http_mongo_compressor_names[id[i]].data) == 0) {
+                    mongo_conn->compressor = id[i];
+                    break;
+                }
+            }
+        }
+    }
+
+    ngx_http_mongo_msg_release(msg);
+
+    if (mongo_conn->compressor == MONGO_COMPRESSOR_NOOP) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "mongo \"%V\" supports none of the compressors, "
+                      "traffic is not compressed", &mongo_conn->name);
+    }
+
+    return NGX_OK;
+}
+
+/* Find the cursor id and the batch of a find or getMore reply. */
+static ngx_int_t ngx_http_mongo_msg_cursor(ngx_log_t* log, ngx_http_mongo_msg_t* msg, const char* key, bson_iterator* batch, int64_t* cursor_id) {
+    bson_iterator it, sub;
+    ngx_uint_t ok = 0, found = 0;
+    const char* errmsg = "no cursor in reply";
+
+    *cursor_id = 0;
+
+    bson_iterator_from_buffer(&it, msg->doc);
+    while (bson_iterator_next(&it)) {
+        if (ngx_strcmp(bson_iterator_key(&it), "ok") == 0) {
+            ok = (bson_iterator_double(&it) == 1.0);
+        } else if (ngx_strcmp(bson_iterator_key(&it), "errmsg") == 0) {
+            errmsg = bson_iterator_string(&it);
+        } else if (ngx_strcmp(bson_iterator_key(&it), "cursor") == 0) {
+            bson_iterator_subiterator(&it, &sub);
+            while (bson_iterator_next(&sub)) {
+                if (ngx_strcmp(bson_iterator_key(&sub), "id") == 0) {
+                    *cursor_id = bson_iterator_long(&sub);
+                } else if (ngx_strcmp(bson_iterator_key(&sub), key) == 0) {
+                    bson_iterator_subiterator(&sub, batch);
+                    found = 1;
+                }
+            }
+        }
+    }
+
+    if (!ok || !found) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "mongo %s failed: %s",
+                      key[0] == 'f' ? "find" : "getMore", errmsg);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/* Keep the chunks of a batch; they must come in order. */
+static ngx_int_t ngx_http_gridfs_stream_batch(ngx_http_request_t* request, ngx_http_gridfs_ctx_t* ctx, ngx_http_mongo_msg_t* msg, bson_iterator* batch) {
+    bson_iterator it;
+    const char* doc;
+
+    while (bson_iterator_next(batch)) {
+        doc = bson_iterator_value(batch);
+
+        bson_iterator_from_buffer(&it, doc);
+        while (bson_iterator_next(&it)) {
+            if (ngx_strcmp(bson_iterator_key(&it), "n") == 0) {
+                break;
+            }
+        }
+        if (ctx->fetched >= ctx->numchunks
+            || bson_iterator_type(&it) == BSON_EOO
+            || (ngx_uint_t) bson_iterator_int(&it) != ctx->fetched)
+        {
+            ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                          "chunk %ui missing from mongo reply", ctx->fetched);
+            return NGX_ERROR;
+        }
+
+        ctx->msgs[ctx->fetched] = msg;
+        ctx->docs[ctx->fetched] = doc;
+        ctx->fetched++;
+        msg->refs++;
+    }
+
+    return NGX_OK;
+}
+
+/* Fetch the next window of chunks. */
+static ngx_int_t ngx_http_gridfs_stream_window(ngx_http_request_t* request, ngx_http_gridfs_ctx_t* ctx) {
+    ngx_http_mongo_connection_t* mongo_conn = ctx->mongo_conn;
+    ngx_log_t* log = request->connection->log;
+    ngx_http_mongo_msg_t* msg;
+    bson cmd;
+    bson_iterator id, batch;
+    int64_t cursor_id;
+    ngx_uint_t first, last, batch_size;
+    const char* collection;
+    const char* op;
+    uint64_t start, usec;
+    ngx_uint_t more;
+    ngx_int_t rc;
+    size_t chunk_size;
+
+    chunk_size = ctx->chunk_size ? ctx->chunk_size : 1;
+    batch_size = ngx_max(GRIDFS_STREAM_BATCH / chunk_size, 1);
+
+    if (ctx->fetched < ctx->chunk) {
+        ctx->fetched = ctx->chunk;
+    }
+    first = ctx->fetched;
+    last = ctx->numchunks;
+    if (ctx->ranged) {
+        last = ngx_min(last, ctx->range_end / chunk_size + 1);
+    }
+    last = ngx_min(last, first + ngx_max(GRIDFS_STREAM_WINDOW / chunk_size, 1));
+
+    /* chunks_ns is "db.collection" */
+    collection = ctx->gfs.chunks_ns + ngx_strlen(ctx->gfs.dbname) + 1;
+
+    bson_init(&cmd);
+    bson_append_string(&cmd, "find", collection);
+    bson_append_start_object(&cmd, "filter");
+    bson_find(&id, ctx->gfile.meta, "_id");
+    bson_append_element(&cmd, "files_id", &id);
+    bson_append_start_object(&cmd, "n");
+    bson_append_int(&cmd, "$gte", first);
+    bson_append_int(&cmd, "$lt", last);
+    bson_append_finish_object(&cmd);
+    bson_append_finish_object(&cmd);
+    bson_append_start_object(&cmd, "sort");
+    bson_append_int(&cmd, "n", 1);
+    bson_append_finish_object(&cmd);
+    bson_append_int(&cmd, "batchSize", batch_size);
+    bson_append_string(&cmd, "$db", ctx->gfs.dbname);
+    bson_finish(&cmd);
+
+    op = "find";
+    start = ngx_http_gridfs_usec();
+    rc = ngx_http_mongo_msg_send(log, mongo_conn, &cmd, 0);
+    bson_destroy(&cmd);
+
+    while (rc == NGX_OK) {
+        rc = ngx_http_mongo_msg_recv(log, mongo_conn, &msg);
+        if (rc != NGX_OK) {
+            break;
+        }
+
+        usec = ngx_http_gridfs_usec() - start;
+        ngx_http_gridfs_trace(request, mongo_conn, op, ctx->gfs.chunks_ns,
+                              ctx->fetched, usec, msg->len);
+        ngx_http_gridfs_observe(request, GRIDFS_STAT(chunk_fetch), usec);
+
+        rc = ngx_http_mongo_msg_cursor(log, msg, op[0] == 'f' ? "firstBatch" : "nextBatch",
+                                       &batch, &cursor_id);
+        if (rc == NGX_OK) {
+            rc = ngx_http_gridfs_stream_batch(request, ctx, msg, &batch);
+        }
+        more = msg->flags & MONGO_MSG_MORE_TO_COME;
+        ngx_http_mongo_msg_release(msg);
+
+        if (rc != NGX_OK || cursor_id == 0) {
+            break;
+        }
+
+        start = ngx_http_gridfs_usec();
+
+        /* Pushed by mongod */
+        if (more) {
+            op = "more";
+            continue;
+        }
+
+        bson_init(&cmd);
+        bson_append_long(&cmd, "getMore", cursor_id);
+        bson_append_string(&cmd, "collection", collection);
+        bson_append_int(&cmd, "batchSize", batch_size);
+        bson_append_string(&cmd, "$db", ctx->gfs.dbname);
+        bson_finish(&cmd);
+
+        op = "getMore";
+        rc = ngx_http_mongo_msg_send(log, mongo_conn, &cmd, MONGO_MSG_EXHAUST_ALLOWED);
+        bson_destroy(&cmd);
+    }
+
+    if (rc != NGX_OK) {
+        /* The rest of the window may still be on its way */
+        mongo_disconnect(&mongo_conn->conn);
+        return NGX_ERROR;
+    }
+
+    if (ctx->fetched < last) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "chunk %ui missing from mongo reply", ctx->fetched);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/* Point it at the data of chunk ctx->chunk, fetching its window first. */
+static ngx_int_t ngx_http_gridfs_stream_chunk(ngx_http_request_t* request, ngx_http_gridfs_ctx_t* ctx, bson_iterator* it) {
+    if (ctx->chunk >= ctx->fetched
+        && ngx_http_gridfs_stream_window(request, ctx) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    bson_iterator_from_buffer(it, ctx->docs[ctx->chunk]);
+    while (bson_iterator_next(it)) {
+        if (ngx_strcmp(bson_iterator_key(it), "data") == 0) {
+            break;
+        }
+    }
+
+    if (bson_iterator_type(it) != BSON_BINDATA) {
+        ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                      "chunk %ui has no data", ctx->chunk);
+        return NGX_ERROR;
+    }
+
+    ngx_http_gridfs_count(request, GRIDFS_STAT(chunks), 1);
+    ngx_http_gridfs_count(request, GRIDFS_STAT(bytes), bson_iterator_bin_len(it));
+
+    return NGX_OK;
+}
+
+// ---------- ADMISSION ---------- //
+
+/* Turn the request away with a 503 telling the client when to come back. */
+static ngx_int_t ngx_http_gridfs_reject(ngx_http_request_t* request, ngx_http_gridfs_admission_t* admission) {
+    ngx_table_elt_t* retry_after;
+
+    retry_after = ngx_list_push(&request->headers_out.headers);
+    if (retry_after == NULL) {
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    retry_after->value.data = ngx_pnalloc(request->pool, NGX_TIME_T_LEN);
+    if (retry_after->value.data == NULL) {
+        retry_after->hash = 0;
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    retry_after->hash = 1;
+    ngx_str_set(&retry_after->key, "Retry-After");
+    retry_after->value.len = ngx_sprintf(retry_after->value.data, "%T",
+                                         admission->retry_after)
+                             - retry_after->value.data;
+
+    return NGX_HTTP_SERVICE_UNAVAILABLE;
+}
+
+/* Let the request in if it is under the in-flight limit, queue it or turn it
+ * away. Returns NGX_OK, NGX_DONE if queued, or the status to answer with. */
+static ngx_int_t ngx_http_gridfs_admit(ngx_http_request_t* request, ngx_http_gridfs_ctx_t* ctx, ngx_http_gridfs_admission_t* admission) {
+    ctx->admission = admission;
+
+    if (admission->active < admission->max) {
+        admission->active++;
+        ctx->admitted = 1;
+        return NGX_OK;
+    }
+
+    if (admission->waiting >= admission->queue_max) {
+        ngx_log_error(NGX_LOG_INFO, request->connection->log, 0,
+                      "gridfs in-flight limit of %ui reached, rejecting",
+                      admission->max);
+        return ngx_http_gridfs_reject(request, admission);
+    }
+
+    ngx_queue_insert_tail(&admission->queue, &ctx->queue);
+    admission->waiting++;
+    ctx->queued = 1;
+
+    ctx->wait.handler = ngx_http_gridfs_admission_handler;
+    ctx->wait.data = request;
+    ctx->wait.log = request->connection->log;
+    ngx_add_timer(&ctx->wait, admission->timeout);
+
+    request->read_event_handler = ngx_http_gridfs_admission_read;
+
+    request->main->count++;
+    return NGX_DONE;
+}
+
+/* Give the request's slot to the oldest waiting request. */
+static void ngx_http_gridfs_release(ngx_http_gridfs_ctx_t* ctx) {
+    ngx_http_gridfs_admission_t* admission = ctx->admission;
+    ngx_http_gridfs_ctx_t* next;
+    ngx_queue_t* q;
+
+    if (ctx->wait.timer_set) {
+        ngx_del_timer(&ctx->wait);
+    }
+    if (ctx->wait.posted) {
+        ngx_delete_posted_event(&ctx->wait);
+    }
+
+    if (ctx->queued) {
+        ngx_queue_remove(&ctx->queue);
+        admission->waiting--;
+        ctx->queued = 0;
+    }
+
+    if (!ctx->admitted) {
+        return;
+    }
+
+    ctx->admitted = 0;
+    admission->active--;
+
+    if (ngx_queue_empty(&admission->queue)) {
+        return;
+    }
+
+    q = ngx_queue_head(&admission->queue);
+    next = ngx_queue_data(q, ngx_http_gridfs_ctx_t, queue);
+    ngx_queue_remove(q);
+    admission->waiting--;
+    admission->active++;
+    next->queued = 0;
+    next->admitted = 1;
+
+    /* Run it from the event loop, not from this request's cleanup. */
+    if (next->wait.timer_set) {
+        ngx_del_timer(&next->wait);
+    }
+    ngx_post_event(&next->wait, &ngx_posted_events);
+}
+
+/* A queued request was admitted, or waited too long. */
+static void ngx_http_gridfs_admission_handler(ngx_event_t* ev) {
+    ngx_http_request_t* request = ev->data;
+    ngx_connection_t* c = request->connection;
+    ngx_http_gridfs_ctx_t* ctx;
+    ngx_int_t rc;
+
+    ctx = ngx_http_get_module_ctx(request, ngx_http_gridfs_module);
+
+    ngx_http_set_log_request(c->log, request);
+
+    request->read_event_handler = ngx_http_block_reading;
+
+    if (ctx->admitted) {
+        rc = ngx_http_gridfs_serve(request);
+    } else {
+        ngx_queue_remove(&ctx->queue);
+        ctx->admission->waiting--;
+        ctx->queued = 0;
+
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "gridfs request waited %M ms for an in-flight slot, rejecting",
+                      ctx->admission->timeout);
+        rc = ngx_http_gridfs_reject(request, ctx->admission);
+        ngx_http_gridfs_count_status(request, rc);
+    }
+
+    ngx_http_finalize_request(request, rc);
+    ngx_http_run_posted_requests(c);
+}
+
+/* Watch a queued request's connection; a client that went away leaves the
+ * queue, or hands on the slot it was just given, at once. */
+static void ngx_http_gridfs_admission_read(ngx_http_request_t* request) {
+    ngx_http_gridfs_ctx_t* ctx;
+
+    /* Terminates the request on a close, which then runs from the posted
+     * requests, so it is still there below. */
+    ngx_http_test_reading(request);
+
+    if (request->connection->error) {
+        ctx = ngx_http_get_module_ctx(request, ngx_http_gridfs_module);
+        ngx_http_gridfs_release(ctx);
+    }
+}
+
+// ---------- BATCH ---------- //
+
+/* Queue one key of a batch, url-decoding it if it came from the args. */
+static ngx_int_t ngx_http_gridfs_batch_add_key(ngx_http_request_t* request, ngx_array_t* files, u_char* p, size_t len, ngx_uint_t decode) {
+    ngx_http_gridfs_loc_conf_t* gridfs_conf;
+    ngx_http_gridfs_batch_file_t* file;
+    u_char* c;
+
+    if (len == 0) {
+        return NGX_OK;
+    }
+
+    gridfs_conf = ngx_http_get_module_loc_conf(request, ngx_http_gridfs_module);
+
+    if (files->nelts == gridfs_conf->batch_max_keys) {
+        ngx_log_error(NGX_LOG_INFO, request->connection->log, 0,
+                      "GridFS batch has more than %ui keys", gridfs_conf->batch_max_keys);
+        return NGX_HTTP_REQUEST_ENTITY_TOO_LARGE;
+    }
+
+    if (len > GRIDFS_KEY_MAX_LEN) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    file = ngx_array_push(files);
+    if (file == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    ngx_memzero(file, sizeof(ngx_http_gridfs_batch_file_t));
+
+    file->key = ngx_pnalloc(request->pool, len + 1);
+    if (file->key == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    ngx_memcpy(file->key, p, len);
+    file->key[len] = '\0';
+
+    if (decode && !url_decode(file->key)) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    /* Keys are echoed back in part headers */
+    for (c = (u_char*)file->key; *c; c++) {
+        if (*c < 0x20 || *c == 0x7f) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+    }
+
+    return NGX_OK;
+}
+
+/* Keys come from "?keys=a,b,c" or one per line in a POST body. */
+static ngx_int_t ngx_http_gridfs_batch_keys(ngx_http_request_t* request, ngx_array_t* files) {
+    ngx_str_t list;
+    ngx_chain_t* cl;
+    ngx_buf_t* b;
+    u_char *p, *q, *last;
+    ngx_uint_t decode;
+    ssize_t n;
+    size_t len;
+    ngx_int_t rc;
+    u_char sep;
+
+    if (request->request_body && request->request_body->bufs) {
+        len = 0;
+        for (cl = request->request_body->bufs; cl; cl = cl->next) {
+            len += ngx_buf_size(cl->buf);
+        }
+
+        list.data = ngx_pnalloc(request->pool, len);
+        if (list.data == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        p = list.data;
+        for (cl = request->request_body->bufs; cl; cl = cl->next) {
+            b = cl->buf;
+            if (b->in_file) {
+                n = ngx_read_file(b->file, p, b->file_last - b->file_pos, b->file_pos);
+                if (n != b->file_last - b->file_pos) {
+                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+                }
+                p += n;
+            } else {
+                p = ngx_cpymem(p, b->pos, b->last - b->pos);
+            }
+        }
+        list.len = p - list.data;
+        sep = '\n';
+        decode = FALSE;
+
+    } else if (ngx_http_arg(request, (u_char*)"keys", sizeof("keys") - 1, &list) == NGX_OK) {
+        sep = ',';
+        decode = TRUE;
+
+    } else {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    p = list.data;
+    last = list.data + list.len;
+
+    for ( ;; ) {
+        q = ngx_strlchr(p, last, sep);
+        if (q == NULL) {
+            q = last;
+        }
+
+        len = q - p;
+        if (len && p[len - 1] == '\r') {
+            len--;
+        }
+
+        rc = ngx_http_gridfs_batch_add_key(request, files, p, len, decode);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        if (q == last) {
+            break;
+        }
+        p = q + 1;
+    }
+
+    return files->nelts ? NGX_OK : NGX_HTTP_BAD_REQUEST;
+}
+
+/* Whether a chunk's files_id is a file's _id. */
+static ngx_uint_t ngx_http_gridfs_same_id(bson_iterator* a, bson_iterator* b) {
+    if (bson_iterator_type(a) != bson_iterator_type(b)) {
+        return FALSE;
+    }
+
+    switch (bson_iterator_type(a)) {
+    case BSON_OID:
+        return ngx_memcmp(bson_iterator_oid(a)->bytes, bson_iterator_oid(b)->bytes, 12) == 0;
+    case BSON_STRING:
+        return ngx_strcmp(bson_iterator_string(a), bson_iterator_string(b)) == 0;
+    case BSON_INT:
+    case BSON_LONG:
+        return bson_iterator_long(a) == bson_iterator_long(b);
+    default:
+        return FALSE;
+    }
+}
+
+/* Run a query, reconnecting once if the connection dropped. */
+static mongo_cursor* ngx_http_gridfs_batch_find(ngx_http_request_t* request, ngx_http_mongo_connection_t* mongo_conn, const char* ns, bson* query, ngx_uint_t* ecounter) {
+    mongo_cursor* cursor;
+
+    for ( ;; ) {
+        mongo_clear_errors(&mongo_conn->conn);
+
+        cursor = mongo_find(&mongo_conn->conn, ns, query, NULL, 0, 0, 0);
+        if (cursor != NULL) {
+            return cursor;
+        }
+
+        (*ecounter)++;
+        if (*ecounter > MONGO_MAX_RETRIES_PER_REQUEST
+            || ngx_http_gridfs_reconnect(request, mongo_conn) == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                          "Mongo connection dropped, could not reconnect");
+            if(mongo_conn->conn.connected) { mongo_disconnect(&mongo_conn->conn); }
+            return NULL;
+        }
+    }
+}
+
+/* Resolve every pending key with one $in query on the files collection. */
+static ngx_int_t ngx_http_gridfs_batch_files(ngx_http_request_t* request, ngx_http_mongo_connection_t* mongo_conn, ngx_array_t* files, const char* ns, ngx_uint_t* ecounter) {
+    ngx_http_gridfs_loc_conf_t* gridfs_conf;
+    ngx_http_gridfs_batch_file_t* file;
+    mongo_cursor* cursor;
+    bson_iterator it;
+    bson query;
+    ngx_uint_t i, n;
+    ngx_int_t rc;
+    uint64_t start, usec;
+    size_t reply = 0;
+    char index[NGX_INT_T_LEN + 1];
+
+    gridfs_conf = ngx_http_get_module_loc_conf(request, ngx_http_gridfs_module);
+    file = files->elts;
+
+    bson_init(&query);
+    bson_append_start_object(&query, (char*)gridfs_conf->field.data);
+    bson_append_start_array(&query, "$in");
+    for (i = 0, n = 0; i < files->nelts; i++) {
+        if (file[i].status == 0) {
+            ngx_sprintf((u_char*)index, "%ui%Z", n++);
+            ngx_http_gridfs_append_key(&query, index, gridfs_conf->type, file[i].key);
+        }
+    }
+    bson_append_finish_array(&query);
+    bson_append_finish_object(&query);
+    bson_finish(&query);
+
+    if (n == 0) {
+        bson_destroy(&query);
+        return NGX_OK;
+    }
+
+    start = ngx_http_gridfs_usec();
+    cursor = ngx_http_gridfs_batch_find(request, mongo_conn, ns, &query, ecounter);
+    bson_destroy(&query);
+
+    if (cursor == NULL) {
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    while (mongo_cursor_next(cursor) == MONGO_OK) {
+        reply += bson_size(&cursor->current);
+        if (bson_find(&it, &cursor->current, (char*)gridfs_conf->field.data) == BSON_EOO) {
+            continue;
+        }
+        for (i = 0; i < files->nelts; i++) {
+            if (file[i].status == 0 && !file[i].found
+                && ngx_http_gridfs_key_matches(&it, gridfs_conf->type, file[i].key)) {
+                bson_copy(&file[i].doc, &cursor->current);
+                file[i].found = TRUE;
+            }
+        }
+    }
+
+    rc = (cursor->err == MONGO_CURSOR_EXHAUSTED) ? NGX_OK : NGX_HTTP_SERVICE_UNAVAILABLE;
+    mongo_cursor_destroy(cursor);
+
+    usec = ngx_http_gridfs_usec() - start;
+    ngx_http_gridfs_trace(request, mongo_conn, "find", ns, -1, usec, reply);
+    ngx_http_gridfs_observe(request, GRIDFS_STAT(lookup), usec);
+
+    return rc;
+}
+
+/* Fetch the chunks of every found file with one $in query on files_id. */
+static ngx_int_t ngx_http_gridfs_batch_chunks(ngx_http_request_t* request, ngx_http_mongo_connection_t* mongo_conn, ngx_array_t* files, const char* ns, ngx_uint_t* ecounter) {
+    ngx_http_gridfs_batch_file_t* file;
+    mongo_cursor* cursor;
+    bson_iterator id, it;
+    bson query;
+    gridfs_offset offset, len;
+    ngx_uint_t i, n;
+    ngx_int_t rc;
+    uint64_t start, usec;
+    size_t reply = 0;
+    char index[NGX_INT_T_LEN + 1];
+
+    file = files->elts;
+
+    bson_init(&query);
+    bson_append_start_object(&query, "files_id");
+    bson_append_start_array(&query, "$in");
+    for (i = 0, n = 0; i < files->nelts; i++) {
+        if (file[i].status == NGX_HTTP_OK && file[i].numchunks) {
+            ngx_sprintf((u_char*)index, "%ui%Z", n++);
+            bson_append_element(&query, index, &file[i].id);
+        }
+    }
+    bson_append_finish_array(&query);
+    bson_append_finish_object(&query);
+    bson_finish(&query);
+
+    if (n == 0) {
+        bson_destroy(&query);
+        return NGX_OK;
+    }
+
+    start = ngx_http_gridfs_usec();
+    cursor = ngx_http_gridfs_batch_find(request, mongo_conn, ns, &query, ecounter);
+    bson_destroy(&query);
+
+    if (cursor == NULL) {
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    while (mongo_cursor_next(cursor) == MONGO_OK) {
+        reply += bson_size(&cursor->current);
+        if (bson_find(&id, &cursor->current, "files_id") == BSON_EOO
+            || bson_find(&it, &cursor->current, "n") == BSON_EOO) {
+            continue;
+        }
+        n = bson_iterator_int(&it);
+
+        if (bson_find(&it, &cursor->current, "data") != BSON_BINDATA) {
+            continue;
+        }
+        len = bson_iterator_bin_len(&it);
+        ngx_http_gridfs_count(request, GRIDFS_STAT(chunks), 1);
+        ngx_http_gridfs_count(request, GRIDFS_STAT(bytes), len);
+
+        for (i = 0; i < files->nelts; i++) {
+            if (file[i].status != NGX_HTTP_OK || !ngx_http_gridfs_same_id(&file[i].id, &id)) {
+                continue;
+            }
+            offset = (gridfs_offset) n * file[i].chunk_size;
+            /* every chunk but the last is full */
+            if (n >= file[i].numchunks
+                || len != ngx_min(file[i].chunk_size, file[i].length - offset)) {
+                ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                              "GridFS chunk %ui of \"%s\" is out of bounds or of the wrong size",
+                              n, file[i].key);
+                file[i].status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+                continue;
+            }
+            if (file[i].seen[n / 8] & (1 << (n % 8))) {
+                continue;
+            }
+            file[i].seen[n / 8] |= 1 << (n % 8);
+            ngx_memcpy(file[i].data + offset, bson_iterator_bin_data(&it), len);
+            file[i].received++;
+        }
+    }
+
+    rc = (cursor->err == MONGO_CURSOR_EXHAUSTED) ? NGX_OK : NGX_HTTP_SERVICE_UNAVAILABLE;
+    mongo_cursor_destroy(cursor);
+
+    usec = ngx_http_gridfs_usec() - start;
+    ngx_http_gridfs_trace(request, mongo_conn, "find", ns, -1, usec, reply);
+    ngx_http_gridfs_observe(request, GRIDFS_STAT(chunk_fetch), usec);
+
+    return rc;
+}
+
+static void ngx_http_gridfs_batch_cleanup(void* data) {
+    ngx_array_t* files = data;
+    ngx_http_gridfs_batch_file_t* file;
+    ngx_uint_t i;
+
+    file = files->elts;
+    for (i = 0; i < files->nelts; i++) {
+        if (file[i].found) {
+            bson_destroy(&file[i].doc);
+        }
+    }
+}
+
+/* Answer a batch as multipart/mixed, one part per key in request order.
+ * Each part carries X-GridFS-Key and X-GridFS-Status headers; files that
+ * weren't found, or would take the response past gridfs_batch_max_size,
+ * get a part with no body. */
+static ngx_int_t ngx_http_gridfs_batch_send(ngx_http_request_t* request) {
+    ngx_http_gridfs_loc_conf_t* gridfs_conf;
+    ngx_http_mongo_connection_t* mongo_conn;
+    ngx_http_gridfs_batch_file_t* file;
+    ngx_pool_cleanup_t* cln;
+    ngx_array_t* files;
+    ngx_chain_t *out, **ll, *cl;
+    ngx_buf_t* b;
+    ngx_str_t key, miss_key;
+    bson_iterator it;
+    char *files_ns, *chunks_ns;
+    const char* type;
+    size_t total, len;
+    off_t content_length;
+    ngx_uint_t i, ecounter, gzipped;
+    ngx_int_t rc;
+    u_char boundary[2 * 8];
+
+    gridfs_conf = ngx_http_get_module_loc_conf(request, ngx_http_gridfs_module);
+
+    files = ngx_array_create(request->pool, 8, sizeof(ngx_http_gridfs_batch_file_t));
+    cln = ngx_pool_cleanup_add(request->pool, 0);
+    if (files == NULL || cln == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    cln->handler = ngx_http_gridfs_batch_cleanup;
+    cln->data = files;
+
+    rc = ngx_http_gridfs_batch_keys(request, files);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    file = files->elts;
+
+    // ---------- CHECK NEGATIVE CACHES ---------- //
+
+    for (i = 0; i < files->nelts; i++) {
+        key.data = (u_char*)file[i].key;
+        key.len = strlen(file[i].key);
+
+        if (gridfs_conf->miss_zone) {
+            if (ngx_http_gridfs_miss_key(request->pool, gridfs_conf, &key, &miss_key) != NGX_OK) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+            if (ngx_http_gridfs_miss_lookup(gridfs_conf, &miss_key) == NGX_OK) {
+                file[i].status = NGX_HTTP_NOT_FOUND;
+                continue;
+            }
+        }
+
+        if (gridfs_conf->filter_zone
+            && ngx_http_gridfs_filter_test(gridfs_conf, &key) == NGX_DECLINED) {
+            file[i].status = NGX_HTTP_NOT_FOUND;
+        }
+    }
+
+    // ---------- QUERY MONGO ---------- //
+
+    rc = ngx_http_gridfs_get_connection(request, gridfs_conf, &mongo_conn);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    len = gridfs_conf->db.len + 1 + gridfs_conf->root_collection.len;
+    files_ns = ngx_pnalloc(request->pool, len + sizeof(".files"));
+    chunks_ns = ngx_pnalloc(request->pool, len + sizeof(".chunks"));
+    if (files_ns == NULL || chunks_ns == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    ngx_sprintf((u_char*)files_ns, "%V.%V.files%Z", &gridfs_conf->db, &gridfs_conf->root_collection);
+    ngx_sprintf((u_char*)chunks_ns, "%V.%V.chunks%Z", &gridfs_conf->db, &gridfs_conf->root_collection);
+
+    ecounter = 0;
+
+    rc = ngx_http_gridfs_batch_files(request, mongo_conn, files, files_ns, &ecounter);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    total = 0;
+    for (i = 0; i < files->nelts; i++) {
+        if (file[i].status) {
+            continue;
+        }
+
+        if (!file[i].found) {
+            file[i].status = NGX_HTTP_NOT_FOUND;
+            if (gridfs_conf->miss_zone && mongo_conn->conn.err == MONGO_CONN_SUCCESS) {
+                key.data = (u_char*)file[i].key;
+                key.len = strlen(file[i].key);
+                if (ngx_http_gridfs_miss_key(request->pool, gridfs_conf, &key, &miss_key) == NGX_OK) {
+                    ngx_http_gridfs_miss_add(gridfs_conf, &miss_key);
+                }
+            }
+            continue;
+        }
+
+        if (gridfs_conf->filter_zone) {
+            key.data = (u_char*)file[i].key;
+            key.len = strlen(file[i].key);
+            ngx_http_gridfs_filter_add(gridfs_conf, &key);
+        }
+
+        bson_find(&file[i].id, &file[i].doc, "_id");
+        file[i].length = ngx_http_gridfs_doc_length(&file[i].doc);
+        file[i].chunk_size = 0;
+        if (bson_find(&it, &file[i].doc, "chunkSize") != BSON_EOO
+            && bson_iterator_int(&it) > 0) {
+            file[i].chunk_size = bson_iterator_int(&it);
+        }
+
+        if (file[i].length && file[i].chunk_size == 0) {
+            file[i].status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            continue;
+        }
+
+        if (file[i].length > gridfs_conf->batch_max_size - total) {
+            file[i].status = NGX_HTTP_REQUEST_ENTITY_TOO_LARGE;
+            continue;
+        }
+
+        file[i].numchunks = file[i].length
+            ? (file[i].length + file[i].chunk_size - 1) / file[i].chunk_size : 0;
+
+        if (file[i].length) {
+            file[i].data = ngx_pnalloc(request->pool, file[i].length);
+            file[i].seen = ngx_pcalloc(request->pool, (file[i].numchunks + 7) / 8);
+            if (file[i].data == NULL || file[i].seen == NULL) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+        }
+
+        total += file[i].length;
+        file[i].status = NGX_HTTP_OK;
+    }
+
+    rc = ngx_http_gridfs_batch_chunks(request, mongo_conn, files, chunks_ns, &ecounter);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    // ---------- BUILD THE RESPONSE ---------- //
+
+    ngx_sprintf(boundary, "%08xD%08xD", (uint32_t) ngx_random(), (uint32_t) ngx_random());
+
+    out = NULL;
+    ll = &out;
+    content_length = 0;
+
+    for (i = 0; i <= files->nelts; i++) {
+        if (i == files->nelts) {
+            len = sizeof(CRLF "--" "--" CRLF) - 1 + sizeof(boundary);
+        } else {
+            if (file[i].status == NGX_HTTP_OK && file[i].received != file[i].numchunks) {
+                ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                              "GridFS file \"%s\" is missing chunks", file[i].key);
+                file[i].status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            type = NULL;
+            gzipped = FALSE;
+            if (file[i].status == NGX_HTTP_OK) {
+                if (bson_find(&it, &file[i].doc, "contentType") == BSON_STRING) {
+                    type = bson_iterator_string(&it);
+                }
+                gzipped = (bson_find(&it, &file[i].doc, "gzipped") == BSON_BOOL
+                           && bson_iterator_bool(&it));
+            } else {
+                file[i].length = 0;
+            }
+
+            len = sizeof(CRLF "--" CRLF) - 1 + sizeof(boundary)
+                + sizeof("X-GridFS-Key: " CRLF) - 1 + strlen(file[i].key)
+                + sizeof("X-GridFS-Status: " CRLF) - 1 + NGX_INT_T_LEN
+                + sizeof("Content-Length: " CRLF CRLF) - 1 + NGX_OFF_T_LEN;
+            if (type) {
+                len += sizeof("Content-Type: " CRLF) - 1 + strlen(type);
+            }
+            if (gzipped) {
+                len += sizeof("Content-Encoding: gzip" CRLF) - 1;
+            }
+        }
+
+        b = ngx_create_temp_buf(request->pool, len);
+        cl = ngx_alloc_chain_link(request->pool);
+        if (b == NULL || cl == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        if (i == files->nelts) {
+            b->last = ngx_sprintf(b->last, CRLF "--%*s--" CRLF, sizeof(boundary), boundary);
+            b->last_buf = 1;
+        } else {
+            b->last = ngx_sprintf(b->last, "%s--%*s" CRLF, i ? CRLF : "",
+                                  sizeof(boundary), boundary);
+            b->last = ngx_sprintf(b->last, "X-GridFS-Key: %s" CRLF, file[i].key);
+            b->last = ngx_sprintf(b->last, "X-GridFS-Status: %ui" CRLF, file[i].status);
+            if (type) {
+                b->last = ngx_sprintf(b->last, "Content-Type: %s" CRLF, type);
+            }
+            if (gzipped) {
+                b->last = ngx_cpymem(b->last, "Content-Encoding: gzip" CRLF,
+                                     sizeof("Content-Encoding: gzip" CRLF) - 1);
+            }
+            b->last = ngx_sprintf(b->last, "Content-Length: %O" CRLF CRLF,
+                                  (off_t) file[i].length);
+        }
+
+        content_length += b->last - b->pos;
+        cl->buf = b;
+        *ll = cl;
+        ll = &cl->next;
+
+        if (i < files->nelts && file[i].length) {
+            b = ngx_calloc_buf(request->pool);
+            cl = ngx_alloc_chain_link(request->pool);
+            if (b == NULL || cl == NULL) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+            b->pos = file[i].data;
+            b->last = file[i].data + file[i].length;
+            b->memory = 1;
+
+            content_length += file[i].length;
+            cl->buf = b;
+            *ll = cl;
+            ll = &cl->next;
+        }
+    }
+    *ll = NULL;
+
+    // ---------- SEND THE RESPONSE ---------- //
+
+    request->headers_out.status = NGX_HTTP_OK;
+    request->headers_out.content_length_n = content_length;
+
+    len = sizeof("multipart/mixed; boundary=") - 1 + sizeof(boundary);
+    request->headers_out.content_type.data = ngx_pnalloc(request->pool, len);
+    if (request->headers_out.content_type.data == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    ngx_sprintf(request->headers_out.content_type.data, "multipart/mixed; boundary=%*s",
+                sizeof(boundary), boundary);
+    request->headers_out.content_type.len = len;
+
+    rc = ngx_http_send_header(request);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || request->header_only) {
+        return rc;
+    }
+
+    return ngx_http_gridfs_output_filter(request, out);
+}
+
+static void ngx_http_gridfs_batch_body_handler(ngx_http_request_t* request) {
+    ngx_int_t rc;
+
+    rc = ngx_http_gridfs_batch_send(request);
+    ngx_http_gridfs_count_status(request, rc);
+    ngx_http_finalize_request(request, rc);
+}
+
+static ngx_int_t ngx_http_gridfs_batch_handler(ngx_http_request_t* request) {
+    ngx_int_t rc;
+
+    if (!(request->method & (NGX_HTTP_GET | NGX_HTTP_HEAD | NGX_HTTP_POST))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    if (request->method & NGX_HTTP_POST) {
+        rc = ngx_http_read_client_request_body(request, ngx_http_gridfs_batch_body_handler);
+        if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+            return rc;
+        }
+        return NGX_DONE;
+    }
+
+    rc = ngx_http_discard_request_body(request);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    return ngx_http_gridfs_batch_send(request);
+}
+
+// ---------- UPLOAD ---------- //
+
+/* Run an insert or delete on the location's database and check that mongod
+ * wrote it. Returns NGX_OK or the status to answer with. cmd is left open
+ * by the caller and destroyed here. */
+static ngx_int_t ngx_http_gridfs_write_command(ngx_http_request_t* request, ngx_http_mongo_connection_t* mongo_conn, bson* cmd, const char* op, const char* ns) {
+    ngx_http_gridfs_loc_conf_t* gridfs_conf;
+    ngx_log_t* log = request->connection->log;
+    ngx_http_mongo_msg_t* msg = NULL;
+    bson reply, fields;
+    bson_iterator it, sub, err;
+    const char* doc = NULL;
+    const char* errmsg = "no reply";
+    char* cmd_ns;
+    ngx_uint_t ok = 0;
+    ngx_int_t rc, code = 0;
+    uint64_t start;
+    size_t len, reply_len = 0;
+
+    gridfs_conf = ngx_http_get_module_loc_conf(request, ngx_http_gridfs_module);
+
+    start = ngx_http_gridfs_usec();
+
+    if (gridfs_conf->mongo_protocol == MONGO_PROTOCOL_OP_MSG) {
+        bson_append_string(cmd, "$db", (const char*) gridfs_conf->db.data);
+        bson_finish(cmd);
+        rc = ngx_http_mongo_msg_send(log, mongo_conn, cmd, 0);
+        if (rc == NGX_OK) {
+            rc = ngx_http_mongo_msg_recv(log, mongo_conn, &msg);
+        }
+        if (rc != NGX_OK) {
+            mongo_disconnect(&mongo_conn->conn);
+        } else {
+            doc = msg->doc;
+            reply_len = msg->len;
+        }
+    } else {
+        bson_finish(cmd);
+        /* Like mongo_run_command, but keeping the reply of a failed one */
+        len = gridfs_conf->db.len + sizeof(".$cmd");
+        cmd_ns = ngx_pnalloc(request->pool, len);
+        if (cmd_ns == NULL) {
+            bson_destroy(cmd);
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        ngx_sprintf((u_char*) cmd_ns, "%V.$cmd%Z", &gridfs_conf->db);
+        mongo_clear_errors(&mongo_conn->conn);
+        if (mongo_find_one(&mongo_conn->conn, cmd_ns, cmd, bson_empty(&fields), &reply) == MONGO_OK) {
+            doc = reply.data;
+            reply_len = bson_size(&reply);
+        }
+    }
+
+    ngx_http_gridfs_trace(request, mongo_conn, op, ns, -1, ngx_http_gridfs_usec() - start,
+                          reply_len);
+    bson_destroy(cmd);
+
+    if (doc == NULL) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "mongo %s on \"%s\" failed: %s", op, ns, errmsg);
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    bson_iterator_from_buffer(&it, doc);
+    while (bson_iterator_next(&it)) {
+        if (ngx_strcmp(bson_iterator_key(&it), "ok") == 0) {
+            ok = (bson_iterator_double(&it) == 1.0);
+        } else if (ngx_strcmp(bson_iterator_key(&it), "errmsg") == 0) {
+            errmsg = bson_iterator_string(&it);
+        } else if (ngx_strcmp(bson_iterator_key(&it), "writeErrors") == 0
+                   || ngx_strcmp(bson_iterator_key(&it), "writeConcernError") == 0) {
+            ok = 0;
+            bson_iterator_subiterator(&it, &sub);
+            /* Of a list of write errors, the first says enough */
+            if (bson_iterator_key(&it)[5] == 'E') {
+                if (!bson_iterator_next(&sub)) {
+                    continue;
+                }
+                bson_iterator_subiterator(&sub, &err);
+            } else {
+                err = sub;
+            }
+            while (bson_iterator_next(&err)) {
+                if (ngx_strcmp(bson_iterator_key(&err), "code") == 0) {
+                    code = bson_iterator_int(&err);
+                } else if (ngx_strcmp(bson_iterator_key(&err), "errmsg") == 0) {
+                    errmsg = bson_iterator_string(&err);
+                }
+            }
+        }
+    }
+
+    rc = NGX_OK;
+    if (!ok) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "mongo %s on \"%s\" failed: %s", op, ns, errmsg);
+        rc = (code == 11000) ? NGX_HTTP_CONFLICT : NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (msg != NULL) {
+        ngx_http_mongo_msg_release(msg);
+    } else {
+        bson_destroy(&reply);
+    }
+
+    return rc;
+}
+
+/* Start an insert into a collection, documents to follow. */
+static void ngx_http_gridfs_upload_insert(bson* cmd, const char* ns) {
+    bson_init(cmd);
+    /* the namespace is "db.collection" */
+    bson_append_string(cmd, "insert", ngx_strchr(ns, '.') + 1);
+    bson_append_start_array(cmd, "documents");
+}
+
+/* Send the chunks batched so far. */
+static ngx_int_t ngx_http_gridfs_upload_flush(ngx_http_request_t* request, ngx_http_gridfs_upload_t* up) {
+    if (!up->cmd_init) {
+        return NGX_OK;
+    }
+
+    bson_append_finish_array(&up->cmd);
+    up->cmd_init = 0;
+    up->written = 1;
+
+    return ngx_http_gridfs_write_command(request, up->mongo_conn, &up->cmd, "insert",
+                                         up->chunks_ns);
+}
+
+/* Add the chunk assembled so far to the insert, sending it when full. */
+static ngx_int_t ngx_http_gridfs_upload_chunk(ngx_http_request_t* request, ngx_http_gridfs_upload_t* up) {
+    ngx_http_gridfs_loc_conf_t* gridfs_conf;
+    char index[NGX_INT_T_LEN + 1];
+
+    if (up->chunk_len == 0) {
+        return NGX_OK;
+    }
+
+    gridfs_conf = ngx_http_get_module_loc_conf(request, ngx_http_gridfs_module);
+
+    if (!up->cmd_init) {
+        ngx_http_gridfs_upload_insert(&up->cmd, up->chunks_ns);
+        up->cmd_init = 1;
+        up->batched = 0;
+    }
+
+    *ngx_sprintf((u_char*) index, "%ui", up->batched) = '\0';
+
+    bson_append_start_object(&up->cmd, index);
+    bson_append_new_oid(&up->cmd, "_id");
+    bson_append_oid(&up->cmd, "files_id", &up->files_id);
+    bson_append_int(&up->cmd, "n", up->n);
+    bson_append_binary(&up->cmd, "data", BSON_BIN_BINARY, (const char*) up->chunk, up->chunk_len);
+    bson_append_finish_object(&up->cmd);
+
+    up->n++;
+    up->batched++;
+    up->chunk_len = 0;
+
+    if (up->batched < gridfs_conf->upload_batch) {
+        return NGX_OK;
+    }
+
+    return ngx_http_gridfs_upload_flush(request, up);
+}
+
+/* Take in a buffer of the body, inserting the chunks it completes. */
+static ngx_int_t ngx_http_gridfs_upload_buf(ngx_http_request_t* request, ngx_http_gridfs_upload_t* up, ngx_buf_t* b) {
+    u_char* p;
+    size_t n;
+    ngx_int_t rc;
+
+    while (ngx_buf_size(b) > 0) {
+        n = (size_t) ngx_min((off_t) (up->chunk_size - up->chunk_len), ngx_buf_size(b));
+        p = up->chunk + up->chunk_len;
+
+        if (ngx_buf_in_memory(b)) {
+            ngx_memcpy(p, b->pos, n);
+            b->pos += n;
+        } else {
+            /* a body read in full before we got to it may be in a file */
+            if (ngx_read_file(b->file, p, n, b->file_pos) != (ssize_t) n) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+            b->file_pos += n;
+        }
+
+        ngx_md5_update(&up->md5, p, n);
+        up->chunk_len += n;
+        up->length += n;
+
+        if (up->chunk_len == up->chunk_size) {
+            rc = ngx_http_gridfs_upload_chunk(request, up);
+            if (rc != NGX_OK) {
+                return rc;
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
+/* Delete the documents of ns whose field is the element at it. */
+static ngx_int_t ngx_http_gridfs_upload_remove(ngx_http_request_t* request, ngx_http_gridfs_upload_t* up, const char* ns, const char* field, bson_iterator* it) {
+    bson cmd;
+
+    bson_init(&cmd);
+    bson_append_string(&cmd, "delete", ngx_strchr(ns, '.') + 1);
+    bson_append_start_array(&cmd, "deletes");
+    bson_append_start_object(&cmd, "0");
+    bson_append_start_object(&cmd, "q");
+    bson_append_element(&cmd, field, it);
+    bson_append_finish_object(&cmd);
+    bson_append_int(&cmd, "limit", 0);
+    bson_append_finish_object(&cmd);
+    bson_append_finish_array(&cmd);
+
+    return ngx_http_gridfs_write_command(request, up->mongo_conn, &cmd, "delete", ns);
+}
+
+/* With the key as _id, the chunks are written under the upload's own
+ * files_id and only moved to the key once the files document holds it,
+ * so an upload losing the race for a key never touches the winner's
+ * chunks. Chunks left under the key by an earlier failure go first. */
+static ngx_int_t ngx_http_gridfs_upload_relink(ngx_http_request_t* request, ngx_http_gridfs_upload_t* up) {
+    bson_iterator id;
+    bson cmd;
+    ngx_int_t rc;
+
+    bson_find(&id, &up->id, "_id");
+
+    rc = ngx_http_gridfs_upload_remove(request, up, up->chunks_ns, "files_id", &id);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    bson_init(&cmd);
+    bson_append_string(&cmd, "update", ngx_strchr(up->chunks_ns, '.') + 1);
+    bson_append_start_array(&cmd, "updates");
+    bson_append_start_object(&cmd, "0");
+    bson_append_start_object(&cmd, "q");
+    bson_append_oid(&cmd, "files_id", &up->files_id);
+    bson_append_finish_object(&cmd);
+    bson_append_start_object(&cmd, "u");
+    bson_append_start_object(&cmd, "$set");
+    bson_append_element(&cmd, "files_id", &id);
+    bson_append_finish_object(&cmd);
+    bson_append_finish_object(&cmd);
+    bson_append_bool(&cmd, "multi", 1);
+    bson_append_finish_object(&cmd);
+    bson_append_finish_array(&cmd);
+
+    return ngx_http_gridfs_write_command(request, up->mongo_conn, &cmd, "update",
+                                         up->chunks_ns);
+}
+
+/* Write the last chunks, then the files document which makes the file
+ * visible, and answer 201. */
+static ngx_int_t ngx_http_gridfs_upload_finish(ngx_http_request_t* request, ngx_http_gridfs_upload_t* up) {
+    ngx_http_gridfs_loc_conf_t* gridfs_conf;
+    ngx_table_elt_t* content_type;
+    ngx_time_t* tp;
+    bson_iterator id;
+    ngx_str_t key, miss_key;
+    u_char digest[16];
+    char md5[33];
+    bson cmd;
+    ngx_int_t rc;
+
+    gridfs_conf = ngx_http_get_module_loc_conf(request, ngx_http_gridfs_module);
+
+    rc = ngx_http_gridfs_upload_chunk(request, up);
+    if (rc == NGX_OK) {
+        rc = ngx_http_gridfs_upload_flush(request, up);
+    }
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    ngx_md5_final(digest, &up->md5);
+    *ngx_hex_dump((u_char*) md5, digest, 16) = '\0';
+
+    tp = ngx_timeofday();
+    bson_find(&id, &up->id, "_id");
+
+    ngx_http_gridfs_upload_insert(&cmd, up->files_ns);
+    bson_append_start_object(&cmd, "0");
+    bson_append_element(&cmd, "_id", &id);
+    if (ngx_strcmp(gridfs_conf->field.data, "_id") != 0) {
+        ngx_http_gridfs_append_key(&cmd, (char*) gridfs_conf->field.data, gridfs_conf->type,
+                                   up->key);
+    }
+    bson_append_long(&cmd, "length", up->length);
+    bson_append_int(&cmd, "chunkSize", up->chunk_size);
+    bson_append_date(&cmd, "uploadDate", (bson_date_t) tp->sec * 1000 + tp->msec);
+    bson_append_string(&cmd, "md5", md5);
+    content_type = request->headers_in.content_type;
+    if (content_type != NULL && content_type->value.len) {
+        bson_append_string_n(&cmd, "contentType", (const char*) content_type->value.data,
+                             content_type->value.len);
+    }
+    bson_append_finish_object(&cmd);
+    bson_append_finish_array(&cmd);
+
+    rc = ngx_http_gridfs_write_command(request, up->mongo_conn, &cmd, "insert", up->files_ns);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    if (up->relink) {
+        rc = ngx_http_gridfs_upload_relink(request, up);
+        if (rc != NGX_OK) {
+            ngx_http_gridfs_upload_remove(request, up, up->files_ns, "_id", &id);
+            return rc;
+        }
+    }
+    up->done = 1;
+
+    /* The key exists now */
+    key.data = (u_char*) up->key;
+    key.len = ngx_strlen(up->key);
+    if ((gridfs_conf->miss_zone || gridfs_conf->cache_zone)
+        && ngx_http_gridfs_miss_key(request->pool, gridfs_conf, &key, &miss_key) == NGX_OK) {
+        if (gridfs_conf->miss_zone) {
+            ngx_http_gridfs_miss_delete(gridfs_conf->miss_zone->data, &miss_key);
+        }
+        /* Whatever was cached belongs to a file deleted since */
+        if (gridfs_conf->cache_zone) {
+            ngx_http_gridfs_miss_delete(gridfs_conf->cache_zone->data, &miss_key);
+        }
+    }
+    if (gridfs_conf->filter_zone) {
+        ngx_http_gridfs_filter_add(gridfs_conf, &key);
+    }
+
+    request->headers_out.status = NGX_HTTP_CREATED;
+    request->headers_out.content_length_n = 0;
+    request->header_only = 1;
+
+    request->headers_out.etag = ngx_list_push(&request->headers_out.headers);
+    if (request->headers_out.etag == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    request->headers_out.etag->hash = 1;
+    request->headers_out.etag->key.len = sizeof("ETag") - 1;
+    request->headers_out.etag->key.data = (u_char*)"ETag";
+    request->headers_out.etag->value.data = ngx_pnalloc(request->pool, sizeof(md5) + 2);
+    if (request->headers_out.etag->value.data == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    request->headers_out.etag->value.len =
+        ngx_sprintf(request->headers_out.etag->value.data, "\"%s\"", md5)
+        - request->headers_out.etag->value.data;
+
+    return ngx_http_send_header(request);
+}
+
+/* Remove the chunks of an upload that won't complete. */
+static void ngx_http_gridfs_upload_abort(ngx_http_request_t* request, ngx_http_gridfs_upload_t* up) {
+    bson_iterator id;
+    bson files_id;
+    char oid[25];
+
+    if (up->cmd_init) {
+        bson_destroy(&up->cmd);
+        up->cmd_init = 0;
+    }
+
+    if (!up->written || up->done) {
+        return;
+    }
+    up->done = 1;
+
+    bson_oid_to_string(&up->files_id, oid);
+
+    if (!up->mongo_conn->conn.connected
+        && ngx_http_gridfs_reconnect(request, up->mongo_conn) == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0,
+                      "Could not remove the chunks of an incomplete upload of \"%s\", "
+                      "files_id %s left in \"%s\"", up->key, oid, up->chunks_ns);
+        return;
+    }
+
+    bson_init(&files_id);
+    bson_append_oid(&files_id, "files_id", &up->files_id);
+    bson_finish(&files_id);
+    bson_find(&id, &files_id, "files_id");
+
+    if (ngx_http_gridfs_upload_remove(request, up, up->chunks_ns, "files_id", &id) != NGX_OK) {
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0,
+                      "Could not remove the chunks of an incomplete upload of \"%s\", "
+                      "files_id %s left in \"%s\"", up->key, oid, up->chunks_ns);
+    }
+
+    bson_destroy(&files_id);
+}
+
+/* A request ended without finishing or aborting its upload, e.g. by a
+ * timeout, still has chunks to remove. */
+static void ngx_http_gridfs_upload_cleanup(ngx_http_gridfs_upload_t* up) {
+    ngx_http_gridfs_upload_abort(up->request, up);
+
+    if (up->id_init) {
+        bson_destroy(&up->id);
+    }
+}
+
+/* Make sure of the unique index on the chunks' files_id and n, once per
+ * worker. It keeps two uploads from ever mixing chunks under one files_id;
+ * an index that can't be made is logged and left to the operator. */
+static void ngx_http_gridfs_upload_index(ngx_http_request_t* request, ngx_http_gridfs_loc_conf_t* gridfs_conf, ngx_http_gridfs_upload_t* up) {
+    bson cmd;
+
+    if (gridfs_conf->upload_indexed) {
+        return;
+    }
+    gridfs_conf->upload_indexed = 1;
+
+    bson_init(&cmd);
+    bson_append_string(&cmd, "createIndexes", ngx_strchr(up->chunks_ns, '.') + 1);
+    bson_append_start_array(&cmd, "indexes");
+    bson_append_start_object(&cmd, "0");
+    bson_append_start_object(&cmd, "key");
+    bson_append_int(&cmd, "files_id", 1);
+    bson_append_int(&cmd, "n", 1);
+    bson_append_finish_object(&cmd);
+    bson_append_string(&cmd, "name", "files_id_1_n_1");
+    bson_append_bool(&cmd, "unique", 1);
+    bson_append_finish_object(&cmd);
+    bson_append_finish_array(&cmd);
+
+    (void) ngx_http_gridfs_write_command(request, up->mongo_conn, &cmd, "createIndexes",
+                                         up->chunks_ns);
+}
+
+/* Take in what arrived of the body. Returns NGX_AGAIN while more is to come,
+ * otherwise the status to finalize the request with. */
+static ngx_int_t ngx_http_gridfs_upload_body(ngx_http_request_t* request) {
+    ngx_http_gridfs_ctx_t* ctx;
+    ngx_http_request_body_t* rb;
+    ngx_chain_t* cl;
+    ngx_int_t rc;
+
+    ctx = ngx_http_get_module_ctx(request, ngx_http_gridfs_module);
+    rb = request->request_body;
+
+    for ( ;; ) {
+        for (cl = rb->bufs; cl; cl = cl->next) {
+            rc = ngx_http_gridfs_upload_buf(request, ctx->upload, cl->buf);
+            if (rc != NGX_OK) {
+                return rc;
+            }
+        }
+        rb->bufs = NULL;
+
+        if (!request->reading_body) {
+            break;
+        }
+
+        rc = ngx_http_read_unbuffered_request_body(request);
+        if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+            return rc;
+        }
+
+        if (rb->bufs == NULL && request->reading_body) {
+            return NGX_AGAIN;
+        }
+    }
+
+    return ngx_http_gridfs_upload_finish(request, ctx->upload);
+}
+
+static void ngx_http_gridfs_upload_read_handler(ngx_http_request_t* request) {
+    ngx_http_gridfs_ctx_t* ctx;
+    ngx_int_t rc;
+
+    ctx = ngx_http_get_module_ctx(request, ngx_http_gridfs_module);
+
+    rc = ngx_http_gridfs_upload_body(request);
+    if (rc == NGX_AGAIN) {
+        return;
+    }
+
+    if (rc != NGX_OK) {
+        ngx_http_gridfs_upload_abort(request, ctx->upload);
+    }
+
+    ngx_http_gridfs_count_status(request, rc);
+    ngx_http_finalize_request(request, rc);
+}
+
+static void ngx_http_gridfs_upload_body_handler(ngx_http_request_t* request) {
+    /* Later parts of the body are read as they arrive */
+    request->read_event_handler = ngx_http_gridfs_upload_read_handler;
+    ngx_http_gridfs_upload_read_handler(request);
+}
+
+/* PUT or POST a file to the location's key. The file becomes visible once
+ * every chunk is in; an existing key is answered with 409. */
+static ngx_int_t ngx_http_gridfs_upload_handler(ngx_http_request_t* request) {
+    ngx_http_gridfs_loc_conf_t* gridfs_conf;
+    ngx_http_gridfs_ctx_t* ctx;
+    ngx_http_gridfs_upload_t* up;
+    ngx_http_mongo_connection_t* mongo_conn;
+    bson query, fields, found;
+    uint64_t op_start;
+    size_t len;
+    int status;
+    ngx_int_t rc;
+
+    gridfs_conf = ngx_http_get_module_loc_conf(request, ngx_http_gridfs_module);
+    ctx = ngx_http_get_module_ctx(request, ngx_http_gridfs_module);
+
+    up = ngx_pcalloc(request->pool, sizeof(ngx_http_gridfs_upload_t));
+    if (up == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    ctx->upload = up;
+    up->request = request;
+
+    // ---------- RETRIEVE KEY ---------- //
+
+    rc = ngx_http_gridfs_request_key(request, gridfs_conf, &up->key);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    if (!ngx_http_gridfs_key_valid(gridfs_conf->type, up->key)) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    len = gridfs_conf->db.len + gridfs_conf->root_collection.len + sizeof(".") + sizeof(".chunks");
+    up->files_ns = ngx_pnalloc(request->pool, len);
+    up->chunks_ns = ngx_pnalloc(request->pool, len);
+    up->chunk = ngx_palloc(request->pool, gridfs_conf->upload_chunk_size);
+    if (up->files_ns == NULL || up->chunks_ns == NULL || up->chunk == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    ngx_sprintf((u_char*) up->files_ns, "%V.%V.files%Z", &gridfs_conf->db,
+                &gridfs_conf->root_collection);
+    ngx_sprintf((u_char*) up->chunks_ns, "%V.%V.chunks%Z", &gridfs_conf->db,
+                &gridfs_conf->root_collection);
+    up->chunk_size = gridfs_conf->upload_chunk_size;
+    ngx_md5_init(&up->md5);
+
+    // ---------- ENSURE MONGO CONNECTION ---------- //
+
+    rc = ngx_http_gridfs_get_connection(request, gridfs_conf, &mongo_conn);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+    up->mongo_conn = mongo_conn;
+    ctx->mongo_conn = mongo_conn;
+
+    // ---------- CHECK THE KEY IS FREE ---------- //
+
+    if (ngx_http_gridfs_key_query(request->pool, gridfs_conf, up->key, &query) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    bson_init(&fields);
+    bson_append_int(&fields, "_id", 1);
+    bson_finish(&fields);
+
+    for ( ;; ) {
+        mongo_clear_errors(&mongo_conn->conn);
+        op_start = ngx_http_gridfs_usec();
+        status = mongo_find_one(&mongo_conn->conn, up->files_ns, &query, &fields, &found);
+        ngx_http_gridfs_trace(request, mongo_conn, "find", up->files_ns, -1,
+                              ngx_http_gridfs_usec() - op_start,
+                              status == MONGO_OK ? bson_size(&found) : 0);
+
+        if (status == MONGO_OK || mongo_conn->conn.err == MONGO_CONN_SUCCESS) {
+            break;
+        }
+
+        ctx->ecounter++;
+        if (ctx->ecounter > MONGO_MAX_RETRIES_PER_REQUEST
+            || ngx_http_gridfs_reconnect(request, mongo_conn) == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                          "Mongo connection dropped, could not reconnect");
+            if(mongo_conn->conn.connected) { mongo_disconnect(&mongo_conn->conn); }
+            bson_destroy(&fields);
+            return NGX_HTTP_SERVICE_UNAVAILABLE;
+        }
     }
-    *write = '\0';
-    return 1;
+
+    bson_destroy(&fields);
+
+    if (status == MONGO_OK) {
+        bson_destroy(&found);
+        return NGX_HTTP_CONFLICT;
+    }
+
+    ngx_http_gridfs_upload_index(request, gridfs_conf, up);
+
+    /* The key is the file's _id, or its _id is the chunks' ObjectId with
+     * the key alongside */
+    bson_oid_gen(&up->files_id);
+    bson_init(&up->id);
+    if (ngx_strcmp(gridfs_conf->field.data, "_id") == 0) {
+        ngx_http_gridfs_append_key(&up->id, "_id", gridfs_conf->type, up->key);
+        up->relink = 1;
+    } else {
+        bson_append_oid(&up->id, "_id", &up->files_id);
+    }
+    bson_finish(&up->id);
+    up->id_init = 1;
+
+    // ---------- STREAM THE BODY ---------- //
+
+    request->request_body_no_buffering = 1;
+
+    rc = ngx_http_read_client_request_body(request, ngx_http_gridfs_upload_body_handler);
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        return rc;
+    }
+
+    return NGX_DONE;
+}
+
+// ---------- MP4 ---------- //
+
+#define GRIDFS_MP4_GET_32(p)                                                  \
+    (((uint32_t) (p)[0] << 24) | ((uint32_t) (p)[1] << 16)                    \
+     | ((uint32_t) (p)[2] << 8) | (uint32_t) (p)[3])
+
+#define GRIDFS_MP4_GET_64(p)                                                  \
+    (((uint64_t) GRIDFS_MP4_GET_32(p) << 32) | GRIDFS_MP4_GET_32((p) + 4))
+
+#define GRIDFS_MP4_SET_32(p, n)                                               \
+    (p)[0] = (u_char) ((n) >> 24);                                            \
+    (p)[1] = (u_char) ((n) >> 16);                                            \
+    (p)[2] = (u_char) ((n) >> 8);                                             \
+    (p)[3] = (u_char) (n)
+
+#define GRIDFS_MP4_SET_64(p, n)                                               \
+    GRIDFS_MP4_SET_32(p, (uint32_t) ((uint64_t) (n) >> 32));                  \
+    GRIDFS_MP4_SET_32((p) + 4, (uint32_t) (n))
+
+#define GRIDFS_MP4_IS(p, t) (ngx_memcmp((p) + 4, t, 4) == 0)
+
+/* Read bytes [offset, offset + len) of the file, fetching only the chunks
+ * they span. The last chunk fetched is kept, as atom headers tend to be
+ * read one after the other from the same chunk. */
+static ngx_int_t ngx_http_gridfs_mp4_read(ngx_http_gridfs_mp4_t* mp4, uint64_t offset, size_t len, u_char* buf) {
+    mongo_cursor* cursor;
+    bson_iterator it;
+    uint64_t first, last, start, from, to;
+    const char* data;
+    size_t got, clen;
+    ngx_uint_t n;
+    uint64_t fetch_start, usec;
+    size_t reply = 0;
+
+    first = offset / mp4->chunk_size;
+    last = (offset + len - 1) / mp4->chunk_size;
+
+    if (first == last && (ngx_int_t) first == mp4->cached) {
+        start = first * mp4->chunk_size;
+        if (offset + len - start > mp4->cache_len) {
+            return NGX_ERROR;
+        }
+        ngx_memcpy(buf, mp4->cache + (offset - start), len);
+        return NGX_OK;
+    }
+
+    /* A cached body holds every chunk */
+    if (mp4->ctx->body != NULL) {
+        got = 0;
+        for (n = first; n <= last; n++) {
+            if (ngx_http_gridfs_body_chunk(mp4->ctx->body, n, &it) != NGX_OK) {
+                return NGX_ERROR;
+            }
+            data = bson_iterator_bin_data(&it);
+            clen = bson_iterator_bin_len(&it);
+            start = (uint64_t) n * mp4->chunk_size;
+            from = ngx_max(start, offset);
+            to = ngx_min(start + clen, offset + len);
+            if (from < to) {
+                ngx_memcpy(buf + (from - offset), data + (from - start), to - from);
+                got += to - from;
+            }
+        }
+        return got == len ? NGX_OK : NGX_ERROR;
+    }
+
+    fetch_start = ngx_http_gridfs_usec();
+    cursor = gridfile_get_chunks(&mp4->ctx->gfile, first, last - first + 1);
+    if (cursor == NULL) {
+        return NGX_ERROR;
+    }
+
+    got = 0;
+    while (mongo_cursor_next(cursor) == MONGO_OK) {
+        reply += bson_size(&cursor->current);
+        if (bson_find(&it, &cursor->current, "n") == BSON_EOO) {
+            continue;
+        }
+        n = bson_iterator_int(&it);
+        if (n < first || n > last
+            || bson_find(&it, &cursor->current, "data") != BSON_BINDATA) {
+            continue;
+        }
+        data = bson_iterator_bin_data(&it);
+        clen = bson_iterator_bin_len(&it);
+        ngx_http_gridfs_count(mp4->request, GRIDFS_STAT(chunks), 1);
+        ngx_http_gridfs_count(mp4->request, GRIDFS_STAT(bytes), clen);
+
+        start = (uint64_t) n * mp4->chunk_size;
+        from = ngx_max(start, offset);
+        to = ngx_min(start + clen, offset + len);
+        if (from < to) {
+            ngx_memcpy(buf + (from - offset), data + (from - start), to - from);
+            got += to - from;
+        }
+
+        if (n == last && clen <= mp4->chunk_size) {
+            ngx_memcpy(mp4->cache, data, clen);
+            mp4->cache_len = clen;
+            mp4->cached = n;
+        }
+    }
+
+    mongo_cursor_destroy(cursor);
+
+    usec = ngx_http_gridfs_usec() - fetch_start;
+    ngx_http_gridfs_trace(mp4->request, mp4->ctx->mongo_conn, "chunk",
+                          mp4->ctx->gfs.chunks_ns, first, usec, reply);
+    ngx_http_gridfs_observe(mp4->request, GRIDFS_STAT(chunk_fetch), usec);
+
+    return got == len ? NGX_OK : NGX_ERROR;
+}
+
+/* Split off the atom at p: its payload starts at *data, the next atom at
+ * *next. */
+static ngx_int_t ngx_http_gridfs_mp4_atom(u_char* p, u_char* end, u_char** data, u_char** next) {
+    uint64_t size;
+
+    if (end - p < 8) {
+        return NGX_ERROR;
+    }
+
+    size = GRIDFS_MP4_GET_32(p);
+    *data = p + 8;
+
+    if (size == 1) {
+        if (end - p < 16) {
+            return NGX_ERROR;
+        }
+        size = GRIDFS_MP4_GET_64(p + 8);
+        *data = p + 16;
+    } else if (size == 0) {
+        size = end - p;
+    }
+
+    if (size < (uint64_t) (*data - p) || size > (uint64_t) (end - p)) {
+        return NGX_ERROR;
+    }
+
+    *next = p + size;
+    return NGX_OK;
+}
+
+/* Find the atoms we rewrite in the buffered moov. */
+static ngx_int_t ngx_http_gridfs_mp4_parse(ngx_http_gridfs_mp4_t* mp4, u_char* p, u_char* end, ngx_http_gridfs_mp4_trak_t* trak) {
+    ngx_http_gridfs_mp4_trak_t* t;
+    u_char *data, *next, **slot;
+    ngx_int_t rc;
+
+    while (p < end) {
+        if (ngx_http_gridfs_mp4_atom(p, end, &data, &next) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        slot = NULL;
+
+        if (GRIDFS_MP4_IS(p, "moov") || GRIDFS_MP4_IS(p, "mdia")
+            || GRIDFS_MP4_IS(p, "minf") || GRIDFS_MP4_IS(p, "stbl")) {
+            rc = ngx_http_gridfs_mp4_parse(mp4, data, next, trak);
+            if (rc != NGX_OK) {
+                return rc;
+            }
+
+        } else if (GRIDFS_MP4_IS(p, "trak")) {
+            t = ngx_array_push(&mp4->traks);
+            if (t == NULL) {
+                return NGX_ERROR;
+            }
+            ngx_memzero(t, sizeof(ngx_http_gridfs_mp4_trak_t));
+            t->trak = p;
+            rc = ngx_http_gridfs_mp4_parse(mp4, data, next, t);
+            if (rc != NGX_OK) {
+                return rc;
+            }
+
+        } else if (GRIDFS_MP4_IS(p, "mvex") || GRIDFS_MP4_IS(p, "stz2")) {
+            /* Fragmented files and compact sample sizes */
+            return NGX_DECLINED;
+
+        } else if (GRIDFS_MP4_IS(p, "mvhd")) {
+            slot = &mp4->mvhd;
+
+        } else if (trak != NULL) {
+            if (GRIDFS_MP4_IS(p, "tkhd")) {
+                slot = &trak->tkhd;
+            } else if (GRIDFS_MP4_IS(p, "mdhd")) {
+                slot = &trak->mdhd;
+            } else if (GRIDFS_MP4_IS(p, "stts")) {
+                slot = &trak->stts;
+            } else if (GRIDFS_MP4_IS(p, "ctts")) {
+                slot = &trak->ctts;
+            } else if (GRIDFS_MP4_IS(p, "stss")) {
+                slot = &trak->stss;
+            } else if (GRIDFS_MP4_IS(p, "stsc")) {
+                slot = &trak->stsc;
+            } else if (GRIDFS_MP4_IS(p, "stsz")) {
+                slot = &trak->stsz;
+            } else if (GRIDFS_MP4_IS(p, "stco")) {
+                slot = &trak->stco;
+            } else if (GRIDFS_MP4_IS(p, "co64")) {
+                slot = &trak->stco;
+                trak->co64 = 1;
+            }
+        }
+
+        if (slot != NULL) {
+            /* Atoms we patch or replace must have a plain header */
+            if (data != p + 8 || *slot != NULL) {
+                return NGX_DECLINED;
+            }
+            *slot = p;
+        }
+
+        p = next;
+    }
+
+    return NGX_OK;
+}
+
+/* Whether a table atom is big enough for its entry count. */
+static ngx_uint_t ngx_http_gridfs_mp4_table_ok(u_char* atom, size_t header, size_t entry) {
+    uint64_t size = GRIDFS_MP4_GET_32(atom);
+
+    return size >= header && (size - header) / entry >= GRIDFS_MP4_GET_32(atom + header - 4);
+}
+
+static uint64_t ngx_http_gridfs_mp4_chunk_offset(ngx_http_gridfs_mp4_trak_t* t, ngx_uint_t chunk) {
+    return t->co64 ? GRIDFS_MP4_GET_64(t->stco + 16 + 8 * chunk)
+                   : GRIDFS_MP4_GET_32(t->stco + 16 + 4 * chunk);
+}
+
+static uint32_t ngx_http_gridfs_mp4_sample_size(ngx_http_gridfs_mp4_trak_t* t, ngx_uint_t sample) {
+    uint32_t size = GRIDFS_MP4_GET_32(t->stsz + 12);
+
+    return size ? size : GRIDFS_MP4_GET_32(t->stsz + 20 + 4 * sample);
+}
+
+/* Check a track's tables and expand its sample-to-chunk map. */
+static ngx_int_t ngx_http_gridfs_mp4_trak_init(ngx_http_gridfs_mp4_t* mp4, ngx_http_gridfs_mp4_trak_t* t) {
+    u_char* e;
+    ngx_uint_t i, n, c, first, next, total;
+    uint64_t samples;
+
+    if (t->tkhd == NULL || t->mdhd == NULL || t->stts == NULL
+        || t->stsc == NULL || t->stsz == NULL || t->stco == NULL) {
+        return NGX_DECLINED;
+    }
+
+    if (GRIDFS_MP4_GET_32(t->tkhd) < (t->tkhd[8] ? 44u : 32u)
+        || GRIDFS_MP4_GET_32(t->mdhd) < (t->mdhd[8] ? 40u : 28u)) {
+        return NGX_ERROR;
+    }
+
+    t->timescale = t->mdhd[8] ? GRIDFS_MP4_GET_32(t->mdhd + 28)
+                              : GRIDFS_MP4_GET_32(t->mdhd + 20);
+    if (t->timescale == 0) {
+        return NGX_ERROR;
+    }
+
+    if (!ngx_http_gridfs_mp4_table_ok(t->stts, 16, 8)
+        || (t->ctts && !ngx_http_gridfs_mp4_table_ok(t->ctts, 16, 8))
+        || (t->stss && !ngx_http_gridfs_mp4_table_ok(t->stss, 16, 4))
+        || !ngx_http_gridfs_mp4_table_ok(t->stsc, 16, 12)
+        || !ngx_http_gridfs_mp4_table_ok(t->stco, 16, t->co64 ? 8 : 4)
+        || GRIDFS_MP4_GET_32(t->stsz) < 20) {
+        return NGX_ERROR;
+    }
+
+    t->nsamples = GRIDFS_MP4_GET_32(t->stsz + 16);
+    if (GRIDFS_MP4_GET_32(t->stsz + 12) == 0
+        && (GRIDFS_MP4_GET_32(t->stsz) - 20) / 4 < t->nsamples) {
+        return NGX_ERROR;
+    }
+
+    /* Decode times must cover every sample */
+    n = GRIDFS_MP4_GET_32(t->stts + 12);
+    samples = 0;
+    for (i = 0, e = t->stts + 16; i < n; i++, e += 8) {
+        samples += GRIDFS_MP4_GET_32(e);
+    }
+    if (samples != t->nsamples) {
+        return NGX_ERROR;
+    }
+
+    t->nchunks = GRIDFS_MP4_GET_32(t->stco + 12);
+    t->chunk_samples = ngx_palloc(mp4->request->pool, t->nchunks * sizeof(ngx_uint_t));
+    t->chunk_desc = ngx_palloc(mp4->request->pool, t->nchunks * sizeof(uint32_t));
+    if (t->nchunks && (t->chunk_samples == NULL || t->chunk_desc == NULL)) {
+        return NGX_ERROR;
+    }
+
+    n = GRIDFS_MP4_GET_32(t->stsc + 12);
+    total = 0;
+    c = 0;
+    for (i = 0, e = t->stsc + 16; i < n; i++, e += 12) {
+        first = GRIDFS_MP4_GET_32(e);
+        next = (i + 1 < n) ? GRIDFS_MP4_GET_32(e + 12) : t->nchunks + 1;
+        if (first != c + 1 || next < first || next > t->nchunks + 1) {
+            return NGX_ERROR;
+        }
+        for ( ; c + 1 < next; c++) {
+            t->chunk_samples[c] = GRIDFS_MP4_GET_32(e + 4);
+            t->chunk_desc[c] = GRIDFS_MP4_GET_32(e + 8);
+            total += t->chunk_samples[c];
+        }
+    }
+
+    if (c != t->nchunks || total != t->nsamples) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/* The sample playing at a media time (or the first one starting at or
+ * after it, if ceil), and when it starts. nsamples if past the end. */
+static ngx_uint_t ngx_http_gridfs_mp4_sample_at(ngx_http_gridfs_mp4_trak_t* t, uint64_t time, ngx_uint_t ceil, uint64_t* start) {
+    u_char* e;
+    ngx_uint_t i, n, sample;
+    uint64_t acc, count, delta, k;
+
+    n = GRIDFS_MP4_GET_32(t->stts + 12);
+    acc = 0;
+    sample = 0;
+
+    for (i = 0, e = t->stts + 16; i < n; i++, e += 8) {
+        count = GRIDFS_MP4_GET_32(e);
+        delta = GRIDFS_MP4_GET_32(e + 4);
+
+        if (delta && time < acc + count * delta) {
+            k = (time - acc) / delta;
+            if (ceil && k * delta < time - acc) {
+                k++;
+            }
+            *start = acc + k * delta;
+            return sample + k;
+        }
+
+        acc += count * delta;
+        sample += count;
+    }
+
+    *start = acc;
+    return t->nsamples;
+}
+
+static uint64_t ngx_http_gridfs_mp4_sample_time(ngx_http_gridfs_mp4_trak_t* t, ngx_uint_t sample) {
+    u_char* e;
+    ngx_uint_t i, n;
+    uint64_t acc, count;
+
+    n = GRIDFS_MP4_GET_32(t->stts + 12);
+    acc = 0;
+
+    for (i = 0, e = t->stts + 16; i < n && sample; i++, e += 8) {
+        count = ngx_min(GRIDFS_MP4_GET_32(e), sample);
+        acc += count * GRIDFS_MP4_GET_32(e + 4);
+        sample -= count;
+    }
+
+    return acc;
+}
+
+/* The closest key frame at or before a sample. */
+static ngx_uint_t ngx_http_gridfs_mp4_key_frame(ngx_http_gridfs_mp4_trak_t* t, ngx_uint_t sample) {
+    u_char* e;
+    ngx_uint_t i, n, key, found;
+
+    n = GRIDFS_MP4_GET_32(t->stss + 12);
+    found = 0;
+
+    for (i = 0, e = t->stss + 16; i < n; i++, e += 4) {
+        key = GRIDFS_MP4_GET_32(e);
+        if (key == 0 || key > sample + 1) {
+            break;
+        }
+        found = key - 1;
+    }
+
+    return found;
+}
+
+/* Work out where a track resumes: its first sample, chunk and the file
+ * offset of that sample, and what is left of its duration. */
+static ngx_int_t ngx_http_gridfs_mp4_trak_cut(ngx_http_gridfs_mp4_t* mp4, ngx_http_gridfs_mp4_trak_t* t, uint64_t time) {
+    ngx_uint_t s, c, first, i;
+    uint64_t start, offset;
+
+    if (t->stss) {
+        s = ngx_http_gridfs_mp4_sample_at(t, time, 0, &start);
+        if (s < t->nsamples) {
+            s = ngx_http_gridfs_mp4_key_frame(t, s);
+        }
+    } else {
+        s = ngx_http_gridfs_mp4_sample_at(t, time, 1, &start);
+    }
+
+    t->start_sample = s;
+    t->duration = ngx_http_gridfs_mp4_sample_time(t, t->nsamples)
+                  - ngx_http_gridfs_mp4_sample_time(t, s);
+
+    if (s == t->nsamples) {
+        t->start_chunk = t->nchunks;
+        return NGX_OK;
+    }
+
+    first = 0;
+    for (c = 0; c < t->nchunks; c++) {
+        if (s < first + t->chunk_samples[c]) {
+            break;
+        }
+        first += t->chunk_samples[c];
+    }
+
+    t->start_chunk = c;
+    t->chunk_skip = s - first;
+
+    t->start_offset = ngx_http_gridfs_mp4_chunk_offset(t, c);
+    for (i = first; i < s; i++) {
+        t->start_offset += ngx_http_gridfs_mp4_sample_size(t, i);
+    }
+
+    /* Everything we keep must lie in the mdat we stream */
+    t->max_offset = t->start_offset;
+    for (c = t->start_chunk; c < t->nchunks; c++) {
+        offset = (c == t->start_chunk) ? t->start_offset
+                                       : ngx_http_gridfs_mp4_chunk_offset(t, c);
+        if (offset < mp4->mdat_start || offset >= mp4->mdat_end) {
+            return NGX_DECLINED;
+        }
+        t->max_offset = ngx_max(t->max_offset, offset);
+    }
+
+    return NGX_OK;
+}
+
+/* Copy a table of (count, value) runs, dropping the first skip samples. */
+static u_char* ngx_http_gridfs_mp4_write_runs(u_char* atom, ngx_uint_t skip, u_char* out) {
+    u_char *e, *start;
+    ngx_uint_t i, n, kept;
+    uint32_t count;
+
+    start = out;
+    out = ngx_cpymem(out, atom, 16);
+
+    n = GRIDFS_MP4_GET_32(atom + 12);
+    kept = 0;
+
+    for (i = 0, e = atom + 16; i < n; i++, e += 8) {
+        count = GRIDFS_MP4_GET_32(e);
+        if (skip >= count) {
+            skip -= count;
+            continue;
+        }
+        count -= skip;
+        skip = 0;
+        GRIDFS_MP4_SET_32(out, count);
+        ngx_memcpy(out + 4, e + 4, 4);
+        out += 8;
+        kept++;
+    }
+
+    GRIDFS_MP4_SET_32(start, out - start);
+    GRIDFS_MP4_SET_32(start + 12, kept);
+    return out;
+}
+
+static u_char* ngx_http_gridfs_mp4_write_stss(ngx_http_gridfs_mp4_trak_t* t, u_char* out) {
+    u_char *e, *start;
+    ngx_uint_t i, n, kept;
+    uint32_t key;
+
+    start = out;
+    out = ngx_cpymem(out, t->stss, 16);
+
+    n = GRIDFS_MP4_GET_32(t->stss + 12);
+    kept = 0;
+
+    for (i = 0, e = t->stss + 16; i < n; i++, e += 4) {
+        key = GRIDFS_MP4_GET_32(e);
+        if (key > t->start_sample) {
+            GRIDFS_MP4_SET_32(out, key - t->start_sample);
+            out += 4;
+            kept++;
+        }
+    }
+
+    GRIDFS_MP4_SET_32(start, out - start);
+    GRIDFS_MP4_SET_32(start + 12, kept);
+    return out;
+}
+
+static u_char* ngx_http_gridfs_mp4_write_stsz(ngx_http_gridfs_mp4_trak_t* t, u_char* out) {
+    u_char* start;
+
+    start = out;
+    out = ngx_cpymem(out, t->stsz, 20);
+    GRIDFS_MP4_SET_32(start + 16, t->nsamples - t->start_sample);
+
+    if (GRIDFS_MP4_GET_32(t->stsz + 12) == 0) {
+        out = ngx_cpymem(out, t->stsz + 20 + 4 * t->start_sample,
+                         4 * (t->nsamples - t->start_sample));
+    }
+
+    GRIDFS_MP4_SET_32(start, out - start);
+    return out;
+}
+
+static u_char* ngx_http_gridfs_mp4_write_stsc(ngx_http_gridfs_mp4_trak_t* t, u_char* out) {
+    u_char* start;
+    ngx_uint_t c, kept, samples, last_samples;
+    uint32_t desc, last_desc;
+
+    start = out;
+    out = ngx_cpymem(out, t->stsc, 16);
+
+    kept = 0;
+    last_samples = 0;
+    last_desc = 0;
+
+    for (c = t->start_chunk; c < t->nchunks; c++) {
+        samples = t->chunk_samples[c];
+        if (c == t->start_chunk) {
+            samples -= t->chunk_skip;
+        }
+        desc = t->chunk_desc[c];
+
+        if (kept && samples == last_samples && desc == last_desc) {
+            continue;
+        }
+
+        GRIDFS_MP4_SET_32(out, c - t->start_chunk + 1);
+        GRIDFS_MP4_SET_32(out + 4, samples);
+        GRIDFS_MP4_SET_32(out + 8, desc);
+        out += 12;
+        kept++;
+
+        last_samples = samples;
+        last_desc = desc;
+    }
+
+    GRIDFS_MP4_SET_32(start, out - start);
+    GRIDFS_MP4_SET_32(start + 12, kept);
+    return out;
+}
+
+/* Chunk offsets are filled in once the size of the new moov is known. */
+static u_char* ngx_http_gridfs_mp4_write_stco(ngx_http_gridfs_mp4_trak_t* t, u_char* out) {
+    u_char* start;
+    ngx_uint_t n;
+
+    n = t->nchunks - t->start_chunk;
+    start = out;
+
+    out = ngx_cpymem(out, t->stco, 16);
+    ngx_memcpy(start + 4, t->out_co64 ? "co64" : "stco", 4);
+    GRIDFS_MP4_SET_32(start + 12, n);
+
+    t->out_offsets = out;
+    out += n * (t->out_co64 ? 8 : 4);
+
+    GRIDFS_MP4_SET_32(start, out - start);
+    return out;
+}
+
+static void ngx_http_gridfs_mp4_set_offsets(ngx_http_gridfs_mp4_t* mp4, ngx_http_gridfs_mp4_trak_t* t) {
+    u_char* p;
+    ngx_uint_t c;
+    uint64_t offset;
+
+    p = t->out_offsets;
+
+    for (c = t->start_chunk; c < t->nchunks; c++) {
+        offset = (c == t->start_chunk) ? t->start_offset
+                                       : ngx_http_gridfs_mp4_chunk_offset(t, c);
+        offset += mp4->shift;
+
+        if (t->out_co64) {
+            GRIDFS_MP4_SET_64(p, offset);
+            p += 8;
+        } else {
+            GRIDFS_MP4_SET_32(p, offset);
+            p += 4;
+        }
+    }
+}
+
+/* Durations of the cut movie, in the movie or media timescale. */
+static void ngx_http_gridfs_mp4_set_duration(u_char* atom, size_t v0, size_t v1, uint64_t duration) {
+    if (atom[8]) {
+        GRIDFS_MP4_SET_64(atom + v1, duration);
+    } else {
+        GRIDFS_MP4_SET_32(atom + v0, (uint32_t) ngx_min(duration, NGX_MAX_UINT32_VALUE));
+    }
+}
+
+/* Write the cut moov: containers are rebuilt, edit lists dropped, sample
+ * tables replaced and headers copied with their durations updated. */
+static u_char* ngx_http_gridfs_mp4_write(ngx_http_gridfs_mp4_t* mp4, u_char* p, u_char* end, u_char* out, ngx_http_gridfs_mp4_trak_t* trak) {
+    ngx_http_gridfs_mp4_trak_t* t;
+    u_char *data, *next, *atom;
+    ngx_uint_t i;
+
+    while (p < end) {
+        ngx_http_gridfs_mp4_atom(p, end, &data, &next);
+        atom = out;
+
+        if (GRIDFS_MP4_IS(p, "edts")) {
+            /* Edits refer to the uncut timeline */
+
+        } else if (GRIDFS_MP4_IS(p, "moov") || GRIDFS_MP4_IS(p, "trak")
+                   || GRIDFS_MP4_IS(p, "mdia") || GRIDFS_MP4_IS(p, "minf")
+                   || GRIDFS_MP4_IS(p, "stbl")) {
+            t = trak;
+            if (GRIDFS_MP4_IS(p, "trak")) {
+                t = mp4->traks.elts;
+                for (i = 0; t[i].trak != p; i++) { /* void */ }
+                t = &t[i];
+            }
+            out = ngx_http_gridfs_mp4_write(mp4, data, next, out + 8, t);
+            GRIDFS_MP4_SET_32(atom, out - atom);
+            ngx_memcpy(atom + 4, p + 4, 4);
+
+        } else if (trak && p == trak->stts) {
+            out = ngx_http_gridfs_mp4_write_runs(p, trak->start_sample, out);
+        } else if (trak && p == trak->ctts) {
+            out = ngx_http_gridfs_mp4_write_runs(p, trak->start_sample, out);
+        } else if (trak && p == trak->stss) {
+            out = ngx_http_gridfs_mp4_write_stss(trak, out);
+        } else if (trak && p == trak->stsz) {
+            out = ngx_http_gridfs_mp4_write_stsz(trak, out);
+        } else if (trak && p == trak->stsc) {
+            out = ngx_http_gridfs_mp4_write_stsc(trak, out);
+        } else if (trak && p == trak->stco) {
+            out = ngx_http_gridfs_mp4_write_stco(trak, out);
+
+        } else {
+            out = ngx_cpymem(out, p, next - p);
+
+            if (p == mp4->mvhd) {
+                ngx_http_gridfs_mp4_set_duration(atom, 24, 32, mp4->duration);
+            } else if (trak && p == trak->tkhd) {
+                ngx_http_gridfs_mp4_set_duration(atom, 28, 36,
+                    trak->duration * mp4->timescale / trak->timescale);
+            } else if (trak && p == trak->mdhd) {
+                ngx_http_gridfs_mp4_set_duration(atom, 24, 32, trak->duration);
+            }
+        }
+
+        p = next;
+    }
+
+    return out;
 }
 
-static void gridfs_parse_range(ngx_http_request_t* r, ngx_str_t* range_str, uint64_t* range_start, uint64_t* range_end, gridfs_offset content_length) {
-    u_char *p, *last;
-    off_t start, end;
-    ngx_uint_t bad;
-    enum {
-        sw_start = 0,
-        sw_first_byte_pos,
-        sw_first_byte_pos_n,
-        sw_last_byte_pos,
-        sw_last_byte_pos_n,
-        sw_done
-    } state = 0;
+/* Prepare a pseudo-streaming response starting "start" seconds in: a new
+ * ftyp/moov/mdat header, followed by the tail of the mdat from the chunk
+ * holding the first kept sample. Only the chunks holding the atom headers
+ * and the moov are fetched here. NGX_DECLINED sends the file as is. */
+static ngx_int_t ngx_http_gridfs_mp4(ngx_http_request_t* request, ngx_http_gridfs_ctx_t* ctx, ngx_str_t* arg, gridfs_offset length) {
+    ngx_http_gridfs_loc_conf_t* gridfs_conf;
+    ngx_http_gridfs_mp4_t mp4;
+    ngx_http_gridfs_mp4_trak_t* t;
+    ngx_chain_t *cl, **ll;
+    ngx_buf_t* b;
+    u_char header[16];
+    u_char *moov, *end;
+    uint64_t offset, size, ftyp_offset, ftyp_size, moov_offset, moov_size;
+    uint64_t win_time, win_scale, time, data_end, prefix;
+    size_t hlen, mdat_hlen, moov_len;
+    ngx_int_t start, rc;
+    ngx_uint_t i, changed, found;
 
-    p = (u_char *) ngx_strnstr(range_str->data, "bytes=", range_str->len);
+    gridfs_conf = ngx_http_get_module_loc_conf(request, ngx_http_gridfs_module);
 
-    if (p == NULL) {
-        return;
+    start = ngx_atofp(arg->data, arg->len, 3);
+    if (start == NGX_ERROR) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+    if (start == 0) {
+        return NGX_DECLINED;
     }
 
-    p += sizeof("bytes=") - 1;
-    last = range_str->data + range_str->len;
+    ngx_memzero(&mp4, sizeof(ngx_http_gridfs_mp4_t));
+    mp4.request = request;
+    mp4.ctx = ctx;
+    mp4.chunk_size = gridfile_get_chunksize(&ctx->gfile);
+    mp4.cached = -1;
 
-    /*
-     * bytes= contain ranges compatible with RFC 2616, "14.35.1 Byte Ranges",
-     * but no whitespaces permitted
-     */
+    if (mp4.chunk_size == 0 || length < 16) {
+        return NGX_DECLINED;
+    }
 
-    bad = 0;
-    start = 0;
-    end = 0;
+    mp4.cache = ngx_palloc(request->pool, mp4.chunk_size);
+    if (mp4.cache == NULL
+        || ngx_array_init(&mp4.traks, request->pool, 2, sizeof(ngx_http_gridfs_mp4_trak_t)) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 
-    while (p < last) {
+    // ---------- FIND THE TOP LEVEL ATOMS ---------- //
 
-        switch (state) {
+    ftyp_offset = ftyp_size = moov_offset = moov_size = 0;
+    found = FALSE;
 
-        case sw_start:
-        case sw_first_byte_pos:
-            if (*p == '-') {
-                p++;
-                state = sw_last_byte_pos;
+    for (offset = 0; length - offset >= 8; offset += size) {
+        hlen = ngx_min(sizeof(header), length - offset);
+        if (ngx_http_gridfs_mp4_read(&mp4, offset, hlen, header) != NGX_OK) {
+            return NGX_HTTP_SERVICE_UNAVAILABLE;
+        }
+
+        size = GRIDFS_MP4_GET_32(header);
+        hlen = 8;
+        if (size == 1) {
+            if (length - offset < 16) {
                 break;
             }
-            start = 0;
-            state = sw_first_byte_pos_n;
+            size = GRIDFS_MP4_GET_64(header + 8);
+            hlen = 16;
+        } else if (size == 0) {
+            size = length - offset;
+        }
 
-            /* fall through */
+        if (size < hlen || size > length - offset) {
+            ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                          "GridFS mp4 file is corrupt");
+            return NGX_DECLINED;
+        }
 
-        case sw_first_byte_pos_n:
-            if (*p == '-') {
-                p++;
-                state = sw_last_byte_pos;
-                break;
-            }
-            if (*p < '0' || *p > '9') {
-                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                               "bytes header filter: unexpected char '%c'"
-                               " (expected first-byte-pos)", *p);
-                bad = 1;
-                break;
+        if (GRIDFS_MP4_IS(header, "ftyp")) {
+            ftyp_offset = offset;
+            ftyp_size = size;
+        } else if (GRIDFS_MP4_IS(header, "moov")) {
+            moov_offset = offset;
+            moov_size = size;
+        } else if (GRIDFS_MP4_IS(header, "mdat")) {
+            if (found) {
+                return NGX_DECLINED;
             }
-            start = start * 10 + *p - '0';
-            p++;
-            break;
+            mp4.mdat_start = offset + hlen;
+            mp4.mdat_end = offset + size;
+            found = TRUE;
+        } else if (GRIDFS_MP4_IS(header, "moof")) {
+            return NGX_DECLINED;
+        }
+    }
 
-        case sw_last_byte_pos:
-            if (*p == ',' || *p == '&' || *p == ';') {
-                /* no last byte pos, assume end of file */
-                end = content_length - 1;
-                state = sw_done;
-                break;
-            }
-            end = 0;
-            state = sw_last_byte_pos_n;
+    if (moov_size == 0 || !found) {
+        return NGX_DECLINED;
+    }
 
-            /* fall though */
+    if (ftyp_size + moov_size > gridfs_conf->mp4_max_buffer_size) {
+        ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                      "GridFS mp4 moov atom is too large: %uL", moov_size);
+        return NGX_DECLINED;
+    }
 
-        case sw_last_byte_pos_n:
-            if (*p == ',' || *p == '&' || *p == ';') {
-                state = sw_done;
-                break;
-            }
-            if (*p < '0' || *p > '9') {
-                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                               "bytes header filter: unexpected char '%c'"
-                               " (expected last-byte-pos)", *p);
-                bad = 1;
-                break;
-            }
-            end = end * 10 + *p - '0';
-            p++;
-            break;
+    // ---------- READ AND PARSE THE MOOV ---------- //
 
-        case sw_done:
-            *range_start = start;
-            *range_end = end;
+    if (ftyp_size) {
+        mp4.ftyp = ngx_palloc(request->pool, ftyp_size);
+        if (mp4.ftyp == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        if (ngx_http_gridfs_mp4_read(&mp4, ftyp_offset, ftyp_size, mp4.ftyp) != NGX_OK) {
+            return NGX_HTTP_SERVICE_UNAVAILABLE;
+        }
+    }
 
-            break;
+    moov = ngx_palloc(request->pool, moov_size);
+    if (moov == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    if (ngx_http_gridfs_mp4_read(&mp4, moov_offset, moov_size, moov) != NGX_OK) {
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    rc = ngx_http_gridfs_mp4_parse(&mp4, moov, moov + moov_size, NULL);
+    if (rc == NGX_OK && (mp4.mvhd == NULL || mp4.traks.nelts == 0
+                         || GRIDFS_MP4_GET_32(mp4.mvhd) < (mp4.mvhd[8] ? 40u : 28u))) {
+        rc = NGX_ERROR;
+    }
+
+    t = mp4.traks.elts;
+    for (i = 0; rc == NGX_OK && i < mp4.traks.nelts; i++) {
+        rc = ngx_http_gridfs_mp4_trak_init(&mp4, &t[i]);
+    }
+
+    if (rc != NGX_OK) {
+        if (rc == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                          "GridFS mp4 moov atom is corrupt");
         }
+        return NGX_DECLINED;
+    }
 
-        if (bad) {
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                           "bytes header filter: invalid range specification");
-            return;
+    mp4.timescale = mp4.mvhd[8] ? GRIDFS_MP4_GET_32(mp4.mvhd + 28)
+                                : GRIDFS_MP4_GET_32(mp4.mvhd + 20);
+    if (mp4.timescale == 0) {
+        return NGX_DECLINED;
+    }
+
+    // ---------- CUT EVERY TRACK AT THE SAME TIME ---------- //
+
+    /* Start at the earliest key frame at or before the requested time in
+     * any track that has key frames, so that audio lines up with video. */
+    win_time = start;
+    win_scale = 1000;
+    found = FALSE;
+
+    for (i = 0; i < mp4.traks.nelts; i++) {
+        if (t[i].stss == NULL) {
+            continue;
+        }
+        time = (uint64_t) start * t[i].timescale / 1000;
+        if (ngx_http_gridfs_mp4_sample_at(&t[i], time, 0, &offset) == t[i].nsamples) {
+            continue;
+        }
+        time = ngx_http_gridfs_mp4_sample_time(&t[i],
+                   ngx_http_gridfs_mp4_key_frame(&t[i],
+                       ngx_http_gridfs_mp4_sample_at(&t[i], time, 0, &offset)));
+        if (!found || time * win_scale < win_time * t[i].timescale) {
+            win_time = time;
+            win_scale = t[i].timescale;
+            found = TRUE;
         }
     }
 
-    switch (state) {
+    mp4.data_start = mp4.mdat_end;
+    found = FALSE;
 
-    case sw_last_byte_pos:
-        end = content_length - 1;
+    for (i = 0; i < mp4.traks.nelts; i++) {
+        time = (win_time * t[i].timescale + win_scale - 1) / win_scale;
+        rc = ngx_http_gridfs_mp4_trak_cut(&mp4, &t[i], time);
+        if (rc != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                          "GridFS mp4 chunk offsets are outside of mdat");
+            return NGX_DECLINED;
+        }
+        if (t[i].start_sample < t[i].nsamples) {
+            mp4.data_start = ngx_min(mp4.data_start, t[i].start_offset);
+            found = TRUE;
+        }
+        mp4.duration = ngx_max(mp4.duration,
+                               t[i].duration * mp4.timescale / t[i].timescale);
+    }
 
-    case sw_last_byte_pos_n:
-        if (start > end) {
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                           "bytes header filter: invalid range specification");
-            return;
+    if (!found) {
+        ngx_log_error(NGX_LOG_INFO, request->connection->log, 0,
+                      "GridFS mp4 start time is past the end of the file");
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    // ---------- WRITE THE NEW HEADER ---------- //
+
+    data_end = mp4.mdat_end;
+    mdat_hlen = (data_end - mp4.data_start + 8 > NGX_MAX_UINT32_VALUE) ? 16 : 8;
+
+    moov_len = moov_size;
+    for (i = 0; i < mp4.traks.nelts; i++) {
+        moov_len += t[i].nchunks * (12 + 8);
+    }
+
+    mp4.moov = ngx_palloc(request->pool, moov_len);
+    if (mp4.moov == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* Chunk offsets move by the change in header size; switch tracks to
+     * 64-bit offsets until they all fit. */
+    do {
+        end = ngx_http_gridfs_mp4_write(&mp4, moov, moov + moov_size, mp4.moov, NULL);
+        mp4.moov_len = end - mp4.moov;
+
+        prefix = ftyp_size + mp4.moov_len + mdat_hlen;
+        mp4.shift = (int64_t) prefix - (int64_t) mp4.data_start;
+
+        changed = FALSE;
+        for (i = 0; i < mp4.traks.nelts; i++) {
+            if (!t[i].out_co64 && t[i].start_sample < t[i].nsamples
+                && t[i].max_offset + mp4.shift > NGX_MAX_UINT32_VALUE) {
+                t[i].out_co64 = 1;
+                changed = TRUE;
+            }
         }
+    } while (changed);
 
-        *range_start = start;
-        *range_end = end;
-        break;
+    for (i = 0; i < mp4.traks.nelts; i++) {
+        ngx_http_gridfs_mp4_set_offsets(&mp4, &t[i]);
+    }
 
-    default:
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "bytes header filter: invalid range specification");
-        return;
+    // ---------- SET UP THE RESPONSE ---------- //
+
+    b = ngx_create_temp_buf(request->pool, mdat_hlen);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    if (mdat_hlen == 16) {
+        GRIDFS_MP4_SET_32(b->last, 1);
+        ngx_memcpy(b->last + 4, "mdat", 4);
+        GRIDFS_MP4_SET_64(b->last + 8, data_end - mp4.data_start + 16);
+    } else {
+        GRIDFS_MP4_SET_32(b->last, data_end - mp4.data_start + 8);
+        ngx_memcpy(b->last + 4, "mdat", 4);
+    }
+    b->last += mdat_hlen;
+
+    ctx->prefix = NULL;
+    ll = &ctx->prefix;
 
+    for (i = 0; i < 3; i++) {
+        if (i == 0 && ftyp_size == 0) {
+            continue;
+        }
+        cl = ngx_alloc_chain_link(request->pool);
+        if (cl == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        if (i < 2) {
+            cl->buf = ngx_calloc_buf(request->pool);
+            if (cl->buf == NULL) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+            cl->buf->pos = (i == 0) ? mp4.ftyp : mp4.moov;
+            cl->buf->last = cl->buf->pos + ((i == 0) ? ftyp_size : mp4.moov_len);
+            cl->buf->memory = 1;
+        } else {
+            cl->buf = b;
+        }
+        *ll = cl;
+        ll = &cl->next;
     }
+    *ll = NULL;
+
+    ctx->prefix_len = prefix;
+    ctx->ranged = 1;
+    ctx->range_start = mp4.data_start;
+    ctx->range_end = data_end - 1;
+
+    /* Skip the chunks before the cut */
+    ctx->chunk = mp4.data_start / mp4.chunk_size;
+    ctx->released = ctx->chunk;
+    ctx->offset = (uint64_t) ctx->chunk * mp4.chunk_size;
+
+    return NGX_OK;
 }
 
-static ngx_int_t ngx_http_gridfs_handler(ngx_http_request_t* request) {
-    ngx_http_gridfs_loc_conf_t* gridfs_conf;
+// ---------- STATUS ---------- //
+
+typedef struct {
+    char* name;
+    char* help;
+    size_t offset;
+} ngx_http_gridfs_stat_t;
+
+static ngx_http_gridfs_stat_t ngx_http_gridfs_counters[] = {
+    { "requests", "Requests handled.", GRIDFS_STAT(requests) },
+    { "not_found", "Requests answered with 404.", GRIDFS_STAT(not_found) },
+    { "unavailable", "Requests answered with 503.", GRIDFS_STAT(unavailable) },
+    { "reconnects", "Reconnects to mongo.", GRIDFS_STAT(reconnects) },
+    { "reauths", "Reauthentications after a reconnect.", GRIDFS_STAT(reauths) },
+    { "chunks_fetched", "Chunks fetched from mongo.", GRIDFS_STAT(chunks) },
+    { "backend_bytes", "Chunk data bytes fetched from mongo.", GRIDFS_STAT(bytes) },
+    { NULL, NULL, 0 }
+};
+
+static ngx_http_gridfs_stat_t ngx_http_gridfs_histograms[] = {
+    { "lookup_seconds", "File metadata lookup latency.", GRIDFS_STAT(lookup) },
+    { "chunk_fetch_seconds", "Chunk fetch latency.", GRIDFS_STAT(chunk_fetch) },
+    { NULL, NULL, 0 }
+};
+
+/* Upper bounds of the histogram buckets, in microseconds. */
+static uint64_t ngx_http_gridfs_bucket_usec[GRIDFS_STATS_BUCKETS - 1] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000
+};
+
+static char* ngx_http_gridfs_bucket_names[GRIDFS_STATS_BUCKETS] = {
+    "0.001", "0.0025", "0.005", "0.01", "0.025", "0.05", "0.1", "0.25",
+    "0.5", "1", "2.5", "+Inf"
+};
+
+static ngx_int_t ngx_http_gridfs_status_handler(ngx_http_request_t* request);
+
+/* Parse the 'gridfs_status' directive. */
+static char* ngx_http_gridfs_status(ngx_conf_t* cf, ngx_command_t* command, void* void_conf) {
+    ngx_http_gridfs_main_conf_t* gridfs_main_conf;
     ngx_http_core_loc_conf_t* core_conf;
-    ngx_buf_t* buffer;
-    ngx_chain_t out;
-    ngx_str_t location_name;
-    ngx_str_t full_uri;
-    char* value;
-    ngx_http_mongo_connection_t *mongo_conn;
-    gridfs gfs;
-    gridfile gfile;
-    gridfs_offset length;
-    ngx_uint_t numchunks;
-    char* contenttype;
-    char* md5;
-    bson_date_t last_modified;
 
-    volatile ngx_uint_t i;
-    ngx_int_t rc = NGX_OK;
-    bson query;
-    bson_oid_t oid;
-    mongo_cursor ** cursors;
-    gridfs_offset chunk_len;
-    const char * chunk_data;
-    bson_iterator it;
-    bson chunk;
-    ngx_pool_cleanup_t* gridfs_cln;
-    ngx_http_gridfs_cleanup_t* gridfs_clndata;
-    int status;
-    volatile ngx_uint_t e = FALSE;
-    volatile ngx_uint_t ecounter = 0;
-    uint64_t range_start = 0;
-    uint64_t range_end   = 0;
-    uint64_t current_buf_pos = 0;
+    core_conf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    core_conf->handler = ngx_http_gridfs_status_handler;
+
+    gridfs_main_conf = ngx_http_conf_get_module_main_conf(cf, ngx_http_gridfs_module);
+    gridfs_main_conf->status = 1;
+
+    return NGX_CONF_OK;
+}
+
+/* Number the backends and size the counters zone, once every location has
+ * been merged. */
+static ngx_int_t ngx_http_gridfs_init_stats(ngx_conf_t* cf) {
+    ngx_http_gridfs_main_conf_t* gridfs_main_conf;
+    ngx_http_gridfs_loc_conf_t** gridfs_loc_confs;
+    ngx_shm_zone_t* shm_zone;
+    ngx_str_t* backends;
+    ngx_str_t name = ngx_string("gridfs_status");
+    ngx_uint_t i, j;
+    size_t size;
+
+    gridfs_main_conf = ngx_http_conf_get_module_main_conf(cf, ngx_http_gridfs_module);
+    if (!gridfs_main_conf->status) {
+        return NGX_OK;
+    }
+
+    if (ngx_array_init(&gridfs_main_conf->backends, cf->pool, 4, sizeof(ngx_str_t))
+        != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    gridfs_loc_confs = gridfs_main_conf->loc_confs.elts;
+
+    for (i = 0; i < gridfs_main_conf->loc_confs.nelts; i++) {
+        backends = gridfs_main_conf->backends.elts;
+        for (j = 0; j < gridfs_main_conf->backends.nelts; j++) {
+            if (backends[j].len == gridfs_loc_confs[i]->mongo.len
+                && ngx_strncmp(backends[j].data, gridfs_loc_confs[i]->mongo.data,
+                               backends[j].len) == 0) {
+                break;
+            }
+        }
+        if (j == gridfs_main_conf->backends.nelts) {
+            backends = ngx_array_push(&gridfs_main_conf->backends);
+            if (backends == NULL) {
+                return NGX_ERROR;
+            }
+            *backends = gridfs_loc_confs[i]->mongo;
+        }
+        gridfs_loc_confs[i]->backend_index = j;
+    }
+
+    size = sizeof(ngx_http_gridfs_stats_t)
+           * (gridfs_main_conf->loc_confs.nelts + gridfs_main_conf->backends.nelts);
+
+    shm_zone = ngx_shared_memory_add(cf, &name, ngx_align(size, ngx_pagesize) + 8 * ngx_pagesize,
+                                     &ngx_http_gridfs_module);
+    if (shm_zone == NULL) {
+        return NGX_ERROR;
+    }
+    shm_zone->init = ngx_http_gridfs_init_stats_zone;
+    shm_zone->data = gridfs_main_conf;
+
+    return NGX_OK;
+}
+
+/* Counters start from zero on reload, as locations may have moved. */
+static ngx_int_t ngx_http_gridfs_init_stats_zone(ngx_shm_zone_t* shm_zone, void* data) {
+    ngx_http_gridfs_main_conf_t* gridfs_main_conf = shm_zone->data;
+    ngx_http_gridfs_main_conf_t* old = data;
+    ngx_slab_pool_t* shpool;
+
+    shpool = (ngx_slab_pool_t*) shm_zone->shm.addr;
+
+    if (old != NULL && old->stats != NULL) {
+        ngx_slab_free(shpool, old->stats);
+    }
+
+    gridfs_main_conf->stats = ngx_slab_calloc(shpool, sizeof(ngx_http_gridfs_stats_t)
+                                              * (gridfs_main_conf->loc_confs.nelts
+                                                 + gridfs_main_conf->backends.nelts));
+    if (gridfs_main_conf->stats == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+static uint64_t ngx_http_gridfs_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Add n to a counter of the request's location and of its backend. */
+static void ngx_http_gridfs_count(ngx_http_request_t* request, size_t field, ngx_atomic_int_t n) {
+    ngx_http_gridfs_main_conf_t* gridfs_main_conf;
+    ngx_http_gridfs_loc_conf_t* gridfs_conf;
+    ngx_http_gridfs_stats_t* stats;
+    ngx_http_gridfs_ctx_t* ctx;
+
+    ctx = ngx_http_get_module_ctx(request, ngx_http_gridfs_module);
+    if (ctx != NULL) {
+        if (field == GRIDFS_STAT(reconnects)) {
+            ctx->retries += n;
+        } else if (field == GRIDFS_STAT(chunks)) {
+            if (ctx->chunks_fetched == 0) {
+                ctx->first_chunk_time = ngx_http_gridfs_usec() - ctx->start;
+            }
+            ctx->chunks_fetched += n;
+        } else if (field == GRIDFS_STAT(bytes)) {
+            ctx->backend_bytes += n;
+        }
+    }
+
+    gridfs_main_conf = ngx_http_get_module_main_conf(request, ngx_http_gridfs_module);
+    if (gridfs_main_conf->stats == NULL) {
+        return;
+    }
 
     gridfs_conf = ngx_http_get_module_loc_conf(request, ngx_http_gridfs_module);
-    core_conf = ngx_http_get_module_loc_conf(request, ngx_http_core_module);
 
-    // ---------- ENSURE MONGO CONNECTION ---------- //
+    stats = &gridfs_main_conf->stats[gridfs_conf->stats_index];
+    ngx_atomic_fetch_add((ngx_atomic_t*) ((u_char*) stats + field), n);
 
-    mongo_conn = ngx_http_get_mongo_connection( gridfs_conf->mongo );
-    if (mongo_conn == NULL) {
-        ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
-                      "Mongo Connection not found: \"%V\"", &gridfs_conf->mongo);
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    stats = &gridfs_main_conf->stats[gridfs_main_conf->loc_confs.nelts
+                                     + gridfs_conf->backend_index];
+    ngx_atomic_fetch_add((ngx_atomic_t*) ((u_char*) stats + field), n);
+}
+
+/* Count the error statuses a handler answered with. */
+static void ngx_http_gridfs_count_status(ngx_http_request_t* request, ngx_int_t rc) {
+    if (rc == NGX_HTTP_NOT_FOUND) {
+        ngx_http_gridfs_count(request, GRIDFS_STAT(not_found), 1);
+    } else if (rc == NGX_HTTP_SERVICE_UNAVAILABLE) {
+        ngx_http_gridfs_count(request, GRIDFS_STAT(unavailable), 1);
     }
+}
 
-    if (mongo_conn->conn.connected == 0) {
-        if (ngx_http_mongo_reconnect(request->connection->log, mongo_conn) == NGX_ERROR) {
-            ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
-                          "Could not connect to mongo: \"%V\"", &gridfs_conf->mongo);
-            if(mongo_conn->conn.connected) { mongo_disconnect(&mongo_conn->conn); }
-            return NGX_HTTP_SERVICE_UNAVAILABLE;
+/* Record a latency in one of the request's histograms. */
+static void ngx_http_gridfs_observe(ngx_http_request_t* request, size_t field, uint64_t usec) {
+    ngx_http_gridfs_ctx_t* ctx;
+    ngx_uint_t i;
+
+    ctx = ngx_http_get_module_ctx(request, ngx_http_gridfs_module);
+    if (ctx != NULL && field == GRIDFS_STAT(lookup)) {
+        ctx->lookup_time += usec;
+    }
+
+    for (i = 0; i < GRIDFS_STATS_BUCKETS - 1; i++) {
+        if (usec <= ngx_http_gridfs_bucket_usec[i]) {
+            break;
         }
-        if (ngx_http_mongo_reauth(request->connection->log, mongo_conn) == NGX_ERROR) {
-            ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
-                          "Failed to reauth to mongo: \"%V\"", &gridfs_conf->mongo);
-            if(mongo_conn->conn.connected) { mongo_disconnect(&mongo_conn->conn); }
-            return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    ngx_http_gridfs_count(request, field + offsetof(ngx_http_gridfs_histogram_t, buckets)
+                                   + i * sizeof(ngx_atomic_t), 1);
+    ngx_http_gridfs_count(request, field + offsetof(ngx_http_gridfs_histogram_t, sum),
+                          (ngx_atomic_int_t) usec);
+}
+
+/* Write name as a label value, escaped. */
+static u_char* ngx_http_gridfs_status_label(u_char* p, ngx_str_t* name) {
+    ngx_uint_t i;
+
+    for (i = 0; i < name->len; i++) {
+        if (name->data[i] == '"' || name->data[i] == '\\') {
+            *p++ = '\\';
+        } else if (name->data[i] == '\n') {
+            *p++ = '\\';
+            *p++ = 'n';
+            continue;
         }
+        *p++ = name->data[i];
     }
 
-    // ---------- RETRIEVE KEY ---------- //
+    return p;
+}
 
-    location_name = core_conf->name;
-    full_uri = request->uri;
+/* Answer with the counters, as text or in the Prometheus format. */
+static ngx_int_t ngx_http_gridfs_status_handler(ngx_http_request_t* request) {
+    ngx_http_gridfs_main_conf_t* gridfs_main_conf;
+    ngx_http_gridfs_loc_conf_t** gridfs_loc_confs;
+    ngx_http_gridfs_histogram_t* hist;
+    ngx_http_gridfs_stats_t* stats;
+    ngx_http_gridfs_stat_t* stat;
+    ngx_str_t* backends;
+    ngx_str_t* name;
+    ngx_str_t format;
+    ngx_buf_t* b;
+    ngx_chain_t out;
+    ngx_uint_t i, n, nstats, prometheus;
+    ngx_atomic_uint_t count;
+    size_t size, len;
+    char* label;
+    u_char* p;
+    ngx_int_t rc;
+
+    if (!(request->method & (NGX_HTTP_GET | NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
 
-    if (full_uri.len < location_name.len) {
-        ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
-                      "Invalid location name or uri.");
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    rc = ngx_http_discard_request_body(request);
+    if (rc != NGX_OK) {
+        return rc;
     }
 
-    value = (char*)malloc(sizeof(char) * (full_uri.len - location_name.len + 1));
-    if (value == NULL) {
-        ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
-                      "Failed to allocate memory for value buffer.");
+    gridfs_main_conf = ngx_http_get_module_main_conf(request, ngx_http_gridfs_module);
+    if (gridfs_main_conf->stats == NULL) {
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
-    memcpy(value, full_uri.data + location_name.len, full_uri.len - location_name.len);
-    value[full_uri.len - location_name.len] = '\0';
 
-    if (!url_decode(value)) {
-        ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
-                      "Malformed request.");
-        free(value);
-        return NGX_HTTP_BAD_REQUEST;
+    gridfs_loc_confs = gridfs_main_conf->loc_confs.elts;
+    backends = gridfs_main_conf->backends.elts;
+    nstats = gridfs_main_conf->loc_confs.nelts + gridfs_main_conf->backends.nelts;
+
+    prometheus = (ngx_http_arg(request, (u_char*) "format", 6, &format) == NGX_OK
+                  && format.len == 10
+                  && ngx_strncmp(format.data, "prometheus", 10) == 0);
+
+    /* Every line names its location or backend, escaped at worst */
+    size = 2048;
+    for (i = 0; i < nstats; i++) {
+        name = (i < gridfs_main_conf->loc_confs.nelts)
+               ? &gridfs_loc_confs[i]->name
+               : &backends[i - gridfs_main_conf->loc_confs.nelts];
+        size += (7 + 2 * (GRIDFS_STATS_BUCKETS + 2))
+                * (2 * name->len + 96 + 2 * NGX_ATOMIC_T_LEN);
     }
 
-    // ---------- RETRIEVE GRIDFILE ---------- //
+    b = ngx_create_temp_buf(request->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    p = b->last;
+
+    if (prometheus) {
+        for (stat = ngx_http_gridfs_counters; stat->name; stat++) {
+            p = ngx_sprintf(p, "# HELP gridfs_%s_total %s\n"
+                               "# TYPE gridfs_%s_total counter\n",
+                            stat->name, stat->help, stat->name);
+            for (i = 0; i < nstats; i++) {
+                label = (i < gridfs_main_conf->loc_confs.nelts) ? "location" : "backend";
+                name = (i < gridfs_main_conf->loc_confs.nelts)
+                       ? &gridfs_loc_confs[i]->name
+                       : &backends[i - gridfs_main_conf->loc_confs.nelts];
+                p = ngx_sprintf(p, "gridfs_%s_total{%s=\"", stat->name, label);
+                p = ngx_http_gridfs_status_label(p, name);
+                p = ngx_sprintf(p, "\"} %uA\n",
+                                *(ngx_atomic_t*) ((u_char*) &gridfs_main_conf->stats[i]
+                                                  + stat->offset));
+            }
+        }
 
-    do {
-        e = FALSE;
-        status = gridfs_init(&mongo_conn->conn,
-                             (const char*)gridfs_conf->db.data,
-                             (const char*)gridfs_conf->root_collection.data,
-                             &gfs);
-        if (status != MONGO_OK) {
-            e = TRUE; ecounter++;
-            if (ecounter > MONGO_MAX_RETRIES_PER_REQUEST
-                || ngx_http_mongo_reconnect(request->connection->log, mongo_conn) == NGX_ERROR
-                || ngx_http_mongo_reauth(request->connection->log, mongo_conn) == NGX_ERROR) {
-                ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
-                              "Mongo connection dropped, could not reconnect");
-                if(mongo_conn->conn.connected) { mongo_disconnect(&mongo_conn->conn); }
-                free(value);
-                return NGX_HTTP_SERVICE_UNAVAILABLE;
+        for (stat = ngx_http_gridfs_histograms; stat->name; stat++) {
+            p = ngx_sprintf(p, "# HELP gridfs_%s %s\n"
+                               "# TYPE gridfs_%s histogram\n",
+                            stat->name, stat->help, stat->name);
+            for (i = 0; i < nstats; i++) {
+                label = (i < gridfs_main_conf->loc_confs.nelts) ? "location" : "backend";
+                name = (i < gridfs_main_conf->loc_confs.nelts)
+                       ? &gridfs_loc_confs[i]->name
+                       : &backends[i - gridfs_main_conf->loc_confs.nelts];
+                hist = (ngx_http_gridfs_histogram_t*) ((u_char*) &gridfs_main_conf->stats[i]
+                                                       + stat->offset);
+                count = 0;
+                for (n = 0; n < GRIDFS_STATS_BUCKETS; n++) {
+                    count += hist->buckets[n];
+                    p = ngx_sprintf(p, "gridfs_%s_bucket{%s=\"", stat->name, label);
+                    p = ngx_http_gridfs_status_label(p, name);
+                    p = ngx_sprintf(p, "\",le=\"%s\"} %uA\n",
+                                    ngx_http_gridfs_bucket_names[n], count);
+                }
+                p = ngx_sprintf(p, "gridfs_%s_sum{%s=\"", stat->name, label);
+                p = ngx_http_gridfs_status_label(p, name);
+                p = ngx_sprintf(p, "\"} %uA.%06uA\n",
+                                hist->sum / 1000000, hist->sum % 1000000);
+                p = ngx_sprintf(p, "gridfs_%s_count{%s=\"", stat->name, label);
+                p = ngx_http_gridfs_status_label(p, name);
+                p = ngx_sprintf(p, "\"} %uA\n", count);
             }
         }
-    } while (e);
+    } else {
+        for (i = 0; i < nstats; i++) {
+            stats = &gridfs_main_conf->stats[i];
+            if (i < gridfs_main_conf->loc_confs.nelts) {
+                p = ngx_sprintf(p, "location %V\n", &gridfs_loc_confs[i]->name);
+            } else {
+                p = ngx_sprintf(p, "backend %V\n",
+                                &backends[i - gridfs_main_conf->loc_confs.nelts]);
+            }
 
-    bson_init(&query);
-    switch (gridfs_conf->type) {
-    case  BSON_OID:
-        bson_oid_from_string(&oid, value);
-        bson_append_oid(&query, (char*)gridfs_conf->field.data, &oid);
-        break;
-    case BSON_INT:
-      bson_append_int(&query, (char*)gridfs_conf->field.data, ngx_atoi((u_char*)value, strlen(value)));
-        break;
-    case BSON_STRING:
-        bson_append_string(&query, (char*)gridfs_conf->field.data, value);
-        break;
-    }
-    bson_finish(&query);
+            for (stat = ngx_http_gridfs_counters; stat->name; stat++) {
+                p = ngx_sprintf(p, "  %s %uA\n", stat->name,
+                                *(ngx_atomic_t*) ((u_char*) stats + stat->offset));
+            }
 
-    status = gridfs_find_query(&gfs, &query, &gfile);
+            for (stat = ngx_http_gridfs_histograms; stat->name; stat++) {
+                hist = (ngx_http_gridfs_histogram_t*) ((u_char*) stats + stat->offset);
+                count = 0;
+                for (n = 0; n < GRIDFS_STATS_BUCKETS; n++) {
+                    count += hist->buckets[n];
+                }
+                p = ngx_sprintf(p, "  %s count=%uA sum=%uA.%06uA", stat->name, count,
+                                hist->sum / 1000000, hist->sum % 1000000);
+                count = 0;
+                for (n = 0; n < GRIDFS_STATS_BUCKETS; n++) {
+                    count += hist->buckets[n];
+                    p = ngx_sprintf(p, " %s:%uA", ngx_http_gridfs_bucket_names[n], count);
+                }
+                *p++ = '\n';
+            }
+        }
+    }
 
-    bson_destroy(&query);
-    free(value);
+    len = p - b->last;
+    b->last = p;
+    b->last_buf = (request == request->main) ? 1 : 0;
+    b->last_in_chain = 1;
 
-    if(status == MONGO_ERROR) {
-        gridfs_destroy(&gfs);
-        return NGX_HTTP_NOT_FOUND;
+    request->headers_out.status = NGX_HTTP_OK;
+    request->headers_out.content_length_n = len;
+    if (prometheus) {
+        ngx_str_set(&request->headers_out.content_type, "text/plain; version=0.0.4");
+    } else {
+        ngx_str_set(&request->headers_out.content_type, "text/plain");
     }
+    request->headers_out.content_type_len = request->headers_out.content_type.len;
 
-    /* Get information about the file */
-    length = gridfile_get_contentlength(&gfile);
-    numchunks = gridfile_get_numchunks(&gfile);
+    rc = ngx_http_send_header(request);
+    if (rc == NGX_ERROR || rc > NGX_OK || request->header_only) {
+        return rc;
+    }
 
-    // NaN workaround
-    if (numchunks > INT_MAX)
-    {
-        gridfile_destroy(&gfile);
-        gridfs_destroy(&gfs);
-        return NGX_HTTP_NOT_FOUND;
+    if (len == 0) {
+        return ngx_http_send_special(request, NGX_HTTP_LAST);
     }
 
-    contenttype = (char*)gridfile_get_contenttype(&gfile);
+    out.buf = b;
+    out.next = NULL;
 
-    md5 = (char*)gridfile_get_md5(&gfile);
-    last_modified = gridfile_get_uploaddate(&gfile);
+    return ngx_http_output_filter(request, &out);
+}
 
-    // ---------- Partial Range
-    // set follow-fork-mode child
-    // attach (pid)
-    // break ngx_http_gridfs_module.c:959
+// ---------- VARIABLES ---------- //
 
-    if (request->headers_in.range) {
-        gridfs_parse_range(request, &request->headers_in.range->value, &range_start, &range_end, length);
-    }
+static ngx_int_t ngx_http_gridfs_time_variable(ngx_http_request_t* request, ngx_http_variable_value_t* v, uintptr_t data);
 
-    // ---------- SEND THE HEADERS ---------- //
+static ngx_int_t ngx_http_gridfs_number_variable(ngx_http_request_t* request, ngx_http_variable_value_t* v, uintptr_t data);
 
-    if (range_start == 0 && range_end == 0) {
-        request->headers_out.status = NGX_HTTP_OK;
-        request->headers_out.content_length_n = length;
-    } else {
-        request->headers_out.status = NGX_HTTP_PARTIAL_CONTENT;
-        request->headers_out.content_length_n = length;
-        //request->headers_out.content_range = range_end - range_start + 1;
+static ngx_int_t ngx_http_gridfs_cache_status_variable(ngx_http_request_t* request, ngx_http_variable_value_t* v, uintptr_t data);
 
-        ngx_table_elt_t   *content_range;
+static ngx_http_variable_t ngx_http_gridfs_variables[] = {
 
-        content_range = ngx_list_push(&request->headers_out.headers);
-        if (content_range == NULL) {
-            return NGX_ERROR;
-        }
+    { ngx_string("gridfs_lookup_time"), NULL,
+      ngx_http_gridfs_time_variable,
+      offsetof(ngx_http_gridfs_ctx_t, lookup_time),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
-        request->headers_out.content_range = content_range;
+    { ngx_string("gridfs_first_chunk_time"), NULL,
+      ngx_http_gridfs_time_variable,
+      offsetof(ngx_http_gridfs_ctx_t, first_chunk_time),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
-        content_range->hash = 1;
-        ngx_str_set(&content_range->key, "Content-Range");
+    { ngx_string("gridfs_total_backend_time"), NULL,
+      ngx_http_gridfs_time_variable,
+      offsetof(ngx_http_gridfs_ctx_t, backend_time),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
-        content_range->value.data = ngx_pnalloc(request->pool,sizeof("bytes -/") - 1 + 3 * NGX_OFF_T_LEN);
-        if (content_range->value.data == NULL) {
+    { ngx_string("gridfs_chunks_fetched"), NULL,
+      ngx_http_gridfs_number_variable,
+      offsetof(ngx_http_gridfs_ctx_t, chunks_fetched),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("gridfs_backend_bytes"), NULL,
+      ngx_http_gridfs_number_variable,
+      offsetof(ngx_http_gridfs_ctx_t, backend_bytes),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("gridfs_retries"), NULL,
+      ngx_http_gridfs_number_variable,
+      offsetof(ngx_http_gridfs_ctx_t, retries),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("gridfs_cache_status"), NULL,
+      ngx_http_gridfs_cache_status_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_null_string, NULL, NULL, 0, 0, 0 }
+};
+
+static ngx_int_t ngx_http_gridfs_add_variables(ngx_conf_t* cf) {
+    ngx_http_variable_t *var, *v;
+
+    for (v = ngx_http_gridfs_variables; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
             return NGX_ERROR;
         }
 
-        /* "Content-Range: bytes SSSS-EEEE/TTTT" header */
-        content_range->value.len = ngx_sprintf(content_range->value.data,
-                                               "bytes %O-%O/%O",
-                                               range_start, range_end,
-                                               request->headers_out.content_length_n)
-            - content_range->value.data;
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
 
-        request->headers_out.content_length_n = range_end - range_start + 1;
+    return NGX_OK;
+}
+
+/* A duration in seconds with millisecond resolution, like
+ * $upstream_response_time. */
+static ngx_int_t ngx_http_gridfs_time_variable(ngx_http_request_t* request, ngx_http_variable_value_t* v, uintptr_t data) {
+    ngx_http_gridfs_ctx_t* ctx;
+    uint64_t usec;
+    u_char* p;
+
+    ctx = ngx_http_get_module_ctx(request, ngx_http_gridfs_module);
+    if (ctx == NULL
+        || (data == offsetof(ngx_http_gridfs_ctx_t, first_chunk_time)
+            && ctx->chunks_fetched == 0)) {
+        v->not_found = 1;
+        return NGX_OK;
     }
-    if (contenttype != NULL) {
-        request->headers_out.content_type.len = strlen(contenttype);
-        request->headers_out.content_type.data = (u_char*)contenttype;
+
+    p = ngx_pnalloc(request->pool, NGX_TIME_T_LEN + 4);
+    if (p == NULL) {
+        return NGX_ERROR;
     }
-    else ngx_http_set_content_type(request);
 
-    // use md5 field as ETag if possible
-    if (md5 != NULL) {
-        request->headers_out.etag = ngx_list_push(&request->headers_out.headers);
-        request->headers_out.etag->hash = 1;
-        request->headers_out.etag->key.len = sizeof("ETag") - 1;
-        request->headers_out.etag->key.data = (u_char*)"ETag";
+    usec = *(uint64_t*) ((u_char*) ctx + data);
 
-        ngx_buf_t *b;
-        b = ngx_create_temp_buf(request->pool, strlen(md5) + 2);
-        b->last = ngx_sprintf(b->last, "\"%s\"", md5);
-        request->headers_out.etag->value.len = strlen(md5) + 2;
-        request->headers_out.etag->value.data = b->start;
+    v->len = ngx_sprintf(p, "%uL.%03uL", usec / 1000000, (usec / 1000) % 1000) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_gridfs_number_variable(ngx_http_request_t* request, ngx_http_variable_value_t* v, uintptr_t data) {
+    ngx_http_gridfs_ctx_t* ctx;
+    u_char* p;
+
+    ctx = ngx_http_get_module_ctx(request, ngx_http_gridfs_module);
+    if (ctx == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
     }
 
-    // use uploadDate field as last_modified if possible
-    if (last_modified) {
-        request->headers_out.last_modified_time = (time_t)(last_modified/1000);
+    p = ngx_pnalloc(request->pool, NGX_INT64_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
     }
 
-    /* Determine if content is gzipped, set headers accordingly */
-    if ( gridfile_get_boolean(&gfile,"gzipped") ) {
-        ngx_log_error(NGX_LOG_ERR, request->connection->log, 0, gridfile_get_field(&gfile,"gzipped") );
-        request->headers_out.content_encoding = ngx_list_push(&request->headers_out.headers);
-        if (request->headers_out.content_encoding == NULL) {
-            gridfile_destroy(&gfile);
-            gridfs_destroy(&gfs);
-            return NGX_ERROR;
-        }
-        request->headers_out.content_encoding->hash = 1;
-        request->headers_out.content_encoding->key.len = sizeof("Content-Encoding") - 1;
-        request->headers_out.content_encoding->key.data = (u_char *) "Content-Encoding";
-        request->headers_out.content_encoding->value.len = sizeof("gzip") - 1;
-        request->headers_out.content_encoding->value.data = (u_char *) "gzip";
+    v->len = ngx_sprintf(p, "%uL", *(uint64_t*) ((u_char*) ctx + data)) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_gridfs_cache_status_variable(ngx_http_request_t* request, ngx_http_variable_value_t* v, uintptr_t data) {
+    ngx_http_gridfs_ctx_t* ctx;
+
+    ctx = ngx_http_get_module_ctx(request, ngx_http_gridfs_module);
+    if (ctx == NULL || ctx->cache_status.len == 0) {
+        v->not_found = 1;
+        return NGX_OK;
     }
 
-    ngx_http_send_header(request);
+    v->len = ctx->cache_status.len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = ctx->cache_status.data;
 
-    // ---------- SEND THE BODY ---------- //
+    return NGX_OK;
+}
 
-    /* Empty file */
-    if (numchunks == 0) {
-        /* Allocate space for the response buffer */
-        buffer = ngx_pcalloc(request->pool, sizeof(ngx_buf_t));
-        if (buffer == NULL) {
-            ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
-                          "Failed to allocate response buffer");
-            gridfile_destroy(&gfile);
-            gridfs_destroy(&gfs);
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
-        }
+// ---------- SLOW LOG ---------- //
 
-        buffer->pos = NULL;
-        buffer->last = NULL;
-        buffer->memory = 1;
-        buffer->last_buf = 1;
-        out.buf = buffer;
-        out.next = NULL;
+/* Account for a round trip to mongod, and keep it for the slow log if the
+ * location has one. */
+static void ngx_http_gridfs_trace(ngx_http_request_t* request, ngx_http_mongo_connection_t* mongo_conn, const char* op, const char* ns, ngx_int_t n, uint64_t usec, size_t reply) {
+    ngx_http_gridfs_loc_conf_t* gridfs_conf;
+    ngx_http_gridfs_ctx_t* ctx;
+    ngx_http_gridfs_op_t* record;
+    ngx_uint_t i;
+    mongo_host_port* primary;
+    u_char member[sizeof(primary->host) + NGX_INT_T_LEN + 1];
+    ngx_str_t name;
 
-        gridfile_destroy(&gfile);
-        gridfs_destroy(&gfs);
+    ctx = ngx_http_get_module_ctx(request, ngx_http_gridfs_module);
+    if (ctx == NULL) {
+        return;
+    }
 
-        return ngx_http_output_filter(request, &out);
+    ctx->backend_time += usec;
+
+    gridfs_conf = ngx_http_get_module_loc_conf(request, ngx_http_gridfs_module);
+    if (!gridfs_conf->slow_log) {
+        return;
     }
 
-    cursors = (mongo_cursor **)ngx_pcalloc(request->pool, sizeof(mongo_cursor *) * numchunks);
-    if (cursors == NULL) {
-      gridfile_destroy(&gfile);
-      gridfs_destroy(&gfs);
-      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (ctx->ops == NULL) {
+        ctx->ops = ngx_palloc(request->pool, GRIDFS_SLOW_LOG_OPS * sizeof(ngx_http_gridfs_op_t));
+        if (ctx->ops == NULL) {
+            return;
+        }
     }
 
-    ngx_memzero( cursors, sizeof(mongo_cursor *) * numchunks);
+    /* Only the slowest operations are kept: once full, a slower one takes
+     * the place of the fastest */
+    if (ctx->nops < GRIDFS_SLOW_LOG_OPS) {
+        record = &ctx->ops[ctx->nops];
+    } else {
+        record = &ctx->ops[0];
+        for (i = 1; i < GRIDFS_SLOW_LOG_OPS; i++) {
+            if (ctx->ops[i].usec < record->usec) {
+                record = &ctx->ops[i];
+            }
+        }
+        if (record->usec >= usec) {
+            ctx->nops++;
+            return;
+        }
+    }
 
-    /* Hook in the cleanup function */
-    gridfs_cln = ngx_pool_cleanup_add(request->pool, sizeof(ngx_http_gridfs_cleanup_t));
-    if (gridfs_cln == NULL) {
-      gridfile_destroy(&gfile);
-      gridfs_destroy(&gfs);
-      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    record->seq = ctx->nops++;
+    record->op = op;
+    record->ns = ns;
+    record->n = n;
+    record->usec = usec;
+    record->reply = reply;
+    record->member = NULL;
+
+    /* Operations mostly go to the same member: share its name */
+    primary = mongo_conn->conn.primary;
+    if (primary == NULL || primary->host[0] == '\0') {
+        return;
     }
-    gridfs_cln->handler = ngx_http_gridfs_cleanup;
-    gridfs_clndata = gridfs_cln->data;
-    gridfs_clndata->cursors = cursors;
-    gridfs_clndata->numchunks = numchunks;
 
-    /* Read and serve chunk by chunk */
-    for (i = 0; i < numchunks; i++) {
+    name.data = member;
+    name.len = ngx_snprintf(member, sizeof(member), "%s:%d",
+                            primary->host, primary->port) - member;
 
-        /* Allocate space for the response buffer */
-        buffer = ngx_pcalloc(request->pool, sizeof(ngx_buf_t));
-        if (buffer == NULL) {
-            ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
-                          "Failed to allocate response buffer");
-            gridfile_destroy(&gfile);
-            gridfs_destroy(&gfs);
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (ctx->member == NULL || ctx->member->len != name.len
+        || ngx_strncmp(ctx->member->data, name.data, name.len) != 0) {
+        ctx->member = ngx_palloc(request->pool, sizeof(ngx_str_t));
+        if (ctx->member == NULL) {
+            return;
+        }
+        ctx->member->len = name.len;
+        ctx->member->data = ngx_pstrdup(request->pool, &name);
+        if (ctx->member->data == NULL) {
+            ctx->member = NULL;
+            return;
         }
+    }
 
-        /* Fetch the chunk from mongo */
-        do {
-            e = FALSE;
-            cursors[i] = gridfile_get_chunks(&gfile, i, 1);
-            if (!(cursors[i] && mongo_cursor_next(cursors[i]) == MONGO_OK)) {
-                e = TRUE; ecounter++;
-                if (ecounter > MONGO_MAX_RETRIES_PER_REQUEST
-                    || ngx_http_mongo_reconnect(request->connection->log, mongo_conn) == NGX_ERROR
-                    || ngx_http_mongo_reauth(request->connection->log, mongo_conn) == NGX_ERROR) {
-                    ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
-                                  "Mongo connection dropped, could not reconnect");
-                    if(mongo_conn->conn.connected) { mongo_disconnect(&mongo_conn->conn); }
-                    gridfile_destroy(&gfile);
-                    gridfs_destroy(&gfs);
-                    return NGX_HTTP_SERVICE_UNAVAILABLE;
-                }
-            }
-        } while (e);
+    record->member = ctx->member;
+}
 
-        chunk = cursors[i]->current;
-        bson_find(&it, &chunk, "data");
-        chunk_len = bson_iterator_bin_len( &it ); // break ngx_http_gridfs_module.c:1099
-        chunk_data = bson_iterator_bin_data( &it );
+/* Log requests slower than the threshold with the operations they made. */
+static ngx_int_t ngx_http_gridfs_log_handler(ngx_http_request_t* request) {
+    ngx_http_gridfs_loc_conf_t* gridfs_conf;
+    ngx_http_gridfs_ctx_t* ctx;
+    ngx_http_gridfs_op_t *ops, op;
+    ngx_str_t none = ngx_string("-");
+    ngx_uint_t i, k, nops;
+    uint64_t elapsed;
+    u_char *line, *p;
+    size_t size;
 
-        if (range_start == 0 && range_end == 0) {
-            /* <<no range request>> */
-            /* Set up the buffer chain */
-            buffer->pos = (u_char*)chunk_data;
-            buffer->last = (u_char*)chunk_data + chunk_len;
-            buffer->memory = 1;
-            buffer->last_buf = (i == numchunks-1);
-            out.buf = buffer;
-            out.next = NULL;
+    gridfs_conf = ngx_http_get_module_loc_conf(request, ngx_http_gridfs_module);
+    ctx = ngx_http_get_module_ctx(request, ngx_http_gridfs_module);
 
-            /* Serve the Chunk */
-            rc = ngx_http_output_filter(request, &out);
-        } else {
-            /* <<range request>> */
-            if ( range_start >= (current_buf_pos+chunk_len) ||
-                 range_end <= current_buf_pos) {
-                /* no output */
-                ngx_pfree(request->pool, buffer);
-            } else {
-                if (range_start <= current_buf_pos) {
-                    buffer->pos = (u_char*)chunk_data;
-                } else {
-                    buffer->pos = (u_char*)chunk_data + (range_start - current_buf_pos);
-                }
-                if (range_end < (current_buf_pos+chunk_len)) {
-                    buffer->last = (u_char*)chunk_data + (range_end - current_buf_pos + 1);
-                } else {
-                    buffer->last = (u_char*)chunk_data + chunk_len;
-                }
-                if (buffer->pos == buffer->last) {
-                    ngx_log_error(NGX_LOG_ALERT, request->connection->log, 0,
-                                  "zero size buf in writer "
-                                  "range_start:%d range_end:%d "
-                                  "current_buf_pos:%d chunk_len:%d i:%d numchunk:%d",
-                                  range_start,range_end,
-                                  current_buf_pos, chunk_len,
-                                  i,numchunks);
-                }
-                buffer->memory = 1;
-                buffer->last_buf = (i == numchunks-1) || (range_end < (current_buf_pos+chunk_len));
-                out.buf = buffer;
-                out.next = NULL;
+    if (ctx == NULL || !gridfs_conf->slow_log) {
+        return NGX_OK;
+    }
 
-                /* Serve the Chunk */
-                rc = ngx_http_output_filter(request, &out);
-            }
-        }
+    elapsed = ngx_http_gridfs_usec() - ctx->start;
+    if (elapsed < (uint64_t) gridfs_conf->slow_log * 1000) {
+        return NGX_OK;
+    }
 
-        current_buf_pos += chunk_len;
+    ops = ctx->ops;
+    nops = ngx_min(ctx->nops, GRIDFS_SLOW_LOG_OPS);
 
-        /* TODO: More Codes to Catch? */
-        if (rc == NGX_ERROR) {
-            gridfile_destroy(&gfile);
-            gridfs_destroy(&gfs);
-            return NGX_ERROR;
+    /* Listed in the order they were made */
+    for (i = 1; i < nops; i++) {
+        op = ops[i];
+        for (k = i; k > 0 && ops[k - 1].seq > op.seq; k--) {
+            ops[k] = ops[k - 1];
         }
+        ops[k] = op;
     }
 
-    gridfile_destroy(&gfile);
-    gridfs_destroy(&gfs);
+    size = 1;
+    for (i = 0; i < nops; i++) {
+        size += 96 + 2 * NGX_INT64_LEN + ngx_strlen(ops[i].op)
+                + (ops[i].ns ? ngx_strlen(ops[i].ns) : 0)
+                + (ops[i].member ? ops[i].member->len : none.len);
+    }
 
-    return rc;
-}
+    line = ngx_pnalloc(request->pool, size);
+    if (line == NULL) {
+        return NGX_OK;
+    }
+    p = line;
 
-static void ngx_http_gridfs_cleanup(void* data) {
-    ngx_http_gridfs_cleanup_t* gridfs_clndata;
-    volatile ngx_uint_t i;
+    for (i = 0; i < nops; i++) {
+        p = ngx_sprintf(p, "; op=%s", ops[i].op);
+        if (ops[i].ns) {
+            p = ngx_sprintf(p, " ns=%s", ops[i].ns);
+        }
+        if (ops[i].n >= 0) {
+            p = ngx_sprintf(p, " n=%i", ops[i].n);
+        }
+        p = ngx_sprintf(p, " time=%uL.%03uLms reply=%uz member=%V",
+                        ops[i].usec / 1000, ops[i].usec % 1000, ops[i].reply,
+                        ops[i].member ? ops[i].member : &none);
+    }
 
-    gridfs_clndata = data;
+    ngx_log_error(NGX_LOG_WARN, request->connection->log, 0,
+                  "gridfs slow request: time=%uL.%03uLms backend=%uL.%03uLms "
+                  "ops=%ui shown=%ui%*s",
+                  elapsed / 1000, elapsed % 1000,
+                  ctx->backend_time / 1000, ctx->backend_time % 1000,
+                  ctx->nops, nops, (size_t) (p - line), line);
 
-    for (i = 0; i < gridfs_clndata->numchunks; i++) {
-        mongo_cursor_destroy(gridfs_clndata->cursors[i]);
-    }
+    return NGX_OK;
 }
@@ -0,0 +1,12 @@
+/*
+ * The driver's socket layer, built under other names so that the module
+ * can put TLS between the driver and the socket: ngx_http_gridfs_module.c
+ * defines mongo_socket_connect(), mongo_write_socket() and
+ * mongo_read_socket() and calls these for the plain TCP part.
+ */
+
+#define mongo_socket_connect ngx_http_mongo_plain_socket_connect
+#define mongo_write_socket ngx_http_mongo_plain_write_socket
+#define mongo_read_socket ngx_http_mongo_plain_read_socket
+
+#include "mongo-c-driver/src/net.c"